@@ -0,0 +1,71 @@
+"""
+Compares the built-in batched Levenberg-Marquardt solver with Ceres, for a one-pool Lorentzian fit
+to a simulated Z-spectrum (--lm) and for DESPOT1 (--algo=m). Prints the fit time, mean iterations,
+function evaluations and the errors in each parameter (as multiples of the noise, as in the unit
+tests). The batches are as wide as the SIMD registers qi was built for, so compare builds with and
+without BUILD_NATIVE to see the effect of AVX.
+"""
+import numpy as np
+from nipype.interfaces.base import CommandLine
+from qipype.interfaces.core import NewImage, Diff
+from qipype.interfaces.mt import LorentzianSim
+from qipype.interfaces.relax import DESPOT1Sim
+from bench_util import bench_dir, fit, print_table
+
+CommandLine.terminal_output = 'allatonce'
+
+seq = {'MTSat': {'pulse': {'p1': 0.4, 'p2': 0.3, 'bandwidth': 0.39},
+                 'TR': 4,
+                 'Trf': 0.02,
+                 'FA': 5,
+                 'sat_f0': np.linspace(-5, 5, 21).squeeze().tolist(),
+                 'sat_angle': np.repeat(180.0, 21).squeeze().tolist()},
+       'pools': [{'name': 'DS',
+                  'df0': [0, -2.5, 2.5],
+                  'fwhm': [1.0, 1.e-6, 3.0],
+                  'A': [0.2, 1.e-3, 1.0],
+                  'use_bandwidth': True}]}
+img_sz = [64, 64, 32]
+noise = 0.001
+
+bench_dir('benchdata')
+NewImage(img_size=img_sz, grad_dim=0, grad_vals=(-0.5, 0.5), out_file='f0.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=1, grad_vals=(0.5, 2.5), out_file='fwhm.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=2, grad_vals=(0.5, 1), out_file='A.nii.gz').run()
+LorentzianSim(seq['pools'])(sequence=seq, out_file='sim_lorentz.nii.gz', noise=noise,
+                            DS_f0_map='f0.nii.gz', DS_fwhm_map='fwhm.nii.gz',
+                            DS_A_map='A.nii.gz').run()
+
+rows = []
+for solver in ['ceres', 'lm']:
+    for threads in [1, 4]:
+        prefix = '{}_T{}_'.format(solver, threads)
+        args = ['lorentzian', 'sim_lorentz.nii.gz', '--out=' + prefix]
+        if solver == 'lm':
+            args.append('--lm')
+        wall, profile = fit(args, seq, threads)
+        errors = [Diff(in_file=prefix + 'LTZ_DS_{}.nii.gz'.format(p), baseline=p + '.nii.gz',
+                       noise=noise).run().outputs.out_diff for p in ['f0', 'fwhm', 'A']]
+        rows.append([solver, threads, profile['seconds']['process'], profile['mean_iterations'],
+                     profile['evaluations']['residuals'], *errors])
+print_table(['Solver', 'Threads', 'Fit (s)', 'Mean its', 'Residual evals',
+             'f0 error', 'FWHM error', 'A error'], rows)
+
+spgr = {'SPGR': {'TR': 10e-3, 'FA': [3, 10, 18]}}
+NewImage(img_size=img_sz, grad_dim=0, grad_vals=(0.8, 1.0), out_file='PD.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=1, grad_vals=(0.8, 1.3), out_file='T1.nii.gz').run()
+DESPOT1Sim(sequence=spgr, out_file='sim_spgr.nii.gz', noise=noise,
+           PD_map='PD.nii.gz', T1_map='T1.nii.gz').run()
+
+rows = []
+for algo in ['n', 'm']:
+    for threads in [1, 4]:
+        prefix = '{}_T{}_'.format(algo, threads)
+        args = ['despot1', 'sim_spgr.nii.gz', '--algo=' + algo, '--out=' + prefix]
+        wall, profile = fit(args, spgr, threads)
+        errors = [Diff(in_file=prefix + 'D1_{}.nii.gz'.format(p), baseline=p + '.nii.gz',
+                       noise=noise).run().outputs.out_diff for p in ['PD', 'T1']]
+        rows.append([algo, threads, profile['seconds']['process'], profile['mean_iterations'],
+                     profile['evaluations']['residuals'], *errors])
+print_table(['Algorithm', 'Threads', 'Fit (s)', 'Mean its', 'Residual evals',
+             'PD error', 'T1 error'], rows)
@@ -0,0 +1,42 @@
+"""
+Compares the voxel scheduler in ModelFitFilter with the fixed per-thread regions it replaced
+(QUIT_SCHEDULE=region) on a DESPOT2-FM phantom. The off-resonance gradient runs along the slice
+axis, which is the axis ITK splits regions along, so the fixed regions get very different amounts
+of work. Prints the fit time, speed-up over one thread, and how long the slowest thread ran
+compared to the average.
+"""
+from nipype.interfaces.base import CommandLine
+from qipype.interfaces.core import NewImage
+from qipype.interfaces.relax import FMSim
+from bench_util import bench_dir, fit, print_table
+
+CommandLine.terminal_output = 'allatonce'
+
+seq = {'SSFP': {'TR': 5e-3,
+                'FA': [15, 15, 60, 60],
+                'PhaseInc': [180, 0, 180, 0]}}
+img_sz = [48, 48, 48]
+noise = 0.002
+
+bench_dir('benchdata')
+NewImage(img_size=img_sz, fill=1.0, out_file='PD.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=0, grad_vals=(0.8, 1.2), out_file='T1.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=1, grad_vals=(0.04, 0.1), out_file='T2.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=2, grad_vals=(-150, 150), out_file='f0.nii.gz').run()
+FMSim(sequence=seq, out_file='sim_ssfp.nii.gz', asym=False, T1_map='T1.nii.gz', noise=noise,
+      PD_map='PD.nii.gz', T2_map='T2.nii.gz', f0_map='f0.nii.gz').run()
+
+rows = []
+for schedule in ['voxel', 'region']:
+    env = {'QUIT_SCHEDULE': schedule}
+    single = None
+    for threads in [1, 2, 4, 8]:
+        args = ['despot2fm', 'sim_ssfp.nii.gz', '--T1=T1.nii.gz',
+                '--out={}_T{}_'.format(schedule, threads)]
+        wall, profile = fit(args, seq, threads, env)
+        process = profile['seconds']['process']
+        single = single or process
+        seconds = [t['seconds'] for t in profile['threads'] if t['voxels'] > 0]
+        imbalance = max(seconds) / (sum(seconds) / len(seconds))
+        rows.append([schedule, threads, process, single / process, imbalance, wall])
+print_table(['Schedule', 'Threads', 'Fit (s)', 'Speed-up', 'Slowest/mean', 'Wall (s)'], rows)
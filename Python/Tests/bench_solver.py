@@ -0,0 +1,52 @@
+"""
+Compares the Ceres solver settings that can be chosen with --solver on a simulated qMT phantom.
+Prints the fit time, mean iterations and function evaluations for each combination of linear
+solver and trust region strategy, and the error in M0_f and k against the true values (as
+multiples of the noise, as in the unit tests).
+"""
+import json
+from nipype.interfaces.base import CommandLine
+from qipype.interfaces.core import NewImage, Diff
+from qipype.interfaces.mt import Lineshape, qMTSim
+from bench_util import bench_dir, fit, print_table
+
+CommandLine.terminal_output = 'allatonce'
+
+seq = {'MTSat': {'TR': 0.032,
+                 'Trf': 0.020,
+                 'FA': 5,
+                 'sat_f0': [1000, 1000, 2236, 2236, 5000, 5000, 11180, 11180, 250000, 250000],
+                 'sat_angle': [750, 360, 750, 360, 750, 360, 750, 360, 750, 360],
+                 'pulse': {'name': 'Gauss', 'p1': 0.416, 'p2': 0.295, 'bandwidth': 200}}}
+img_sz = [32, 32, 8]
+noise = 0.001
+lineshape = 'lineshape.json'
+
+bench_dir('benchdata')
+Lineshape(out_file=lineshape, lineshape='SuperLorentzian',
+          frq_start=500, frq_space=500, frq_count=150).run()
+NewImage(img_size=img_sz, fill=1.0, out_file='M0_f.nii.gz').run()
+NewImage(img_size=img_sz, fill=0.1, out_file='F_over_R1_f.nii.gz').run()
+NewImage(img_size=img_sz, fill=12e-6, out_file='T2_b.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=0, grad_vals=(5, 15), out_file='T1_f_over_T2_f.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=1, grad_vals=(2, 6), out_file='k.nii.gz').run()
+NewImage(img_size=img_sz, fill=1.0, out_file='T1app.nii.gz').run()
+qMTSim(sequence=seq, out_file='sim_qmt.nii.gz', T1_map='T1app.nii.gz', lineshape=lineshape,
+       noise=noise, M0_f_map='M0_f.nii.gz', F_over_R1_f_map='F_over_R1_f.nii.gz',
+       T2_b_map='T2_b.nii.gz', T1_f_over_T2_f_map='T1_f_over_T2_f.nii.gz',
+       k_map='k.nii.gz').run()
+
+rows = []
+for linear in ['DENSE_QR', 'DENSE_NORMAL_CHOLESKY']:
+    for region in ['LEVENBERG_MARQUARDT', 'DOGLEG']:
+        prefix = '{}_{}_'.format(linear, region)
+        solver = {'linear_solver': linear, 'trust_region': region}
+        args = ['qmt', 'sim_qmt.nii.gz', '--T1=T1app.nii.gz', '--lineshape=' + lineshape,
+                '--out=' + prefix, '--solver=' + json.dumps(solver)]
+        wall, profile = fit(args, seq)
+        errors = [Diff(in_file=prefix + 'QMT_{}.nii.gz'.format(p), baseline=p + '.nii.gz',
+                       noise=noise).run().outputs.out_diff for p in ['M0_f', 'k']]
+        rows.append([linear, region, profile['seconds']['process'], profile['mean_iterations'],
+                     profile['evaluations']['residuals'], *errors])
+print_table(['Linear solver', 'Trust region', 'Fit (s)', 'Mean its', 'Residual evals',
+             'M0_f error', 'k error'], rows)
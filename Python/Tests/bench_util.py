@@ -0,0 +1,46 @@
+"""
+Helpers for the benchmark scripts, bench_*.py. These are not unit tests, as they take a while and
+only print numbers, so unittest discover does not pick them up. Run them from Python/Tests, e.g.
+python bench_warm.py
+"""
+import json
+import os
+import subprocess
+import time
+from os import chdir
+from pathlib import Path
+
+
+def bench_dir(name):
+    """Create and change into a directory for the benchmark data"""
+    Path(name).mkdir(exist_ok=True)
+    chdir(name)
+
+
+def fit(args, sequence, threads=None, env=None):
+    """
+    Run 'qi <args> --profile' with the sequence as the input JSON, with any extra environment
+    variables in env. Returns the wall time of the whole command and the profile summary it prints.
+    """
+    Path('bench.json').write_text(json.dumps(sequence))
+    cmd = ['qi'] + args + ['--profile', '--json=bench.json']
+    if threads:
+        cmd.append('--threads={}'.format(threads))
+    start = time.perf_counter()
+    full_env = {**os.environ, **env} if env else None
+    out = subprocess.run(cmd, check=True, capture_output=True, text=True, env=full_env).stdout
+    wall = time.perf_counter() - start
+    return wall, json.loads(out[out.index('{'):])
+
+
+def print_table(header, rows):
+    """Print rows of values under the header, in columns wide enough for both"""
+    widths = [max(len(str(h)), *(len(fmt_value(r[i])) for r in rows))
+              for i, h in enumerate(header)]
+    print('  '.join(str(h).rjust(w) for h, w in zip(header, widths)))
+    for r in rows:
+        print('  '.join(fmt_value(v).rjust(w) for v, w in zip(r, widths)))
+
+
+def fmt_value(v):
+    return '{:.4g}'.format(v) if isinstance(v, float) else str(v)
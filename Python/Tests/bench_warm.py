@@ -0,0 +1,42 @@
+"""
+Compares DESPOT2-FM fits with and without --warm on a simulated phantom. Prints the mean iterations
+per voxel and the fit time, and checks that warm-started results do not depend on the number of
+threads.
+"""
+from nipype.interfaces.base import CommandLine
+from qipype.interfaces.core import NewImage, Diff
+from qipype.interfaces.relax import FMSim
+from bench_util import bench_dir, fit, print_table
+
+CommandLine.terminal_output = 'allatonce'
+
+seq = {'SSFP': {'TR': 5e-3,
+                'FA': [15, 15, 60, 60],
+                'PhaseInc': [180, 0, 180, 0]}}
+img_sz = [48, 48, 48]
+noise = 0.002
+
+bench_dir('benchdata')
+NewImage(img_size=img_sz, fill=1.0, out_file='PD.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=0, grad_vals=(0.8, 1.2), out_file='T1.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=1, grad_vals=(0.04, 0.1), out_file='T2.nii.gz').run()
+NewImage(img_size=img_sz, grad_dim=2, grad_vals=(-100, 100), out_file='f0.nii.gz').run()
+FMSim(sequence=seq, out_file='sim_ssfp.nii.gz', asym=False, T1_map='T1.nii.gz', noise=noise,
+      PD_map='PD.nii.gz', T2_map='T2.nii.gz', f0_map='f0.nii.gz').run()
+
+rows = []
+for warm in [False, True]:
+    for threads in [1, 4]:
+        prefix = '{}_T{}_'.format('warm' if warm else 'cold', threads)
+        args = ['despot2fm', 'sim_ssfp.nii.gz', '--T1=T1.nii.gz', '--out=' + prefix]
+        if warm:
+            args.append('--warm')
+        wall, profile = fit(args, seq, threads)
+        rows.append(['on' if warm else 'off', threads, profile['mean_iterations'],
+                     profile['seconds']['process'], wall])
+print_table(['Warm', 'Threads', 'Mean its', 'Fit (s)', 'Wall (s)'], rows)
+
+for warm in ['cold', 'warm']:
+    diff = Diff(in_file='{}_T4_FM_T2.nii.gz'.format(warm),
+                baseline='{}_T1_FM_T2.nii.gz'.format(warm), abs_diff=True).run()
+    print('{} start, 4 vs 1 threads, T2 difference: {}'.format(warm, diff.outputs.out_diff))
@@ -41,6 +41,128 @@ class DESPOT_SC(unittest.TestCase):
         self.assertLessEqual(diff_T1.outputs.out_diff, 35)
         self.assertLessEqual(diff_PD.outputs.out_diff, 35)
 
+    def test_despot1_lm(self):
+        seq = {'SPGR': {'TR': 10e-3, 'FA': [3, 10, 18]}}
+        spgr_file = 'sim_spgr.nii.gz'
+        img_sz = [32, 32, 32]
+        noise = 0.001
+
+        NewImage(img_size=img_sz, grad_dim=0, grad_vals=(
+            0.8, 1.0), out_file='PD.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=1, grad_vals=(
+            0.8, 1.3), out_file='T1.nii.gz', verbose=vb).run()
+        DESPOT1Sim(sequence=seq, out_file=spgr_file,
+                   noise=noise, verbose=vb,
+                   PD_map='PD.nii.gz', T1_map='T1.nii.gz').run()
+
+        # The batched LM fit solves the same problem as NLLS, so should be as accurate
+        diffs = {}
+        for algo in ['n', 'm']:
+            DESPOT1(sequence=seq, in_file=spgr_file, algo=algo, verbose=vb).run()
+            diffs[algo] = Diff(in_file='D1_T1.nii.gz', baseline='T1.nii.gz',
+                               noise=noise, verbose=vb).run().outputs.out_diff
+        print('T1 difference NLLS {} LM {}'.format(diffs['n'], diffs['m']))
+        self.assertLessEqual(diffs['m'], 1.1 * diffs['n'])
+
+    def test_despot1_dictionary(self):
+        seq = {'SPGR': {'TR': 10e-3, 'FA': [3, 18]}}
+        spgr_file = 'sim_spgr.nii.gz'
+        img_sz = [32, 32, 32]
+        noise = 0.001
+
+        NewImage(img_size=img_sz, grad_dim=0, grad_vals=(
+            0.8, 1.0), out_file='PD.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=1, grad_vals=(
+            0.8, 1.3), out_file='T1.nii.gz', verbose=vb).run()
+        DESPOT1Sim(sequence=seq, out_file=spgr_file,
+                   noise=noise, verbose=vb,
+                   PD_map='PD.nii.gz', T1_map='T1.nii.gz').run()
+
+        # Compare dictionary matching against the NLLS (Ceres) fit on the same data
+        diffs = {}
+        for algo, polish in [('n', False), ('d', False), ('d', True)]:
+            DESPOT1(sequence=seq, in_file=spgr_file, algo=algo, polish=polish,
+                    verbose=vb).run()
+            diffs[(algo, polish)] = Diff(in_file='D1_T1.nii.gz', baseline='T1.nii.gz',
+                                         noise=noise, verbose=vb).run().outputs.out_diff
+        print('T1 difference NLLS {} Dictionary {} Polished {}'.format(
+            diffs[('n', False)], diffs[('d', False)], diffs[('d', True)]))
+        self.assertLessEqual(diffs[('d', False)], 40)
+        self.assertLessEqual(diffs[('d', True)], 35)
+
+    def test_despot1_dictionary_rank(self):
+        # Four flip-angles, so a rank 3 dictionary is compressed but keeps nearly all the energy
+        seq = {'SPGR': {'TR': 10e-3, 'FA': [2, 5, 10, 18]}}
+        spgr_file = 'sim_spgr.nii.gz'
+        img_sz = [32, 32, 32]
+        noise = 0.001
+
+        NewImage(img_size=img_sz, grad_dim=0, grad_vals=(
+            0.8, 1.0), out_file='PD.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=1, grad_vals=(
+            0.8, 1.3), out_file='T1.nii.gz', verbose=vb).run()
+        DESPOT1Sim(sequence=seq, out_file=spgr_file,
+                   noise=noise, verbose=vb,
+                   PD_map='PD.nii.gz', T1_map='T1.nii.gz').run()
+
+        cache = Path('dict_rank_cache')
+        for f in cache.glob('*.dict'):
+            f.unlink()
+        # The second rank 3 run loads the dictionary saved by the first
+        for tag, rank in [('full', 0), ('rank', 3), ('cached', 3)]:
+            DESPOT1(sequence=seq, in_file=spgr_file, algo='d', dict_rank=rank,
+                    dict_cache=str(cache), prefix='{}_'.format(tag), verbose=vb).run()
+        diff_full = Diff(in_file='full_D1_T1.nii.gz', baseline='T1.nii.gz',
+                         noise=noise, verbose=vb).run().outputs.out_diff
+        diff_rank = Diff(in_file='rank_D1_T1.nii.gz', baseline='T1.nii.gz',
+                         noise=noise, verbose=vb).run().outputs.out_diff
+        diff_cached = Diff(in_file='cached_D1_T1.nii.gz', baseline='rank_D1_T1.nii.gz',
+                           verbose=vb).run().outputs.out_diff
+        print('T1 difference full rank {} rank 3 {}'.format(diff_full, diff_rank))
+        self.assertLessEqual(diff_rank, 1.1 * diff_full)
+        self.assertLessEqual(diff_cached, 1e-6)
+        self.assertEqual(len(list(cache.glob('*.dict'))), 2)
+
+    def test_despot1_int16(self):
+        # Scaled int16 storage against float32. Each stored value is within 1/65534 of the range
+        # of its image, so relative errors of 1e-3 leave a wide margin.
+        seq = {'SPGR': {'TR': 10e-3, 'FA': [3, 10, 18]}}
+        img_sz = [32, 32, 32]
+        noise = 0.001
+
+        NewImage(img_size=img_sz, grad_dim=0, grad_vals=(
+            0.8, 1.0), out_file='PD.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=1, grad_vals=(
+            0.8, 1.3), out_file='T1.nii.gz', verbose=vb).run()
+
+        # Noise-free data, so the only difference between the fits comes from quantising the input
+        for tag, int16 in [('f32', False), ('i16', True)]:
+            DESPOT1Sim(sequence=seq, out_file='sim_spgr_{}.nii.gz'.format(tag), int16=int16,
+                       verbose=vb, PD_map='PD.nii.gz', T1_map='T1.nii.gz').run()
+            DESPOT1(sequence=seq, in_file='sim_spgr_{}.nii.gz'.format(tag),
+                    prefix='{}_'.format(tag), verbose=vb).run()
+        sim_diff = Diff(in_file='i16_D1_T1.nii.gz', baseline='f32_D1_T1.nii.gz',
+                        verbose=vb).run().outputs.out_diff
+
+        # Noisy data fitted once, with the covariance and residuals written both ways
+        DESPOT1Sim(sequence=seq, out_file='sim_spgr.nii.gz', noise=noise, verbose=vb,
+                   PD_map='PD.nii.gz', T1_map='T1.nii.gz').run()
+        for tag, int16 in [('f32', False), ('i16', True)]:
+            DESPOT1(sequence=seq, in_file='sim_spgr.nii.gz', algo='n', covar=True,
+                    residuals=True, int16=int16, prefix='{}_'.format(tag), verbose=vb).run()
+        cov_diff = Diff(in_file='i16_D1_CoV_T1.nii.gz', baseline='f32_D1_CoV_T1.nii.gz',
+                        verbose=vb).run().outputs.out_diff
+        # The maps themselves are never quantised
+        map_diff = Diff(in_file='i16_D1_T1.nii.gz', baseline='f32_D1_T1.nii.gz',
+                        verbose=vb).run().outputs.out_diff
+        print('int16 relative error simulation {} CoV {}'.format(sim_diff, cov_diff))
+        self.assertLessEqual(sim_diff, 1e-3)
+        self.assertLessEqual(cov_diff, 1e-3)
+        self.assertLessEqual(map_diff, 1e-6)
+        for name in ['CoV_T1', 'residuals_0']:
+            self.assertLess(Path('i16_D1_{}.nii.gz'.format(name)).stat().st_size,
+                            Path('f32_D1_{}.nii.gz'.format(name)).stat().st_size)
+
     def test_hifi(self):
         seqs = {'SPGR': {'TR': 5e-3, 'FA': [3, 18]},
                 'MPRAGE': {'FA': 5, 'TR': 5e-3, 'TI': 0.45, 'TD': 0, 'eta': 1, 'ETL': 64, 'k0': 0},
@@ -104,7 +226,7 @@ class DESPOT_SC(unittest.TestCase):
     def test_despot2gs(self):
         self.test_despot2(True, 30)
 
-    def test_fm(self):
+    def test_fm(self, basins=2):
         seq = {'SSFP': {'TR': 5e-3,
                         'FA': [15, 15, 60, 60],
                         'PhaseInc': [180, 0, 180, 0]}
@@ -126,7 +248,7 @@ class DESPOT_SC(unittest.TestCase):
                     T1_map='T1.nii.gz', noise=noise, verbose=vb,
                     PD_map='PD.nii.gz', T2_map='T2.nii.gz', f0_map='f0.nii.gz')
         sim.run()
-        FM(sequence=seq, in_file=ssfp_file, asym=False,
+        FM(sequence=seq, in_file=ssfp_file, asym=False, basins=basins,
            T1_map='T1.nii.gz', verbose=vb, residuals=True).run()
 
         diff_T2 = Diff(in_file='FM_T2.nii.gz', baseline='T2.nii.gz',
@@ -136,6 +258,9 @@ class DESPOT_SC(unittest.TestCase):
         self.assertLessEqual(diff_T2.outputs.out_diff, 20)
         self.assertLessEqual(diff_PD.outputs.out_diff, 10)
 
+    def test_fm_fixed_starts(self):
+        self.test_fm(0)
+
 
 if __name__ == '__main__':
     unittest.main()
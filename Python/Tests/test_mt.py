@@ -50,17 +50,19 @@ class MT(unittest.TestCase):
               DS_fwhm_map='fwhm.nii.gz',
               DS_A_map='A.nii.gz').run()
         L1Fit = Lorentzian(pools)
-        L1Fit(sequence=sequence, in_file=lorentz_file, verbose=vb).run()
+        for lm in [False, True]:
+            L1Fit(sequence=sequence, in_file=lorentz_file,
+                  lm=lm, verbose=vb).run()
 
-        diff_f0 = Diff(in_file='LTZ_DS_f0.nii.gz', baseline='f0.nii.gz',
-                       noise=noise, verbose=vb).run()
-        diff_fwhm = Diff(in_file='LTZ_DS_fwhm.nii.gz', baseline='fwhm.nii.gz',
-                         noise=noise, verbose=vb).run()
-        diff_A = Diff(in_file='LTZ_DS_A.nii.gz', baseline='A.nii.gz',
-                      noise=noise, verbose=vb).run()
-        self.assertLessEqual(diff_f0.outputs.out_diff, 100)
-        self.assertLessEqual(diff_fwhm.outputs.out_diff, 20)
-        self.assertLessEqual(diff_A.outputs.out_diff, 25)
+            diff_f0 = Diff(in_file='LTZ_DS_f0.nii.gz', baseline='f0.nii.gz',
+                           noise=noise, verbose=vb).run()
+            diff_fwhm = Diff(in_file='LTZ_DS_fwhm.nii.gz', baseline='fwhm.nii.gz',
+                             noise=noise, verbose=vb).run()
+            diff_A = Diff(in_file='LTZ_DS_A.nii.gz', baseline='A.nii.gz',
+                          noise=noise, verbose=vb).run()
+            self.assertLessEqual(diff_f0.outputs.out_diff, 100)
+            self.assertLessEqual(diff_fwhm.outputs.out_diff, 20)
+            self.assertLessEqual(diff_A.outputs.out_diff, 25)
 
     def test_lorentzian2(self):
         sat_f0 = [*np.linspace(-40, 40,
@@ -184,6 +186,10 @@ class MT(unittest.TestCase):
         self.assertLessEqual(diff_F.outputs.out_diff, 30)
         self.assertLessEqual(diff_k.outputs.out_diff, 35)
 
+    def test_superlorentzian_table(self):
+        # Exits with an error if the table disagrees with direct integration
+        CommandLine('qi', args='lineshape --check=500').run()
+
     def test_ZSpec(self):
         NewImage(out_file='zspec_linear.nii.gz', verbose=vb, img_size=[8, 8, 8, 4],
                  grad_dim=3, grad_vals=(-3, 3)).run()
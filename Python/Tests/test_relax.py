@@ -1,9 +1,10 @@
 from pathlib import Path
 from os import chdir
+import json
 import unittest
 from nipype.interfaces.base import CommandLine
 from qipype.interfaces.core import NewImage, Diff
-from qipype.interfaces.relax import Multiecho, MultiechoSim
+from qipype.interfaces.relax import Multiecho, MultiechoSim, MCDespot, MCDespotSim
 
 vb = True
 CommandLine.terminal_output = 'allatonce'
@@ -41,6 +42,89 @@ class Relax(unittest.TestCase):
         self.assertLessEqual(diff_T2.outputs.out_diff, 3)
         self.assertLessEqual(diff_PD.outputs.out_diff, 2)
 
+    def test_multiecho_lm(self):
+        me = {'MultiEcho': {'TR': 10, 'TE1': 0.01, 'ESP': 0.01,
+                            'ETL': 5}}
+        me_file = 'sim_me.nii.gz'
+        img_sz = [32, 32, 32]
+        noise = 0.001
+
+        NewImage(img_size=img_sz, grad_dim=0, grad_vals=(0.8, 1.0),
+                 out_file='PD.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=2, grad_vals=(0.04, 0.1),
+                 out_file='T2.nii.gz', verbose=vb).run()
+        MultiechoSim(sequence=me, out_file=me_file,
+                     PD_map='PD.nii.gz', T2_map='T2.nii.gz',
+                     noise=noise, verbose=vb).run()
+
+        # The batched LM fit solves the same problem as the Ceres fit, so should be as accurate
+        diffs = {}
+        for algo in ['n', 'm']:
+            Multiecho(sequence=me, in_file=me_file, algo=algo, verbose=vb).run()
+            diffs[algo] = Diff(in_file='ME_T2.nii.gz', baseline='T2.nii.gz',
+                               noise=noise, verbose=vb).run().outputs.out_diff
+        print('T2 difference NLLS {} LM {}'.format(diffs['n'], diffs['m']))
+        self.assertLessEqual(diffs['m'], 1.1 * diffs['n'])
+
+    def test_mcdespot(self):
+        seq = {'SPGR': {'TR': 6.5e-3, 'FA': [3, 4, 5, 7, 9, 12, 15, 18]},
+               'SSFP': {'TR': 5e-3,
+                        'FA': [12, 16, 20, 24, 30, 40, 50, 60, 12, 16, 20, 24, 30, 40, 50, 60],
+                        'PhaseInc': [180, 180, 180, 180, 180, 180, 180, 180, 0, 0, 0, 0, 0, 0, 0, 0]}}
+        spgr_file = 'sim_spgr.nii.gz'
+        ssfp_file = 'sim_ssfp.nii.gz'
+        img_sz = [8, 8, 8]
+        noise = 0.0005
+
+        values = {'PD': 1.0, 'T1_m': 0.45, 'T2_m': 0.015, 'T1_ie': 1.1, 'T2_ie': 0.07,
+                  'tau_m': 0.2}
+        maps = {}
+        for p, v in values.items():
+            NewImage(img_size=img_sz, fill=v, out_file=p + '.nii.gz', verbose=vb).run()
+            maps[p + '_map'] = p + '.nii.gz'
+        NewImage(img_size=img_sz, grad_dim=0, grad_vals=(0.1, 0.25),
+                 out_file='f_m.nii.gz', verbose=vb).run()
+        maps['f_m_map'] = 'f_m.nii.gz'
+
+        MCDespotSim(sequence=seq, model='2', spgr_file=spgr_file, ssfp_file=ssfp_file,
+                    noise=noise, verbose=vb, **maps).run()
+        # The random numbers depend only on the seed and voxel, so the thread count should not
+        # change the result
+        for threads in [1, 4]:
+            MCDespot(sequence=seq, model='2', spgr_file=spgr_file, ssfp_file=ssfp_file,
+                     scale=True, prefit=True, threads=threads, prefix='t{}_'.format(threads),
+                     verbose=vb).run()
+
+        diff_threads = Diff(in_file='t4_2C_f_m.nii.gz', baseline='t1_2C_f_m.nii.gz',
+                            verbose=vb).run()
+        diff_f_m = Diff(in_file='t1_2C_f_m.nii.gz', baseline='f_m.nii.gz',
+                        verbose=vb).run()
+        diff_T1_ie = Diff(in_file='t1_2C_T1_ie.nii.gz', baseline='T1_ie.nii.gz',
+                          verbose=vb).run()
+        self.assertEqual(diff_threads.outputs.out_diff, 0)
+        self.assertLessEqual(diff_f_m.outputs.out_diff, 0.3)
+        self.assertLessEqual(diff_T1_ie.outputs.out_diff, 0.1)
+
+    def test_mcdespot_kernels(self):
+        seq = {'SPGR': {'TR': 6.5e-3, 'FA': [3, 4, 5, 7, 9, 12, 15, 18]},
+               'SSFP': {'TR': 5e-3,
+                        'FA': [12, 16, 20, 24, 30, 40, 50, 60, 12, 16, 20, 24, 30, 40, 50, 60],
+                        'PhaseInc': [180, 180, 180, 180, 180, 180, 180, 180, 0, 0, 0, 0, 0, 0, 0, 0]}}
+        with open('mcdespot.json', 'w') as f:
+            json.dump(seq, f)
+        # Exits with an error if the closed-form signals disagree with the LU-based ones
+        for model in [2, 3]:
+            args = 'mcdespot --model={} --check-kernels=1000 --json=mcdespot.json'.format(model)
+            CommandLine('qi', args=args).run()
+
+    def test_mp2rage_table(self):
+        seq = {'MP2RAGE': {'TR': 0.006, 'TRPrep': 5, 'TI': [0.9, 2],
+                           'SegLength': 128, 'k0': 64, 'FA': [6, 8]}}
+        with open('mp2rage.json', 'w') as f:
+            json.dump(seq, f)
+        # Exits with an error if the table disagrees with root-finding
+        CommandLine('qi', args='mp2rage --check=1000 --json=mp2rage.json').run()
+
 
 if __name__ == '__main__':
     unittest.main()
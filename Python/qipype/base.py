@@ -52,6 +52,18 @@ class FitInputSpec(InputSpec):
         decsc='Write out parameter covar images', argstr='--covar')
     residuals = traits.Bool(
         desc='Write out residuals for each data-point', argstr='--resids')
+    status = traits.Bool(
+        desc='Write out an image of fit status codes', argstr='--status')
+    profile = traits.Bool(
+        desc='Write out per-voxel fit times and evaluation counts', argstr='--profile')
+    pack = traits.Bool(
+        desc='Write parameter maps as volumes of one file, with a JSON sidecar', argstr='--pack')
+    int16 = traits.Bool(
+        desc='Write residual and covariance images as scaled 16-bit integers', argstr='--int16')
+    checkpoint = traits.String(
+        desc='Save finished slabs to this directory and resume from it', argstr='--checkpoint=%s')
+    slab = traits.Int(
+        desc='Process N slices at a time', argstr='--slab=%d')
 
 
 def SimInputSpec(name, varying, fixed=[], out_files=None, extras=None):
@@ -62,7 +74,9 @@ def SimInputSpec(name, varying, fixed=[], out_files=None, extras=None):
         out_files = ['out']
 
     attrs = {'noise': traits.Float(desc='Noise level to add to simulation',
-                                   argstr='--simulate=%f', default_value=0.0, usedefault=True)}
+                                   argstr='--simulate=%f', default_value=0.0, usedefault=True),
+             'int16': traits.Bool(desc='Write simulated data as scaled 16-bit integers',
+                                  argstr='--int16')}
     varying_names = []
     for v in varying:
         aname = '{}_map'.format(v)
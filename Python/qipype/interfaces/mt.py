@@ -56,6 +56,8 @@ class LorentzianInputSpec(base.FitInputSpec):
                            desc='Use an additive instead of subtractive model')
     Zref = traits.Float(argstr='--zref=%f',
                         desc='Set reference Z-spectrum value (usually 1 or 0)')
+    lm = traits.Bool(argstr='--lm',
+                     desc='Fit with the built-in Levenberg-Marquardt solver')
 
 
 def Lorentzian(pools):
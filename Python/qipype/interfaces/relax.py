@@ -16,9 +16,15 @@ from .. import base
 class DESPOT1InputSpec(base.FitInputSpec):
     # Additional Options
     B1_map = File(desc='B1 map (ratio) file', argstr='--B1=%s')
-    algo = traits.String(desc="Choose algorithm (l/w/n)", argstr="--algo=%s")
+    algo = traits.String(desc="Choose algorithm (l/w/n/m/d)", argstr="--algo=%s")
     iterations = traits.Int(
         desc='Max iterations for WLLS/NLLS (default 15)', argstr='--its=%d')
+    polish = traits.Bool(
+        desc='Refine dictionary matches with a Gauss-Newton step', argstr='--polish')
+    dict_rank = traits.Int(
+        desc='Compress the dictionary to this many singular vectors', argstr='--dict-rank=%d')
+    dict_cache = traits.String(
+        desc='Save dictionaries to this directory and re-use them', argstr='--dict-cache=%s')
 
 
 class DESPOT1(base.FitCommand):
@@ -159,6 +165,10 @@ class FMInputSpec(base.FitInputSpec):
     B1_map = File(desc='B1 map (ratio) file', argstr='--B1=%s')
     asym = traits.Bool(
         desc="Fit asymmetric (+/-) off-resonance frequency", argstr='--asym')
+    basins = traits.Int(
+        desc='Refine at most N basins of the seed grid, 0 for fixed starts', argstr='--basins=%d')
+    prune = traits.Float(
+        desc='Skip basins whose grid cost is over PRUNE times the best', argstr='--prune=%f')
     algo = traits.Enum("LLS", "WLS", "NLS",
                        desc="Choose algorithm", argstr="--algo=%d")
 
@@ -217,57 +227,91 @@ class JSR(base.FitCommand):
     output_spec = base.FitOutputSpec('JSR', ['PD', 'T1', 'T2', 'df0'])
 
 ############################ qimcdespot ############################
-# Status: Everything is there but not tested. Very much unsupported.
 
+MCD_VARYING = {'2': ['PD', 'T1_m', 'T2_m', 'T1_ie', 'T2_ie', 'tau_m', 'f_m'],
+               '3': ['PD', 'T1_m', 'T2_m', 'T1_ie', 'T2_ie', 'T1_csf', 'T2_csf', 'tau_m', 'f_m',
+                     'f_csf']}
 
-class QIMCDespotInputSpec(base.InputSpec):
+
+class MCDespotInputSpec(base.InputSpec):
     # Inputs
     spgr_file = File(exists=True, argstr='%s', mandatory=True,
-                     position=0, desc='SPGR file')
+                     position=-2, desc='Path to SPGR data')
+
     ssfp_file = File(exists=True, argstr='%s', mandatory=True,
-                     position=1, desc='SSFP file')
-    param_dict = traits.Dict(desc='Parameters as dictionary', position=2,
-                             argstr='', mandatory=True, xor=['param_file'])
-    param_file = File(desc='Parameters as .json file', position=2, argstr='--json=%s',
-                      xor=['param_dict'], mandatory=True, exists=True)
+                     position=-1, desc='Path to SSFP data')
 
     # Options
     f0_map = File(desc='f0 map (Hertz)', argstr='--f0=%s', exists=True)
     B1_map = File(desc='B1 map (ratio)', argstr='--B1=%s', exists=True)
-    mask = File(desc='Only process voxels within the mask',
-                argstr='--mask=%s', exists=True)
-    residuals = traits.Bool(
-        desc='Write out residuals for each data-point', argstr='--resid')
-    model = traits.Enum("1", "2", "2nex", "3", "3_f0", "3nex", desc="Select model to fit - 1/2/2nex/3/3_f0/3nex, default 3",
-                        argstr="--model=%d")
+    model = traits.Enum('3', '2', desc='Number of components, default 3',
+                        argstr='--model=%s', usedefault=True)
     scale = traits.Bool(
         desc='Normalize signals to mean (a good idea)', argstr='--scale')
-    algo = traits.Enum(
-        "S", "G", desc="Select (S)tochastic or (G)aussian Region Contraction", argstr="--algo=%d")
+    src = traits.Bool(
+        desc='Use a flat prior (stochastic region contraction), not gaussian', argstr='--SRC')
     iterations = traits.Int(
-        desc='Max iterations, default 4', argstr='---its=%d')
-    field_strength = traits.Float(
-        desc='Specify field-strength for fitting regions - 3/7/u for user input', argstr='--tesla=%f')
-    threads = traits.Int(
-        desc='Use N threads (default=4, 0=hardware limit)', argstr='--threads=%d')
-    prefix = traits.String(
-        desc='Add a prefix to output filenames', argstr='--out=%s')
+        desc='Max iterations, default 4', argstr='--its=%d')
+    samples = traits.Int(
+        desc='Samples per iteration, default 5000', argstr='--samples=%d')
+    retain = traits.Int(
+        desc='Samples retained per iteration, default 50', argstr='--retain=%d')
+    seed = traits.Int(desc='Random seed, default 0', argstr='--seed=%d')
+    prefit = traits.Bool(
+        desc='Narrow bounds with single-component DESPOT1/2 fits', argstr='--prefit')
+    residuals = traits.Bool(
+        desc='Write out residuals for each data-point', argstr='--resids')
+    status = traits.Bool(
+        desc='Write out an image of fit status codes', argstr='--status')
+    profile = traits.Bool(
+        desc='Write out per-voxel fit times and evaluation counts', argstr='--profile')
 
 
-class QIMCDespot(base.FitCommand):
+class MCDespot(base.FitCommand):
     """
-    Interace for qimcdespot
+    Fit the two or three component mcDESPOT model with Region Contraction
 
-    Example 1
+    Example
     -------
-    >>> from qipype.interfaces.relax import QiMcDespot
-    >>> interface = QiMcDespot(prefix='nipype_', param_file='mcdespot_params.json')
+    >>> from qipype.interfaces.relax import MCDespot
+    >>> seq = {'SPGR': {'TR': 6.5e-3, 'FA': [3, 4, 5, 7, 9, 12, 15, 18]},
+    ...        'SSFP': {'TR': 5e-3, 'FA': [12, 16, 20, 24, 30, 40, 50, 60],
+    ...                 'PhaseInc': [180, 180, 180, 180, 180, 180, 180, 180]}}
+    >>> mcd = MCDespot(sequence=seq, spgr_file='SPGR.nii.gz', ssfp_file='SSFP.nii.gz', scale=True)
+    >>> mcd_res = mcd.run()
     """
 
     _cmd = 'qi mcdespot'
-    input_spec = QIMCDespotInputSpec
-    output_spec = base.FitOutputSpec(
-        '3C', ['T1_m', 'T2_m', 'T1_ie', 'T2_ie', 'T1_csf', 'T2_csf', 'tau_m', 'f_m', 'f_csf', 'f0', 'B1'])
+    input_spec = MCDespotInputSpec
+    output_spec = base.FitOutputSpec('3C', MCD_VARYING['3'])
+
+    def _list_outputs(self):
+        # Outputs are named after the model, and the two component model has no CSF pool
+        prefix = self.inputs.model + 'C'
+        outputs = {}
+        for p in MCD_VARYING[self.inputs.model] + ['rmse']:
+            fname = '{}_{}.nii.gz'.format(prefix, p)
+            outputs['{}_map'.format(p)] = self._gen_fname(
+                fname, prefix=self.inputs.prefix)
+        return outputs
+
+
+class MCDespotSim(base.SimCommand):
+    """
+    Simulate SPGR and SSFP images with the mcDESPOT model. Maps for all the varying parameters of
+    the chosen model must be given.
+    """
+
+    _cmd = 'qi mcdespot'
+    sim_files = ['spgr', 'ssfp']
+    input_spec = base.SimInputSpec('MCD',
+                                   varying=MCD_VARYING['3'],
+                                   fixed=['f0', 'B1'],
+                                   out_files=sim_files,
+                                   extras={'model': traits.Enum('3', '2',
+                                                                desc='Number of components, default 3',
+                                                                argstr='--model=%s', usedefault=True)})
+    output_spec = base.SimOutputSpec('MCD', sim_files)
 
 ############################ qimp2rage ############################
 # Implemented but not tested #
@@ -284,6 +328,7 @@ class MP2RAGEInputSpec(base.InputSpec):
     prefix = traits.String(
         desc='Add a prefix to output filenames', argstr='--out=%s')
     beta = traits.Float(desc='Regularisation paramter', argstr='--beta=%f')
+    B1_map = File(desc='B1 map (ratio) file', argstr='--B1=%s')
 
 
 class MP2RAGEOutputSpec(TraitedSpec):
@@ -313,7 +358,7 @@ class MP2RAGE(base.FitCommand):
 
 class MultiechoInputSpec(base.FitInputSpec):
     # Options
-    algo = traits.String(desc="Choose algorithm (l/a/n)", argstr="--algo=%s")
+    algo = traits.String(desc="Choose algorithm (l/a/n/m)", argstr="--algo=%s")
     iterations = traits.Int(
         desc='Max iterations for WLLS/NLLS (default 15)', argstr='--its=%d')
     thresh_PD = traits.Float(
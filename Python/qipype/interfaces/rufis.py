@@ -107,7 +107,10 @@ class MUPAB1Sim(QI.SimCommand):
 
 class MUPASteadyStateInputSpec(QI.FitInputSpec):
     # Inputs - none
-    pass
+
+    # Options
+    autodiff = traits.Bool(
+        desc='Use automatic instead of numeric derivatives', argstr='--autodiff')
 
 
 class MUPASteadyStateOutputSpec(TraitedSpec):
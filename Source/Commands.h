@@ -2,6 +2,7 @@
 
 int diff_main(args::Subparser &parser);
 int hdr_main(args::Subparser &parser);
+int io_bench_main(args::Subparser &parser);
 int newimage_main(args::Subparser &parser);
 
 #ifdef BUILD_B1
@@ -75,6 +75,14 @@ extern args::Flag     verbose;
     args::Flag resids(parser, "RESIDS", "Write point residuals", {'r', "resids"});             \
     args::Flag covar(                                                                          \
         parser, "COVAR", "Write out covariance matrix (CoV and Corr) images", {"covar"});      \
+    args::Flag fit_status(                                                                     \
+        parser, "STATUS", "Write out an image of fit status codes", {"status"});               \
+    args::Flag profile(                                                                        \
+        parser, "PROFILE", "Write per-voxel fit times and evaluation counts", {"profile"});    \
+    args::Flag pack(                                                                           \
+        parser, "PACK", "Write parameter maps as volumes of one file", {"pack"});              \
+    args::Flag int16(                                                                          \
+        parser, "INT16", "Write residuals, covariance and simulations as int16", {"int16"});   \
                                                                                                \
     args::ValueFlag<int>   threads(parser,                                                     \
                                  "THREADS",                                                  \
@@ -93,4 +101,21 @@ extern args::Flag     verbose;
     args::ValueFlag<std::string> prefix(                                                       \
         parser, "PREFIX", "Add a prefix to output filenames", {'o', "out"});                   \
     args::ValueFlag<std::string> json_file(                                                    \
-        parser, "JSON", "Read JSON from file instead of stdin", {"json"});
+        parser, "JSON", "Read JSON from file instead of stdin", {"json"});                     \
+    args::ValueFlag<std::string> checkpoint(                                                   \
+        parser,                                                                                \
+        "CHECKPOINT",                                                                          \
+        "Save finished slabs to this directory, and resume from it if it exists",              \
+        {"checkpoint"});                                                                       \
+    args::ValueFlag<int> slab(                                                                 \
+        parser, "SLAB", "Process N slices at a time (default all)", {"slab"}, 0);
+
+/*
+ *  For commands whose fits use Ceres. Pass solver.Get() to QI::ReadSolverOptions.
+ */
+#define QI_SOLVER_ARGS                                                                         \
+    args::ValueFlag<std::string> solver(                                                       \
+        parser,                                                                                \
+        "SOLVER",                                                                              \
+        "Solver options as JSON, e.g. '{\"max_iterations\": 50}', overrides the input JSON",   \
+        {"solver"});
@@ -0,0 +1,229 @@
+/*
+ *  BatchLM.h - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <Eigen/Core>
+#include <array>
+
+namespace QI {
+
+// Doubles per SIMD register for the instruction set Eigen was compiled for, 2 for SSE2 and 4 for
+// AVX. Build with BUILD_NATIVE to use AVX where the CPU has it.
+constexpr int SIMDWidth = Eigen::internal::packet_traits<double>::size;
+
+/*
+ *  Structure-of-arrays storage for W voxels. Each row is one voxel (lane) and each column is one
+ *  data point or parameter, so with W equal to SIMDWidth every column is one SIMD register and
+ *  column-wise arithmetic works on all the voxels at once.
+ */
+template <int W> using BatchArray = Eigen::Array<double, W, Eigen::Dynamic>;
+template <int W> using BatchLanes = Eigen::Array<double, W, 1>;
+template <int W> using BatchMask  = Eigen::Array<bool, W, 1>;
+
+struct BatchLMOptions {
+    int    max_iterations      = 30;
+    double function_tolerance  = 1e-6;
+    double gradient_tolerance  = 1e-10;
+    double parameter_tolerance = 1e-8;
+};
+
+enum class BatchLMStatus : unsigned char { Running, Converged, IterationLimit, Stalled };
+
+/*
+ *  A bounded Levenberg-Marquardt solver that fits W voxels at once, one per lane. Every lane runs
+ *  the same algorithm with its own cost, damping and status, and the normal equations are built
+ *  and solved with lane-wise arithmetic, so the only per-lane branches are in the bookkeeping.
+ *  Lanes that have finished are still evaluated with the others, but their parameters are frozen.
+ *
+ *  The evaluator is called as eval(p, s, j), where p is W x NV. It must fill the signal s, which is
+ *  W x n, and if j is not nullptr the Jacobian, which is W x (n * NV) with the derivatives by
+ *  parameter a in columns a*n to a*n + n - 1. It must not change the size of either.
+ *
+ *  Damping is lambda * diag(JtJ), divided by 10 after a step that reduces the cost and multiplied
+ *  by 10 after one that does not, with up to 10 attempts per iteration. A lane converges when the
+ *  gradient, the relative cost reduction or the relative step meets its tolerance, and stalls if
+ *  no attempt reduces the cost. Trial parameters are clamped to the bounds.
+ */
+template <int NV, int W> class BatchLM {
+  public:
+    using Params = Eigen::Array<double, W, NV>;
+    using Bounds = Eigen::Array<double, NV, 1>;
+
+    // Set p to the start before solve(). The other members are outputs.
+    Params                       p;
+    BatchLanes<W>                cost; // Sum of squared residuals
+    Eigen::Array<int, W, 1>      iterations, residual_evaluations, jacobian_evaluations;
+    std::array<BatchLMStatus, W> status;
+
+    /*
+     *  Fit the lanes that are set in active to data, which is W x n. Inactive lanes are left with
+     *  status Converged and zero iterations, but their data and start must still be finite.
+     */
+    template <typename Eval>
+    void solve(BatchArray<W> const & data,
+               Bounds const &        lo,
+               Bounds const &        hi,
+               BatchMask<W> const &  active,
+               Eval &&               eval,
+               BatchLMOptions const &options) {
+        Eigen::Index const n = data.cols();
+        m_s.resize(W, n);
+        m_r.resize(W, n);
+        m_j.resize(W, n * NV);
+        iterations.setZero();
+        residual_evaluations = active.template cast<int>();
+        jacobian_evaluations.setZero();
+        for (int l = 0; l < W; l++) {
+            status[l] = active[l] ? BatchLMStatus::Running : BatchLMStatus::Converged;
+        }
+        for (int a = 0; a < NV; a++) {
+            p.col(a) = p.col(a).max(lo[a]).min(hi[a]);
+        }
+        eval(p, m_s, nullptr);
+        cost = SumSquares(data);
+
+        BatchMask<W>  running = active;
+        BatchLanes<W> lambda  = BatchLanes<W>::Constant(1e-3);
+        for (int it = 0; it < options.max_iterations && running.any(); it++) {
+            iterations += running.template cast<int>();
+            jacobian_evaluations += running.template cast<int>();
+            eval(p, m_s, &m_j);
+            m_r = data - m_s;
+            BuildNormalEquations(n);
+
+            BatchLanes<W> gmax = m_g[0].abs();
+            for (int a = 1; a < NV; a++) {
+                gmax = gmax.max(m_g[a].abs());
+            }
+            // Written so that a NaN gradient keeps the lane running, it will stall below
+            running = running && !(gmax <= options.gradient_tolerance);
+
+            BatchLanes<W> p2 = BatchLanes<W>::Zero();
+            for (int a = 0; a < NV; a++) {
+                p2 += p.col(a).square();
+            }
+            BatchMask<W> trying = running;
+            for (int attempt = 0; attempt < 10 && trying.any(); attempt++) {
+                SolveDamped(lambda);
+                BatchLanes<W> step2 = BatchLanes<W>::Zero();
+                for (int a = 0; a < NV; a++) {
+                    m_trial.col(a) = (p.col(a) + m_delta[a]).max(lo[a]).min(hi[a]);
+                    step2 += (m_trial.col(a) - p.col(a)).square();
+                }
+                eval(m_trial, m_s, nullptr);
+                residual_evaluations += trying.template cast<int>();
+                BatchLanes<W> const trial_cost = SumSquares(data);
+
+                BatchMask<W> const accept = trying && (trial_cost < cost);
+                BatchMask<W> const converged =
+                    accept && (((cost - trial_cost) <= options.function_tolerance * cost) ||
+                               (step2.sqrt() <= options.parameter_tolerance *
+                                                    (p2.sqrt() + options.parameter_tolerance)));
+                for (int a = 0; a < NV; a++) {
+                    p.col(a) = accept.select(m_trial.col(a), p.col(a));
+                }
+                cost   = accept.select(trial_cost, cost);
+                lambda = accept.select((lambda / 10).max(1e-10),
+                                       trying.select(lambda * 10, lambda));
+                running = running && !converged;
+                trying  = trying && !accept;
+            }
+            for (int l = 0; l < W; l++) {
+                if (trying[l]) {
+                    status[l]  = BatchLMStatus::Stalled;
+                    running[l] = false;
+                } else if (!running[l] && status[l] == BatchLMStatus::Running) {
+                    status[l] = BatchLMStatus::Converged;
+                }
+            }
+        }
+        for (int l = 0; l < W; l++) {
+            if (running[l]) {
+                status[l] = BatchLMStatus::IterationLimit;
+            }
+        }
+    }
+
+  private:
+    BatchArray<W>                      m_s, m_r, m_j;
+    Params                             m_trial;
+    std::array<BatchLanes<W>, NV>      m_g, m_delta, m_y;
+    std::array<BatchLanes<W>, NV * NV> m_jtj, m_l; // Only the lower triangles are used
+
+    // Sum of squared residuals of the signal in m_s
+    BatchLanes<W> SumSquares(BatchArray<W> const &data) const {
+        BatchLanes<W> sum = BatchLanes<W>::Zero();
+        for (Eigen::Index k = 0; k < data.cols(); k++) {
+            sum += (data.col(k) - m_s.col(k)).square();
+        }
+        return sum;
+    }
+
+    // JtJ and the gradient Jt r from m_j and m_r, accumulated one data point at a time
+    void BuildNormalEquations(Eigen::Index const n) {
+        for (int a = 0; a < NV; a++) {
+            m_g[a].setZero();
+            for (int b = 0; b <= a; b++) {
+                m_jtj[a * NV + b].setZero();
+            }
+        }
+        for (Eigen::Index k = 0; k < n; k++) {
+            for (int a = 0; a < NV; a++) {
+                auto const ja = m_j.col(a * n + k);
+                m_g[a] += ja * m_r.col(k);
+                for (int b = 0; b <= a; b++) {
+                    m_jtj[a * NV + b] += ja * m_j.col(b * n + k);
+                }
+            }
+        }
+    }
+
+    /*
+     *  Solve (JtJ + lambda diag(JtJ)) delta = g in every lane with a Cholesky decomposition. If a
+     *  lane's matrix is not positive definite its step is NaN, so the trial cost is NaN and the
+     *  step is rejected.
+     */
+    void SolveDamped(BatchLanes<W> const &lambda) {
+        for (int a = 0; a < NV; a++) {
+            for (int b = 0; b <= a; b++) {
+                BatchLanes<W> sum = m_jtj[a * NV + b];
+                if (a == b) {
+                    sum *= 1 + lambda;
+                }
+                for (int c = 0; c < b; c++) {
+                    sum -= m_l[a * NV + c] * m_l[b * NV + c];
+                }
+                if (a == b) {
+                    m_l[a * NV + b] = sum.sqrt();
+                } else {
+                    m_l[a * NV + b] = sum / m_l[b * NV + b];
+                }
+            }
+        }
+        for (int a = 0; a < NV; a++) {
+            BatchLanes<W> sum = m_g[a];
+            for (int c = 0; c < a; c++) {
+                sum -= m_l[a * NV + c] * m_y[c];
+            }
+            m_y[a] = sum / m_l[a * NV + a];
+        }
+        for (int a = NV - 1; a >= 0; a--) {
+            BatchLanes<W> sum = m_y[a];
+            for (int c = a + 1; c < NV; c++) {
+                sum -= m_l[c * NV + a] * m_delta[c];
+            }
+            m_delta[a] = sum / m_l[a * NV + a];
+        }
+    }
+};
+
+} // namespace QI
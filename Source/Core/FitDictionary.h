@@ -0,0 +1,330 @@
+/*
+ *  FitDictionary.h - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include "FitFunction.h"
+#include "JSON.h"
+#include "Log.h"
+#include "itkMultiThreaderBase.h"
+#include <Eigen/Dense>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+
+namespace QI {
+
+/*
+ *  Fit by matching each voxel against a dictionary of signals precomputed on a grid, which for
+ *  models with only a few parameters is much cheaper than a Ceres solve per voxel.
+ *
+ *  The first varying parameter must be a linear scale factor (PD or M0). It is not part of the
+ *  grid, and is found by projecting the data onto the best matching signal. The remaining varying
+ *  parameters and the fixed parameters each have a grid of values, and a voxel is matched using
+ *  the part of the dictionary for the nearest fixed grid point. The dictionary can be compressed
+ *  to its leading singular vectors, and can optionally be refined with a single Gauss-Newton step.
+ *
+ *  Set the grids then call Build() before the fit is used.
+ *
+ *  Only qi despot1 uses this at present. qi multiecho has closed-form log-linear and ARLO fits that
+ *  are already as cheap as a dictionary match, and qi mp2rage looks T1 up in its own table of
+ *  contrast values.
+ */
+template <typename ModelType, typename FlagType_ = int>
+struct DictionaryFit : FitFunction<ModelType, FlagType_> {
+    using Super = FitFunction<ModelType, FlagType_>;
+    using typename Super::RMSErrorType;
+    using InputType    = typename ModelType::DataType;
+    using OutputType   = typename ModelType::ParameterType;
+    using FlagType     = FlagType_; // 1 if the Gauss-Newton step improved the match
+    using VaryingArray = typename ModelType::VaryingArray;
+    using FixedArray   = typename ModelType::FixedArray;
+
+    static_assert(std::is_same_v<InputType, double>, "Dictionary fitting requires real data");
+    static_assert(ModelType::NI == 1, "Dictionary fitting requires a single input");
+
+    /*
+     *  varying_grid holds the values for varying parameters 1 to NV-1. An empty fixed_grid uses
+     *  only fixed_defaults. rank is the number of singular vectors to keep, 0 keeps the full
+     *  dictionary. If cache is set, dictionaries are saved there and re-used by later runs with
+     *  the same sequence and grids.
+     */
+    std::array<Eigen::ArrayXd, ModelType::NV - 1> varying_grid;
+    std::array<Eigen::ArrayXd, ModelType::NF>     fixed_grid;
+    int                                           rank   = 0;
+    bool                                          polish = false;
+    std::string                                   cache;
+
+    DictionaryFit(ModelType &m) : Super{m} {}
+
+    static Eigen::ArrayXd Grid(double const lo, double const hi, int const n, bool const log) {
+        if (log) {
+            return Eigen::ArrayXd::LinSpaced(n, std::log(lo), std::log(hi)).exp();
+        } else {
+            return Eigen::ArrayXd::LinSpaced(n, lo, hi);
+        }
+    }
+
+    // A grid of n values between the model bounds for varying parameter i, so the dictionary
+    // covers the same range as the other fits
+    Eigen::ArrayXd BoundsGrid(int const i, int const n, bool const log) const {
+        return Grid(this->model.bounds_lo[i], this->model.bounds_hi[i], n, log);
+    }
+
+    void Build(bool const verbose) {
+        for (int i = 0; i < ModelType::NV - 1; i++) {
+            if (varying_grid[i].size() == 0) {
+                QI::Fail("No dictionary grid for {}", this->model.varying_names[i + 1]);
+            }
+        }
+        for (int i = 0; i < ModelType::NF; i++) {
+            if (fixed_grid[i].size() == 0) {
+                fixed_grid[i] = Eigen::ArrayXd::Constant(1, this->model.fixed_defaults[i]);
+            }
+        }
+        m_entries = 1;
+        for (auto const &g : varying_grid) {
+            m_entries *= g.size();
+        }
+        Eigen::Index nodes = 1;
+        for (auto const &g : fixed_grid) {
+            nodes *= g.size();
+        }
+
+        json key_doc{{"model", typeid(ModelType).name()},
+                     {"sequence", this->model.sequence},
+                     {"rank", rank}};
+        for (auto const &g : varying_grid) {
+            key_doc["varying"].push_back(std::vector<double>(g.begin(), g.end()));
+        }
+        for (auto const &g : fixed_grid) {
+            key_doc["fixed"].push_back(std::vector<double>(g.begin(), g.end()));
+        }
+        std::string const key  = key_doc.dump();
+        std::string const path =
+            (cache != "") ? fmt::format("{}/{:016x}.dict", cache, Hash(key)) : "";
+        auto const n    = this->input_size(0);
+        auto const cols = (rank > 0 && rank < n) ? rank : n;
+        if (path != "" && std::filesystem::exists(path)) {
+            QI::Log(verbose, "Loading dictionary from {}", path);
+            if (Load(path, key, n, cols, m_entries * nodes)) {
+                return;
+            }
+            QI::Log(verbose, "Dictionary file {} was built with other settings", path);
+        }
+
+        QI::Log(verbose, "Building dictionary with {} entries", m_entries * nodes);
+        Eigen::MatrixXd signals(n, m_entries * nodes);
+        m_norms.resize(m_entries * nodes);
+        auto mt = itk::MultiThreaderBase::New();
+        mt->ParallelizeArray(
+            0,
+            m_entries * nodes,
+            [&](itk::SizeValueType const index) {
+                Eigen::Index const j = index;
+                VaryingArray       v;
+                FixedArray         f;
+                Decode(j % m_entries, j / m_entries, v, f);
+                Eigen::ArrayXd const s = this->model.signal(v, f);
+                m_norms[j]             = s.matrix().norm();
+                if (m_norms[j] > 0) {
+                    signals.col(j) = s.matrix() / m_norms[j];
+                } else {
+                    signals.col(j).setZero();
+                    m_norms[j] = 1;
+                }
+            },
+            nullptr);
+
+        if (rank > 0 && rank < n) {
+            // The leading left singular vectors are the top eigenvectors of the Gram matrix, which
+            // is only n x n and so much cheaper to decompose than the dictionary itself
+            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(signals * signals.transpose());
+            m_basis = eig.eigenvectors().rightCols(rank);
+            m_atoms = m_basis.transpose() * signals;
+            QI::Log(verbose,
+                    "Compressed to rank {}, retaining {:.4f}% of energy",
+                    rank,
+                    100. * eig.eigenvalues().tail(rank).sum() / eig.eigenvalues().sum());
+        } else {
+            m_basis = Eigen::MatrixXd::Identity(n, n);
+            m_atoms = std::move(signals);
+        }
+        if (path != "") {
+            QI::Log(verbose, "Saving dictionary to {}", path);
+            std::filesystem::create_directories(cache);
+            Save(path, key);
+        }
+    }
+
+    FitReturnType fit(std::vector<QI_ARRAY(InputType)> const &inputs,
+                      FixedArray const &                      fixed,
+                      VaryingArray &                          p,
+                      typename ModelType::CovarArray *        cov,
+                      RMSErrorType &                          rmse,
+                      std::vector<QI_ARRAY(InputType)> &      residuals,
+                      FlagType &                              iterations) const override {
+        if (m_atoms.size() == 0) {
+            QI::Fail("Dictionary fit was used before Build() was called");
+        }
+        Eigen::ArrayXd const &data = inputs[0];
+        if ((data == 0).all() || !data.allFinite()) {
+            return {false, FitStatus::BadData};
+        }
+        Eigen::Index node = 0, stride = 1;
+        for (int i = 0; i < ModelType::NF; i++) {
+            Eigen::Index nearest;
+            (fixed_grid[i] - fixed[i]).abs().minCoeff(&nearest);
+            node += nearest * stride;
+            stride *= fixed_grid[i].size();
+        }
+
+        Eigen::VectorXd const projected = m_basis.transpose() * data.matrix();
+        Eigen::Index const    first     = node * m_entries;
+        Eigen::Index          best      = first;
+        double                best_dot  = -std::numeric_limits<double>::infinity();
+        for (Eigen::Index j = first; j < first + m_entries; j++) {
+            double const dot = m_atoms.col(j).dot(projected);
+            if (dot > best_dot) {
+                best_dot = dot;
+                best     = j;
+            }
+        }
+        if (!(best_dot > 0)) {
+            return {false, FitStatus::NoSolution};
+        }
+        FixedArray grid_fixed;
+        Decode(best - first, node, p, grid_fixed);
+        p[0]       = best_dot / m_norms[best];
+        iterations = 0;
+
+        Eigen::ArrayXd  s = this->model.signal(p, fixed);
+        Eigen::MatrixXd jacobian;
+        FitEvaluations  evaluations{1, 0};
+        if (polish) {
+            GetModelJacobian(this->model, p, fixed, s, jacobian);
+            evaluations.residuals++;
+            evaluations.jacobians++;
+            Eigen::VectorXd const step = jacobian.colPivHouseholderQr().solve((data - s).matrix());
+            VaryingArray const    next =
+                (p + step.array()).max(this->model.bounds_lo).min(this->model.bounds_hi);
+            Eigen::ArrayXd const next_s = this->model.signal(next, fixed);
+            if ((data - next_s).square().sum() < (data - s).square().sum()) {
+                p          = next;
+                s          = next_s;
+                iterations = 1;
+            }
+        }
+
+        Eigen::ArrayXd const rs  = data - s;
+        double const         var = rs.square().sum();
+        rmse                     = sqrt(var / data.rows());
+        if (residuals.size() > 0) {
+            residuals[0] = rs;
+        }
+        if (cov) {
+            GetModelJacobian(this->model, p, fixed, s, jacobian);
+            GetJacobianCovariance<ModelType>(jacobian, p, var / (data.rows() - ModelType::NV), cov);
+        }
+        return {true, FitStatus::Success, evaluations};
+    }
+
+  private:
+    Eigen::Index    m_entries = 0; // Number of dictionary entries for each fixed grid point
+    Eigen::MatrixXd m_basis;       // Columns are the singular vectors used for compression
+    Eigen::MatrixXd m_atoms;       // Normalised (and compressed) signals, one per column
+    Eigen::ArrayXd  m_norms;       // Norm of each signal before normalisation, with scale 1
+
+    // Convert an entry and fixed grid point number to parameter values, with a scale of 1
+    void Decode(Eigen::Index entry, Eigen::Index node, VaryingArray &v, FixedArray &f) const {
+        v[0] = 1;
+        for (int i = 0; i < ModelType::NV - 1; i++) {
+            v[i + 1] = varying_grid[i][entry % varying_grid[i].size()];
+            entry /= varying_grid[i].size();
+        }
+        for (int i = 0; i < ModelType::NF; i++) {
+            f[i] = fixed_grid[i][node % fixed_grid[i].size()];
+            node /= fixed_grid[i].size();
+        }
+    }
+
+    // FNV-1a, as std::hash can give different values in different builds
+    static uint64_t Hash(std::string const &key) {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char const c : key) {
+            h = (h ^ c) * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    template <typename Matrix> static void WriteMatrix(std::ofstream &file, Matrix const &m) {
+        Eigen::Index const dims[2]{m.rows(), m.cols()};
+        file.write(reinterpret_cast<char const *>(dims), sizeof(dims));
+        file.write(reinterpret_cast<char const *>(m.data()), m.size() * sizeof(double));
+    }
+
+    // Returns false without touching m if the stored size is not rows x cols
+    template <typename Matrix>
+    static bool
+    ReadMatrix(std::ifstream &file, Matrix &m, Eigen::Index const rows, Eigen::Index const cols) {
+        Eigen::Index dims[2];
+        if (!file.read(reinterpret_cast<char *>(dims), sizeof(dims)) || dims[0] != rows ||
+            dims[1] != cols) {
+            return false;
+        }
+        m.resize(rows, cols);
+        return static_cast<bool>(
+            file.read(reinterpret_cast<char *>(m.data()), m.size() * sizeof(double)));
+    }
+
+    // The key is stored at the start of the file so a hash collision or stale file is detected
+    void Save(std::string const &path, std::string const &key) const {
+        std::string const tmp_path = path + ".tmp";
+        {
+            std::ofstream  file(tmp_path, std::ios::binary);
+            uint64_t const key_size = key.size();
+            file.write(reinterpret_cast<char const *>(&key_size), sizeof(key_size));
+            file.write(key.data(), key.size());
+            WriteMatrix(file, m_basis);
+            WriteMatrix(file, m_atoms);
+            WriteMatrix(file, m_norms);
+            if (!file) {
+                QI::Fail("Failed to write dictionary to {}", tmp_path);
+            }
+        }
+        std::filesystem::rename(tmp_path, path);
+    }
+
+    bool Load(std::string const &path,
+              std::string const &key,
+              Eigen::Index const n,
+              Eigen::Index const cols,
+              Eigen::Index const entries) {
+        std::ifstream file(path, std::ios::binary);
+        uint64_t      key_size = 0;
+        if (!file.read(reinterpret_cast<char *>(&key_size), sizeof(key_size)) ||
+            key_size != key.size()) {
+            return false;
+        }
+        std::string stored(key_size, '\0');
+        if (!file.read(stored.data(), key_size) || stored != key) {
+            return false;
+        }
+        if (!ReadMatrix(file, m_basis, n, cols) || !ReadMatrix(file, m_atoms, cols, entries) ||
+            !ReadMatrix(file, m_norms, entries, 1)) {
+            QI::Fail("Dictionary file {} is corrupt", path);
+        }
+        return true;
+    }
+};
+
+} // namespace QI
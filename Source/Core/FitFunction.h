@@ -13,7 +13,9 @@
 
 #include "Macro.h"
 #include "Model.h"
+#include "SolverOptions.h"
 #include <Eigen/Core>
+#include <array>
 #include <itkIndex.h>
 #include <string>
 #include <tuple>
@@ -21,21 +23,118 @@
 namespace QI {
 
 /*
- *  Return type required by the fit() function objects
+ *  Why a fit failed, or a warning about a fit that succeeded. ModelFitFilter counts these and can
+ *  write them out as an image, so the values of existing codes must not change.
  */
+enum class FitStatus : unsigned char {
+    Success = 0,    // The fit converged
+    IterationLimit, // The iteration limit was reached first, but the result is still used
+    BoundsHit,      // The fit converged with at least one parameter on a bound
+    NonFinite,      // The parameters or RMSE were not finite
+    BadData,        // The data were not positive, so no fit was attempted
+    BadFixed,       // A fixed parameter was out of range, so no fit was attempted
+    SolverFailure,  // The solver failed, e.g. a numerical problem in the linear solver
+    CostFailure,    // The cost function could not be evaluated
+    NoSolution      // No acceptable solution was found
+};
+constexpr int                                      FitStatusCount = 9;
+constexpr std::array<char const *, FitStatusCount> FitStatusNames{"Success",
+                                                                  "Iteration limit",
+                                                                  "Bounds hit",
+                                                                  "Not finite",
+                                                                  "Bad data",
+                                                                  "Bad fixed parameter",
+                                                                  "Solver failure",
+                                                                  "Cost failure",
+                                                                  "No solution"};
+
+/*
+ *  Number of times a fit evaluated the residuals and the Jacobian, for the profiling outputs of
+ *  ModelFitFilter. Fit functions that do not count them leave both at zero.
+ */
+struct FitEvaluations {
+    int residuals = 0;
+    int jacobians = 0;
 
+    void Add(ceres::Solver::Summary const &summary) {
+        residuals += summary.num_residual_evaluations;
+        jacobians += summary.num_jacobian_evaluations;
+    }
+};
+
+inline FitEvaluations CeresEvaluations(ceres::Solver::Summary const &summary) {
+    FitEvaluations e;
+    e.Add(summary);
+    return e;
+}
+
+/*
+ *  Return type required by the fit() function objects. If success is false the outputs are not
+ *  usable, otherwise status may still hold a warning.
+ */
 struct FitReturnType {
-    bool        success;
-    std::string message;
+    bool           success;
+    FitStatus      status;
+    FitEvaluations evaluations{};
 };
 
+inline FitStatus CeresStatus(ceres::Solver::Summary const &summary) {
+    switch (summary.termination_type) {
+    case ceres::CONVERGENCE:
+    case ceres::USER_SUCCESS:
+        return FitStatus::Success;
+    case ceres::NO_CONVERGENCE:
+        return FitStatus::IterationLimit;
+    case ceres::USER_FAILURE:
+        return FitStatus::CostFailure;
+    default:
+        return FitStatus::SolverFailure;
+    }
+}
+
+// Turn Success into BoundsHit if any parameter finished on a bound
+template <typename P, typename B>
+FitStatus CheckBounds(FitStatus const status, P const &p, B const &lo, B const &hi) {
+    if (status == FitStatus::Success && ((p <= lo).any() || (p >= hi).any())) {
+        return FitStatus::BoundsHit;
+    }
+    return status;
+}
+
+/*
+ *  In warm-start mode ModelFitFilter passes the result of the last converged voxel before this one
+ *  in the same fixed-size chunk of the voxel list, or NaN if there is none yet. If that seed is
+ *  finite and inside the bounds (after dividing the first nscale parameters by the data scale) it
+ *  is used as the starting point, otherwise the default start is used. Returns true if the seed was
+ *  used, so the caller can fall back to the default start if the seeded solve does not converge.
+ */
+template <typename Derived, typename Start, typename Bound>
+bool WarmStart(Eigen::ArrayBase<Derived> &p,
+               Start const &              start,
+               Bound const &              lo,
+               Bound const &              hi,
+               bool const                 warm,
+               double const               scale  = 1.0,
+               int const                  nscale = 0) {
+    if (warm && p.allFinite()) {
+        p.head(nscale) /= scale;
+        if ((p >= lo).all() && (p <= hi).all()) {
+            return true;
+        }
+    }
+    p << start;
+    return false;
+}
+
 template <typename Model_, bool Blocked_ = false, bool Indexed_ = false> struct FitFunctionBase {
     using ModelType           = Model_;
     using RMSErrorType        = double;
     static const bool Blocked = Blocked_;
     static const bool Indexed = Indexed_;
 
-    ModelType model;
+    ModelType     model;
+    bool          warm_start = false; // Start from a converged neighbour (see WarmStart)
+    SolverOptions solver;             // Overrides for the Ceres settings used by each fit
     FitFunctionBase(ModelType &m) : model{m} {}
 
     long input_size(long const &i) const { return model.input_size(i); }
@@ -81,11 +180,7 @@ struct NLLSFitFunction : FitFunction<ModelType> {
                       FlagType &                              iterations) const {
         auto const &   data = inputs[0];
         ceres::Problem problem;
-        using Cost      = ModelCost<ModelType>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, ModelType::NV>;
-        auto *cost      = new Cost{this->model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, this->model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
+        problem.AddResidualBlock(MakeModelCost(this->model, fixed, data), NULL, p.data());
         for (int i = 0; i < ModelType::NV; i++) {
             problem.SetParameterLowerBound(p.data(), i, this->model.bounds_lo[i]);
             problem.SetParameterUpperBound(p.data(), i, this->model.bounds_hi[i]);
@@ -97,12 +192,21 @@ struct NLLSFitFunction : FitFunction<ModelType> {
         options.gradient_tolerance  = 1e-7;
         options.parameter_tolerance = 1e-5;
         options.logging_type        = ceres::SILENT;
-        p << this->model.start;
+        this->solver.Apply(options);
+        bool const seeded = WarmStart(
+            p, this->model.start, this->model.bounds_lo, this->model.bounds_hi, this->warm_start);
         ceres::Solve(options, &problem, &summary);
+        iterations = summary.iterations.size();
+        FitEvaluations evaluations = CeresEvaluations(summary);
+        if (seeded && summary.termination_type != ceres::CONVERGENCE) {
+            p << this->model.start;
+            ceres::Solve(options, &problem, &summary);
+            iterations += summary.iterations.size();
+            evaluations.Add(summary);
+        }
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, CeresStatus(summary), evaluations};
         }
-        iterations = summary.iterations.size();
 
         Eigen::ArrayXd const rs  = (data - this->model.signal(p, fixed));
         double const         var = rs.square().sum();
@@ -114,7 +218,9 @@ struct NLLSFitFunction : FitFunction<ModelType> {
             QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
         }
 
-        return {true, ""};
+        return {true,
+                CheckBounds(CeresStatus(summary), p, this->model.bounds_lo, this->model.bounds_hi),
+                evaluations};
     }
 };
 
@@ -0,0 +1,268 @@
+/*
+ *  FitLM.h - Part of QUantitative Imaging Tools
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include "BatchLM.h"
+#include "FitFunction.h"
+#include <Eigen/Dense>
+#include <limits>
+#include <type_traits>
+
+namespace QI {
+
+// Models with signal equations for a whole batch of voxels, and terms prepared for them (see LMFit)
+template <typename Model, int W>
+constexpr bool HasBatchSignal = requires(Model const &                              m,
+                                         Eigen::Array<double, W, Model::NV> const &v,
+                                         BatchArray<W> const &                      f,
+                                         BatchArray<W> &                            s) {
+    m.template signal_batch<W>(v, f, s, &s);
+};
+
+template <typename Model, int W>
+constexpr bool HasBatchPrepare = requires(Model const &        m,
+                                          BatchArray<W> const &f,
+                                          BatchArray<W> &      p) {
+    m.template prepare_batch<W>(f, p);
+};
+
+/*
+ *  A bounded Levenberg-Marquardt fit for models with few parameters and cheap closed-form signal
+ *  equations, where setting up a ceres::Problem for every voxel costs more than the fit itself. The
+ *  solver is QI::BatchLM, which fits BatchSize voxels at once, one per SIMD lane.
+ *
+ *  ModelFitFilter passes up to BatchSize voxels (or blocks of a voxel) at a time to fit_batch() as
+ *  columns of the data array. fit() fits one voxel, and is used when residuals or covariance are
+ *  requested.
+ *
+ *  Models with a member
+ *      template <int W> void signal_batch(Eigen::Array<double, W, NV> const &v,
+ *                                         BatchArray<W> const &fixed,
+ *                                         BatchArray<W> &s, BatchArray<W> *j) const;
+ *  are evaluated for the whole batch at once, with s and j laid out as for BatchLM. fixed holds
+ *  the fixed parameters (W x NF), unless the model also has
+ *      template <int W> void prepare_batch(BatchArray<W> const &fixed,
+ *                                          BatchArray<W> &prepared) const;
+ *  which is called once per batch, e.g. to calculate terms that only depend on the fixed
+ *  parameters, and then signal_batch() is passed prepared instead. Other models are evaluated one
+ *  voxel at a time with GetModelJacobian(), so only the solver is vectorised.
+ *
+ *  Parameters start at model.start and are clamped to bounds_lo/bounds_hi. As for
+ *  ScaledNumericDiffFit, the first NScale parameters are relative to the largest data point in
+ *  each voxel, and voxels where that is not positive are reported as BadData. Set Blocked for
+ *  models with several blocks of data per voxel. The iteration limit and tolerances are taken from
+ *  the solver options. A voxel whose cost cannot be reduced before it meets a tolerance is
+ *  reported as NoSolution.
+ */
+template <typename ModelType, int NScale = 0, bool Blocked = false>
+struct LMFit : std::conditional_t<Blocked,
+                                  BlockFitFunction<ModelType, int>,
+                                  FitFunction<ModelType, int>> {
+    using Super = std::conditional_t<Blocked,
+                                     BlockFitFunction<ModelType, int>,
+                                     FitFunction<ModelType, int>>;
+    using typename Super::RMSErrorType;
+    using InputType    = typename ModelType::DataType;
+    using OutputType   = typename ModelType::ParameterType;
+    using FlagType     = int; // Iterations
+    using VaryingArray = typename ModelType::VaryingArray;
+    using FixedArray   = typename ModelType::FixedArray;
+
+    static constexpr int NV        = ModelType::NV;
+    static constexpr int BatchSize = SIMDWidth;
+
+    static_assert(std::is_same_v<InputType, double>, "LM fitting requires real data");
+    static_assert(ModelType::NI == 1, "LM fitting requires a single input");
+
+    // Buffers for one thread, so fitting a batch does not allocate (see ModelFitFilter)
+    struct Scratch {
+        BatchLM<NV, BatchSize> lm;
+        BatchArray<BatchSize>  data, fixed, prepared;
+        BatchLanes<BatchSize>  scale;
+        BatchMask<BatchSize>   active;
+        Eigen::ArrayXd         signal; // For models without signal_batch, and fit()
+        Eigen::MatrixXd        jacobian;
+        VaryingArray           p;
+    };
+
+    LMFit(ModelType &m) : Super{m} {}
+
+    Scratch make_scratch() const { return Scratch{}; }
+
+    /*
+     *  data is n x count and fixed is NF x count, one voxel per column, with count at most
+     *  BatchSize. The parameters, RMSE, iterations and result (status and evaluation counts) for
+     *  each voxel are written to the corresponding column or entry of the outputs.
+     */
+    void fit_batch(Eigen::Ref<Eigen::ArrayXXd const> const &data,
+                   Eigen::Ref<Eigen::ArrayXXd const> const &fixed,
+                   Eigen::Ref<Eigen::ArrayXXd>              p,
+                   Eigen::Ref<Eigen::ArrayXd>               rmse,
+                   Eigen::Ref<Eigen::ArrayXi>               iterations,
+                   FitReturnType *                          result,
+                   Scratch &                                sc) const {
+        Eigen::Index const n     = data.rows();
+        Eigen::Index const count = data.cols();
+        // Unused lanes are copies of the first voxel, so they are finite but ignored
+        sc.data.resize(BatchSize, n);
+        sc.fixed.resize(BatchSize, ModelType::NF);
+        for (int l = 0; l < BatchSize; l++) {
+            Eigen::Index const j = (l < count) ? l : 0;
+            sc.data.row(l)       = data.col(j).transpose();
+            sc.fixed.row(l)      = fixed.col(j).transpose();
+            sc.scale[l]          = 1.0;
+            sc.active[l]         = (l < count);
+            if constexpr (NScale > 0) {
+                double const scale = data.col(j).maxCoeff();
+                if (scale >= std::numeric_limits<double>::epsilon()) {
+                    sc.scale[l] = scale;
+                    sc.data.row(l) /= scale;
+                } else {
+                    sc.active[l] = false;
+                }
+            }
+            sc.lm.p.row(l) = this->model.start.transpose();
+        }
+        if constexpr (HasBatchPrepare<ModelType, BatchSize>) {
+            this->model.template prepare_batch<BatchSize>(sc.fixed, sc.prepared);
+        }
+
+        auto const eval = [&](typename BatchLM<NV, BatchSize>::Params const &v,
+                              BatchArray<BatchSize> &                         s,
+                              BatchArray<BatchSize> *                         j) {
+            if constexpr (HasBatchSignal<ModelType, BatchSize>) {
+                if constexpr (HasBatchPrepare<ModelType, BatchSize>) {
+                    this->model.template signal_batch<BatchSize>(v, sc.prepared, s, j);
+                } else {
+                    this->model.template signal_batch<BatchSize>(v, sc.fixed, s, j);
+                }
+            } else {
+                for (int l = 0; l < BatchSize; l++) {
+                    VaryingArray const vl = v.row(l).transpose();
+                    FixedArray const   fl = sc.fixed.row(l).transpose();
+                    if (j) {
+                        GetModelJacobian(this->model, vl, fl, sc.signal, sc.jacobian);
+                        for (int a = 0; a < NV; a++) {
+                            j->row(l).segment(a * n, n) = sc.jacobian.col(a).transpose().array();
+                        }
+                    } else {
+                        sc.signal = this->model.signal(vl, fl);
+                    }
+                    s.row(l) = sc.signal.transpose();
+                }
+            }
+        };
+        BatchLMOptions options;
+        options.max_iterations      = this->solver.max_iterations.value_or(30);
+        options.function_tolerance  = this->solver.function_tolerance.value_or(1e-6);
+        options.gradient_tolerance  = this->solver.gradient_tolerance.value_or(1e-10);
+        options.parameter_tolerance = this->solver.parameter_tolerance.value_or(1e-8);
+        sc.lm.solve(
+            sc.data, this->model.bounds_lo, this->model.bounds_hi, sc.active, eval, options);
+
+        for (Eigen::Index j = 0; j < count; j++) {
+            if (!sc.active[j]) {
+                p.col(j).setZero();
+                rmse[j]       = 0.0;
+                iterations[j] = 0;
+                result[j]     = {false, FitStatus::BadData};
+                continue;
+            }
+            sc.p = sc.lm.p.row(j).transpose();
+            switch (sc.lm.status[j]) {
+            case BatchLMStatus::Converged:
+                result[j] = {true,
+                             CheckBounds(FitStatus::Success,
+                                         sc.p,
+                                         this->model.bounds_lo,
+                                         this->model.bounds_hi)};
+                break;
+            case BatchLMStatus::IterationLimit:
+                result[j] = {true, FitStatus::IterationLimit};
+                break;
+            default:
+                result[j] = {false, FitStatus::NoSolution};
+            }
+            result[j].evaluations = {sc.lm.residual_evaluations[j], sc.lm.jacobian_evaluations[j]};
+            sc.p.template head<NScale>() *= sc.scale[j];
+            p.col(j)      = sc.p;
+            rmse[j]       = std::sqrt(sc.lm.cost[j] / n) * sc.scale[j];
+            iterations[j] = sc.lm.iterations[j];
+        }
+    }
+
+    FitReturnType fit(std::vector<QI_ARRAY(InputType)> const &inputs,
+                      FixedArray const &                      fixed,
+                      VaryingArray &                          p,
+                      typename ModelType::CovarArray *        cov,
+                      RMSErrorType &                          rmse,
+                      std::vector<QI_ARRAY(InputType)> &      residuals,
+                      FlagType &                              iterations,
+                      Scratch &                               sc) const {
+        FitReturnType              result;
+        Eigen::Map<Eigen::ArrayXd> rmse_map(&rmse, 1);
+        Eigen::Map<Eigen::ArrayXi> iterations_map(&iterations, 1);
+        fit_batch(inputs[0], fixed, p, rmse_map, iterations_map, &result, sc);
+        if (result.status == FitStatus::BadData) {
+            return result;
+        }
+        GetModelJacobian(this->model, p, fixed, sc.signal, sc.jacobian);
+        Eigen::ArrayXd const rs = inputs[0] - sc.signal;
+        if (residuals.size() > 0) {
+            residuals[0] = rs;
+        }
+        if (cov) {
+            GetJacobianCovariance<ModelType>(
+                sc.jacobian, p, rs.square().sum() / (rs.rows() - NV), cov);
+        }
+        return result;
+    }
+
+    // The blocks are independent, so the block number is not needed
+    FitReturnType fit(std::vector<QI_ARRAY(InputType)> const &inputs,
+                      FixedArray const &                      fixed,
+                      VaryingArray &                          p,
+                      typename ModelType::CovarArray *        cov,
+                      RMSErrorType &                          rmse,
+                      std::vector<QI_ARRAY(InputType)> &      residuals,
+                      FlagType &                              iterations,
+                      int const /* Unused */,
+                      Scratch &sc) const {
+        return fit(inputs, fixed, p, cov, rmse, residuals, iterations, sc);
+    }
+
+    // These implement the virtual fit() of FitFunction or BlockFitFunction, whichever is the base
+    FitReturnType fit(std::vector<QI_ARRAY(InputType)> const &inputs,
+                      FixedArray const &                      fixed,
+                      VaryingArray &                          p,
+                      typename ModelType::CovarArray *        cov,
+                      RMSErrorType &                          rmse,
+                      std::vector<QI_ARRAY(InputType)> &      residuals,
+                      FlagType &                              iterations) const {
+        Scratch sc = make_scratch();
+        return fit(inputs, fixed, p, cov, rmse, residuals, iterations, sc);
+    }
+
+    FitReturnType fit(std::vector<QI_ARRAY(InputType)> const &inputs,
+                      FixedArray const &                      fixed,
+                      VaryingArray &                          p,
+                      typename ModelType::CovarArray *        cov,
+                      RMSErrorType &                          rmse,
+                      std::vector<QI_ARRAY(InputType)> &      residuals,
+                      FlagType &                              iterations,
+                      int const /* Unused */) const {
+        Scratch sc = make_scratch();
+        return fit(inputs, fixed, p, cov, rmse, residuals, iterations, sc);
+    }
+};
+
+} // namespace QI
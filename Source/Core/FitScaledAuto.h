@@ -26,15 +26,11 @@ struct ScaledAutoDiffFit : FitFunction<ModelType, FlagType_> {
         if (scale < std::numeric_limits<double>::epsilon()) {
             p    = ModelType::VaryingArray::Zero();
             rmse = 0;
-            return {false, "Maximum data value was not positive"};
+            return {false, FitStatus::BadData};
         }
         const Eigen::ArrayXd data = inputs[0] / scale;
         ceres::Problem       problem;
-        using Cost      = ModelCost<ModelType>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, ModelType::NV>;
-        auto *cost      = new Cost{this->model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, this->model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
+        problem.AddResidualBlock(MakeModelCost(this->model, fixed, data), NULL, p.data());
         for (int i = 0; i < ModelType::NV; i++) {
             problem.SetParameterLowerBound(p.data(), i, this->model.bounds_lo[i]);
             problem.SetParameterUpperBound(p.data(), i, this->model.bounds_hi[i]);
@@ -46,12 +42,29 @@ struct ScaledAutoDiffFit : FitFunction<ModelType, FlagType_> {
         options.gradient_tolerance  = 1e-7;
         options.parameter_tolerance = 1e-5;
         options.logging_type        = ceres::SILENT;
-        p << this->model.start;
+        this->solver.Apply(options);
+        bool const seeded = WarmStart(p,
+                                      this->model.start,
+                                      this->model.bounds_lo,
+                                      this->model.bounds_hi,
+                                      this->warm_start,
+                                      scale,
+                                      1);
         ceres::Solve(options, &problem, &summary);
+        iterations = summary.iterations.size();
+        FitEvaluations evaluations = CeresEvaluations(summary);
+        if (seeded && summary.termination_type != ceres::CONVERGENCE) {
+            p << this->model.start;
+            ceres::Solve(options, &problem, &summary);
+            iterations += summary.iterations.size();
+            evaluations.Add(summary);
+        }
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, CeresStatus(summary), evaluations};
         }
-        iterations               = summary.iterations.size();
+        FitStatus const status =
+            CheckBounds(CeresStatus(summary), p, this->model.bounds_lo, this->model.bounds_hi);
+
         Eigen::ArrayXd const rs  = (data - this->model.signal(p, fixed));
         double const         var = rs.square().sum();
         rmse                     = sqrt(var / data.rows()) * scale;
@@ -62,7 +75,7 @@ struct ScaledAutoDiffFit : FitFunction<ModelType, FlagType_> {
             QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
         }
         p[0] = p[0] * scale;
-        return {true, ""};
+        return {true, status, evaluations};
     }
 };
 
@@ -4,7 +4,12 @@
 
 namespace QI {
 
-template <typename ModelType, int NScale = 1>
+/*
+ *  Fits with the first NScale parameters scaled by the maximum of the data. Jacobians are
+ *  calculated with central differences, or with Jets if AutoDiff is set, which needs a templated
+ *  signal().
+ */
+template <typename ModelType, int NScale = 1, bool AutoDiff = false>
 struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
     using Super = FitFunction<ModelType, int>;
     using Super::Super;
@@ -31,19 +36,27 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
         if (scale < std::numeric_limits<double>::epsilon()) {
             varying = ModelType::VaryingArray::Zero();
             rmse    = 0.0;
-            return {false, "Maximum data value was zero or less"};
+            return {false, FitStatus::BadData};
         }
         Eigen::ArrayXd const data = inputs[0] / scale;
 
         // Setup Ceres
         ceres::Problem problem;
-        using Diff = ceres::NumericDiffCostFunction<QI::ModelCost<ModelType>,
-                                                    ceres::CENTRAL,
-                                                    ceres::DYNAMIC,
-                                                    ModelType::NV>;
-        auto *cost = new Diff(new QI::ModelCost<ModelType>{this->model, fixed, data},
-                              ceres::TAKE_OWNERSHIP,
-                              this->model.sequence.size());
+        ceres::CostFunction *cost;
+        if constexpr (AutoDiff) {
+            using Diff = ceres::
+                AutoDiffCostFunction<QI::ModelCost<ModelType>, ceres::DYNAMIC, ModelType::NV>;
+            cost = new Diff(new QI::ModelCost<ModelType>{this->model, fixed, data},
+                            this->model.sequence.size());
+        } else {
+            using Diff = ceres::NumericDiffCostFunction<QI::ModelCost<ModelType>,
+                                                        ceres::CENTRAL,
+                                                        ceres::DYNAMIC,
+                                                        ModelType::NV>;
+            cost = new Diff(new QI::ModelCost<ModelType>{this->model, fixed, data},
+                            ceres::TAKE_OWNERSHIP,
+                            this->model.sequence.size());
+        }
         auto *loss = new ceres::HuberLoss(1.0); // Don't know if this helps
 
         // This is where the parameters and cost functions actually get added to Ceres
@@ -62,13 +75,30 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
         options.gradient_tolerance  = 1e-7;
         options.parameter_tolerance = 1e-5;
         options.logging_type        = ceres::SILENT;
+        this->solver.Apply(options);
 
-        varying = this->model.start;
+        bool const seeded = WarmStart(varying,
+                                      this->model.start,
+                                      this->model.lo,
+                                      this->model.hi,
+                                      this->warm_start,
+                                      scale,
+                                      NScale);
         ceres::Solve(options, &problem, &summary);
+        iterations = summary.iterations.size();
+        FitEvaluations evaluations = CeresEvaluations(summary);
+        if (seeded && summary.termination_type != ceres::CONVERGENCE) {
+            varying = this->model.start;
+            ceres::Solve(options, &problem, &summary);
+            iterations += summary.iterations.size();
+            evaluations.Add(summary);
+        }
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, CeresStatus(summary), evaluations};
         }
-        iterations = summary.iterations.size();
+        FitStatus const status =
+            CheckBounds(CeresStatus(summary), varying, this->model.lo, this->model.hi);
+
         double              var;
         std::vector<double> rs(data.size());
         problem.Evaluate(ceres::Problem::EvaluateOptions(), &var, &rs, nullptr, nullptr);
@@ -84,7 +114,7 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
         }
         varying.template head<NScale>() *= scale; // Multiply signals/proton density back up
 
-        return {true, ""};
+        return {true, status, evaluations};
     }
 };
 
@@ -16,6 +16,29 @@ using namespace std::string_literals;
 
 namespace QI {
 
+namespace {
+Eigen::ArrayXd TabulateSuperLorentzian(double const x_min, double const x_max, int const count) {
+    double const   step = (log(x_max) - log(x_min)) / (count - 1);
+    Eigen::ArrayXd values(count + 2);
+    for (int i = -1; i <= count; i++) {
+        double const x = exp(log(x_min) + i * step);
+        // With f = 1 Hz, x = T2b
+        values[i + 1] = log(SuperLorentzianQuadrature(1.0, x) / x) + 2.0 * M_PI * M_PI * x * x;
+    }
+    return values;
+}
+} // namespace
+
+SuperLorentzianTable::SuperLorentzianTable() :
+    log_x_min{log(x_min)}, log_x_step{(log(x_max) - log(x_min)) / (x_count - 1)},
+    values{TabulateSuperLorentzian(x_min, x_max, x_count)}, grid{&values[0], -1, x_count + 1},
+    interpolator{grid} {}
+
+SuperLorentzianTable const &SuperLorentzianTable::Get() {
+    static SuperLorentzianTable const table;
+    return table;
+}
+
 InterpLineshape::InterpLineshape(const double          fmin,
                                  const double          fstep,
                                  const int             fcount,
@@ -14,7 +14,10 @@
 #include "ImageTypes.h"
 #include "Macro.h"
 #include "ceres/ceres.h"
+#include <Eigen/Dense>
 #include <array>
+#include <limits>
+#include <random>
 #include <string>
 
 namespace QI {
@@ -78,6 +81,178 @@ void GetModelCovariance(ceres::Problem &                    p,
     QI_DBVEC(cov);
 }
 
+/*
+ *  Models with closed-form signal equations can also provide the derivatives of the signal with
+ *  respect to the varying parameters, which is much cheaper than evaluating the signal with Jets:
+ *
+ *  void signal_jacobian(VaryingArray const &v, FixedArray const &f,
+ *                       Eigen::ArrayXd &signal, Eigen::MatrixXd &jacobian) const;
+ *
+ *  which should resize jacobian to n x NV and calculate the signal exactly as signal() does. Use
+ *  CheckJacobian() to compare the derivatives with automatic differentiation.
+ */
+template <typename Model>
+constexpr bool HasAnalyticJacobian = requires(Model const &                       m,
+                                              typename Model::VaryingArray const &v,
+                                              typename Model::FixedArray const &  f,
+                                              Eigen::ArrayXd &                    s,
+                                              Eigen::MatrixXd &                   j) {
+    m.signal_jacobian(v, f, s, j);
+};
+
+/*
+ *  Evaluate the signal and its Jacobian with respect to the varying parameters using Jets, so that
+ *  any model that works with ModelCost can be used.
+ */
+template <typename Model>
+void GetAutoJacobian(Model const &                       model,
+                     typename Model::VaryingArray const &v,
+                     typename Model::FixedArray const &  fixed,
+                     Eigen::ArrayXd &                    signal,
+                     Eigen::MatrixXd &                   jacobian) {
+    using Jet = ceres::Jet<double, Model::NV>;
+    QI_ARRAYN(Jet, Model::NV) vj;
+    for (int i = 0; i < Model::NV; i++) {
+        vj[i] = Jet(v[i], i);
+    }
+    auto const s = model.signal(vj, fixed);
+    signal.resize(s.rows());
+    jacobian.resize(s.rows(), Model::NV);
+    for (Eigen::Index r = 0; r < s.rows(); r++) {
+        signal[r]       = s[r].a;
+        jacobian.row(r) = s[r].v.transpose();
+    }
+}
+
+/*
+ *  Evaluate the signal and its Jacobian, with the model's analytic Jacobian if it has one. For fits
+ *  that do not build a ceres::Problem.
+ */
+template <typename Model>
+void GetModelJacobian(Model const &                       model,
+                      typename Model::VaryingArray const &v,
+                      typename Model::FixedArray const &  fixed,
+                      Eigen::ArrayXd &                    signal,
+                      Eigen::MatrixXd &                   jacobian) {
+    if constexpr (HasAnalyticJacobian<Model>) {
+        model.signal_jacobian(v, fixed, signal, jacobian);
+    } else {
+        GetAutoJacobian(model, v, fixed, signal, jacobian);
+    }
+}
+
+/*
+ *  Evaluate the signal and its Jacobian with central differences, with the same relative step as
+ *  ceres::NumericDiffCostFunction
+ */
+template <typename Model>
+void GetNumericJacobian(Model const &                       model,
+                        typename Model::VaryingArray const &v,
+                        typename Model::FixedArray const &  fixed,
+                        Eigen::ArrayXd &                    signal,
+                        Eigen::MatrixXd &                   jacobian) {
+    signal = model.signal(v, fixed);
+    jacobian.resize(signal.rows(), Model::NV);
+    for (int i = 0; i < Model::NV; i++) {
+        double const                 h  = (v[i] == 0.) ? 1e-6 : std::abs(v[i]) * 1e-6;
+        typename Model::VaryingArray vp = v, vm = v;
+        vp[i] += h;
+        vm[i] -= h;
+        jacobian.col(i) = (model.signal(vp, fixed) - model.signal(vm, fixed)).matrix() / (2. * h);
+    }
+}
+
+/*
+ *  The difference between two signals and Jacobians, relative to the largest entry of the first
+ *  signal or that column of the first Jacobian
+ */
+inline double JacobianDifference(Eigen::ArrayXd const & s1,
+                                 Eigen::MatrixXd const &j1,
+                                 Eigen::ArrayXd const & s2,
+                                 Eigen::MatrixXd const &j2) {
+    Eigen::ArrayXXd const scale =
+        j1.array().abs().colwise().maxCoeff().max(std::numeric_limits<double>::min());
+    double const diff_j = ((j2 - j1).array().abs().rowwise() / scale.row(0)).maxCoeff();
+    double const diff_s = (s2 - s1).abs().maxCoeff() /
+                          std::max(s1.abs().maxCoeff(), std::numeric_limits<double>::min());
+    return std::max(diff_j, diff_s);
+}
+
+/*
+ *  Compare a model's analytic Jacobian with automatic differentiation at random points between lo
+ *  and hi. Returns the largest difference found in the signal or the Jacobian, relative to the
+ *  largest entry of the automatic signal or that column of the automatic Jacobian.
+ */
+template <typename Model>
+double CheckJacobian(Model const &                       model,
+                     typename Model::FixedArray const &  fixed,
+                     typename Model::VaryingArray const &lo,
+                     typename Model::VaryingArray const &hi,
+                     int const                           samples) {
+    std::mt19937                           rng(0);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    Eigen::ArrayXd                         auto_s, analytic_s;
+    Eigen::MatrixXd                        auto_j, analytic_j;
+    double                                 worst = 0;
+    for (int i = 0; i < samples; i++) {
+        typename Model::VaryingArray v;
+        for (int p = 0; p < Model::NV; p++) {
+            v[p] = lo[p] + uniform(rng) * (hi[p] - lo[p]);
+        }
+        GetAutoJacobian(model, v, fixed, auto_s, auto_j);
+        model.signal_jacobian(v, fixed, analytic_s, analytic_j);
+        worst = std::max(worst, JacobianDifference(auto_s, auto_j, analytic_s, analytic_j));
+    }
+    return worst;
+}
+
+/*
+ *  As CheckJacobian, but compares automatic differentiation with central differences, for models
+ *  that can be fitted either way
+ */
+template <typename Model>
+double CheckNumericJacobian(Model const &                       model,
+                            typename Model::FixedArray const &  fixed,
+                            typename Model::VaryingArray const &lo,
+                            typename Model::VaryingArray const &hi,
+                            int const                           samples) {
+    std::mt19937                           rng(0);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    Eigen::ArrayXd                         auto_s, numeric_s;
+    Eigen::MatrixXd                        auto_j, numeric_j;
+    double                                 worst = 0;
+    for (int i = 0; i < samples; i++) {
+        typename Model::VaryingArray v;
+        for (int p = 0; p < Model::NV; p++) {
+            v[p] = lo[p] + uniform(rng) * (hi[p] - lo[p]);
+        }
+        GetAutoJacobian(model, v, fixed, auto_s, auto_j);
+        GetNumericJacobian(model, v, fixed, numeric_s, numeric_j);
+        worst = std::max(worst, JacobianDifference(auto_s, auto_j, numeric_s, numeric_j));
+    }
+    return worst;
+}
+
+/*
+ *  As GetModelCovariance, but from a Jacobian instead of a ceres::Problem
+ */
+template <typename Model>
+void GetJacobianCovariance(Eigen::MatrixXd const &             jacobian,
+                           typename Model::VaryingArray const &v,
+                           double const &                      scale,
+                           typename Model::CovarArray *        ptr) {
+    Eigen::MatrixXd const       full = (jacobian.transpose() * jacobian).inverse() * scale;
+    typename Model::CovarArray &cov  = (*ptr);
+    cov.head(Model::NV)              = full.diagonal().array().sqrt();
+    int index                        = Model::NV;
+    for (int ii = 0; ii < Model::NV; ii++) {
+        for (int jj = ii + 1; jj < Model::NV; jj++) {
+            cov[index++] = full(ii, jj) / (cov[ii] * cov[jj]);
+        }
+    }
+    cov.head(Model::NV) /= v;
+}
+
 /*
  *  A generic Ceres Cost Function compatible with auto-differentation
  */
@@ -104,6 +279,63 @@ template <typename Model> struct ModelCost {
     }
 };
 
+/*
+ *  A Ceres cost function for models that provide signal_jacobian()
+ */
+template <typename Model>
+struct AnalyticModelCost : ceres::SizedCostFunction<ceres::DYNAMIC, Model::NV> {
+    using VaryingArray = typename Model::VaryingArray;
+    using FixedArray   = typename Model::FixedArray;
+    using DataArray    = QI_ARRAY(typename Model::DataType);
+    // Ceres Jacobians are row-major, which Eigen does not allow for a single column
+    using JacobianMap = Eigen::Map<Eigen::Matrix<double,
+                                                 Eigen::Dynamic,
+                                                 Model::NV,
+                                                 (Model::NV == 1) ? Eigen::ColMajor :
+                                                                    Eigen::RowMajor>>;
+
+    const Model &    model;
+    const FixedArray fixed;
+    const DataArray  data;
+    // Workspace, each problem is only evaluated by one thread at a time
+    mutable Eigen::ArrayXd  signal;
+    mutable Eigen::MatrixXd jacobian;
+
+    AnalyticModelCost(Model const &m, FixedArray const &f, DataArray const &d) :
+        model{m}, fixed{f}, data{d} {
+        this->set_num_residuals(data.rows());
+    }
+
+    bool Evaluate(double const *const *parameters, double *rin, double **jacobians) const override {
+        VaryingArray const    v = Eigen::Map<VaryingArray const>(parameters[0]);
+        Eigen::Map<DataArray> residual(rin, data.rows());
+        if (jacobians && jacobians[0]) {
+            model.signal_jacobian(v, fixed, signal, jacobian);
+            JacobianMap(jacobians[0], data.rows(), Model::NV) = -jacobian;
+        } else {
+            signal = model.signal(v, fixed);
+        }
+        residual = data - signal;
+        return true;
+    }
+};
+
+/*
+ *  Create a cost function for fitting a model to data, using the analytic Jacobian if the model has
+ *  one and automatic differentiation otherwise
+ */
+template <typename Model>
+ceres::CostFunction *MakeModelCost(Model const &                             model,
+                                   typename Model::FixedArray const &        fixed,
+                                   QI_ARRAY(typename Model::DataType) const &data) {
+    if constexpr (HasAnalyticJacobian<Model>) {
+        return new AnalyticModelCost<Model>(model, fixed, data);
+    } else {
+        using AutoCost = ceres::AutoDiffCostFunction<ModelCost<Model>, ceres::DYNAMIC, Model::NV>;
+        return new AutoCost(new ModelCost<Model>{model, fixed, data}, data.rows());
+    }
+}
+
 /*
  *  Helper struct for converting between double/float for processing & IO
  */
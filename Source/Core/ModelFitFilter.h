@@ -13,28 +13,51 @@
 #define QI_MODELFITFILTER_H
 
 #include <Eigen/Core>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include <limits>
+#include <mutex>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "itkCommand.h"
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkImageToImageFilter.h"
 #include "itkTimeProbe.h"
 #include "itkVariableLengthVector.h"
 #include "itkVectorImage.h"
 
 #include "FitFunction.h"
+#include "JSON.h"
 #include "Log.h"
 #include "Model.h"
 #include "Monitor.h"
+#include "OutputQueue.h"
 #include "Util.h"
 
 namespace QI {
 
+// The per-thread scratch type of a fit function, or an empty struct if it has none (see
+// ModelFitFilter::HasScratch)
+template <typename FitType> struct FitScratch {
+    struct Type {};
+};
+
+template <typename FitType>
+requires requires(FitType const &f) { f.make_scratch(); }
+struct FitScratch<FitType> {
+    using Type = decltype(std::declval<FitType const &>().make_scratch());
+};
+
 template <typename FitType>
 class ModelFitFilter
     : public itk::ImageToImageFilter<
@@ -71,6 +94,9 @@ class ModelFitFilter
     using TOutputImage   = typename BlockTypes<Blocked, ImageDim, OutputPixelType>::Type;
     using TFlagImage     = typename BlockTypes<Blocked, ImageDim, typename FitType::FlagType>::Type;
     using TRMSErrorImage = typename BlockTypes<Blocked, ImageDim, RMSErrorPixelType>::Type;
+    using TStatusImage   = typename BlockTypes<Blocked, ImageDim, unsigned char>::Type;
+    using TTimeImage     = typename BlockTypes<Blocked, ImageDim, float>::Type;
+    using TCountImage    = typename BlockTypes<Blocked, ImageDim, int>::Type;
     using TResidualsImage = TInputImage;
 
     using TRegion = typename TInputImage::RegionType;
@@ -97,7 +123,10 @@ class ModelFitFilter
     static constexpr int RMSErrorOffset  = FlagOffset + 1;
     static constexpr int CovarOffset     = RMSErrorOffset + 1;
     static constexpr int ResidualsOffset = CovarOffset + ModelType::NCov;
-    static constexpr int TotalOutputs    = ResidualsOffset + ModelType::NI;
+    static constexpr int StatusOffset    = ResidualsOffset + ModelType::NI;
+    static constexpr int TimeOffset      = StatusOffset + 1;
+    static constexpr int EvalsOffset     = TimeOffset + 1; // Residual then Jacobian evaluations
+    static constexpr int TotalOutputs    = EvalsOffset + 2;
 
     ModelFitFilter(FitType const *    f,
                    const bool         verbose,
@@ -105,7 +134,7 @@ class ModelFitFilter
                    const bool         allResids,
                    std::string const &subregion) :
         m_fit(f),
-        m_verbose(verbose), m_allResiduals(allResids), m_covar(covar) {
+        m_verbose(verbose), m_allResiduals(allResids), m_covar(covar), m_outputs(verbose) {
         this->SetNumberOfRequiredInputs(ModelType::NI);
         this->SetNumberOfRequiredOutputs(TotalOutputs);
         for (int i = 0; i < TotalOutputs; i++) {
@@ -173,12 +202,44 @@ class ModelFitFilter
 
     void SetOutputAllResiduals(const bool r) { m_allResiduals = r; }
     void SetOutputCovar(const bool covar) { m_covar = covar; }
+    void SetOutputStatus(const bool status) { m_status = status; }
+
+    /*
+     *  Write the time taken to fit each voxel and the number of residual and Jacobian evaluations,
+     *  and print a JSON summary of the run to stdout once the outputs have been written.
+     */
+    void SetOutputProfile(const bool profile) { m_profile = profile; }
+
+    // Write the parameter maps as the volumes of one file instead of one file each
+    void SetPackOutputs(const bool pack) { m_pack = pack; }
+
+    // Write the residual and covariance images as scaled 16-bit integers, at half the size
+    void SetInt16Outputs(const bool int16) { m_int16 = int16; }
 
     void SetSubregion(const TRegion &sr) {
         m_subregion    = sr;
         m_hasSubregion = true;
     }
 
+    /*
+     *  Process the region in slabs of n slices along the last axis. If a checkpoint directory is
+     *  given, the outputs of each slab are saved there as soon as it finishes, and a later run with
+     *  the same settings will load finished slabs instead of fitting them again. The settings
+     *  include the files given to ReadInputs() and the fit's solver and warm-start settings, but
+     *  the filter cannot see the rest of the command, so commands pass the input JSON and any
+     *  options that change the fit in options.
+     */
+    void SetCheckpoint(std::string const &dir,
+                       int const          slab_size,
+                       json const &       options = json::object()) {
+        m_checkpoint        = dir;
+        m_slabSize          = slab_size;
+        m_checkpointOptions = options;
+        if (m_checkpoint != "" && m_slabSize < 1) {
+            m_slabSize = 1;
+        }
+    }
+
     void SetBlocks(const int &nb) {
         if constexpr (Blocked) {
             m_blocks = nb;
@@ -223,6 +284,25 @@ class ModelFitFilter
         return dynamic_cast<TFlagImage *>(this->itk::ProcessObject::GetOutput(FlagOffset));
     }
 
+    TStatusImage *GetStatusOutput() {
+        return dynamic_cast<TStatusImage *>(this->itk::ProcessObject::GetOutput(StatusOffset));
+    }
+
+    TTimeImage *GetTimeOutput() {
+        return dynamic_cast<TTimeImage *>(this->itk::ProcessObject::GetOutput(TimeOffset));
+    }
+
+    // 0 for residual evaluations, 1 for Jacobian evaluations
+    TCountImage *GetEvaluationsOutput(const int i) {
+        return dynamic_cast<TCountImage *>(this->itk::ProcessObject::GetOutput(EvalsOffset + i));
+    }
+
+    /*
+     *  Number of voxels that finished with each FitStatus during the last run, indexed by the
+     *  status value. Voxels loaded from a checkpoint are not included.
+     */
+    std::array<size_t, FitStatusCount> const &GetStatusCounts() const { return m_statusCounts; }
+
     TOutputImage *GetDerivedOutput(const int i) {
         if constexpr (HasDerived) {
             if (i < ModelType::ND) {
@@ -250,57 +330,103 @@ class ModelFitFilter
             QI::Fail("Number of input file paths did not match number of inputs for model");
         }
 
+        itk::TimeProbe clock;
+        clock.Start();
+        m_inputFiles = json::array();
         for (int i = 0; i < ModelType::NI; i++) {
             SetInput(i, QI::ReadImage<TInputImage>(inputs[i], m_verbose));
+            m_inputFiles.push_back(FileStamp(inputs[i]));
         }
         for (int f = 0; f < ModelType::NF; f++) {
-            if (fixed[f] != "")
+            if (fixed[f] != "") {
                 SetFixed(f, QI::ReadImage<TFixedImage>(fixed[f], m_verbose));
+                m_inputFiles.push_back(FileStamp(fixed[f]));
+            }
         }
-        if (mask != "")
+        if (mask != "") {
             SetMask(QI::ReadImage<TMaskImage>(mask, m_verbose));
+            m_inputFiles.push_back(FileStamp(mask));
+        }
+        clock.Stop();
+        m_readTime = clock.GetTotal();
     }
 
+    /*
+     *  Queue every output for writing and wait until they are all on disk. Images added to
+     *  GetOutputQueue() earlier are written alongside them. With SetPackOutputs(true) the varying
+     *  and derived maps go in one 4D file, <prefix>maps, and the covariance images in
+     *  <prefix>covar, each with a JSON sidecar that names the volumes. SetInt16Outputs(true)
+     *  applies to the residual and covariance images only, the parameter maps are always float.
+     */
     void WriteOutputs(std::string const &prefix) {
+        itk::TimeProbe clock;
+        clock.Start();
+        auto const path = [&](std::string const &name) { return prefix + name + QI::OutExt(); };
+        std::vector<TOutputImage const *> maps;
+        std::vector<std::string>          map_names;
         for (int i = 0; i < ModelType::NV; i++) {
-            QI::WriteImage(
-                GetOutput(i), prefix + m_fit->model.varying_names.at(i) + QI::OutExt(), m_verbose);
+            maps.push_back(GetOutput(i));
+            map_names.push_back(m_fit->model.varying_names.at(i));
         }
         if constexpr (ModelType::ND > 0) {
             for (int i = 0; i < ModelType::ND; i++) {
-                QI::WriteImage(GetDerivedOutput(i),
-                               prefix + m_fit->model.derived_names.at(i) + QI::OutExt(),
-                               m_verbose);
+                maps.push_back(GetDerivedOutput(i));
+                map_names.push_back(m_fit->model.derived_names.at(i));
             }
         }
-        QI::WriteImage(GetRMSErrorOutput(), prefix + "rmse" + QI::OutExt(), m_verbose);
-        QI::WriteImage(GetFlagOutput(), prefix + "iterations" + QI::OutExt(), m_verbose);
+        WriteMaps(maps, map_names, path("maps"), path, false);
+        m_outputs.Write(GetRMSErrorOutput(), path("rmse"));
+        m_outputs.Write(GetFlagOutput(), path("iterations"));
+        if (m_status) {
+            m_outputs.Write(GetStatusOutput(), path("status"));
+        }
+        if (m_profile) {
+            m_outputs.Write(GetTimeOutput(), path("time"));
+            m_outputs.Write(GetEvaluationsOutput(0), path("residual_evals"));
+            m_outputs.Write(GetEvaluationsOutput(1), path("jacobian_evals"));
+        }
         if (m_covar) {
+            std::vector<TOutputImage const *> covar;
+            std::vector<std::string>          covar_names;
             for (int ii = 0; ii < ModelType::NV; ii++) {
-                auto const &name = m_fit->model.varying_names.at(ii);
-                QI::WriteImage(
-                    GetCovarOutput(ii), prefix + "CoV_" + name + QI::OutExt(), m_verbose);
+                covar.push_back(GetCovarOutput(ii));
+                covar_names.push_back("CoV_" + m_fit->model.varying_names.at(ii));
             }
             int index = ModelType::NV;
             for (int ii = 0; ii < ModelType::NV; ii++) {
                 auto const &name1 = m_fit->model.varying_names.at(ii);
                 for (int jj = ii + 1; jj < ModelType::NV; jj++) {
                     auto const &name2 = m_fit->model.varying_names.at(jj);
-                    QI::WriteImage(GetCovarOutput(index++),
-                                   prefix + "Corr_" + name1 + "_" + name2 + QI::OutExt(),
-                                   m_verbose);
+                    covar.push_back(GetCovarOutput(index++));
+                    covar_names.push_back("Corr_" + name1 + "_" + name2);
                 }
             }
+            WriteMaps(covar, covar_names, path("covar"), path, m_int16);
         }
         if (m_allResiduals) {
             for (int i = 0; i < ModelType::NI; i++) {
-                QI::WriteImage(GetResidualsOutput(i),
-                               prefix + "residuals_" + std::to_string(i) + QI::OutExt(),
-                               m_verbose);
+                m_outputs.Write(
+                    GetResidualsOutput(i), path("residuals_" + std::to_string(i)), m_int16);
             }
         }
+        m_outputs.Wait();
+        // Only remove the checkpoint once the outputs are safely written
+        if (m_checkpoint != "") {
+            QI::Log(m_verbose, "Removing checkpoint directory: {}", m_checkpoint);
+            std::filesystem::remove_all(m_checkpoint);
+        }
+        clock.Stop();
+        if (m_profile) {
+            fmt::print("{}\n", ProfileSummary(clock.GetTotal()).dump(4));
+        }
     }
 
+    /*
+     *  Images queued here are written on background threads while the command carries on, e.g.
+     *  inputs calculated before the fit. WriteOutputs() waits for them too.
+     */
+    OutputQueue &GetOutputQueue() { return m_outputs; }
+
   private:
     ModelFitFilter(const Self &); // purposely not implemented
     void operator=(const Self &); // purposely not implemented
@@ -322,6 +448,12 @@ class ModelFitFilter
             return TOutputImage::New().GetPointer();
         } else if (idx < static_cast<itype>(ResidualsOffset + ModelType::NI)) {
             return TResidualsImage::New().GetPointer();
+        } else if (idx == static_cast<itype>(StatusOffset)) {
+            return TStatusImage::New().GetPointer();
+        } else if (idx == static_cast<itype>(TimeOffset)) {
+            return TTimeImage::New().GetPointer();
+        } else if (idx < static_cast<itype>(EvalsOffset + 2)) {
+            return TCountImage::New().GetPointer();
         } else {
             QI::Fail("Attempted to create output {} but {} has {}",
                      idx,
@@ -330,11 +462,298 @@ class ModelFitFilter
         }
     }
 
+    using InputMap = Eigen::Map<const QI_ARRAY(InputPixelType)>;
+
+    /*
+     *  Scratch storage for one thread. The fit functions take std::vectors of arrays, so these are
+     *  sized once from the sequences and then re-used. Residuals are left empty if not requested,
+     *  as the fit functions check the size to decide whether to write them. In warm-start mode
+     *  each block starts from the last voxel that converged earlier in the same chunk of the voxel
+     *  list, NaN means no seed yet.
+     *  The statistics are only merged into the filter totals when the thread finishes, and the
+     *  profiling fields are only filled in if profiling was requested. Fit functions with their
+     *  own buffers get them in scratch (see HasScratch).
+     */
+    struct Workspace {
+        std::vector<DataArray>             inputs;
+        std::vector<ResidualArray>         residuals;
+        VaryingArray                       outputs;
+        FixedArray                         fixed;
+        CovarArray                         covar;
+        std::vector<VaryingArray>          seeds;
+        double                             total_iterations = 0;
+        size_t                             fitted_voxels    = 0;
+        std::array<size_t, FitStatusCount> status_counts{};
+        FitEvaluations                     evaluations;
+        double                             fit_time = 0;
+        std::vector<float>                 voxel_times;
+        Eigen::ArrayXXd                    batch_data, batch_fixed, batch_outputs;
+        Eigen::ArrayXd                     batch_rmse;
+        Eigen::ArrayXi                     batch_flags;
+        std::vector<FitReturnType>         batch_results;
+        std::vector<itk::OffsetValueType>  batch_offsets;
+        typename FitScratch<FitType>::Type scratch;
+
+        static VaryingArray NoSeed() {
+            return VaryingArray::Constant(std::numeric_limits<ParameterType>::quiet_NaN());
+        }
+
+        Workspace(FitType const *fit, bool const allResiduals, int const blocks) :
+            inputs(ModelType::NI), seeds(blocks, NoSeed()) {
+            for (int i = 0; i < ModelType::NI; i++) {
+                inputs[i] = DataArray::Zero(fit->input_size(i));
+            }
+            if (allResiduals) {
+                residuals.resize(ModelType::NI);
+                for (int i = 0; i < ModelType::NI; i++) {
+                    residuals[i] = ResidualArray::Zero(fit->input_size(i));
+                }
+            }
+            if constexpr (HasScratch) {
+                scratch = fit->make_scratch();
+            }
+        }
+    };
+
+    /*
+     *  Raw buffer pointers for every image, gathered once per run. All images share the same
+     *  buffered region, so a voxel offset multiplied by the number of components per pixel indexes
+     *  any of them. Fixed inputs that were not supplied are nullptr.
+     */
+    struct Buffers {
+        std::array<InputPixelType const *, ModelType::NI> inputs;
+        std::array<InputPixelType *, ModelType::NI>       residuals;
+        std::array<FixedPixelType const *, ModelType::NF> fixed;
+        std::array<OutputPixelType *, ModelType::NV>      outputs;
+        std::array<OutputPixelType *, ModelType::ND>      derived;
+        std::array<OutputPixelType *, ModelType::NCov>    covar;
+        typename FitType::FlagType *                      flag;
+        RMSErrorPixelType *                               rmse;
+        unsigned char *                                   status;
+        float *                                           time;
+        std::array<int *, 2>                              evaluations;
+        // For converting offsets to indices
+        TInputImage const *                               geometry;
+    };
+
     const FitType *m_fit;
     const bool     m_verbose, m_allResiduals, m_covar;
+    bool           m_status       = false;
+    bool           m_profile      = false;
+    bool           m_pack         = false;
+    bool           m_int16        = false;
     bool           m_hasSubregion = false;
     TRegion        m_subregion;
-    int            m_blocks = 1;
+    int            m_blocks   = 1;
+    int            m_slabSize = 0;
+    std::string    m_checkpoint;
+    json           m_checkpointOptions = json::object();
+    json           m_inputFiles        = json::array(); // See FileStamp
+    OutputQueue    m_outputs;
+
+    // Fit functions that support warm-starting have a warm_start member (see QI::WarmStart)
+    static constexpr bool CanWarmStart = requires(FitType const &f) { f.warm_start; };
+
+    /*
+     *  In warm-start mode the voxel list is handed out in chunks of this size and the seeds are
+     *  cleared at the start of each, so every voxel is seeded from the same neighbour whichever
+     *  thread fits it and the results do not depend on the number of threads. Voxels are listed
+     *  in scan order, so most seeds come from the previous voxel along the row.
+     */
+    static constexpr size_t WarmChunk = 64;
+
+    /*
+     *  Fit functions that keep buffers between voxels, e.g. the samples of QI::RegionContraction,
+     *  have a make_scratch() member. Each thread's Workspace holds the result for the whole run,
+     *  and it is passed to fit() as the last argument.
+     */
+    static constexpr bool HasScratch = requires(FitType const &f) { f.make_scratch(); };
+
+    // Fit functions derived from QI::FitFunctionBase have Ceres settings that can be overridden
+    static constexpr bool HasSolver = requires(FitType const &f) { f.solver; };
+
+    // Fit functions that take several voxels per call have a BatchSize and fit_batch(), which is
+    // passed the scratch (see QI::LMFit). For blocked data each block counts as a voxel. They fall
+    // back to fit() when residuals or covariance are requested.
+    static constexpr bool CanBatch = requires { FitType::BatchSize; } && HasScratch && !Indexed;
+
+    // Totals over all threads, reported at the end of GenerateData
+    std::mutex                         m_statsMutex;
+    double                             m_totalIterations = 0;
+    size_t                             m_fittedVoxels    = 0;
+    std::array<size_t, FitStatusCount> m_statusCounts{};
+
+    // Profiling data, collected if SetOutputProfile(true) was called. Times are in seconds except
+    // for the per-voxel times, which are in microseconds.
+    struct ThreadProfile {
+        size_t voxels   = 0;
+        double seconds  = 0; // Wall time spent by the thread
+        double fit_time = 0; // Time spent inside the fit function
+    };
+    std::vector<ThreadProfile> m_threadProfiles;
+    std::vector<float>         m_voxelTimes;
+    FitEvaluations             m_evaluations;
+    double                     m_readTime = 0, m_processTime = 0;
+
+    template <typename Path>
+    void WriteMaps(std::vector<TOutputImage const *> const &imgs,
+                   std::vector<std::string> const &         names,
+                   std::string const &                      packed_path,
+                   Path const &                             path,
+                   bool const                               int16) {
+        if (m_pack) {
+            m_outputs.WritePacked(imgs, names, packed_path, int16);
+        } else {
+            for (size_t i = 0; i < imgs.size(); i++) {
+                m_outputs.Write(imgs[i], path(names[i]), int16);
+            }
+        }
+    }
+
+    /*
+     *  Call f on every output image that has been allocated, in a fixed order. Used to save and
+     *  restore slabs from the checkpoint directory.
+     */
+    template <typename Func> void ForEachOutput(Func &&f) {
+        for (int i = 0; i < ModelType::NV; i++) {
+            f(this->GetOutput(i));
+        }
+        if constexpr (HasDerived) {
+            for (int i = 0; i < ModelType::ND; i++) {
+                f(this->GetDerivedOutput(i));
+            }
+        }
+        f(this->GetFlagOutput());
+        f(this->GetRMSErrorOutput());
+        if (m_covar) {
+            for (int i = 0; i < ModelType::NCov; i++) {
+                f(this->GetCovarOutput(i));
+            }
+        }
+        if (m_allResiduals) {
+            for (int i = 0; i < ModelType::NI; i++) {
+                f(this->GetResidualsOutput(i));
+            }
+        }
+        if (m_status) {
+            f(this->GetStatusOutput());
+        }
+        if (m_profile) {
+            f(this->GetTimeOutput());
+            f(this->GetEvaluationsOutput(0));
+            f(this->GetEvaluationsOutput(1));
+        }
+    }
+
+    /*
+     *  Slabs are stored as the raw pixel values of each output in turn, in iterator order. They
+     *  are only ever read back by the same build with the same settings (see CheckCheckpoint) so
+     *  there is no need for a portable format.
+     */
+    void SaveSlab(std::string const &path, TRegion const &slab) {
+        std::string const tmp_path = path + ".tmp";
+        {
+            std::ofstream file(tmp_path, std::ios::binary);
+            if (!file) {
+                QI::Fail("Could not open checkpoint file for writing: {}", tmp_path);
+            }
+            ForEachOutput([&](auto *img) {
+                using TImg = std::remove_pointer_t<decltype(img)>;
+                using TInt = typename TImg::InternalPixelType;
+                itk::ImageRegionConstIterator<TImg> it(img, slab);
+                for (; !it.IsAtEnd(); ++it) {
+                    auto const px = it.Get();
+                    if constexpr (std::is_same_v<typename TImg::PixelType, TInt>) {
+                        file.write(reinterpret_cast<char const *>(&px), sizeof(TInt));
+                    } else {
+                        file.write(reinterpret_cast<char const *>(px.GetDataPointer()),
+                                   px.Size() * sizeof(TInt));
+                    }
+                }
+            });
+            if (!file) {
+                QI::Fail("Failed while writing checkpoint file: {}", tmp_path);
+            }
+        }
+        // Rename is atomic, so a slab file only exists once it is complete
+        std::filesystem::rename(tmp_path, path);
+    }
+
+    void LoadSlab(std::string const &path, TRegion const &slab) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            QI::Fail("Could not open checkpoint file for reading: {}", path);
+        }
+        ForEachOutput([&](auto *img) {
+            using TImg = std::remove_pointer_t<decltype(img)>;
+            using TInt = typename TImg::InternalPixelType;
+            itk::ImageRegionIterator<TImg> it(img, slab);
+            for (; !it.IsAtEnd(); ++it) {
+                if constexpr (std::is_same_v<typename TImg::PixelType, TInt>) {
+                    TInt px;
+                    file.read(reinterpret_cast<char *>(&px), sizeof(TInt));
+                    it.Set(px);
+                } else {
+                    auto px = it.Get(); // VariableLengthVector that references the image buffer
+                    file.read(reinterpret_cast<char *>(px.GetDataPointer()),
+                              px.Size() * sizeof(TInt));
+                }
+            }
+        });
+        if (!file) {
+            QI::Fail("Checkpoint file {} was truncated", path);
+        }
+    }
+
+    // Identify a file by its path, size and modification time, so a changed input is noticed
+    static json FileStamp(std::string const &path) {
+        std::error_code ec;
+        auto const      size  = std::filesystem::file_size(path, ec);
+        auto const      mtime = std::filesystem::last_write_time(path, ec);
+        if (ec) {
+            return {{"path", path}};
+        }
+        return {{"path", path},
+                {"size", size},
+                {"mtime", static_cast<long long>(mtime.time_since_epoch().count())}};
+    }
+
+    /*
+     *  Record the settings that determine the slab contents. If the directory already holds a
+     *  checkpoint from different settings the slabs cannot be re-used, so stop rather than silently
+     *  mixing results.
+     */
+    void CheckCheckpoint(TRegion const &region) {
+        json fit_settings{{"warm", WarmStarting()}};
+        if constexpr (HasSolver) {
+            fit_settings["solver"] = m_fit->solver;
+        }
+        json settings{{"fit", typeid(FitType).name()},
+                      {"inputs", m_inputFiles},
+                      {"options", m_checkpointOptions},
+                      {"fit_settings", fit_settings},
+                      {"index", {region.GetIndex()[0], region.GetIndex()[1], region.GetIndex()[2]}},
+                      {"size", {region.GetSize()[0], region.GetSize()[1], region.GetSize()[2]}},
+                      {"slab", m_slabSize},
+                      {"blocks", m_blocks},
+                      {"covar", m_covar},
+                      {"residuals", m_allResiduals},
+                      {"status", m_status},
+                      {"profile", m_profile}};
+        std::string const path = m_checkpoint + "/checkpoint.json";
+        if (std::filesystem::exists(path)) {
+            // Compare as written, as non-finite options are stored as null
+            if (QI::ReadJSON(path) != json::parse(settings.dump())) {
+                QI::Fail("Checkpoint in {} was made with different settings. Remove it to start "
+                         "again.",
+                         m_checkpoint);
+            }
+            QI::Info(m_verbose, "Resuming from checkpoint: {}", m_checkpoint);
+        } else {
+            std::filesystem::create_directories(m_checkpoint);
+            QI::WriteJSON(path, settings);
+        }
+    }
 
     virtual void GenerateOutputInformation() override {
         Superclass::GenerateOutputInformation();
@@ -347,6 +766,17 @@ class ModelFitFilter
                 QI::Fail("Input parameter images are not all the same size");
             }
         }
+        // The voxel loop indexes the mask and fixed images with the same offsets as the inputs
+        for (int i = 0; i < ModelType::NF; i++) {
+            const auto f = this->GetFixed(i);
+            if (f && f->GetLargestPossibleRegion() != ip->GetLargestPossibleRegion()) {
+                QI::Fail("Fixed parameter image {} is not the same size as the input", i);
+            }
+        }
+        const auto mask = this->GetMask();
+        if (mask && mask->GetLargestPossibleRegion() != ip->GetLargestPossibleRegion()) {
+            QI::Fail("Mask is not the same size as the input");
+        }
 
         for (int i = 0; i < ModelType::NI; i++) {
             if ((m_fit->input_size(i) * m_blocks) !=
@@ -436,6 +866,34 @@ class ModelFitFilter
                 res->Allocate(true);
             }
         }
+
+        if (m_status) {
+            auto st = this->GetStatusOutput();
+            st->SetRegions(region);
+            st->SetSpacing(spacing);
+            st->SetOrigin(origin);
+            st->SetDirection(direction);
+            if constexpr (Blocked) {
+                st->SetNumberOfComponentsPerPixel(m_blocks);
+            }
+            st->Allocate(true);
+        }
+
+        if (m_profile) {
+            auto allocate = [&](auto op) {
+                op->SetRegions(region);
+                op->SetSpacing(spacing);
+                op->SetOrigin(origin);
+                op->SetDirection(direction);
+                if constexpr (Blocked) {
+                    op->SetNumberOfComponentsPerPixel(m_blocks);
+                }
+                op->Allocate(true);
+            };
+            allocate(this->GetTimeOutput());
+            allocate(this->GetEvaluationsOutput(0));
+            allocate(this->GetEvaluationsOutput(1));
+        }
     }
 
     virtual void GenerateData() override {
@@ -448,216 +906,527 @@ class ModelFitFilter
             }
         }
 
+        std::vector<TRegion> slabs;
+        if (m_slabSize > 0) {
+            auto const last  = ImageDim - 1;
+            auto const start = region.GetIndex()[last];
+            auto const end   = start + static_cast<long>(region.GetSize()[last]);
+            for (long k = start; k < end; k += m_slabSize) {
+                TRegion slab = region;
+                slab.SetIndex(last, k);
+                slab.SetSize(last, std::min<long>(m_slabSize, end - k));
+                slabs.push_back(slab);
+            }
+        } else {
+            slabs.push_back(region);
+        }
+        if (m_checkpoint != "") {
+            CheckCheckpoint(region);
+        }
+
+        m_totalIterations = 0;
+        m_fittedVoxels    = 0;
+        m_statusCounts.fill(0);
+        m_threadProfiles.assign(this->GetNumberOfWorkUnits(), ThreadProfile{});
+        m_voxelTimes.clear();
+        m_evaluations = FitEvaluations{};
+        itk::TimeProbe clock;
+        clock.Start();
         Info(m_verbose, "Processing...");
-        this->GetMultiThreader()->SetNumberOfWorkUnits(this->GetNumberOfWorkUnits());
-        this->GetMultiThreader()->template ParallelizeImageRegion<ImageDim>(
-            region,
-            [this](const typename TOutputImage::RegionType &outputRegion) {
-                this->DynamicThreadedGenerateData(outputRegion);
-            },
-            this);
+        Buffers const buffers = GetBuffers();
+        for (size_t s = 0; s < slabs.size(); s++) {
+            std::string const slab_path =
+                (m_checkpoint != "") ? fmt::format("{}/slab_{:05d}.bin", m_checkpoint, s) : "";
+            if (slab_path != "" && std::filesystem::exists(slab_path)) {
+                Log(m_verbose, "Loading finished slab {} of {}", s + 1, slabs.size());
+                LoadSlab(slab_path, slabs[s]);
+                continue;
+            }
+            if (slabs.size() > 1) {
+                Log(m_verbose, "Processing slab {} of {}", s + 1, slabs.size());
+            }
+            if (UseRegionScheduling()) {
+                FitRegions(slabs[s], buffers, 1.f / slabs.size());
+            } else {
+                FitVoxels(MaskedVoxels(slabs[s]), buffers, 1.f / slabs.size());
+            }
+            if (slab_path != "") {
+                SaveSlab(slab_path, slabs[s]);
+            }
+        }
+        clock.Stop();
+        m_processTime = clock.GetTotal();
         Info(m_verbose, "Finished processing.");
+        if (m_fittedVoxels > 0) {
+            Log(m_verbose,
+                "Fitted {} voxels in {:.1f}s{}, mean iterations {:.2f}",
+                m_fittedVoxels,
+                clock.GetTotal(),
+                WarmStarting() ? " (warm start)" : "",
+                m_totalIterations / m_fittedVoxels);
+            ReportStatus();
+        }
     }
 
-    virtual void DynamicThreadedGenerateData(const TRegion &region) override {
-        itk::ImageRegionConstIterator<TMaskImage> mask_iter;
-        const auto                                mask = this->GetMask();
-        if (mask) {
-            mask_iter = itk::ImageRegionConstIterator<TMaskImage>(mask, region);
+    /*
+     *  Print the number of voxels that finished with each status. Failures are reported even when
+     *  not verbose, as the outputs for those voxels are whatever the fit function left behind.
+     */
+    void ReportStatus() const {
+        size_t total = 0;
+        for (auto const n : m_statusCounts) {
+            total += n;
         }
-
-        std::vector<itk::ImageRegionConstIterator<TInputImage>> input_iters(ModelType::NI);
-        std::vector<itk::ImageRegionIterator<TResidualsImage>>  residuals_iters(ModelType::NI);
-        for (int i = 0; i < ModelType::NI; i++) {
-            input_iters[i] = itk::ImageRegionConstIterator<TInputImage>(this->GetInput(i), region);
-            if (m_allResiduals) {
-                residuals_iters[i] =
-                    itk::ImageRegionIterator<TResidualsImage>(this->GetResidualsOutput(i), region);
+        Log(m_verbose, "{:<20} {:>10} {:>8}", "Fit status", "Voxels", "Percent");
+        for (int i = 0; i < FitStatusCount; i++) {
+            if (m_statusCounts[i] > 0) {
+                Log(m_verbose,
+                    "{:<20} {:>10} {:>7.2f}%",
+                    FitStatusNames[i],
+                    m_statusCounts[i],
+                    100. * m_statusCounts[i] / total);
             }
         }
-        std::array<itk::ImageRegionConstIterator<TFixedImage>, ModelType::NF> fixed_iters;
-        for (int i = 0; i < ModelType::NF; i++) {
-            typename TFixedImage::ConstPointer c = this->GetFixed(i);
-            if (c) {
-                fixed_iters[i] = itk::ImageRegionConstIterator<TFixedImage>(c, region);
+        size_t const failed =
+            total - m_statusCounts[static_cast<int>(FitStatus::Success)] -
+            m_statusCounts[static_cast<int>(FitStatus::IterationLimit)] -
+            m_statusCounts[static_cast<int>(FitStatus::BoundsHit)];
+        if (failed > 0) {
+            QI::Warn("Fit failed in {} of {} voxels", failed, total);
+        }
+    }
+
+    /*
+     *  Summarise the profiling data for the run. I/O covers reading the inputs in ReadInputs()
+     *  and writing the outputs, so is only complete when both of those were used. Voxels loaded
+     *  from a checkpoint are not included.
+     */
+    json ProfileSummary(double const write_time) const {
+        json threads = json::array();
+        for (auto const &t : m_threadProfiles) {
+            threads.push_back({{"voxels", t.voxels},
+                               {"seconds", t.seconds},
+                               {"voxels_per_second", t.seconds > 0 ? t.voxels / t.seconds : 0.}});
+        }
+        json voxel_time = json::object();
+        if (!m_voxelTimes.empty()) {
+            std::vector<float> sorted = m_voxelTimes;
+            std::sort(sorted.begin(), sorted.end());
+            auto const percentile = [&](double const p) {
+                return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+            };
+            double total = 0;
+            for (auto const t : sorted) {
+                total += t;
             }
+            voxel_time = {{"mean", total / sorted.size()},
+                          {"p50", percentile(0.5)},
+                          {"p90", percentile(0.9)},
+                          {"p99", percentile(0.99)},
+                          {"max", sorted.back()}};
+        }
+        double thread_time = 0, fit_time = 0;
+        for (auto const &t : m_threadProfiles) {
+            thread_time += t.seconds;
+            fit_time += t.fit_time;
         }
+        double const io_time = m_readTime + write_time;
+        return {
+            {"voxels", m_voxelTimes.size()},
+            {"mean_iterations", m_fittedVoxels > 0 ? m_totalIterations / m_fittedVoxels : 0.},
+            {"threads", threads},
+            {"voxel_time_us", voxel_time},
+            {"evaluations",
+             {{"residuals", m_evaluations.residuals}, {"jacobians", m_evaluations.jacobians}}},
+            {"seconds",
+             {{"read", m_readTime},
+              {"process", m_processTime},
+              {"fit", fit_time},
+              {"write", write_time}}},
+            {"io_fraction", io_time / (io_time + m_processTime)},
+            {"fit_fraction", thread_time > 0 ? fit_time / thread_time : 0.}};
+    }
 
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::NV> output_iters;
+    Buffers GetBuffers() {
+        Buffers b;
+        for (int i = 0; i < ModelType::NI; i++) {
+            b.inputs[i]    = this->GetInput(i)->GetBufferPointer();
+            b.residuals[i] = m_allResiduals ? this->GetResidualsOutput(i)->GetBufferPointer() :
+                                              nullptr;
+        }
+        for (int i = 0; i < ModelType::NF; i++) {
+            auto const f = this->GetFixed(i);
+            b.fixed[i]   = f ? f->GetBufferPointer() : nullptr;
+        }
         for (int i = 0; i < ModelType::NV; i++) {
-            output_iters[i] = itk::ImageRegionIterator<TOutputImage>(this->GetOutput(i), region);
+            b.outputs[i] = this->GetOutput(i)->GetBufferPointer();
         }
-
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::ND> derived_iters;
         if constexpr (HasDerived) {
             for (int i = 0; i < ModelType::ND; i++) {
-                derived_iters[i] =
-                    itk::ImageRegionIterator<TOutputImage>(this->GetDerivedOutput(i), region);
+                b.derived[i] = this->GetDerivedOutput(i)->GetBufferPointer();
             }
         }
+        for (int i = 0; i < ModelType::NCov; i++) {
+            b.covar[i] = m_covar ? this->GetCovarOutput(i)->GetBufferPointer() : nullptr;
+        }
+        b.flag     = this->GetFlagOutput()->GetBufferPointer();
+        b.rmse     = this->GetRMSErrorOutput()->GetBufferPointer();
+        b.status   = m_status ? this->GetStatusOutput()->GetBufferPointer() : nullptr;
+        b.time     = m_profile ? this->GetTimeOutput()->GetBufferPointer() : nullptr;
+        for (int i = 0; i < 2; i++) {
+            b.evaluations[i] =
+                m_profile ? this->GetEvaluationsOutput(i)->GetBufferPointer() : nullptr;
+        }
+        b.geometry = this->GetInput(0);
+        return b;
+    }
 
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::NCov> covar_iters;
-        if (m_covar) {
-            for (int ii = 0; ii < ModelType::NCov; ii++) {
-                covar_iters[ii] =
-                    itk::ImageRegionIterator<TOutputImage>(this->GetCovarOutput(ii), region);
-            }
-        }
-
-        // Keep the index on this one to report voxel locations where algorithm fails.
-        itk::ImageRegionIteratorWithIndex<TRMSErrorImage> rmse_iter(this->GetRMSErrorOutput(),
-                                                                    region);
-        itk::ImageRegionIterator<TFlagImage>              flag_iter(this->GetFlagOutput(), region);
-
-        VaryingArray outputs;
-        FixedArray   fixed;
-        CovarArray * covar = m_covar ? new CovarArray : nullptr;
-
-        while (!input_iters[0].IsAtEnd()) {
-            if (!mask || mask_iter.Get()) {
-                for (int b = 0; b < m_blocks; b++) {
-                    std::vector<DataArray> inputs(ModelType::NI);
-                    for (int i = 0; i < ModelType::NI; i++) {
-                        auto input_data       = input_iters[i].Get();
-                        inputs[i]             = DataArray(m_fit->input_size(i));
-                        const int block_start = b * m_fit->input_size(i);
-                        for (Eigen::Index j = 0; j < m_fit->input_size(i); j++) {
-                            inputs[i][j] = input_data[j + block_start];
-                        }
-                    }
+    /*
+     *  Build a compact list of the buffer offsets of the voxels to fit. Outputs are zero-filled
+     *  when they are allocated, so masked voxels need no further work and never reach the threads.
+     */
+    std::vector<itk::OffsetValueType> MaskedVoxels(TRegion const &region) const {
+        auto const                        input = this->GetInput(0);
+        auto const                        mask  = this->GetMask();
+        std::vector<itk::OffsetValueType> voxels;
+        voxels.reserve(region.GetNumberOfPixels());
+        for (itk::ImageRegionConstIteratorWithIndex<TInputImage> it(input, region); !it.IsAtEnd();
+             ++it) {
+            auto const offset = input->ComputeOffset(it.GetIndex());
+            if (!mask || mask->GetBufferPointer()[offset]) {
+                voxels.push_back(offset);
+            }
+        }
+        return voxels;
+    }
 
-                    outputs = VaryingArray::Zero();
-                    if constexpr (ModelType::NF > 0) {
-                        fixed = m_fit->model.fixed_defaults;
-                        for (size_t i = 0; i < fixed_iters.size(); i++) {
-                            if (this->GetFixed(i)) {
-                                fixed[i] = fixed_iters[i].Get();
-                            }
-                        }
-                    }
-                    if (m_covar) {
-                        *covar = CovarArray::Zero();
-                    }
+    /*
+     *  Hand the voxel list out to the threads in chunks from a shared counter, so a thread that
+     *  finishes early takes more work instead of idling while another grinds through a difficult
+     *  area. The chunk size shrinks as the list is used up (guided scheduling), which keeps
+     *  contention on the counter low at the start and every thread busy at the end. Warm-started
+     *  fits use fixed chunks instead (see WarmChunk).
+     */
+    void FitVoxels(std::vector<itk::OffsetValueType> const &voxels,
+                   Buffers const &                          buffers,
+                   float const                              progress_scale) {
+        if (voxels.empty()) {
+            return;
+        }
+        auto const          units = static_cast<size_t>(this->GetNumberOfWorkUnits());
+        bool const          warm  = WarmStarting();
+        std::atomic<size_t> next{0};
+        auto                thread_func = [&](itk::SizeValueType const unit) {
+            Workspace  ws{m_fit, m_allResiduals, m_blocks};
+            auto const thread_start = std::chrono::steady_clock::now();
+            size_t     start        = next.load();
+            while (start < voxels.size()) {
+                size_t const chunk =
+                    warm ? WarmChunk : std::max<size_t>(1, (voxels.size() - start) / (4 * units));
+                if (!next.compare_exchange_weak(start, start + chunk)) {
+                    continue; // start now holds the updated counter
+                }
+                size_t const end = std::min(start + chunk, voxels.size());
+                if (warm) {
+                    std::fill(ws.seeds.begin(), ws.seeds.end(), Workspace::NoSeed());
+                }
+                FitRange(voxels, start, end, buffers, ws);
+                this->IncrementProgress(progress_scale * (end - start) / voxels.size());
+                start = next.load();
+            }
+            std::chrono::duration<double> const thread_time =
+                std::chrono::steady_clock::now() - thread_start;
+            MergeStats(ws, unit, thread_time.count());
+        };
+        this->GetMultiThreader()->SetNumberOfWorkUnits(units);
+        this->GetMultiThreader()->ParallelizeArray(0, units, thread_func, nullptr);
+    }
 
-                    typename FitType::RMSErrorType rmse = 0;
-                    typename FitType::FlagType     flag = 0;
-                    std::vector<ResidualArray>     rs; // Leave size 0 if user doesn't want them
-                    if (m_allResiduals) {
-                        for (int i = 0; i < ModelType::NI; i++) {
-                            const int block_size = m_fit->input_size(i);
-                            rs.push_back(ResidualArray::Zero(block_size));
-                        }
-                    }
+    /*
+     *  The previous scheduler, kept for comparison (see UseRegionScheduling). The slab is split
+     *  into one fixed piece per work unit by ITK, so a thread that gets the difficult voxels
+     *  finishes last while the others idle.
+     */
+    void FitRegions(TRegion const &slab, Buffers const &buffers, float const progress_scale) {
+        auto const          units = static_cast<size_t>(this->GetNumberOfWorkUnits());
+        std::atomic<size_t> next_unit{0};
+        auto                region_func = [&](TRegion const &piece) {
+            Workspace  ws{m_fit, m_allResiduals, m_blocks};
+            auto const thread_start = std::chrono::steady_clock::now();
+            auto const voxels       = MaskedVoxels(piece);
+            FitRange(voxels, 0, voxels.size(), buffers, ws);
+            this->IncrementProgress(progress_scale * piece.GetNumberOfPixels() /
+                                    slab.GetNumberOfPixels());
+            std::chrono::duration<double> const thread_time =
+                std::chrono::steady_clock::now() - thread_start;
+            MergeStats(ws, next_unit++ % units, thread_time.count());
+        };
+        this->GetMultiThreader()->SetNumberOfWorkUnits(units);
+        this->GetMultiThreader()->template ParallelizeImageRegion<ImageDim>(
+            slab, region_func, nullptr);
+    }
 
-                    QI::FitReturnType status;
-                    if constexpr (Blocked && Indexed) {
-                        status = m_fit->fit(
-                            inputs, fixed, outputs, covar, rmse, rs, flag, b, rmse_iter.GetIndex());
-                    } else if constexpr (Blocked) {
-                        status = m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag, b);
-                    } else if constexpr (Indexed) {
-                        status = m_fit->fit(
-                            inputs, fixed, outputs, covar, rmse, rs, flag, rmse_iter.GetIndex());
-                    } else {
-                        status = m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag);
-                    }
+    void MergeStats(Workspace const &ws, size_t const unit, double const seconds) {
+        std::lock_guard<std::mutex> lock(m_statsMutex);
+        m_totalIterations += ws.total_iterations;
+        m_fittedVoxels += ws.fitted_voxels;
+        for (int i = 0; i < FitStatusCount; i++) {
+            m_statusCounts[i] += ws.status_counts[i];
+        }
+        if (m_profile) {
+            m_threadProfiles[unit].voxels += ws.fitted_voxels;
+            m_threadProfiles[unit].seconds += seconds;
+            m_threadProfiles[unit].fit_time += ws.fit_time;
+            m_voxelTimes.insert(m_voxelTimes.end(), ws.voxel_times.begin(), ws.voxel_times.end());
+            m_evaluations.residuals += ws.evaluations.residuals;
+            m_evaluations.jacobians += ws.evaluations.jacobians;
+        }
+    }
 
-                    if (!status.success && m_verbose) {
-                        QI::Warn(
-                            "Fit failed for voxel {}: {}", rmse_iter.GetIndex(), status.message);
-                    }
+    void FitRange(std::vector<itk::OffsetValueType> const &voxels,
+                  size_t const                             start,
+                  size_t const                             end,
+                  Buffers const &                          buf,
+                  Workspace &                              ws) const {
+        if constexpr (CanBatch) {
+            if (!m_covar && !m_allResiduals) {
+                // Batches run across voxels when there are several blocks per voxel
+                size_t const first = start * m_blocks;
+                size_t const last  = end * m_blocks;
+                for (size_t item = first; item < last; item += FitType::BatchSize) {
+                    FitBatch(voxels,
+                             item,
+                             std::min<size_t>(FitType::BatchSize, last - item),
+                             buf,
+                             ws);
+                }
+                return;
+            }
+        }
+        for (size_t v = start; v < end; v++) {
+            FitVoxel(voxels[v], buf, ws);
+        }
+    }
 
-                    if constexpr (Blocked) {
-                        flag_iter.Get()[b] = flag;
-                        rmse_iter.Get()[b] = rmse;
-                        for (int i = 0; i < ModelType::NV; i++) {
-                            output_iters[i].Get()[b] = outputs[i];
-                        }
-                    } else {
-                        flag_iter.Set(flag);
-                        rmse_iter.Set(rmse);
-                        for (int i = 0; i < ModelType::NV; i++) {
-                            output_iters[i].Set(outputs[i]);
-                        }
-                        if (m_covar) {
-                            for (int ii = 0; ii < ModelType::NCov; ii++) {
-                                covar_iters[ii].Set((*covar)[ii]);
-                            }
-                        }
-                    }
-                    if constexpr (HasDerived) {
-                        typename ModelType::DerivedArray derived;
-                        m_fit->model.derived(outputs, fixed, derived);
-                        for (int i = 0; i < ModelType::ND; i++) {
-                            derived_iters[i].Set(derived[i]);
-                        }
-                    }
-                    if (m_allResiduals) {
-                        for (int i = 0; i < ModelType::NI; i++) {
-                            const int block_start = m_fit->input_size(i) * b;
-                            for (int j = 0; j < m_fit->input_size(i); j++) {
-                                residuals_iters[i].Get()[j + block_start] = rs[i][j];
-                            }
-                        }
-                    }
+    /*
+     *  Fit count items starting from first, where item i is block i % m_blocks of voxel
+     *  voxels[i / m_blocks]. The fixed parameters are per voxel, so they are shared by its blocks.
+     */
+    void FitBatch(std::vector<itk::OffsetValueType> const &voxels,
+                  size_t const                             first,
+                  Eigen::Index const                       count,
+                  Buffers const &                          buf,
+                  Workspace &                              ws) const {
+        int const n = m_fit->input_size(0);
+        ws.batch_data.resize(n, count);
+        ws.batch_fixed.resize(ModelType::NF, count);
+        ws.batch_outputs.resize(ModelType::NV, count);
+        ws.batch_rmse.resize(count);
+        ws.batch_flags.resize(count);
+        ws.batch_results.resize(count);
+        ws.batch_offsets.resize(count);
+        for (Eigen::Index j = 0; j < count; j++) {
+            auto const item      = static_cast<itk::OffsetValueType>(first + j);
+            auto const voxel     = voxels[item / m_blocks];
+            auto const o         = voxel * m_blocks + item % m_blocks;
+            ws.batch_offsets[j]  = o;
+            ws.batch_data.col(j) = InputMap(buf.inputs[0] + o * n, n).template cast<DataType>();
+            if constexpr (ModelType::NF > 0) {
+                for (int i = 0; i < ModelType::NF; i++) {
+                    ws.batch_fixed(i, j) =
+                        buf.fixed[i] ? buf.fixed[i][voxel] : m_fit->model.fixed_defaults[i];
                 }
-            } else {
-                if constexpr (Blocked) {
-                    flag_iter.Get().Fill(0);
-                    rmse_iter.Get().Fill(0);
-                    for (auto &o : output_iters) {
-                        o.Get().Fill(0);
-                    }
-                } else {
-                    flag_iter.Set(0);
-                    flag_iter.Set(0);
-                    for (auto &o : output_iters) {
-                        o.Set(0);
-                    }
-                    if (m_covar) {
-                        for (auto &c : covar_iters) {
-                            c.Set(0);
-                        }
-                    }
+            }
+        }
+        auto const batch_start = std::chrono::steady_clock::now();
+        m_fit->fit_batch(ws.batch_data,
+                         ws.batch_fixed,
+                         ws.batch_outputs,
+                         ws.batch_rmse,
+                         ws.batch_flags,
+                         ws.batch_results.data(),
+                         ws.scratch);
+        std::chrono::duration<double> const batch_time =
+            std::chrono::steady_clock::now() - batch_start;
+        for (Eigen::Index j = 0; j < count; j++) {
+            auto const o = ws.batch_offsets[j];
+            buf.flag[o]  = ws.batch_flags[j];
+            buf.rmse[o]  = ws.batch_rmse[j];
+            RecordStatus(ws.batch_results[j],
+                         ws.batch_outputs.col(j),
+                         ws.batch_rmse[j],
+                         buf.status ? buf.status + o : nullptr,
+                         ws);
+            if (m_profile) {
+                // fit_batch() only gives the time for the whole batch, so share it out evenly
+                RecordProfile(
+                    ws.batch_results[j].evaluations, batch_time.count() / count, o, buf, ws);
+            }
+            for (int i = 0; i < ModelType::NV; i++) {
+                buf.outputs[i][o] = ws.batch_outputs(i, j);
+            }
+            if constexpr (HasDerived) {
+                ws.outputs = ws.batch_outputs.col(j);
+                ws.fixed   = ws.batch_fixed.col(j);
+                typename ModelType::DerivedArray derived;
+                m_fit->model.derived(ws.outputs, ws.fixed, derived);
+                for (int i = 0; i < ModelType::ND; i++) {
+                    buf.derived[i][o] = derived[i];
                 }
-                if constexpr (HasDerived) {
-                    for (auto &d : derived_iters) {
-                        d.Set(0);
+            }
+            ws.total_iterations += ws.batch_flags[j];
+        }
+        ws.fitted_voxels += count;
+    }
+
+    /*
+     *  Count the status of one fit and write it to the status image if requested. A fit that
+     *  claims success but produced NaN or infinite outputs is recorded as NonFinite.
+     */
+    template <typename Outputs>
+    static void RecordStatus(FitReturnType const &result,
+                             Outputs const &      outputs,
+                             RMSErrorType const   rmse,
+                             unsigned char *      status,
+                             Workspace &          ws) {
+        FitStatus code = result.status;
+        if (result.success && !(outputs.isFinite().all() && std::isfinite(rmse))) {
+            code = FitStatus::NonFinite;
+        }
+        ws.status_counts[static_cast<int>(code)]++;
+        if (status) {
+            *status = static_cast<unsigned char>(code);
+        }
+    }
+
+    // Write the time and evaluation counts for one fit to the profiling outputs
+    static void RecordProfile(FitEvaluations const &     evaluations,
+                              double const               seconds,
+                              itk::OffsetValueType const o,
+                              Buffers const &            buf,
+                              Workspace &                ws) {
+        float const us = 1e6 * seconds;
+        buf.time[o]    = us;
+        ws.fit_time += seconds;
+        ws.voxel_times.push_back(us);
+        buf.evaluations[0][o] = evaluations.residuals;
+        buf.evaluations[1][o] = evaluations.jacobians;
+        ws.evaluations.residuals += evaluations.residuals;
+        ws.evaluations.jacobians += evaluations.jacobians;
+    }
+
+    void FitVoxel(itk::OffsetValueType const voxel, Buffers const &buf, Workspace &ws) const {
+        bool const warm = WarmStarting();
+        for (int b = 0; b < m_blocks; b++) {
+            for (int i = 0; i < ModelType::NI; i++) {
+                const int input_size = m_fit->input_size(i);
+                ws.inputs[i] =
+                    InputMap(buf.inputs[i] + (voxel * m_blocks + b) * input_size, input_size)
+                        .template cast<DataType>();
+            }
+
+            ws.outputs = warm ? ws.seeds[b] : VaryingArray::Zero();
+            if constexpr (ModelType::NF > 0) {
+                ws.fixed = m_fit->model.fixed_defaults;
+                for (int i = 0; i < ModelType::NF; i++) {
+                    if (buf.fixed[i]) {
+                        ws.fixed[i] = buf.fixed[i][voxel];
                     }
                 }
-                if (m_allResiduals) {
-                    for (auto &r : residuals_iters) {
-                        r.Get().Fill(0);
-                    }
+            }
+            if (m_covar) {
+                ws.covar = CovarArray::Zero();
+            }
+            CovarArray *covar_ptr = m_covar ? &ws.covar : nullptr;
+
+            typename FitType::RMSErrorType rmse = 0;
+            typename FitType::FlagType     flag = 0;
+            for (auto &r : ws.residuals) {
+                r.setZero();
+            }
+
+            auto const call_fit = [&](auto &&...args) {
+                if constexpr (HasScratch) {
+                    return m_fit->fit(std::forward<decltype(args)>(args)..., ws.scratch);
+                } else {
+                    return m_fit->fit(std::forward<decltype(args)>(args)...);
                 }
+            };
+            QI::FitReturnType result;
+            auto const        fit_start = std::chrono::steady_clock::now();
+            if constexpr (Blocked && Indexed) {
+                result = call_fit(ws.inputs,
+                                  ws.fixed,
+                                  ws.outputs,
+                                  covar_ptr,
+                                  rmse,
+                                  ws.residuals,
+                                  flag,
+                                  b,
+                                  buf.geometry->ComputeIndex(voxel));
+            } else if constexpr (Blocked) {
+                result = call_fit(
+                    ws.inputs, ws.fixed, ws.outputs, covar_ptr, rmse, ws.residuals, flag, b);
+            } else if constexpr (Indexed) {
+                result = call_fit(ws.inputs,
+                                  ws.fixed,
+                                  ws.outputs,
+                                  covar_ptr,
+                                  rmse,
+                                  ws.residuals,
+                                  flag,
+                                  buf.geometry->ComputeIndex(voxel));
+            } else {
+                result = call_fit(
+                    ws.inputs, ws.fixed, ws.outputs, covar_ptr, rmse, ws.residuals, flag);
             }
+            std::chrono::duration<double> const fit_time =
+                std::chrono::steady_clock::now() - fit_start;
 
-            if (this->GetMask())
-                ++mask_iter;
-            for (int i = 0; i < ModelType::NI; i++) {
-                ++input_iters[i];
-                if (m_allResiduals)
-                    ++residuals_iters[i];
+            if (warm && result.success) {
+                ws.seeds[b] = ws.outputs;
             }
-            for (int i = 0; i < ModelType::NF; i++) {
-                if (this->GetFixed(i))
-                    ++fixed_iters[i];
+            ws.total_iterations += flag;
+            ws.fitted_voxels++;
+
+            auto const o = voxel * m_blocks + b;
+            buf.flag[o]  = flag;
+            buf.rmse[o]  = rmse;
+            RecordStatus(result, ws.outputs, rmse, buf.status ? buf.status + o : nullptr, ws);
+            if (m_profile) {
+                RecordProfile(result.evaluations, fit_time.count(), o, buf, ws);
             }
             for (int i = 0; i < ModelType::NV; i++) {
-                ++output_iters[i];
+                buf.outputs[i][o] = ws.outputs[i];
+            }
+            if (m_covar) {
+                for (int ii = 0; ii < ModelType::NCov; ii++) {
+                    buf.covar[ii][o] = ws.covar[ii];
+                }
             }
             if constexpr (HasDerived) {
-                for (auto &d : derived_iters) {
-                    ++d;
+                typename ModelType::DerivedArray derived;
+                m_fit->model.derived(ws.outputs, ws.fixed, derived);
+                for (int i = 0; i < ModelType::ND; i++) {
+                    buf.derived[i][o] = derived[i];
                 }
             }
-            if (m_covar) {
-                for (auto &c : covar_iters) {
-                    ++c;
+            if (m_allResiduals) {
+                for (int i = 0; i < ModelType::NI; i++) {
+                    const int input_size = m_fit->input_size(i);
+                    std::copy_n(ws.residuals[i].data(),
+                                input_size,
+                                buf.residuals[i] + (voxel * m_blocks + b) * input_size);
                 }
             }
-            ++flag_iter;
-            ++rmse_iter;
+        }
+    }
+
+    bool WarmStarting() const {
+        if constexpr (CanWarmStart) {
+            return m_fit->warm_start;
+        } else {
+            return false;
         }
     }
 }; // namespace QI
@@ -13,36 +13,71 @@
 #ifndef DESPOT_RegionContraction_h
 #define DESPOT_RegionContraction_h
 
-#include <random>
-#include <vector>
-
-#include <atomic>
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <numeric>
+#include <ostream>
+#include <vector>
 
 #include <Eigen/Core>
 
-#include "Util.h"
+#include "Log.h"
 
 namespace QI {
 
-typedef Eigen::Array<bool, Eigen::Dynamic, 1> ArrayXb;
+/*
+ *  Counter-based random number generator. Each number is a hash (the SplitMix64 finaliser) of a
+ *  key and a counter, so a stream depends only on its key. Keying the stream on the voxel index
+ *  makes the results independent of the number of threads and the order voxels are processed in.
+ */
+class CounterRNG {
+  public:
+    explicit CounterRNG(std::uint64_t const key) : m_key(Mix(key)) {}
 
-std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x,
-                                       Eigen::ArrayXd::Index             N);
-std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x,
-                                       Eigen::ArrayXd::Index             N) {
-    eigen_assert(x.size() >= N);
-    std::vector<size_t> allIndices(x.size()), indices(N);
-    for (size_t i = 0; i < allIndices.size(); i++) {
-        allIndices[i] = i;
+    // Combine a seed and a set of indices (e.g. a voxel index) into a single key
+    static std::uint64_t Key(std::uint64_t const                       seed,
+                             std::initializer_list<std::int64_t> const indices) {
+        std::uint64_t key = Mix(seed);
+        for (auto const i : indices) {
+            key = Mix(key ^ static_cast<std::uint64_t>(i));
+        }
+        return key;
     }
-    partial_sort(allIndices.begin(), allIndices.begin() + N, allIndices.end(),
-                 [&x](size_t i1, size_t i2) { return x[i1] < x[i2]; });
-    for (Eigen::ArrayXd::Index i = 0; i < N; i++) {
-        indices[i] = allIndices[i];
+
+    std::uint64_t next() { return Mix(m_key + Golden * ++m_counter); }
+
+    // Uniform on [0, 1)
+    double uniform() { return (next() >> 11) * 0x1.0p-53; }
+
+    // Standard normal, by the Box-Muller transform
+    double normal() {
+        if (m_has_spare) {
+            m_has_spare = false;
+            return m_spare;
+        }
+        double const r = std::sqrt(-2. * std::log(1. - uniform()));
+        double const t = 2. * M_PI * uniform();
+        m_spare        = r * std::sin(t);
+        m_has_spare    = true;
+        return r * std::cos(t);
     }
-    return indices;
-}
+
+  private:
+    static constexpr std::uint64_t Golden = 0x9E3779B97F4A7C15ULL;
+
+    static std::uint64_t Mix(std::uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    std::uint64_t m_key, m_counter = 0;
+    double        m_spare     = 0;
+    bool          m_has_spare = false;
+};
 
 enum class RCStatus {
     NotStarted = -1,
@@ -53,7 +88,7 @@ enum class RCStatus {
     ErrorResidual
 };
 
-std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
+inline std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
     switch (s) {
     case RCStatus::NotStarted:
         os << "Not Started";
@@ -77,54 +112,51 @@ std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
     return os;
 }
 
-template <typename Functor_t> class RegionContraction {
-  private:
-    Functor_t &     m_f;
-    std::mt19937_64 m_rng;
-    Eigen::ArrayXXd m_startBounds, m_currentBounds;
-    Eigen::ArrayXd  m_threshes;
-    size_t          m_nS, m_nR, m_maxContractions, m_contractions;
-    double          m_expand, m_SoS;
-    RCStatus        m_status;
-    bool            m_gaussian, m_debug;
+struct RCOptions {
+    int    samples          = 5000;  // Samples drawn in each contraction
+    int    retain           = 50;    // Best samples used to define the next region
+    int    max_contractions = 10;    // Maximum number of contractions
+    int    batch            = 256;   // Samples generated and then scored together
+    double expand           = 0.;    // Fraction of the width to re-expand the region by
+    bool   gaussian         = false; // Sample from a gaussian fitted to the retained samples
+    bool   debug            = false; // Print progress to stderr
+};
 
+/*
+ *  Stochastic (or Gaussian) Region Contraction. Each contraction draws samples within the current
+ *  region, keeps the best, and shrinks the region to the bounding box of the kept samples, until
+ *  the width of every parameter is below its threshold (a fraction of the starting width).
+ *
+ *  The functor must provide inputs(), constraint(sample) and operator()(sample), which returns the
+ *  cost of a sample. If it also provides costs(samples, costs), that is called with a whole batch
+ *  of samples (one per column) so the cost can be vectorised across them.
+ *
+ *  All working memory is allocated by the constructor, so an instance can be re-used by calling
+ *  optimise() with a different key for each voxel. setBounds() and setSamples() change the region
+ *  and number of samples between voxels, without allocating.
+ */
+template <typename Functor_t> class RegionContraction {
   public:
-    RegionContraction(Functor_t &f, const Eigen::ArrayXd &loBounds, const Eigen::ArrayXd &hiBounds,
-                      const Eigen::ArrayXd &thresh, const int nS = 5000, const int nR = 50,
-                      const int maxContractions = 10, const double expand = 0.,
-                      const bool gauss = false, const bool debug = false, const int seed = -1)
-        : m_f(f), m_threshes(thresh), m_nS(nS), m_nR(nR), m_maxContractions(maxContractions),
-          m_contractions(0), m_expand(expand), m_status(RCStatus::NotStarted), m_gaussian(gauss),
-          m_debug(debug) {
-        m_startBounds        = Eigen::ArrayXXd(loBounds.rows(), 2);
-        m_startBounds.col(0) = loBounds;
-        m_startBounds.col(1) = hiBounds;
-        m_currentBounds      = m_startBounds;
+    RegionContraction(Functor_t &           f,
+                      const Eigen::ArrayXd &loBounds,
+                      const Eigen::ArrayXd &hiBounds,
+                      const Eigen::ArrayXd &thresh,
+                      const RCOptions &     options) :
+        m_f(f),
+        m_options(options), m_threshes(thresh), m_startBounds(loBounds.rows(), 2),
+        m_currentBounds(loBounds.rows(), 2), m_samples(f.inputs(), options.samples),
+        m_retained(f.inputs(), options.retain), m_mu(f.inputs()), m_sigma(f.inputs()),
+        m_startWidth(f.inputs()), m_width(f.inputs()), m_previousBest(f.inputs()),
+        m_costs(options.samples), m_retainedCosts(options.retain), m_order(options.samples) {
+        setBounds(loBounds, hiBounds);
         eigen_assert(f.inputs() == m_startBounds.rows());
-        eigen_assert(m_startBounds.cols() == 2);
         eigen_assert(thresh.rows() == f.inputs());
         eigen_assert((thresh >= 0.).all() && (thresh <= 1.).all());
-
-        if (seed < 0) {
-            m_rng = std::mt19937_64(RandomSeed());
-        } else {
-            m_rng = std::mt19937_64(seed);
-        }
+        eigen_assert(options.retain > 0 && options.retain <= options.samples);
+        eigen_assert(options.batch > 0);
     }
 
-    const Eigen::ArrayXXd &startBounds() const { return m_startBounds; }
-    void                   setBounds(const Eigen::Ref<Eigen::ArrayXXd> &b) {
-        eigen_assert(m_f.inputs() == b.rows());
-        eigen_assert(b.cols() == 2);
-        m_startBounds = b;
-    }
-    const ArrayXb &thresholds() const { return m_threshes; }
-    void           setThresholds(const Eigen::Ref<Eigen::ArrayXd> &t) {
-        eigen_assert(t.rows() == m_f.inputs());
-        eigen_assert((t >= 0.).all() && (t <= 1.).all());
-        m_threshes = t;
-    }
-    size_t                 contractions() const { return m_contractions; }
+    int                    contractions() const { return m_contractions; }
     RCStatus               status() const { return m_status; }
     const Eigen::ArrayXXd &currentBounds() const { return m_currentBounds; }
     double                 SoS() const { return m_SoS; }
@@ -132,185 +164,180 @@ template <typename Functor_t> class RegionContraction {
     Eigen::ArrayXd width() const { return m_currentBounds.col(1) - m_currentBounds.col(0); }
     Eigen::ArrayXd midPoint() const { return (m_currentBounds.rowwise().sum() / 2.); }
 
-    bool optimise(Eigen::Ref<Eigen::ArrayXd> params) {
-        static std::atomic<bool> finiteWarning(false);
-        static std::atomic<bool> constraintWarning(false);
-        static std::atomic<bool> boundsWarning(false);
-        std::mutex               warn_mtx;
+    void setBounds(const Eigen::ArrayXd &loBounds, const Eigen::ArrayXd &hiBounds) {
+        m_startBounds.col(0) = loBounds;
+        m_startBounds.col(1) = hiBounds;
+        m_startWidth         = m_startBounds.col(1) - m_startBounds.col(0);
+    }
 
+    // Draw fewer samples per contraction than the constructor's options, e.g. in a smaller region
+    void setSamples(int const samples) {
+        eigen_assert(samples >= m_options.retain && samples <= m_samples.cols());
+        m_options.samples = samples;
+    }
+
+    /*
+     *  Find the best parameters. The random numbers are drawn from a stream identified by key, see
+     *  CounterRNG::Key(). Returns false if the bounds are invalid, a valid sample could not be
+     *  generated or a cost was not finite, and status() gives the reason.
+     */
+    bool optimise(Eigen::Ref<Eigen::ArrayXd> params, std::uint64_t const key) {
         eigen_assert(m_f.inputs() == params.size());
-        int                 nP = static_cast<int>(params.size());
-        Eigen::ArrayXXd     samples(m_f.inputs(), m_nS);
-        Eigen::ArrayXXd     retained(m_f.inputs(), m_nR);
-        Eigen::ArrayXd      residuals(m_nS);
-        Eigen::ArrayXd      retainedRes(m_nR);
-        Eigen::ArrayXd      gauss_mu(m_f.inputs()), gauss_sigma(m_f.inputs());
-        std::vector<size_t> indices(m_nR);
+        CounterRNG rng(key);
         m_currentBounds = m_startBounds;
-        if ((m_startBounds != m_startBounds).any() ||
-            (m_startBounds >= std::numeric_limits<double>::infinity()).any() ||
-            (m_startBounds.col(1) < m_startBounds.col(0)).any()) {
-            warn_mtx.lock();
-            if (!boundsWarning) {
-                boundsWarning = true;
-                std::cerr << "Warning: Starting boundaries do not make sense." << std::endl;
-                std::cerr << "Bounds were: " << m_startBounds.transpose() << std::endl;
-                std::cerr << "This warning will only be printed once." << std::endl;
-            }
-            warn_mtx.unlock();
+        m_contractions  = 0;
+        if (!m_startBounds.allFinite() || (m_startBounds.col(1) < m_startBounds.col(0)).any()) {
             params.setZero();
             m_status = RCStatus::ErrorInvalid;
             return false;
         }
+        QI::Log(m_options.debug, "Region contraction start bounds:\n{}", m_startBounds.transpose());
 
-        if (m_debug) {
-            std::cout << std::endl;
-            std::cout << "START REGION CONTRACTION" << std::endl;
-            std::cout << "Start Boundaries: " << std::endl
-                      << m_startBounds.transpose() << std::endl;
-        }
-
-        std::uniform_real_distribution<double> uniform(0., 1.);
+        m_retained.setConstant(std::numeric_limits<double>::quiet_NaN());
         m_status = RCStatus::IterationLimit;
-        for (m_contractions = 0; m_contractions < m_maxContractions; m_contractions++) {
-            size_t startSample = 0;
-            /*if (m_contractions > 0) {
-                    // Keep the retained samples to prevent boundary contracting too fast
-                    for (size_t s = 0; s < m_nR; s++) {
-                            samples.col(s) = retained.col(s);
-                            residuals.col(s) = retainedRes.col(s);
-                    }
-                    startSample = m_nR;
-            }*/
-            for (size_t s = startSample; s < m_nS; s++) {
-                Eigen::ArrayXd tempSample(nP);
-                size_t         nTries = 0;
-                do {
-                    if (!m_gaussian || (m_contractions == 0)) {
-                        for (int p = 0; p < nP; p++) {
-                            tempSample(p) = uniform(m_rng);
-                        }
-                        tempSample *= width();
-                        tempSample += m_currentBounds.col(0);
-                    } else {
-                        for (int p = 0; p < nP; p++) {
-                            if (std::isfinite(gauss_sigma(p))) {
-                                std::normal_distribution<double> gauss(gauss_mu(p), gauss_sigma(p));
-                                do {
-                                    tempSample(p) = gauss(m_rng);
-                                } while ((tempSample(p) < m_currentBounds(p, 0)) ||
-                                         (tempSample(p) > m_currentBounds(p, 1)));
-                            } else {
-                                tempSample(p) = gauss_mu(p);
-                            }
-                        }
-                    }
-                    nTries++;
-                    if (nTries > 100) {
-                        warn_mtx.lock();
-                        if (!constraintWarning) {
-                            constraintWarning = true;
-                            std::cerr << "Warning: Cannot fulfill sample constraints after "
-                                      << std::to_string(nTries) << " attempts, giving up."
-                                      << std::endl
-                                      << "Last attempt was: " << tempSample.transpose() << std::endl
-                                      << "This warning will only be printed once." << std::endl;
-                        }
-                        warn_mtx.unlock();
+        while (m_contractions < m_options.max_contractions) {
+            bool const gaussian = m_options.gaussian && (m_contractions > 0);
+            for (int start = 0; start < m_options.samples; start += m_options.batch) {
+                int const n = std::min(m_options.batch, m_options.samples - start);
+                for (int s = start; s < start + n; s++) {
+                    if (!Sample(rng, gaussian, m_samples.col(s))) {
                         params.setZero();
                         m_status = RCStatus::ErrorInvalid;
                         return false;
                     }
-                } while (!m_f.constraint(tempSample));
-
-                residuals[s] = m_f(tempSample);
-                if (!std::isfinite(residuals[s])) {
-                    warn_mtx.lock();
-                    if (!finiteWarning) {
-                        finiteWarning = true;
-                        std::cout
-                            << "Warning: Non-finite residual found!" << std::endl
-                            << "Result may be meaningless. This warning will only be printed once."
-                            << std::endl
-                            << "Parameters were " << tempSample.transpose() << std::endl;
-                    }
-                    warn_mtx.unlock();
-                    params   = retained.col(0);
-                    m_status = RCStatus::ErrorResidual;
-                    return false;
                 }
-                samples.col(s) = tempSample;
+                Score(start, n);
             }
-            indices                     = index_partial_sort(residuals, m_nR);
-            Eigen::ArrayXd previousBest = retained.col(0);
-            for (size_t i = 0; i < m_nR; i++) {
-                retained.col(i) = samples.col(indices[i]);
-                retainedRes(i)  = residuals(indices[i]);
+            if (!m_costs.head(m_options.samples).allFinite()) {
+                params   = m_samples.col(FirstNonFinite());
+                m_status = RCStatus::ErrorResidual;
+                return false;
             }
-            // Find the min and max for each parameter in the top nR samples
-            m_currentBounds.col(0) = retained.rowwise().minCoeff();
-            m_currentBounds.col(1) = retained.rowwise().maxCoeff();
-            if (m_gaussian) {
-                gauss_mu = retained.rowwise().mean();
-                gauss_sigma =
-                    ((retained.colwise() - gauss_mu).square().rowwise().sum() / (m_f.inputs() - 1))
-                        .sqrt();
+
+            m_previousBest    = m_retained.col(0);
+            auto const retain = m_order.begin() + m_options.retain;
+            auto const end    = m_order.begin() + m_options.samples;
+            std::iota(m_order.begin(), end, 0);
+            std::partial_sort(m_order.begin(), retain, end, [&](int a, int b) {
+                return m_costs[a] < m_costs[b];
+            });
+            for (int i = 0; i < m_options.retain; i++) {
+                m_retained.col(i)  = m_samples.col(m_order[i]);
+                m_retainedCosts[i] = m_costs[m_order[i]];
             }
-            if (m_debug) {
-                std::cout << "CONTRACTION:    " << m_contractions << std::endl
-                          << "Retained best: " << retainedRes.minCoeff()
-                          << " Worst: " << retainedRes.maxCoeff() << std::endl
-                          << "All best:      " << residuals.minCoeff()
-                          << " Worst: " << residuals.maxCoeff() << std::endl
-                          << "Current width%: " << (width() / startWidth()).transpose()
-                          << std::endl;
-                // cout << "Thresh        : " << m_threshes.transpose() << std::endl;
-                // cout << "Width < Thresh: " << (width() <= (m_threshes *
-                // startWidth())).transpose() << std::endl; cout << "Converged:      " << (width() <=
-                // (m_threshes * startWidth())).all() << std::endl;
-                if (m_gaussian) {
-                    std::cout << "Gaussian mu:    " << gauss_mu.transpose() << std::endl
-                              << "Gaussian sigma%:" << (gauss_sigma / startWidth()).transpose()
-                              << std::endl;
-                }
+            // Find the min and max for each parameter in the retained samples
+            m_currentBounds.col(0) = m_retained.rowwise().minCoeff();
+            m_currentBounds.col(1) = m_retained.rowwise().maxCoeff();
+            m_width                = m_currentBounds.col(1) - m_currentBounds.col(0);
+            if (m_options.gaussian) {
+                m_mu    = m_retained.rowwise().mean();
+                // Sample standard deviation, a single retained sample gives zero
+                m_sigma = ((m_retained.colwise() - m_mu).square().rowwise().sum() /
+                           std::max<Eigen::Index>(1, m_retained.cols() - 1))
+                              .sqrt();
             }
+            m_contractions++;
+            QI::Log(m_options.debug,
+                    "Contraction {} best cost {} worst retained {} width {}",
+                    m_contractions,
+                    m_retainedCosts[0],
+                    m_retainedCosts[m_options.retain - 1],
+                    (m_width / m_startWidth).transpose());
+
             // Terminate if all the desired parameters have converged
-            if ((width() <= (m_threshes * startWidth())).all()) {
+            if ((m_width <= (m_threshes * m_startWidth)).all()) {
                 m_status = RCStatus::Converged;
-                m_contractions++; // Just to give an accurate contraction count.
                 break;
-            } else if ((previousBest == retained.col(0)).all()) {
+            } else if ((m_previousBest == m_retained.col(0)).all()) {
                 m_status = RCStatus::NoImprovement;
-                m_contractions++; // Just to give an accurate contraction count.
                 break;
             }
 
-            if (m_expand != 0) {
+            if (m_options.expand != 0) {
                 // Expand the boundaries back out in case we just missed a minima,
                 // but don't go past initial boundaries
-                Eigen::ArrayXd tempW = width(); // Because altering .col(0) will change width
                 m_currentBounds.col(0) =
-                    (m_currentBounds.col(0) - tempW * m_expand).max(m_startBounds.col(0));
+                    (m_currentBounds.col(0) - m_width * m_options.expand).max(m_startBounds.col(0));
                 m_currentBounds.col(1) =
-                    (m_currentBounds.col(1) + tempW * m_expand).min(m_startBounds.col(1));
-                if (m_debug) {
-                    std::cout << "Width expanded to: " << width().transpose() << std::endl;
-                }
+                    (m_currentBounds.col(1) + m_width * m_options.expand).min(m_startBounds.col(1));
             }
         }
 
-        if (m_gaussian) {
-            params = gauss_mu;
+        if (m_options.gaussian) {
+            params = m_mu;
         } else {
             // Return the best evaluated solution so far
-            params = retained.col(0);
-        }
-        m_SoS = retainedRes(0);
-        if (m_debug) {
-            std::cout << "Finished, contractions = " << m_contractions << std::endl;
+            params = m_retained.col(0);
         }
+        m_SoS = m_retainedCosts[0];
         return true;
     }
+
+  private:
+    Functor_t &      m_f;
+    RCOptions        m_options;
+    Eigen::ArrayXd   m_threshes;
+    Eigen::ArrayXXd  m_startBounds, m_currentBounds;
+    Eigen::ArrayXXd  m_samples, m_retained; // One sample per column
+    Eigen::ArrayXd   m_mu, m_sigma;         // Gaussian parameters
+    Eigen::ArrayXd   m_startWidth, m_width, m_previousBest;
+    Eigen::ArrayXd   m_costs, m_retainedCosts;
+    std::vector<int> m_order;
+    int              m_contractions = 0;
+    double           m_SoS          = 0;
+    RCStatus         m_status       = RCStatus::NotStarted;
+
+    static constexpr int MaxTries = 100;
+
+    /*
+     *  Draw one sample that satisfies the functor's constraint, either uniformly within the
+     *  current region or from the gaussian, truncated to the current region.
+     */
+    template <typename Col> bool Sample(CounterRNG &rng, bool const gaussian, Col sample) {
+        auto const &lo = m_currentBounds.col(0);
+        auto const &hi = m_currentBounds.col(1);
+        for (int tries = 0; tries < MaxTries; tries++) {
+            for (Eigen::Index p = 0; p < sample.rows(); p++) {
+                if (gaussian && std::isfinite(m_sigma[p])) {
+                    int t = 0;
+                    do {
+                        sample[p] = m_mu[p] + m_sigma[p] * rng.normal();
+                    } while ((sample[p] < lo[p] || sample[p] > hi[p]) && ++t < MaxTries);
+                    if (t == MaxTries) {
+                        sample[p] = lo[p] + (hi[p] - lo[p]) * rng.uniform();
+                    }
+                } else if (gaussian) {
+                    sample[p] = m_mu[p];
+                } else {
+                    sample[p] = lo[p] + (hi[p] - lo[p]) * rng.uniform();
+                }
+            }
+            if (m_f.constraint(sample)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Score(int const start, int const n) {
+        if constexpr (requires(Eigen::Ref<Eigen::ArrayXXd const> s, Eigen::Ref<Eigen::ArrayXd> c) {
+                          m_f.costs(s, c);
+                      }) {
+            m_f.costs(m_samples.middleCols(start, n), m_costs.segment(start, n));
+        } else {
+            for (int s = start; s < start + n; s++) {
+                m_costs[s] = m_f(m_samples.col(s));
+            }
+        }
+    }
+
+    int FirstNonFinite() const {
+        int i = 0;
+        while (std::isfinite(m_costs[i])) {
+            i++;
+        }
+        return i;
+    }
 };
 
 } // End namespace QI
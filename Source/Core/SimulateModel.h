@@ -26,7 +26,8 @@ void SimulateModel(json &                                    json,
                    std::string const &                       mask_path,
                    bool const                                verbose,
                    double const                              noise,
-                   std::string const &                       subRegion) {
+                   std::string const &                       subRegion,
+                   bool const                                int16 = false) {
     auto simulator = QI::ModelSimFilter<Model, MultiOutput>::New(model, verbose, subRegion);
     simulator->SetNoise(noise);
     for (auto i = 0; i < Model::NV; i++) {
@@ -64,10 +65,10 @@ void SimulateModel(json &                                    json,
                      model.num_outputs());
         }
         for (size_t i = 0; i < model.num_outputs(); i++) {
-            QI::WriteImage(simulator->GetOutput(i), outpaths[i], verbose);
+            QI::WriteImage(simulator->GetOutput(i), outpaths[i], verbose, int16);
         }
     } else {
-        QI::WriteImage(simulator->GetOutput(0), outpaths[0], verbose);
+        QI::WriteImage(simulator->GetOutput(0), outpaths[0], verbose, int16);
     }
 }
 
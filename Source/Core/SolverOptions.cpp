@@ -0,0 +1,95 @@
+/*
+ *  SolverOptions.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "SolverOptions.h"
+#include "Log.h"
+
+namespace QI {
+
+void SolverOptions::Apply(ceres::Solver::Options &options) const {
+    if (max_iterations)
+        options.max_num_iterations = *max_iterations;
+    if (function_tolerance)
+        options.function_tolerance = *function_tolerance;
+    if (gradient_tolerance)
+        options.gradient_tolerance = *gradient_tolerance;
+    if (parameter_tolerance)
+        options.parameter_tolerance = *parameter_tolerance;
+    if (linear_solver)
+        options.linear_solver_type = *linear_solver;
+    if (trust_region)
+        options.trust_region_strategy_type = *trust_region;
+}
+
+void from_json(json const &j, SolverOptions &s) {
+    for (auto const &item : j.items()) {
+        auto const &key   = item.key();
+        auto const &value = item.value();
+        if (key == "max_iterations") {
+            s.max_iterations = value.get<int>();
+        } else if (key == "function_tolerance") {
+            s.function_tolerance = value.get<double>();
+        } else if (key == "gradient_tolerance") {
+            s.gradient_tolerance = value.get<double>();
+        } else if (key == "parameter_tolerance") {
+            s.parameter_tolerance = value.get<double>();
+        } else if (key == "linear_solver") {
+            ceres::LinearSolverType type;
+            auto const              name = value.get<std::string>();
+            if (!ceres::StringToLinearSolverType(name, &type) ||
+                (type != ceres::DENSE_QR && type != ceres::DENSE_NORMAL_CHOLESKY)) {
+                QI::Fail("Unsupported linear solver {}, use DENSE_QR or DENSE_NORMAL_CHOLESKY",
+                         name);
+            }
+            s.linear_solver = type;
+        } else if (key == "trust_region") {
+            ceres::TrustRegionStrategyType type;
+            auto const                     name = value.get<std::string>();
+            if (!ceres::StringToTrustRegionStrategyType(name, &type)) {
+                QI::Fail("Unknown trust region strategy {}, use LEVENBERG_MARQUARDT or DOGLEG",
+                         name);
+            }
+            s.trust_region = type;
+        } else {
+            QI::Fail("Unknown solver option: {}", key);
+        }
+    }
+}
+
+void to_json(json &j, SolverOptions const &s) {
+    j = json::object();
+    if (s.max_iterations)
+        j["max_iterations"] = *s.max_iterations;
+    if (s.function_tolerance)
+        j["function_tolerance"] = *s.function_tolerance;
+    if (s.gradient_tolerance)
+        j["gradient_tolerance"] = *s.gradient_tolerance;
+    if (s.parameter_tolerance)
+        j["parameter_tolerance"] = *s.parameter_tolerance;
+    if (s.linear_solver)
+        j["linear_solver"] = ceres::LinearSolverTypeToString(*s.linear_solver);
+    if (s.trust_region)
+        j["trust_region"] = ceres::TrustRegionStrategyTypeToString(*s.trust_region);
+}
+
+SolverOptions ReadSolverOptions(json const &input, std::string const &command_line) {
+    json options = input.value("Solver", json::object());
+    if (command_line != "") {
+        try {
+            options.merge_patch(json::parse(command_line));
+        } catch (json::parse_error &e) {
+            QI::Fail("Could not parse solver options {}: {}", command_line, e.what());
+        }
+    }
+    return options.get<SolverOptions>();
+}
+
+} // End namespace QI
@@ -0,0 +1,56 @@
+/*
+ *  SolverOptions.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_SOLVEROPTIONS_H
+#define QI_SOLVEROPTIONS_H
+
+#include "JSON.h"
+#include <ceres/solver.h>
+#include <ceres/types.h>
+#include <optional>
+#include <string>
+
+namespace QI {
+
+/*
+ *  User overrides for the Ceres solver settings. Each fit function keeps its own tuned defaults,
+ *  and Apply() only replaces the settings that were given. Can be read from a "Solver" object in
+ *  the input JSON, e.g.
+ *
+ *  "Solver": { "max_iterations": 50, "function_tolerance": 1e-6,
+ *              "linear_solver": "DENSE_QR", "trust_region": "DOGLEG" }
+ *
+ *  linear_solver can be DENSE_QR or DENSE_NORMAL_CHOLESKY, and trust_region can be
+ *  LEVENBERG_MARQUARDT or DOGLEG.
+ */
+struct SolverOptions {
+    std::optional<int>                            max_iterations;
+    std::optional<double>                         function_tolerance;
+    std::optional<double>                         gradient_tolerance;
+    std::optional<double>                         parameter_tolerance;
+    std::optional<ceres::LinearSolverType>        linear_solver;
+    std::optional<ceres::TrustRegionStrategyType> trust_region;
+
+    void Apply(ceres::Solver::Options &options) const;
+};
+
+void from_json(json const &j, SolverOptions &s);
+void to_json(json &j, SolverOptions const &s);
+
+/*
+ *  Read the "Solver" object from the input JSON (if present), then apply any settings given on the
+ *  command line as a JSON string on top of it.
+ */
+SolverOptions ReadSolverOptions(json const &input, std::string const &command_line);
+
+} // End namespace QI
+
+#endif // QI_SOLVEROPTIONS_H
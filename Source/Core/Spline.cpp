@@ -12,6 +12,7 @@
 #include "Log.h"
 #include "Spline.h"
 
+#include <numeric>
 #include <set>
 
 namespace QI {
@@ -83,4 +84,61 @@ std::ostream &operator<<(std::ostream &ostr, const SplineInterpolator &sp) {
     return ostr;
 }
 
+SplineBasis::SplineBasis(Eigen::ArrayXd const &     x,
+                         const int                  order,
+                         std::vector<size_t> const &indices) {
+    if (x.size() == 0) {
+        QI::Fail("Cannot create a spline with no control points");
+    }
+    m_size = x.size();
+    if (indices.size() > 0) {
+        m_indices = indices;
+    } else {
+        m_indices.resize(x.size());
+        std::iota(m_indices.begin(), m_indices.end(), 0);
+    }
+    Eigen::Index const n = m_indices.size();
+    Eigen::ArrayXd     sx(n);
+    std::transform(m_indices.begin(), m_indices.end(), &sx[0], [&](std::size_t i) { return x[i]; });
+    m_min                        = sx[0];
+    m_width                      = sx[n - 1] - m_min;
+    const Eigen::ArrayXd scaledx = (sx - m_min) / m_width;
+    m_degree                     = std::min<int>(n - 1, order);
+
+    // Same system as Eigen::SplineFitting::Interpolate, but solved for all data at once
+    Eigen::KnotAveraging(scaledx.transpose().eval(), m_degree, m_knots);
+    Eigen::MatrixXd A = Eigen::MatrixXd::Zero(n, n);
+    for (Eigen::Index i = 1; i < n - 1; ++i) {
+        auto const span = TSpline::Span(scaledx[i], m_degree, m_knots);
+        A.row(i).segment(span - m_degree, m_degree + 1) =
+            TSpline::BasisFunctions(scaledx[i], m_degree, m_knots);
+    }
+    A(0, 0)         = 1.0;
+    A(n - 1, n - 1) = 1.0;
+    m_control       = A.householderQr().solve(Eigen::MatrixXd::Identity(n, n));
+}
+
+Eigen::MatrixXd SplineBasis::weights(Eigen::ArrayXd const &x) const {
+    Eigen::MatrixXd sorted(x.rows(), m_indices.size());
+    for (Eigen::Index i = 0; i < x.rows(); i++) {
+        const double sx    = (x[i] - m_min) / m_width;
+        auto const   span  = TSpline::Span(sx, m_degree, m_knots);
+        auto const   basis = TSpline::BasisFunctions(sx, m_degree, m_knots);
+        sorted.row(i)      = basis.matrix() * m_control.middleRows(span - m_degree, m_degree + 1);
+    }
+    // Scatter back to the original order of the data, unused (duplicate) points get zero weight
+    Eigen::MatrixXd W = Eigen::MatrixXd::Zero(x.rows(), m_size);
+    for (size_t j = 0; j < m_indices.size(); j++) {
+        W.col(m_indices[j]) = sorted.col(j);
+    }
+    return W;
+}
+
+double SplineBasis::operator()(Eigen::VectorXd const &coeffs, const double &x) const {
+    const double sx    = (x - m_min) / m_width;
+    auto const   span  = TSpline::Span(sx, m_degree, m_knots);
+    auto const   basis = TSpline::BasisFunctions(sx, m_degree, m_knots);
+    return basis.matrix().transpose().dot(coeffs.segment(span - m_degree, m_degree + 1));
+}
+
 } // End namespace QI
\ No newline at end of file
@@ -44,6 +44,43 @@ class SplineInterpolator {
 
 std::ostream &operator<<(std::ostream &ostr, const SplineInterpolator &sp);
 
+/*
+ * Interpolating splines are linear in the data, so when many datasets share the same sample
+ * positions (e.g. every voxel of a Z-spectrum) the spline system can be solved once. Each dataset
+ * then only needs a matrix-vector product. Data is passed in its original order, the indices (as
+ * from SortedUniqueIndices) are only applied internally.
+ */
+class SplineBasis {
+  public:
+    typedef Eigen::Spline<double, 1> TSpline;
+
+    SplineBasis(Eigen::ArrayXd const &     x,
+                const int                  order   = 3,
+                std::vector<size_t> const &indices = std::vector<size_t>());
+
+    // Matrix mapping data to interpolated values at fixed positions
+    Eigen::MatrixXd weights(Eigen::ArrayXd const &x) const;
+    // Spline coefficients for one dataset, for when the positions change between datasets
+    template <typename Derived>
+    Eigen::VectorXd coefficients(Eigen::DenseBase<Derived> const &y) const {
+        Eigen::VectorXd sy(m_indices.size());
+        for (size_t i = 0; i < m_indices.size(); i++) {
+            sy[i] = y[m_indices[i]];
+        }
+        return m_control * sy;
+    }
+    double operator()(Eigen::VectorXd const &coeffs, const double &x) const;
+
+  protected:
+    Eigen::Index            m_size;
+    std::vector<size_t>     m_indices;
+    Eigen::MatrixXd         m_control; // Data to control points
+    TSpline::KnotVectorType m_knots;
+    int                     m_degree;
+    double                  m_min;
+    double                  m_width;
+};
+
 } // End namespace QI
 
 #endif // QI_SPLINE_H
\ No newline at end of file
@@ -74,6 +74,16 @@ const std::string &OutExt() {
     return ext;
 }
 
+/*
+ * Setting QUIT_SCHEDULE=region makes ModelFitFilter split each slab into fixed pieces, one per
+ * thread, instead of handing out chunks of voxels on demand. It is only there to compare the two.
+ */
+bool UseRegionScheduling() {
+    static const char *env_schedule = getenv("QUIT_SCHEDULE");
+    static bool const  region       = env_schedule && std::string(env_schedule) == "region";
+    return region;
+}
+
 std::string StripExt(const std::string &filename) {
     std::size_t dot = filename.find_last_of(".");
     if (dot != std::string::npos) {
@@ -45,6 +45,7 @@ namespace QI {
 int GetDefaultThreads(); //!< Return the number of threads in the $QUIT_THREADS environment variable
 const std::string &GetVersion(); //!< Return the version of the QI library
 const std::string &OutExt();     //!< Return the extension stored in $QUIT_EXT
+bool UseRegionScheduling();      //!< True if $QUIT_SCHEDULE is "region"
 
 std::string StripExt(const std::string &filename); //!< Remove the extension from a filename
 std::string GetExt(const std::string &filename);   //!< Return the extension from a filename with .
@@ -0,0 +1,142 @@
+/*
+ *  qi_io_bench.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <chrono>
+#include <complex>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "itkImageRegionConstIterator.h"
+#include "itkVariableLengthVector.h"
+
+#include "Args.h"
+#include "BGZF.h"
+#include "ImageIO.h"
+#include "NiftiBuffer.h"
+#include "Util.h"
+
+namespace {
+// Current and peak resident set size in MB, from /proc. Zero where that is not available.
+std::pair<double, double> ResidentMB() {
+    std::ifstream status("/proc/self/status");
+    std::string   line;
+    double        rss = 0, peak = 0;
+    while (std::getline(status, line)) {
+        std::istringstream fields(line);
+        std::string        name;
+        double             kb;
+        fields >> name >> kb;
+        if (name == "VmRSS:") {
+            rss = kb / 1024.;
+        } else if (name == "VmHWM:") {
+            peak = kb / 1024.;
+        }
+    }
+    return {rss, peak};
+}
+
+template <typename T> double Magnitude(T const &v) {
+    return std::abs(v);
+}
+template <typename T> double Magnitude(itk::VariableLengthVector<T> const &v) {
+    return v.GetNorm();
+}
+} // namespace
+
+int io_bench_main(args::Subparser &parser) {
+    args::Positional<std::string> in_path(parser, "INPUT", "Input image");
+    args::ValueFlag<std::string>  subregion(
+        parser,
+        "SUBREGION",
+        "Only touch voxels in a block from I,J,K with size SI,SJ,SK",
+        {'s', "subregion"});
+    args::Flag vector(parser, "VECTOR", "Read the input as a 4D vector image", {"vector"});
+    args::ValueFlag<std::string> out_path(
+        parser,
+        "OUTPUT",
+        "Also time writing the image to OUTPUT and reading it back. For .nii.gz, compare ITK's "
+        "gzip with block gzip",
+        {'o', "out"});
+    parser.Parse();
+
+    using clock = std::chrono::steady_clock;
+    auto const seconds = [](clock::time_point const &a, clock::time_point const &b) {
+        return std::chrono::duration<double>(b - a).count();
+    };
+
+    /*
+     * Time-to-first-voxel is the time to read the image and fetch the first voxel of the region.
+     * Touching the region then reads every voxel in it once, which is all a fit of that region
+     * needs. Run with and without QUIT_MMAP set to compare the two input paths.
+     *
+     * Throughput is the uncompressed size of the voxel data over the time taken.
+     */
+    auto const bench = [&]<typename TImg>() {
+        auto const start  = clock::now();
+        auto const img    = QI::ReadImage<TImg>(QI::CheckPos(in_path), verbose);
+        auto       region = img->GetLargestPossibleRegion();
+        if (subregion) {
+            region = QI::RegionFromString<typename TImg::RegionType>(subregion.Get());
+            if (!img->GetLargestPossibleRegion().IsInside(region)) {
+                QI::Fail("Subregion is not inside the image");
+            }
+        }
+        itk::ImageRegionConstIterator<TImg> it(img, region);
+        double                              sum   = Magnitude(it.Get());
+        auto const                          first = clock::now();
+
+        auto const [first_rss, first_peak] = ResidentMB();
+        for (; !it.IsAtEnd(); ++it) {
+            sum += Magnitude(it.Get());
+        }
+        auto const touched                 = clock::now();
+        auto const [touch_rss, touch_peak] = ResidentMB();
+        fmt::print("Input:               {}\n", in_path.Get());
+        fmt::print("Memory-mapped:       {}\n", QI::UseMappedInput() ? "allowed" : "off");
+        fmt::print("Region voxels:       {}\n", region.GetNumberOfPixels());
+        fmt::print("Time to first voxel: {:.4f} s\n", seconds(start, first));
+        fmt::print("Time to touch all:   {:.4f} s\n", seconds(start, touched));
+        fmt::print("RSS at first voxel:  {:.1f} MB (peak {:.1f} MB)\n", first_rss, first_peak);
+        fmt::print("RSS after touching:  {:.1f} MB (peak {:.1f} MB)\n", touch_rss, touch_peak);
+        QI::Log(verbose, "Checksum: {}", sum);
+
+        if (out_path) {
+            double const mb = img->GetPixelContainer()->Size() *
+                              sizeof(typename TImg::InternalPixelType) / (1024. * 1024.);
+            std::vector<bool> modes{QI::UseParallelGzip()};
+            if (out_path.Get().ends_with(".nii.gz")) {
+                modes = {false, true};
+            }
+            for (bool const parallel : modes) {
+                QI::SetParallelGzip(parallel);
+                auto const write_start = clock::now();
+                QI::WriteImage(img, out_path.Get(), verbose);
+                auto const written   = clock::now();
+                auto const read_back = QI::ReadImage<TImg>(out_path.Get(), verbose);
+                auto const read      = clock::now();
+                fmt::print("{:<21}{:.1f} MB on disk, write {:.1f} MB/s, read {:.1f} MB/s\n",
+                           parallel ? "Block gzip:" : "ITK:",
+                           std::filesystem::file_size(out_path.Get()) / (1024. * 1024.),
+                           mb / seconds(write_start, written),
+                           mb / seconds(written, read));
+            }
+        }
+    };
+    if (vector) {
+        bench.operator()<QI::VectorVolumeF>();
+    } else {
+        bench.operator()<QI::VolumeF>();
+    }
+    return EXIT_SUCCESS;
+}
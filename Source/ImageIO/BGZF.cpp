@@ -0,0 +1,247 @@
+/*
+ *  BGZF.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "BGZF.h"
+#include "Log.h"
+#include "itkMultiThreaderBase.h"
+#include "itk_zlib.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+
+namespace QI {
+
+namespace {
+std::optional<bool> parallel_gzip;
+
+size_t constexpr BlockData  = 0xff00; // Leaves room for incompressible data in a 64 KB block
+size_t constexpr BatchSize  = 256;    // Blocks compressed at once, about 16 MB
+size_t constexpr HeaderSize = 18;
+size_t constexpr FooterSize = 8;
+
+// Gzip header with a 6 byte extra field holding the 'BC' subfield, followed by the block size
+unsigned char constexpr Header[16] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0};
+// An empty block, which BGZF readers use to detect a truncated file
+unsigned char constexpr EndOfFile[28] = {31, 139, 8, 4, 0, 0,  0,   0, 0, 255, 6, 0, 66, 67,
+                                         2,  0,   27, 0, 3, 0, 0, 0, 0, 0,   0, 0, 0,  0};
+
+uint32_t GetLE(char const *p, int const bytes) {
+    uint32_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        v = (v << 8) | static_cast<unsigned char>(p[i]);
+    }
+    return v;
+}
+
+// True if p starts with a BGZF block header. The time, extra flags and OS are ignored.
+bool IsBlockHeader(char const *p) {
+    for (int const i : {0, 1, 2, 3, 10, 11, 12, 13, 14, 15}) {
+        if (static_cast<unsigned char>(p[i]) != Header[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void PutLE(std::vector<char> &v, uint32_t x, int const bytes) {
+    for (int i = 0; i < bytes; i++) {
+        v.push_back(static_cast<char>(x & 0xff));
+        x >>= 8;
+    }
+}
+
+std::vector<char> CompressBlock(char const *data, size_t const n) {
+    z_stream z{};
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return {};
+    }
+    std::vector<char> block(HeaderSize + deflateBound(&z, n) + FooterSize);
+    std::copy(std::begin(Header), std::end(Header), block.begin());
+    z.next_in   = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    z.avail_in  = n;
+    z.next_out  = reinterpret_cast<Bytef *>(block.data() + HeaderSize);
+    z.avail_out = block.size() - HeaderSize - FooterSize;
+    int const result = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+    if (result != Z_STREAM_END) {
+        return {};
+    }
+    size_t const total = HeaderSize + z.total_out + FooterSize;
+    block.resize(HeaderSize + z.total_out);
+    PutLE(block, crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<Bytef const *>(data), n), 4);
+    PutLE(block, n, 4);
+    block[16] = static_cast<char>((total - 1) & 0xff);
+    block[17] = static_cast<char>((total - 1) >> 8);
+    return block;
+}
+} // namespace
+
+bool UseParallelGzip() {
+    static const char *env_bgzf = getenv("QUIT_BGZF");
+    if (parallel_gzip) {
+        return *parallel_gzip;
+    }
+    return !(env_bgzf && std::string(env_bgzf) == "0");
+}
+
+void SetParallelGzip(bool const on) {
+    parallel_gzip = on;
+}
+
+void CompressFile(std::string const &src, std::string const &dst) {
+    std::ifstream in(src, std::ios::binary);
+    std::ofstream out(dst, std::ios::binary);
+    if (!in || !out) {
+        throw std::runtime_error(fmt::format("Could not compress {} to {}", src, dst));
+    }
+    std::vector<char>              raw(BlockData * BatchSize);
+    std::vector<std::vector<char>> packed(BatchSize);
+    auto                           mt = itk::MultiThreaderBase::New();
+    while (in) {
+        in.read(raw.data(), raw.size());
+        size_t const n = in.gcount();
+        if (n == 0) {
+            break;
+        }
+        size_t const nblocks = (n + BlockData - 1) / BlockData;
+        mt->ParallelizeArray(
+            0,
+            nblocks,
+            [&](itk::SizeValueType const b) {
+                packed[b] = CompressBlock(raw.data() + b * BlockData,
+                                          std::min(BlockData, n - b * BlockData));
+            },
+            nullptr);
+        for (size_t b = 0; b < nblocks; b++) {
+            if (packed[b].empty()) {
+                throw std::runtime_error(fmt::format("Compression failed writing {}", dst));
+            }
+            out.write(packed[b].data(), packed[b].size());
+        }
+    }
+    out.write(reinterpret_cast<char const *>(EndOfFile), sizeof(EndOfFile));
+    if (!out) {
+        throw std::runtime_error(fmt::format("Could not write {}", dst));
+    }
+}
+
+void WriteCompressed(std::string const &                               path,
+                     std::function<void(std::string const &)> const &write,
+                     bool const                                       edit) {
+    if (!(UseParallelGzip() || edit) || !path.ends_with(".nii.gz")) {
+        write(path);
+        return;
+    }
+    std::string const tmp = fmt::format("{}.{}.tmp.nii",
+                                        path.substr(0, path.size() - 7),
+                                        std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    try {
+        write(tmp);
+        CompressFile(tmp, path);
+    } catch (...) {
+        std::filesystem::remove(tmp);
+        throw;
+    }
+    std::filesystem::remove(tmp);
+}
+
+BGZFReader::BGZFReader(std::string const &path) : m_path(path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return;
+    }
+    size_t const file_size = file.tellg();
+    // Only the block headers and sizes are read here. Every block must carry its size in a BC
+    // subfield at the start of the extra field, so ordinary gzip is rejected after 18 bytes.
+    std::vector<Block> blocks;
+    size_t             total = 0;
+    char               header[HeaderSize], isize[4];
+    for (size_t pos = 0; pos < file_size;) {
+        if (file_size - pos < HeaderSize + FooterSize || !file.seekg(pos) ||
+            !file.read(header, HeaderSize) || !IsBlockHeader(header)) {
+            return;
+        }
+        size_t const bsize = GetLE(header + 16, 2) + 1;
+        if (bsize < HeaderSize + FooterSize || bsize > file_size - pos ||
+            !file.seekg(pos + bsize - 4) || !file.read(isize, 4)) {
+            return;
+        }
+        size_t const out_length = GetLE(isize, 4);
+        blocks.push_back({pos + HeaderSize, bsize - HeaderSize - FooterSize, total, out_length});
+        total += out_length;
+        pos += bsize;
+    }
+    m_blocks = std::move(blocks);
+    m_size   = total;
+}
+
+bool BGZFReader::inflate_block(Block const &b, char const *in, char *out) {
+    z_stream z{};
+    if (inflateInit2(&z, -15) != Z_OK) {
+        return false;
+    }
+    z.next_in        = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+    z.avail_in       = b.length;
+    z.next_out       = reinterpret_cast<Bytef *>(out);
+    z.avail_out      = b.out_length;
+    int const result = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    uint32_t const crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<Bytef *>(out), b.out_length);
+    return result == Z_STREAM_END && z.total_out == b.out_length && crc == GetLE(in + b.length, 4);
+}
+
+std::vector<char> BGZFReader::head() const {
+    for (auto const &b : m_blocks) {
+        if (b.out_length > 0) {
+            std::ifstream     file(m_path, std::ios::binary);
+            std::vector<char> in(b.length + FooterSize), out(b.out_length);
+            if (!file.seekg(b.offset) || !file.read(in.data(), in.size()) ||
+                !inflate_block(b, in.data(), out.data())) {
+                QI::Fail("Corrupt compressed block in image file");
+            }
+            return out;
+        }
+    }
+    return {};
+}
+
+void BGZFReader::read(char *out) const {
+    std::ifstream     file(m_path, std::ios::binary | std::ios::ate);
+    std::vector<char> data(file ? static_cast<size_t>(file.tellg()) : 0);
+    if (!file.seekg(0) || !file.read(data.data(), data.size())) {
+        QI::Fail("Could not read compressed image file {}", m_path);
+    }
+    std::atomic<bool> ok = true;
+    auto              mt = itk::MultiThreaderBase::New();
+    mt->ParallelizeArray(
+        0,
+        m_blocks.size(),
+        [&](itk::SizeValueType const i) {
+            auto const &b = m_blocks[i];
+            if (!inflate_block(b, data.data() + b.offset, out + b.out_offset)) {
+                ok = false;
+            }
+        },
+        nullptr);
+    // QI::Fail exits, so only call it once the workers are finished
+    if (!ok) {
+        QI::Fail("Corrupt compressed block in image file");
+    }
+}
+
+} // namespace QI
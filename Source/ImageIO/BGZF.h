@@ -0,0 +1,71 @@
+/*
+ *  BGZF.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_BGZF_H
+#define QUIT_BGZF_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace QI {
+
+/*
+ *  Blocked gzip, as used by BAM/htslib. The file is a series of independent gzip members, each
+ *  holding at most 64 KB of data and recording its own compressed size in an extra field. Any
+ *  gzip reader can decompress it, but the blocks can also be compressed and decompressed in
+ *  parallel.
+ */
+bool UseParallelGzip();              //!< False if $QUIT_BGZF is 0, otherwise true
+void SetParallelGzip(bool const on); //!< Override $QUIT_BGZF, e.g. for benchmarks
+
+// Compresses the file at src to a BGZF file at dst, a batch of blocks at a time
+void CompressFile(std::string const &src, std::string const &dst);
+
+/*
+ *  Calls write(path), unless path ends in .nii.gz and parallel compression is on. Then write()
+ *  is given a temporary .nii path, and the file it writes is compressed to path and removed.
+ *  Writers that edit the file after ITK has written it set edit, so they always get an
+ *  uncompressed file. A .nii.gz is then block-gzipped even if $QUIT_BGZF is 0.
+ *
+ *  ITK can only write to a file, so this costs an extra uncompressed write and read of the image
+ *  next to the output. That is usually in the page cache and cheap next to the compression, but
+ *  needs the free disk space.
+ */
+void WriteCompressed(std::string const &                               path,
+                     std::function<void(std::string const &)> const &write,
+                     bool const                                       edit = false);
+
+/*
+ *  The constructor only reads the header and size of each block, so checking whether a file is
+ *  BGZF, and what it holds with head(), is cheap. read() loads and decompresses the whole file.
+ */
+class BGZFReader {
+  public:
+    explicit BGZFReader(std::string const &path); //!< valid() is false if not a BGZF file
+    bool              valid() const { return !m_blocks.empty(); }
+    size_t            size() const { return m_size; } //!< Total uncompressed bytes
+    std::vector<char> head() const;                   //!< Only the first block
+    void              read(char *out) const;          //!< All blocks, spread over threads
+
+  private:
+    struct Block {
+        size_t offset, length, out_offset, out_length;
+    };
+    static bool        inflate_block(Block const &b, char const *in, char *out);
+    std::string        m_path;
+    std::vector<Block> m_blocks;
+    size_t             m_size = 0;
+};
+
+} // namespace QI
+
+#endif // QUIT_BGZF_H
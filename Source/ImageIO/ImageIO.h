@@ -14,6 +14,7 @@
 
 #include "ImageTypes.h"
 #include <string>
+#include <type_traits>
 
 namespace QI {
 
@@ -31,6 +32,34 @@ template <typename TImg>
 extern void
 WriteImage(const itk::SmartPointer<TImg> &ptr, const std::string &path, const bool verbose);
 
+/*
+ *  Writes a float image as 16-bit integers spanning its range, with scl_slope and scl_inter set so
+ *  that it reads back as float. Half the size of float32, and each value is within 1/65534 of the
+ *  range of the image. NIfTI outputs only, anything else is written as float.
+ */
+template <typename TImg>
+extern void WriteInt16Image(const TImg *ptr, const std::string &path, const bool verbose);
+
+// Uses WriteInt16Image for real float images if int16 is set, otherwise WriteImage
+template <typename TImg>
+void WriteImage(const TImg *ptr, const std::string &path, const bool verbose, const bool int16) {
+    if constexpr (std::is_same_v<typename TImg::InternalPixelType, float>) {
+        if (int16) {
+            WriteInt16Image(ptr, path, verbose);
+            return;
+        }
+    }
+    WriteImage(ptr, path, verbose);
+}
+
+template <typename TImg>
+void WriteImage(const itk::SmartPointer<TImg> &ptr,
+                const std::string &            path,
+                const bool                     verbose,
+                const bool                     int16) {
+    WriteImage<TImg>(ptr.GetPointer(), path, verbose, int16);
+}
+
 template <typename TImg>
 extern void WriteMagnitudeImage(const TImg *ptr, const std::string &path, const bool verbose);
 
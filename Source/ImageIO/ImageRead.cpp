@@ -11,17 +11,58 @@
 
 #ifndef QUIT_IMAGEIO_H
 
+#include <memory>
 #include <string>
 
 #include "ImageIO.h"
 #include "Log.h"
+#include "NiftiBuffer.h"
+#include "VectorIO.h"
 #include "itkComplexToModulusImageFilter.h"
 #include "itkImageFileReader.h"
+#include "itkImageIOFactory.h"
 
 namespace QI {
 
+/*
+ *  Wraps a NiftiBuffer as an image without copying, if the file holds exactly the pixel type and
+ *  number of voxels the image needs. Returns nullptr otherwise. Compressed files are only
+ *  decompressed once both have been checked.
+ */
+template <typename TImg>
+auto MapImage(std::shared_ptr<NiftiBuffer> const &mapped, const std::string &path) ->
+    typename TImg::Pointer {
+    using TPixel = typename TImg::PixelType;
+    if (mapped->component_type() != ComponentOf<TPixel>() ||
+        mapped->components() != (IsComplex<TPixel>::value ? 2 : 1)) {
+        return nullptr;
+    }
+    auto io = itk::ImageIOFactory::CreateImageIO(path.c_str(), itk::ImageIOFactory::ReadMode);
+    if (!io) {
+        return nullptr;
+    }
+    io->SetFileName(path);
+    io->ReadImageInformation();
+    typename TImg::Pointer img = TImg::New();
+    SetImageInformation(io.GetPointer(), img.GetPointer());
+    if (img->GetBufferedRegion().GetNumberOfPixels() != mapped->voxels()) {
+        return nullptr;
+    }
+    mapped->Load();
+    auto container = NiftiImageContainer<TPixel>::New();
+    container->SetMapping(mapped);
+    img->SetPixelContainer(container);
+    return img;
+}
+
 template <typename TImg>
 auto ReadImage(const std::string &path, const bool verbose) -> typename TImg::Pointer {
+    if (auto const mapped = NiftiBuffer::Open(path)) {
+        if (typename TImg::Pointer img = MapImage<TImg>(mapped, path)) {
+            QI::Log(verbose, "Reading image directly: {}", path);
+            return img;
+        }
+    }
     typedef itk::ImageFileReader<TImg> TReader;
     typename TReader::Pointer          file = TReader::New();
     file->SetFileName(path);
@@ -15,8 +15,11 @@
 #include "itkDivideImageFilter.h"
 #include "itkImageFileWriter.h"
 
+#include "BGZF.h"
 #include "ImageIO.h"
 #include "Log.h"
+#include "NiftiBuffer.h"
+#include "VectorIO.h"
 
 namespace QI {
 
@@ -24,10 +27,12 @@ template <typename TImg>
 void WriteImage(const TImg *ptr, const std::string &path, const bool verbose) {
     typedef itk::ImageFileWriter<TImg> TWriter;
     typename TWriter::Pointer          file = TWriter::New();
-    file->SetFileName(path);
     file->SetInput(ptr);
     QI::Log(verbose, "Writing image: {}", path);
-    file->Update();
+    WriteCompressed(path, [&](std::string const &p) {
+        file->SetFileName(p);
+        file->Update();
+    });
 }
 
 template <typename TImg>
@@ -35,6 +40,43 @@ void WriteImage(const itk::SmartPointer<TImg> &ptr, const std::string &path, con
     WriteImage<TImg>(ptr.GetPointer(), path, verbose);
 }
 
+template <typename TImg>
+void WriteInt16Image(const TImg *img, const std::string &path, const bool verbose) {
+    if (!path.ends_with(".nii") && !path.ends_with(".nii.gz")) {
+        QI::Warn("Scaled int16 needs NIfTI output, writing {} as float", path);
+        WriteImage(img, path, verbose);
+        return;
+    }
+    using TShort             = itk::Image<short, TImg::ImageDimension>;
+    size_t const       n     = img->GetBufferedRegion().GetNumberOfPixels();
+    float const *const in    = img->GetBufferPointer();
+    Int16Scaling const scale(in, n);
+    scale.Report(path);
+    auto               shorts = TShort::New();
+    shorts->SetRegions(img->GetBufferedRegion());
+    shorts->SetSpacing(img->GetSpacing());
+    shorts->SetOrigin(img->GetOrigin());
+    shorts->SetDirection(img->GetDirection());
+    shorts->Allocate();
+    short *const out = shorts->GetBufferPointer();
+    ForVoxelBlocks(n, [&](size_t const first, size_t const last) {
+        for (size_t i = first; i < last; i++) {
+            out[i] = scale(in[i]);
+        }
+    });
+    auto file = itk::ImageFileWriter<TShort>::New();
+    file->SetInput(shorts);
+    QI::Log(verbose, "Writing image: {} (int16, slope {:g})", path, scale.slope);
+    WriteCompressed(
+        path,
+        [&](std::string const &p) {
+            file->SetFileName(p);
+            file->Update();
+            SetNiftiScaling(p, scale.slope, scale.inter);
+        },
+        true);
+}
+
 template <typename TImg>
 void WriteMagnitudeImage(const TImg *ptr, const std::string &path, const bool verbose) {
     typedef typename TImg::PixelType::value_type    TReal;
@@ -96,6 +138,10 @@ template void WriteImage<SeriesXF>(const itk::SmartPointer<SeriesXF> &ptr, const
                                    const bool verbose);
 template void WriteImage<SeriesXD>(const itk::SmartPointer<SeriesXD> &ptr, const std::string &path,
                                    const bool verbose);
+template void WriteInt16Image<VolumeF>(const VolumeF *ptr, const std::string &path,
+                                       const bool verbose);
+template void WriteInt16Image<SeriesF>(const SeriesF *ptr, const std::string &path,
+                                       const bool verbose);
 template void WriteScaledImage<VolumeF>(const VolumeF *img, const VolumeF *simg,
                                         const std::string &path, const bool verbose);
 template void WriteScaledImage<VolumeF>(const itk::SmartPointer<VolumeF> &ptr,
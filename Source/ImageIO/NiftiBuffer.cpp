@@ -0,0 +1,225 @@
+/*
+ *  NiftiBuffer.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "NiftiBuffer.h"
+#include "BGZF.h"
+#include "Log.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define QI_HAVE_MMAP
+#endif
+
+namespace QI {
+
+bool UseMappedInput() {
+    static const char *env_mmap = getenv("QUIT_MMAP");
+    return env_mmap && std::string(env_mmap) != "0";
+}
+
+namespace {
+// Reads a field at a byte offset in the 348 byte NIfTI-1 header
+template <typename T> T HeaderField(char const *hdr, size_t const offset) {
+    T value;
+    std::memcpy(&value, hdr + offset, sizeof(T));
+    return value;
+}
+
+// NIfTI datatype codes that can be used as-is, with their component type and count
+bool NiftiType(int16_t const code, itk::ImageIOBase::IOComponentType &type, unsigned &n) {
+    n = 1;
+    switch (code) {
+    case 2:
+        type = itk::ImageIOBase::UCHAR;
+        return true;
+    case 256:
+        type = itk::ImageIOBase::CHAR;
+        return true;
+    case 4:
+        type = itk::ImageIOBase::SHORT;
+        return true;
+    case 512:
+        type = itk::ImageIOBase::USHORT;
+        return true;
+    case 8:
+        type = itk::ImageIOBase::INT;
+        return true;
+    case 768:
+        type = itk::ImageIOBase::UINT;
+        return true;
+    case 1024:
+        type = itk::ImageIOBase::LONGLONG;
+        return true;
+    case 1280:
+        type = itk::ImageIOBase::ULONGLONG;
+        return true;
+    case 16:
+        type = itk::ImageIOBase::FLOAT;
+        return true;
+    case 64:
+        type = itk::ImageIOBase::DOUBLE;
+        return true;
+    case 32:
+        type = itk::ImageIOBase::FLOAT;
+        n    = 2;
+        return true;
+    case 1792:
+        type = itk::ImageIOBase::DOUBLE;
+        n    = 2;
+        return true;
+    default:
+        return false;
+    }
+}
+} // namespace
+
+void SetNiftiScaling(std::string const &path, float const slope, float const inter) {
+    char         hdr[348];
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!file.read(hdr, sizeof(hdr)) || HeaderField<int32_t>(hdr, 0) != 348) {
+        throw std::runtime_error(
+            fmt::format("Can only set intensity scaling in a NIfTI-1 file, not {}", path));
+    }
+    file.seekp(112);
+    file.write(reinterpret_cast<char const *>(&slope), sizeof(float));
+    file.write(reinterpret_cast<char const *>(&inter), sizeof(float));
+    if (!file) {
+        throw std::runtime_error(fmt::format("Could not write intensity scaling to {}", path));
+    }
+}
+
+// Fills in the type and size from the header, and the offset and length of the voxel data
+bool NiftiBuffer::parse_header(char const *hdr, size_t &offset, size_t &bytes) {
+    if (HeaderField<int32_t>(hdr, 0) != 348 || std::memcmp(hdr + 344, "n+1", 4) != 0) {
+        return false; // Byte-swapped, NIfTI-2 or not a single-file NIfTI
+    }
+    if (!NiftiType(HeaderField<int16_t>(hdr, 70), m_type, m_components)) {
+        return false;
+    }
+    float const slope = HeaderField<float>(hdr, 112);
+    float const inter = HeaderField<float>(hdr, 116);
+    if ((slope != 0.f && slope != 1.f) || inter != 0.f) {
+        return false; // ITK would rescale these to float
+    }
+    int16_t const ndim = HeaderField<int16_t>(hdr, 40);
+    if (ndim < 1 || ndim > 7) {
+        return false;
+    }
+    m_voxels = 1;
+    for (int i = 1; i <= ndim; i++) {
+        m_voxels *= std::max<int16_t>(HeaderField<int16_t>(hdr, 40 + 2 * i), 1);
+    }
+    offset             = static_cast<size_t>(HeaderField<float>(hdr, 108));
+    size_t const voxel = HeaderField<int16_t>(hdr, 72) / 8; // bitpix
+    bytes              = m_voxels * voxel;
+    return voxel != 0 && offset % (voxel / m_components) == 0;
+}
+
+std::shared_ptr<NiftiBuffer> NiftiBuffer::Open(std::string const &path) {
+    std::shared_ptr<NiftiBuffer> m(new NiftiBuffer);
+    size_t                       offset, bytes;
+    if (path.ends_with(".nii.gz") && UseParallelGzip()) {
+        auto reader = std::make_unique<BGZFReader>(path);
+        if (!reader->valid()) {
+            return nullptr; // Written by something else, leave it to ITK's zlib stream
+        }
+        auto const hdr = reader->head();
+        if (hdr.size() < 348 || !m->parse_header(hdr.data(), offset, bytes) ||
+            reader->size() < offset + bytes) {
+            return nullptr;
+        }
+        m->m_reader = std::move(reader);
+        m->m_offset = offset;
+        return m;
+    }
+#ifdef QI_HAVE_MMAP
+    if (!UseMappedInput() || !path.ends_with(".nii")) {
+        return nullptr;
+    }
+    char          hdr[348];
+    std::ifstream file(path, std::ios::binary);
+    if (!file.read(hdr, sizeof(hdr))) {
+        return nullptr;
+    }
+    file.close();
+    if (!m->parse_header(hdr, offset, bytes)) {
+        return nullptr;
+    }
+
+    int const fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < offset + bytes) {
+        close(fd);
+        return nullptr;
+    }
+    m->m_size = st.st_size;
+    m->m_map  = mmap(nullptr, m->m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m->m_map == MAP_FAILED) {
+        m->m_map = nullptr;
+        return nullptr;
+    }
+    m->m_data = static_cast<char *>(m->m_map) + offset;
+    return m;
+#else
+    return nullptr;
+#endif
+}
+
+void NiftiBuffer::Load() {
+    if (m_reader) {
+        m_buffer = std::make_unique<char[]>(m_reader->size());
+        m_reader->read(m_buffer.get());
+        m_data = m_buffer.get() + m_offset;
+        m_reader.reset();
+    }
+}
+
+NiftiBuffer::~NiftiBuffer() {
+#ifdef QI_HAVE_MMAP
+    if (m_map) {
+        munmap(m_map, m_size);
+    }
+#endif
+}
+
+void NiftiBuffer::Release(size_t const first, size_t const length) const {
+#ifdef QI_HAVE_MMAP
+    if (!m_map) {
+        return; // Decompressed data has nowhere to be re-read from
+    }
+    // Only whole pages inside the range can be dropped
+    size_t const page  = sysconf(_SC_PAGESIZE);
+    size_t const start = static_cast<char *>(m_data) - static_cast<char *>(m_map) + first;
+    size_t const begin = (start + page - 1) / page * page;
+    size_t const end   = (start + length) / page * page;
+    if (end > begin) {
+        madvise(static_cast<char *>(m_map) + begin, end - begin, MADV_DONTNEED);
+    }
+#else
+    (void)first;
+    (void)length;
+#endif
+}
+
+} // namespace QI
@@ -0,0 +1,106 @@
+/*
+ *  NiftiBuffer.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_NIFTIBUFFER_H
+#define QUIT_NIFTIBUFFER_H
+
+#include "BGZF.h"
+#include "itkImageIOBase.h"
+#include "itkImportImageContainer.h"
+#include <memory>
+#include <string>
+
+namespace QI {
+
+bool UseMappedInput(); //!< True if the environment variable QUIT_MMAP is set to anything but 0
+
+// Sets scl_slope and scl_inter in the header of an uncompressed, native-endian NIfTI-1 file
+void SetNiftiScaling(std::string const &path, float const slope, float const inter);
+
+/*
+ *  The voxel data of a native-endian NIfTI-1 file, without going through an itk::ImageIO.
+ *
+ *  Uncompressed files are memory-mapped copy-on-write when QUIT_MMAP is set. Pages are read from
+ *  disk the first time they are touched, so a command that only visits a subregion or a sparse
+ *  mask only pays for those pages. Writes to the mapped image go to private copies and never
+ *  reach the file.
+ *
+ *  Block-gzipped .nii.gz files (see BGZF.h) are decompressed on all threads into an owned buffer
+ *  by Load(). Open() only reads the header, so callers can check the type and size first.
+ *
+ *  Open() returns nullptr for anything it cannot use unchanged (ordinary gzip or two-file images,
+ *  byte-swapped headers, intensity scaling, RGB types), and the caller reads the file through
+ *  ITK instead. The header geometry always comes from ITK.
+ */
+class NiftiBuffer {
+  public:
+    static std::shared_ptr<NiftiBuffer> Open(std::string const &path);
+    ~NiftiBuffer();
+    NiftiBuffer(NiftiBuffer const &) = delete;
+    NiftiBuffer &operator=(NiftiBuffer const &) = delete;
+
+    itk::ImageIOBase::IOComponentType component_type() const { return m_type; }
+    unsigned                          components() const { return m_components; } // 2 if complex
+    size_t                            voxels() const { return m_voxels; }
+    void *                            data() const { return m_data; } // Only after Load()
+
+    // Decompresses a block-gzipped file. Does nothing for a mapped file.
+    void Load();
+
+    // Returns the pages holding bytes [first, first + length) of the voxel data to the kernel, so
+    // they stop counting towards RSS. They are re-read from the file if touched again. Does
+    // nothing for decompressed files.
+    void Release(size_t first, size_t length) const;
+
+  private:
+    NiftiBuffer() = default;
+    bool                              parse_header(char const *hdr, size_t &offset, size_t &bytes);
+    std::unique_ptr<char[]>           m_buffer;
+    std::unique_ptr<BGZFReader>       m_reader; // Until Load() is called
+    size_t                            m_offset = 0;
+    void *                            m_map        = nullptr;
+    size_t                            m_size       = 0;
+    void *                            m_data       = nullptr;
+    size_t                            m_voxels     = 0;
+    unsigned                          m_components = 1;
+    itk::ImageIOBase::IOComponentType m_type       = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+};
+
+/*
+ *  Pixel container for an itk::Image whose buffer is a NiftiBuffer. It keeps the buffer alive for
+ *  as long as any image refers to it.
+ */
+template <typename TElement>
+class NiftiImageContainer : public itk::ImportImageContainer<itk::SizeValueType, TElement> {
+  public:
+    using Self         = NiftiImageContainer;
+    using Superclass   = itk::ImportImageContainer<itk::SizeValueType, TElement>;
+    using Pointer      = itk::SmartPointer<Self>;
+    using ConstPointer = itk::SmartPointer<const Self>;
+    itkNewMacro(Self);
+    itkTypeMacro(NiftiImageContainer, ImportImageContainer);
+
+    void SetMapping(std::shared_ptr<NiftiBuffer> const &m) {
+        m_mapping = m;
+        this->SetImportPointer(static_cast<TElement *>(m->data()), m->voxels(), false);
+    }
+
+  protected:
+    NiftiImageContainer()           = default;
+    ~NiftiImageContainer() override = default;
+
+  private:
+    std::shared_ptr<NiftiBuffer> m_mapping;
+};
+
+} // namespace QI
+
+#endif // QUIT_NIFTIBUFFER_H
@@ -0,0 +1,89 @@
+/*
+ *  OutputQueue.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "OutputQueue.h"
+#include <algorithm>
+
+namespace QI {
+
+OutputQueue::OutputQueue(bool const verbose, int const writers) :
+    m_verbose(verbose), m_writers(writers > 0 ? writers : std::min(4, GetDefaultThreads())) {}
+
+OutputQueue::~OutputQueue() {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this] { return m_jobs.empty() && m_running == 0; });
+        m_stop = true;
+    }
+    m_ready.notify_all();
+    for (auto &t : m_threads) {
+        t.join();
+    }
+    // Throwing or exiting from a destructor is unsafe, so callers must Wait() to see errors
+    if (m_error) {
+        try {
+            std::rethrow_exception(m_error);
+        } catch (std::exception const &e) {
+            QI::Warn("Failed to write output: {}", e.what());
+        }
+    }
+}
+
+void OutputQueue::Add(std::function<void()> &&job) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.push_back(std::move(job));
+    // Threads are only started when every existing one is busy
+    if (m_idle == 0 && m_threads.size() < m_writers) {
+        m_threads.emplace_back(&OutputQueue::Work, this);
+    } else {
+        m_ready.notify_one();
+    }
+}
+
+void OutputQueue::Work() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_idle++;
+        m_ready.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+        m_idle--;
+        if (m_jobs.empty()) {
+            return;
+        }
+        auto job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        m_running++;
+        lock.unlock();
+        try {
+            job();
+        } catch (...) {
+            lock.lock();
+            if (!m_error) {
+                m_error = std::current_exception();
+            }
+            lock.unlock();
+        }
+        lock.lock();
+        m_running--;
+        m_done.notify_all();
+    }
+}
+
+void OutputQueue::Wait() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_jobs.empty() && m_running == 0; });
+    if (m_error) {
+        auto error = m_error;
+        m_error    = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+} // namespace QI
@@ -0,0 +1,153 @@
+/*
+ *  OutputQueue.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_OUTPUTQUEUE_H
+#define QUIT_OUTPUTQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "itkVectorImage.h"
+
+#include "ImageIO.h"
+#include "JSON.h"
+#include "Log.h"
+#include "Util.h"
+#include "VectorIO.h"
+
+namespace QI {
+
+/*
+ *  Writes images on a few background threads, so the conversion and compression of each output
+ *  overlaps with the others and with whatever the command does next. The queue keeps a reference
+ *  to each pixel buffer until it has been written, so images must not be modified after they are
+ *  queued. Wait() blocks until everything queued so far is on
+ *  disk and re-throws the first exception from a write on the calling thread. The writers
+ *  themselves throw instead of calling QI::Fail, so a failed write never exits from a background
+ *  thread. The destructor also waits, but can only warn about an error Wait() did not report.
+ */
+class OutputQueue {
+  public:
+    explicit OutputQueue(bool const verbose, int const writers = 0); //!< 0 = min(4, threads)
+    ~OutputQueue();
+    OutputQueue(OutputQueue const &) = delete;
+    OutputQueue &operator=(OutputQueue const &) = delete;
+
+    // If int16 is set, real float images are written as scaled 16-bit integers (see ImageIO.h)
+    template <typename TImg>
+    void Write(TImg const *img, std::string const &path, bool const int16 = false) {
+        // The graft shares the pixel buffer but not the pipeline, so writing it on another thread
+        // never touches the filter that produced it
+        typename TImg::Pointer const keep = TImg::New();
+        keep->Graft(img);
+        Add([this, keep, path, int16]() {
+            QI::WriteImage<TImg>(keep.GetPointer(), path, m_verbose, int16);
+        });
+    }
+
+    template <typename TImg>
+    void
+    Write(itk::SmartPointer<TImg> const &img, std::string const &path, bool const int16 = false) {
+        Write<TImg>(img.GetPointer(), path, int16);
+    }
+
+    /*
+     *  Writes images with the same type and geometry as the volumes of one 4D file, plus a JSON
+     *  sidecar (the path with .json instead of the image extension) that labels each volume.
+     *  Images with several components per voxel give a volume per component, labelled
+     *  name_0, name_1 and so on.
+     */
+    template <typename TImg>
+    void WritePacked(std::vector<TImg const *> const &imgs,
+                     std::vector<std::string> const & names,
+                     std::string const &              path,
+                     bool const                       int16 = false) {
+        if (imgs.empty() || imgs.size() != names.size()) {
+            QI::Fail("Need one name per image to pack into {}", path);
+        }
+        std::vector<typename TImg::ConstPointer> keep(imgs.begin(), imgs.end());
+        auto const     region = keep[0]->GetBufferedRegion();
+        unsigned const ncomp  = keep[0]->GetNumberOfComponentsPerPixel();
+        for (auto const &img : keep) {
+            if (img->GetBufferedRegion() != region ||
+                img->GetNumberOfComponentsPerPixel() != ncomp) {
+                QI::Fail("Images packed into {} must all be the same size", path);
+            }
+        }
+        json labels = json::array();
+        for (auto const &name : names) {
+            for (unsigned c = 0; c < ncomp; c++) {
+                labels.push_back(ncomp > 1 ? fmt::format("{}_{}", name, c) : name);
+            }
+        }
+        Add([this, keep, ncomp, labels, path, int16]() {
+            using TPixel  = typename TImg::InternalPixelType;
+            using TPacked = itk::VectorImage<TPixel, TImg::ImageDimension>;
+            auto const   first  = keep[0];
+            size_t const nvols  = labels.size();
+            auto         packed = TPacked::New();
+            packed->SetRegions(first->GetBufferedRegion());
+            packed->SetSpacing(first->GetSpacing());
+            packed->SetOrigin(first->GetOrigin());
+            packed->SetDirection(first->GetDirection());
+            packed->SetNumberOfComponentsPerPixel(nvols);
+            packed->Allocate();
+            TPixel *const out = packed->GetBufferPointer();
+            ForVoxelBlocks(first->GetBufferedRegion().GetNumberOfPixels(),
+                           [&](size_t const begin, size_t const end) {
+                               for (size_t m = 0; m < keep.size(); m++) {
+                                   TPixel const *in = keep[m]->GetBufferPointer();
+                                   for (size_t i = begin; i < end; i++) {
+                                       for (size_t c = 0; c < ncomp; c++) {
+                                           out[i * nvols + m * ncomp + c] = in[i * ncomp + c];
+                                       }
+                                   }
+                               }
+                           });
+            QI::WriteImage<TPacked>(packed.GetPointer(), path, m_verbose, int16);
+            std::string const sidecar = QI::StripExt(path) + ".json";
+            std::ofstream     ofs(sidecar);
+            if (!ofs) {
+                throw std::runtime_error(
+                    fmt::format("Could not open file for writing: {}", sidecar));
+            }
+            QI::WriteJSON(ofs, json{{"volumes", labels}});
+        });
+    }
+
+    void Wait();
+
+  private:
+    void Add(std::function<void()> &&job);
+    void Work();
+
+    bool const                        m_verbose;
+    size_t                            m_writers;
+    std::vector<std::thread>          m_threads;
+    std::deque<std::function<void()>> m_jobs;
+    std::mutex                        m_mutex;
+    std::condition_variable           m_ready, m_done;
+    size_t                            m_running = 0, m_idle = 0;
+    bool                              m_stop    = false;
+    std::exception_ptr                m_error;
+};
+
+} // namespace QI
+
+#endif // QUIT_OUTPUTQUEUE_H
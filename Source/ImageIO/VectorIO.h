@@ -0,0 +1,250 @@
+/*
+ *  VectorIO.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_VECTORIO_H
+#define QUIT_VECTORIO_H
+
+#include "Log.h"
+#include "itkImageIOBase.h"
+#include "itkMultiThreaderBase.h"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace QI {
+
+/*
+ *  Helpers for moving data directly between the volume-major layout of a 4D file and the
+ *  voxel-interleaved buffer of an itk::VectorImage, without an intermediate 4D itk::Image.
+ */
+template <typename T> struct IsComplex : std::false_type {};
+template <typename T> struct IsComplex<std::complex<T>> : std::true_type {};
+
+// Calls f(first, last) for runs of voxels, spread over threads. Each run is long enough that
+// the strided side of the transpose still touches whole cache lines.
+template <typename F> void ForVoxelBlocks(size_t const nvox, F &&f) {
+    size_t const block   = 4096;
+    size_t const nblocks = (nvox + block - 1) / block;
+    auto         mt      = itk::MultiThreaderBase::New();
+    mt->ParallelizeArray(
+        0,
+        nblocks,
+        [&](itk::SizeValueType const b) { f(b * block, std::min(nvox, (b + 1) * block)); },
+        nullptr);
+}
+
+// Converts one pixel stored as n components in a file (2 for complex) to the in-memory type
+template <typename TOut, typename TIn> inline TOut FromComponents(TIn const *p, unsigned const n) {
+    if constexpr (IsComplex<TOut>::value) {
+        using TV = typename TOut::value_type;
+        return (n == 2) ? TOut(static_cast<TV>(p[0]), static_cast<TV>(p[1]))
+                        : TOut(static_cast<TV>(p[0]), TV{0});
+    } else {
+        return static_cast<TOut>(p[0]);
+    }
+}
+
+template <typename T> constexpr itk::ImageIOBase::IOComponentType ComponentOf() {
+    if constexpr (IsComplex<T>::value) {
+        return ComponentOf<typename T::value_type>();
+    } else if constexpr (std::is_same_v<T, unsigned char>) {
+        return itk::ImageIOBase::UCHAR;
+    } else if constexpr (std::is_same_v<T, int>) {
+        return itk::ImageIOBase::INT;
+    } else if constexpr (std::is_same_v<T, float>) {
+        return itk::ImageIOBase::FLOAT;
+    } else if constexpr (std::is_same_v<T, double>) {
+        return itk::ImageIOBase::DOUBLE;
+    } else {
+        return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+    }
+}
+
+/*
+ *  Copies the size and geometry read by an ImageIO to an image, as ImageFileReader does. Missing
+ *  dimensions have size 1 and the identity direction, extra ones are dropped.
+ */
+template <typename TImg> void SetImageInformation(itk::ImageIOBase const *io, TImg *img) {
+    unsigned const               D    = TImg::ImageDimension;
+    unsigned const               ndim = io->GetNumberOfDimensions();
+    typename TImg::RegionType    region;
+    typename TImg::SpacingType   spacing;
+    typename TImg::PointType     origin;
+    typename TImg::DirectionType direction;
+    for (unsigned i = 0; i < D; i++) {
+        region.SetSize(i, (i < ndim) ? io->GetDimensions(i) : 1);
+        spacing[i] = (i < ndim) ? io->GetSpacing(i) : 1.;
+        origin[i]  = (i < ndim) ? io->GetOrigin(i) : 0.;
+        for (unsigned j = 0; j < D; j++) {
+            direction[j][i] = (i < ndim && j < ndim) ? io->GetDirection(i)[j] : (i == j);
+        }
+    }
+    img->SetRegions(region);
+    img->SetSpacing(spacing);
+    img->SetOrigin(origin);
+    img->SetDirection(direction);
+}
+
+// Calls f.template operator()<T>() with T the C++ type of an ImageIO component type
+template <typename F> void DispatchComponent(itk::ImageIOBase::IOComponentType const t, F &&f) {
+    switch (t) {
+    case itk::ImageIOBase::UCHAR:
+        f.template operator()<unsigned char>();
+        break;
+    case itk::ImageIOBase::CHAR:
+        f.template operator()<char>();
+        break;
+    case itk::ImageIOBase::USHORT:
+        f.template operator()<unsigned short>();
+        break;
+    case itk::ImageIOBase::SHORT:
+        f.template operator()<short>();
+        break;
+    case itk::ImageIOBase::UINT:
+        f.template operator()<unsigned int>();
+        break;
+    case itk::ImageIOBase::INT:
+        f.template operator()<int>();
+        break;
+    case itk::ImageIOBase::ULONG:
+        f.template operator()<unsigned long>();
+        break;
+    case itk::ImageIOBase::LONG:
+        f.template operator()<long>();
+        break;
+    case itk::ImageIOBase::ULONGLONG:
+        f.template operator()<unsigned long long>();
+        break;
+    case itk::ImageIOBase::LONGLONG:
+        f.template operator()<long long>();
+        break;
+    case itk::ImageIOBase::FLOAT:
+        f.template operator()<float>();
+        break;
+    case itk::ImageIOBase::DOUBLE:
+        f.template operator()<double>();
+        break;
+    default:
+        QI::Fail("Unsupported component type {}", itk::ImageIOBase::GetComponentTypeAsString(t));
+    }
+}
+
+/*
+ *  Linear map of a float buffer onto the codes -32767 to 32767, for storage as 16-bit integers
+ *  with the NIfTI scl_slope and scl_inter fields. The range is the finite min and max, but no
+ *  more than a tenth of the 0.01st to 99.99th percentile range beyond those percentiles, so a few
+ *  outliers cannot use up all of the codes. A reader that applies the scaling gets each value in
+ *  the range back to within slope / 2. Values outside the range are clipped to its ends, and NaN
+ *  and infinity, which have no code, are stored as the code closest to zero. Both are counted.
+ */
+struct Int16Scaling {
+    float   slope = 1.f, inter = 0.f;
+    int16_t zero    = 0;
+    size_t  clipped = 0, nonfinite = 0;
+
+    Int16Scaling(float const *data, size_t const n) {
+        float const inf = std::numeric_limits<float>::infinity();
+        float       lo = inf, hi = -inf;
+        std::mutex  range_mutex;
+        ForVoxelBlocks(n, [&](size_t const first, size_t const last) {
+            float  block_lo = inf, block_hi = -inf;
+            size_t block_nonfinite = 0;
+            for (size_t i = first; i < last; i++) {
+                if (std::isfinite(data[i])) {
+                    block_lo = std::min(block_lo, data[i]);
+                    block_hi = std::max(block_hi, data[i]);
+                } else {
+                    block_nonfinite++;
+                }
+            }
+            std::lock_guard<std::mutex> lock(range_mutex);
+            lo = std::min(lo, block_lo);
+            hi = std::max(hi, block_hi);
+            nonfinite += block_nonfinite;
+        });
+        if (!(lo <= hi)) {
+            zero = (*this)(0.f);
+            return; // Nothing finite to scale
+        }
+        // The percentiles come from an evenly spaced sample of about a million values at most
+        size_t const       stride = std::max<size_t>(1, n >> 20);
+        std::vector<float> sample;
+        sample.reserve(n / stride + 1);
+        for (size_t i = 0; i < n; i += stride) {
+            if (std::isfinite(data[i])) {
+                sample.push_back(data[i]);
+            }
+        }
+        if (!sample.empty()) {
+            size_t const tail  = sample.size() / 10000;
+            auto const   lo_it = sample.begin() + tail;
+            auto const   hi_it = sample.end() - 1 - tail;
+            std::nth_element(sample.begin(), lo_it, sample.end());
+            float const p_lo = *lo_it; // The second partition moves it
+            std::nth_element(lo_it, hi_it, sample.end());
+            float const p_hi   = *hi_it;
+            float const margin = 0.1f * p_hi - 0.1f * p_lo;
+            lo                 = std::max(lo, p_lo - margin);
+            hi                 = std::min(hi, p_hi + margin);
+        }
+        // Halve first so that the full float range does not overflow
+        inter = 0.5f * lo + 0.5f * hi;
+        slope = (0.5f * hi - 0.5f * lo) / 32767.f;
+        if (!(slope > 0.f)) {
+            slope = 1.f; // Constant image, every value is exactly inter
+        }
+        zero = (*this)(0.f);
+        ForVoxelBlocks(n, [&](size_t const first, size_t const last) {
+            size_t block_clipped = 0;
+            for (size_t i = first; i < last; i++) {
+                if (std::isfinite(data[i]) && (data[i] < lo || data[i] > hi)) {
+                    block_clipped++;
+                }
+            }
+            std::lock_guard<std::mutex> lock(range_mutex);
+            clipped += block_clipped;
+        });
+    }
+
+    int16_t operator()(float const v) const {
+        if (!std::isfinite(v)) {
+            return zero;
+        }
+        return static_cast<int16_t>(std::clamp(std::lround((v - inter) / slope), -32767L, 32767L));
+    }
+
+    // Warns if any values in the image at path could not be stored
+    void Report(std::string const &path) const {
+        if (clipped > 0) {
+            QI::Warn("Clipped {} outlying values in {} to the int16 range {:g} to {:g}",
+                     clipped,
+                     path,
+                     inter - 32767.f * slope,
+                     inter + 32767.f * slope);
+        }
+        if (nonfinite > 0) {
+            QI::Warn("Stored {} NaN or infinite values in {} as {:g}",
+                     nonfinite,
+                     path,
+                     inter + zero * slope);
+        }
+    }
+};
+
+} // namespace QI
+
+#endif // QUIT_VECTORIO_H
@@ -12,35 +12,105 @@
 #ifndef QUIT_IMAGEIO_H
 
 #include "ImageIO.h"
-#include "ImageToVectorFilter.h"
 #include "Log.h"
-#include "itkImageFileReader.h"
+#include "NiftiBuffer.h"
+#include "VectorIO.h"
+#include "itkImageIOFactory.h"
+#include <memory>
 #include <string>
 
 namespace QI {
 
+/*
+ *  Decodes the file straight into the VectorImage buffer. Uncompressed files are read a few
+ *  volumes at a time, or mapped if QUIT_MMAP is set, so only the interleaved copy has to fit in
+ *  memory. Block-gzipped files are decompressed on all threads. Other compressed files have to be
+ *  decompressed from the start for every region, so they are read in one go.
+ */
 template <typename TVectorImg>
 auto ReadImage(const std::string &path, const bool verbose) -> typename TVectorImg::Pointer {
+    using TPixel = typename TVectorImg::InternalPixelType;
 
-    using TPixel    = typename TVectorImg::InternalPixelType;
-    using TSeries   = itk::Image<TPixel, 4>;
-    using TReader   = itk::ImageFileReader<TSeries>;
-    using TToVector = itk::ImageToVectorFilter<TSeries>;
-
-    auto file = TReader::New();
-    file->SetFileName(path);
-    QI::Log(verbose, "Reading image: {}", path);
-    file->Update();
-
-    auto convert = TToVector::New();
-    convert->SetInput(file->GetOutput());
-    QI::Log(verbose, "Converting to vector image");
-    convert->Update();
-    typename TVectorImg::Pointer vols = convert->GetOutput();
-    if (!vols) {
+    auto io = itk::ImageIOFactory::CreateImageIO(path.c_str(), itk::ImageIOFactory::ReadMode);
+    if (!io) {
         QI::Fail("Failed to read image: {}", path);
     }
-    vols->DisconnectPipeline();
+    io->SetFileName(path);
+    QI::Log(verbose, "Reading image: {}", path);
+    io->ReadImageInformation();
+    unsigned const ndim  = io->GetNumberOfDimensions();
+    unsigned const ncomp = io->GetNumberOfComponents();
+    if (ndim > 4) {
+        QI::Fail("Image {} has {} dimensions, at most 4 are supported", path, ndim);
+    }
+    if (ncomp > (IsComplex<TPixel>::value ? 2 : 1)) {
+        QI::Fail("Image {} has {} components per pixel, expected {}",
+                 path,
+                 ncomp,
+                 IsComplex<TPixel>::value ? "1 or 2" : "1");
+    }
+
+    size_t const nvols = (ndim == 4) ? io->GetDimensions(3) : 1;
+
+    typename TVectorImg::Pointer vols = TVectorImg::New();
+    SetImageInformation(io.GetPointer(), vols.GetPointer());
+    vols->SetNumberOfComponentsPerPixel(nvols);
+    vols->Allocate();
+    TPixel *const out  = vols->GetBufferPointer();
+    size_t const  nvox = vols->GetBufferedRegion().GetNumberOfPixels();
+
+    // Moves volumes [v0, v0 + nv) from a volume-major buffer to the interleaved one
+    auto const interleave = [&]<typename TIn>(TIn const *in, size_t const v0, size_t const nv) {
+        ForVoxelBlocks(nvox, [&](size_t const first, size_t const last) {
+            for (size_t v = 0; v < nv; v++) {
+                TIn const *vol = in + v * nvox * ncomp;
+                for (size_t i = first; i < last; i++) {
+                    out[i * nvols + v0 + v] = FromComponents<TPixel>(vol + i * ncomp, ncomp);
+                }
+            }
+        });
+    };
+
+    size_t const vol_size = nvox * ncomp * io->GetComponentSize();
+    size_t const chunk_size =
+        std::clamp<size_t>((size_t{64} << 20) / std::max<size_t>(vol_size, 1), 1, nvols);
+    auto const mapped = NiftiBuffer::Open(path);
+    if (mapped && mapped->voxels() == nvox * nvols && mapped->components() == ncomp) {
+        // Each chunk of a mapped file is dropped from memory as soon as it has been interleaved
+        QI::Log(verbose, "Reading voxel data directly");
+        mapped->Load();
+        DispatchComponent(mapped->component_type(), [&]<typename TIn>() {
+            TIn const *const in = static_cast<TIn const *>(mapped->data());
+            for (size_t v0 = 0; v0 < nvols; v0 += chunk_size) {
+                size_t const nv = std::min(chunk_size, nvols - v0);
+                interleave(in + v0 * nvox * ncomp, v0, nv);
+                mapped->Release(v0 * nvox * ncomp * sizeof(TIn), nv * nvox * ncomp * sizeof(TIn));
+            }
+        });
+        return vols;
+    }
+
+    bool const   stream = io->CanStreamRead() && !path.ends_with(".gz");
+    size_t const chunk  = stream ? chunk_size : nvols;
+    io->SetUseStreamedReading(stream);
+    DispatchComponent(io->GetComponentType(), [&]<typename TIn>() {
+        std::unique_ptr<TIn[]> buffer(new TIn[nvox * ncomp * chunk]);
+        itk::ImageIORegion     io_region(ndim);
+        for (unsigned i = 0; i < ndim; i++) {
+            io_region.SetIndex(i, 0);
+            io_region.SetSize(i, io->GetDimensions(i));
+        }
+        for (size_t v0 = 0; v0 < nvols; v0 += chunk) {
+            size_t const nv = std::min(chunk, nvols - v0);
+            if (ndim == 4) {
+                io_region.SetIndex(3, v0);
+                io_region.SetSize(3, nv);
+            }
+            io->SetIORegion(io_region);
+            io->Read(buffer.get());
+            interleave(buffer.get(), v0, nv);
+        }
+    });
     return vols;
 }
 
@@ -51,4 +121,4 @@ template auto ReadImage<QI::VectorVolumeXF>(const std::string &path, const bool
 
 } // namespace QI
 
-#endif // QUIT_IMAGEIO_H
\ No newline at end of file
+#endif // QUIT_IMAGEIO_H
@@ -9,33 +9,98 @@
  *
  */
 
+#include <functional>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
-#include "itkComplexToModulusImageFilter.h"
 #include "itkDivideImageFilter.h"
-#include "itkImageFileWriter.h"
-
-#include "VectorToImageFilter.h"
+#include "itkImageIOFactory.h"
 
+#include "BGZF.h"
 #include "ImageIO.h"
 #include "Log.h"
+#include "NiftiBuffer.h"
+#include "VectorIO.h"
 
 namespace QI {
 
+/*
+ *  Writes a vector image as a 4D series, converting each component with f. The volume-major
+ *  buffer is filled in one parallel pass instead of extracting and tiling each volume. If given,
+ *  edit is called on the uncompressed file after it has been written.
+ */
+template <typename TFilePixel, typename TVImg, typename F>
+void WriteSeries(const TVImg *                                   img,
+                 const std::string &                             path,
+                 const bool                                      verbose,
+                 F const &                                       f,
+                 std::function<void(std::string const &)> const &edit = nullptr) {
+    auto io = itk::ImageIOFactory::CreateImageIO(path.c_str(), itk::ImageIOFactory::WriteMode);
+    if (!io) {
+        throw std::runtime_error(fmt::format("Failed to write image: {}", path));
+    }
+    auto const                region = img->GetBufferedRegion();
+    typename TVImg::PointType origin;
+    img->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+    size_t const nvols = img->GetNumberOfComponentsPerPixel();
+    size_t const nvox  = region.GetNumberOfPixels();
+
+    io->SetNumberOfDimensions(4);
+    for (unsigned i = 0; i < 4; i++) {
+        std::vector<double> axis(4, 0.);
+        if (i < 3) {
+            io->SetDimensions(i, region.GetSize(i));
+            io->SetSpacing(i, img->GetSpacing()[i]);
+            io->SetOrigin(i, origin[i]);
+            for (unsigned j = 0; j < 3; j++) {
+                axis[j] = img->GetDirection()[j][i];
+            }
+        } else {
+            io->SetDimensions(i, nvols);
+            io->SetSpacing(i, 1.);
+            io->SetOrigin(i, 0.);
+            axis[i] = 1.;
+        }
+        io->SetDirection(i, axis);
+    }
+    io->SetPixelTypeInfo(static_cast<TFilePixel const *>(nullptr));
+    itk::ImageIORegion io_region(4);
+    for (unsigned i = 0; i < 4; i++) {
+        io_region.SetIndex(i, 0);
+        io_region.SetSize(i, io->GetDimensions(i));
+    }
+    io->SetIORegion(io_region);
+
+    std::unique_ptr<TFilePixel[]> buffer(new TFilePixel[nvox * nvols]);
+    auto const *const             in = img->GetBufferPointer();
+    ForVoxelBlocks(nvox, [&](size_t const first, size_t const last) {
+        for (size_t v = 0; v < nvols; v++) {
+            TFilePixel *out = buffer.get() + v * nvox;
+            for (size_t i = first; i < last; i++) {
+                out[i] = f(in[i * nvols + v]);
+            }
+        }
+    });
+    QI::Log(verbose, "Writing image: {}", path);
+    WriteCompressed(
+        path,
+        [&](std::string const &p) {
+            io->SetFileName(p);
+            io->WriteImageInformation();
+            io->Write(buffer.get());
+            if (edit) {
+                edit(p);
+            }
+        },
+        static_cast<bool>(edit));
+}
+
 template <typename TVImg>
 void WriteImage(const TVImg *img, const std::string &path, const bool verbose) {
-    using TToSeries = itk::VectorToImageFilter<TVImg>;
-    using TWriter   = itk::ImageFileWriter<typename TToSeries::TOutput>;
-
-    typename TToSeries::Pointer convert = TToSeries::New();
-    convert->SetInput(img);
-    convert->Update();
-
-    typename TWriter::Pointer file = TWriter::New();
-    file->SetFileName(path);
-    file->SetInput(convert->GetOutput());
-    QI::Log(verbose, "Writing image: {}", path);
-    file->Update();
+    using TPixel = typename TVImg::InternalPixelType;
+    WriteSeries<TPixel>(img, path, verbose, [](TPixel const &p) { return p; });
 }
 
 template <typename TVImg>
@@ -44,26 +109,27 @@ void WriteImage(const itk::SmartPointer<TVImg> &ptr, const std::string &path, co
 }
 
 template <typename TVImg>
-void WriteMagnitudeImage(const TVImg *img, const std::string &path, const bool verbose) {
-    using TToSeries   = itk::VectorToImageFilter<TVImg>;
-    using TPixel      = typename TVImg::InternalPixelType;
-    using TReal       = typename TPixel::value_type;
-    using TSeries     = itk::Image<TPixel, 4>;
-    using TRealSeries = itk::Image<TReal, 4>;
-
-    auto convert = TToSeries::New();
-    convert->SetInput(img);
-
-    auto mag = itk::ComplexToModulusImageFilter<TSeries, TRealSeries>::New();
-    mag->SetInput(convert->GetOutput());
-    mag->Update();
+void WriteInt16Image(const TVImg *img, const std::string &path, const bool verbose) {
+    if (!path.ends_with(".nii") && !path.ends_with(".nii.gz")) {
+        QI::Warn("Scaled int16 needs NIfTI output, writing {} as float", path);
+        WriteImage(img, path, verbose);
+        return;
+    }
+    Int16Scaling const scale(img->GetBufferPointer(),
+                             img->GetBufferedRegion().GetNumberOfPixels() *
+                                 img->GetNumberOfComponentsPerPixel());
+    QI::Log(verbose, "Scaling to int16 with slope {:g}", scale.slope);
+    scale.Report(path);
+    WriteSeries<short>(img, path, verbose, scale, [&](std::string const &p) {
+        SetNiftiScaling(p, scale.slope, scale.inter);
+    });
+}
 
-    using TWriter = itk::ImageFileWriter<TRealSeries>;
-    auto file     = TWriter::New();
-    file->SetFileName(path);
-    file->SetInput(mag->GetOutput());
-    QI::Log(verbose, "Writing magnitude image: {}", path);
-    file->Update();
+template <typename TVImg>
+void WriteMagnitudeImage(const TVImg *img, const std::string &path, const bool verbose) {
+    using TPixel = typename TVImg::InternalPixelType;
+    using TReal  = typename TPixel::value_type;
+    WriteSeries<TReal>(img, path, verbose, [](TPixel const &p) { return std::abs(p); });
 }
 
 template <typename TVImg>
@@ -97,8 +163,16 @@ template void WriteImage<VectorVolumeF>(const itk::SmartPointer<VectorVolumeF> &
                                         const std::string &path, const bool verbose);
 template void WriteImage<VectorVolumeXF>(const itk::SmartPointer<VectorVolumeXF> &ptr,
                                          const std::string &path, const bool verbose);
+template void WriteImage<VectorVolumeI>(const VectorVolumeI *img, const std::string &path,
+                                        const bool verbose);
 template void WriteImage<VectorVolumeI>(const itk::SmartPointer<VectorVolumeI> &ptr,
                                         const std::string &path, const bool verbose);
+template void WriteImage<VectorVolumeUC>(const VectorVolumeUC *img, const std::string &path,
+                                         const bool verbose);
+template void WriteImage<VectorVolumeUC>(const itk::SmartPointer<VectorVolumeUC> &ptr,
+                                         const std::string &path, const bool verbose);
+template void WriteInt16Image<VectorVolumeF>(const VectorVolumeF *img, const std::string &path,
+                                             const bool verbose);
 template void WriteMagnitudeImage<VectorVolumeXF>(const VectorVolumeXF *ptr,
                                                   const std::string &path, const bool verbose);
 template void WriteMagnitudeImage<VectorVolumeXF>(const itk::SmartPointer<VectorVolumeXF> &ptr,
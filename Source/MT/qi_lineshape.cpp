@@ -13,6 +13,34 @@
 #include "JSON.h"
 #include "Lineshape.h"
 #include "Util.h"
+#include <random>
+
+/*
+ *  Compare the tabulated super-Lorentzian with the quadrature at n random offsets between 100 Hz
+ *  and 100 kHz and T2b between 0.1 and 100 us. Returns the largest relative error in the value and
+ *  in the derivative with respect to T2b. The derivative crosses zero, so its error is taken
+ *  relative to the larger of the derivative and G / T2b.
+ */
+std::pair<double, double> CheckSuperLorentzian(int const n) {
+    using Jet = ceres::Jet<double, 1>;
+    std::mt19937                           gen(0);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    double                                 worst_G = 0, worst_dG = 0;
+    for (int i = 0; i < n; i++) {
+        double const f    = 100. * pow(1000., uniform(gen));
+        double const T2b  = 1e-7 * pow(1000., uniform(gen));
+        double const h    = T2b * 1e-6;
+        Jet const    G    = QI::SuperLorentzianTable::Get()(f, Jet(T2b, 0));
+        double const ref  = QI::SuperLorentzianQuadrature(f, T2b);
+        double const up   = QI::SuperLorentzianQuadrature(f, T2b + h);
+        double const down = QI::SuperLorentzianQuadrature(f, T2b - h);
+        double const dref = (up - down) / (2. * h);
+        worst_G           = std::max(worst_G, std::abs(G.a / ref - 1.));
+        worst_dG =
+            std::max(worst_dG, std::abs(G.v[0] - dref) / std::max(std::abs(dref), ref / T2b));
+    }
+    return {worst_G, worst_dG};
+}
 
 int lineshape_main(args::Subparser &parser) {
     args::Positional<std::string> out_path(parser, "OUTPUT", "Output lineshape JSON path");
@@ -35,7 +63,14 @@ int lineshape_main(args::Subparser &parser) {
                                         "Spacing of frequencies (default 1000 Hz)",
                                         {'p', "frq_space"},
                                         1e3);
+    args::ValueFlag<int> check(
+        parser, "N", "Compare super-Lorentzian table and quadrature at N points", {"check"});
     parser.Parse();
+    if (check) {
+        auto const [worst_G, worst_dG] = CheckSuperLorentzian(check.Get());
+        fmt::print("Largest relative difference: {:g} value, {:g} derivative\n", worst_G, worst_dG);
+        return (worst_G < 1e-7 && worst_dG < 1e-4) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     QI::Log(verbose, "Bound-pool T2: {}", T2b.Get());
     auto frqs =
         Eigen::ArrayXd::LinSpaced(frq_count.Get(),
@@ -15,6 +15,7 @@
 // #define QI_DEBUG_BUILD 1
 
 #include "Args.h"
+#include "FitLM.h"
 #include "FitFunction.h"
 #include "ImageIO.h"
 #include "JSON.h"
@@ -98,6 +99,9 @@ int lorentzian_main(args::Subparser &parser) {
     args::ValueFlag<int>          pools(
         parser, "POOLS", "Number of Lorentzians to fit, default 1", {'p', "pools"}, 1);
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
+    args::Flag warm(parser, "WARM", "Start each voxel from the last converged voxel", {"warm"});
+    args::Flag lm(parser, "LM", "Fit with a built-in Levenberg-Marquardt solver", {"lm"});
     args::Flag additive(
         parser, "ADDITIVE", "Use an additive model instead of subtractive", {'a', "add"}, false);
     args::ValueFlag<double> Zref(
@@ -112,6 +116,7 @@ int lorentzian_main(args::Subparser &parser) {
     auto process = [&]<int N>() {
         using LM   = LorentzModel<N>;
         using LFit = QI::NLLSFitFunction<LM>;
+        using MFit = QI::LMFit<LM>;
 
         auto const &pools_json = input.at("pools");
         if (pools_json.size() != N) {
@@ -175,14 +180,39 @@ int lorentzian_main(args::Subparser &parser) {
                                          mask.Get(),
                                          verbose,
                                          simulate.Get(),
-                                         subregion.Get());
+                                         subregion.Get(),
+                                         int16);
         } else {
-            LFit fit{model};
-            auto fit_filter =
-                QI::ModelFitFilter<LFit>::New(&fit, verbose, covar, resids, subregion.Get());
-            fit_filter->ReadInputs({input_path.Get()}, {}, mask.Get());
-            fit_filter->Update();
-            fit_filter->WriteOutputs(prefix.Get() + "LTZ_");
+            auto run = [&](auto &fit) {
+                using FitType = std::remove_reference_t<decltype(fit)>;
+                fit.solver    = QI::ReadSolverOptions(input, solver.Get());
+                auto fit_filter =
+                    QI::ModelFitFilter<FitType>::New(&fit, verbose, covar, resids, subregion.Get());
+                fit_filter->SetCheckpoint(checkpoint.Get(),
+                                          slab.Get(),
+                                          {{"input", input},
+                                           {"lm", lm.Get()},
+                                           {"additive", additive.Get()},
+                                           {"zref", Zref.Get()}});
+                fit_filter->SetOutputStatus(fit_status);
+                fit_filter->SetOutputProfile(profile);
+                fit_filter->SetPackOutputs(pack);
+                fit_filter->SetInt16Outputs(int16);
+                fit_filter->ReadInputs({input_path.Get()}, {}, mask.Get());
+                fit_filter->Update();
+                fit_filter->WriteOutputs(prefix.Get() + "LTZ_");
+            };
+            if (lm) {
+                if (warm) {
+                    QI::Fail("--warm cannot be used with --lm");
+                }
+                MFit fit{model};
+                run(fit);
+            } else {
+                LFit fit{model};
+                fit.warm_start = warm.Get();
+                run(fit);
+            }
             QI::Log(verbose, "Finished.");
         }
     };
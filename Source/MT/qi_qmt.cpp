@@ -125,6 +125,8 @@ using RamaniFitFunction = QI::ScaledAutoDiffFit<RamaniModel>;
 int qmt_main(args::Subparser &parser) {
     args::Positional<std::string> mtsat_path(parser, "MTSAT FILE", "Path to MT-Sat data");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
+    args::Flag warm(parser, "WARM", "Start each voxel from the last converged voxel", {"warm"});
     args::ValueFlag<std::string> T1(parser, "T1", "T1 map (seconds) file ** REQUIRED **", {"T1"});
     args::ValueFlag<std::string> f0(parser, "f0", "f0 map (Hz) file", {'f', "f0"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
@@ -167,12 +169,23 @@ int qmt_main(args::Subparser &parser) {
                                               mask.Get(),
                                               verbose,
                                               simulate.Get(),
-                                              subregion.Get());
+                                              subregion.Get(),
+                                              int16);
     } else {
         RamaniFitFunction fit{model};
+        fit.warm_start = warm.Get();
+        fit.solver     = QI::ReadSolverOptions(input, solver.Get());
 
         auto fit_filter = QI::ModelFitFilter<RamaniFitFunction>::New(
             &fit, verbose, covar, resids, subregion.Get());
+        fit_filter->SetCheckpoint(checkpoint.Get(),
+                                  slab.Get(),
+                                  {{"input", input},
+                                   {"lineshape", lineshape_arg.Get()}});
+        fit_filter->SetOutputStatus(fit_status);
+        fit_filter->SetOutputProfile(profile);
+        fit_filter->SetPackOutputs(pack);
+        fit_filter->SetInt16Outputs(int16);
         fit_filter->ReadInputs(
             {mtsat_path.Get()}, {f0.Get(), B1.Get(), QI::CheckValue(T1)}, mask.Get());
         fit_filter->Update();
@@ -118,7 +118,8 @@ struct EMTFit {
     using RMSErrorType        = double;
     using FlagType            = int;
     using ModelType           = EMTModel;
-    ModelType &model;
+    ModelType &       model;
+    QI::SolverOptions solver;
 
     int input_size(const int /* Unused */) const { return model.sequence.size(); }
     int n_outputs() const { return 5; }
@@ -152,9 +153,10 @@ struct EMTFit {
         options.gradient_tolerance  = 1e-8;
         options.parameter_tolerance = 1e-3;
         options.logging_type        = ceres::SILENT;
+        solver.Apply(options);
         ceres::Solve(options, &problem, &summary);
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
         }
         rmse = summary.final_cost;
         if (cov) {
@@ -176,7 +178,7 @@ struct EMTFit {
             }
         }
         iterations = summary.iterations.size();
-        return {true, ""};
+        return {true, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
     }
 };
 
@@ -186,6 +188,7 @@ int ssfp_emt_main(args::Subparser &parser) {
     args::Positional<std::string> b_path(parser, "b_FILE", "Input b file");
 
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio)", {'b', "B1"});
     args::ValueFlag<std::string> T2_f(parser, "T2f", "T2 Free map (for simulation only)", {"T2f"});
     args::ValueFlag<double>      G0(
@@ -212,7 +215,8 @@ int ssfp_emt_main(args::Subparser &parser) {
                                           mask.Get(),
                                           verbose,
                                           simulate.Get(),
-                                          subregion.Get());
+                                          subregion.Get(),
+                                          int16);
     } else {
         // First calculate T2_f
         auto a_input = QI::ReadImage<QI::VectorVolumeF>(a_path.Get(), verbose);
@@ -240,14 +244,24 @@ int ssfp_emt_main(args::Subparser &parser) {
             nullptr);
 
         EMTFit fit{model};
-        auto   fit_filter =
+        fit.solver = QI::ReadSolverOptions(input, solver.Get());
+        auto fit_filter =
             QI::ModelFitFilter<EMTFit>::New(&fit, verbose, covar, resids, subregion.Get());
+        fit_filter->SetCheckpoint(checkpoint.Get(),
+                                  slab.Get(),
+                                  {{"input", input},
+                                   {"G0", G0.Get()}});
+        fit_filter->SetOutputStatus(fit_status);
+        fit_filter->SetOutputProfile(profile);
+        fit_filter->SetPackOutputs(pack);
+        fit_filter->SetInt16Outputs(int16);
         fit_filter->ReadInputs(
             {G_path.Get(), a_path.Get(), b_path.Get()}, {B1.Get(), ""}, mask.Get());
         fit_filter->SetFixed(1, T2_f_calc);
+        // T2_f is already final, so write it while the fit runs
+        fit_filter->GetOutputQueue().Write(T2_f_calc, prefix.Get() + "EMT_T2_f" + QI::OutExt());
         fit_filter->Update();
         fit_filter->WriteOutputs(prefix.Get() + "EMT_");
-        QI::WriteImage(T2_f_calc, prefix.Get() + "EMT_T2_f" + QI::OutExt(), verbose);
         QI::Log(verbose, "Finished.");
     }
     return EXIT_SUCCESS;
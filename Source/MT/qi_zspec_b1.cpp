@@ -95,29 +95,25 @@ int zspec_b1_main(args::Subparser &parser) {
             if (mask_image)
                 mask_it = itk::ImageRegionConstIterator<QI::VolumeF>(mask_image, region);
 
+            // The B1 levels are the same for every voxel, so allocate once and re-use
+            Eigen::MatrixXd                               Z(Nz, b1_rms.rows());
+            std::vector<itk::VariableLengthVector<float>> out_z(
+                out_its.size(), itk::VariableLengthVector<float>(Nz));
             for (b1_it.GoToBegin(); !b1_it.IsAtEnd(); ++b1_it) {
                 const double B1 = b1_it.Get();
                 if (!mask_image || mask_it.Get()) {
-                    std::vector<Eigen::Map<const Eigen::ArrayXf>> in_z;
-                    std::vector<itk::VariableLengthVector<float>> out_z;
-                    for (const auto &ii : in_its) {
-                        in_z.emplace_back(ii.Get().GetDataPointer(), Nz);
-                        itk::VariableLengthVector<float> temp(Nz);
-                        out_z.push_back(temp);
+                    for (size_t ib = 0; ib < in_its.size(); ib++) {
+                        Z.col(ib) =
+                            Eigen::Map<const Eigen::VectorXf>(in_its[ib].Get().GetDataPointer(), Nz)
+                                .cast<double>();
                     }
-
-                    for (Eigen::Index iz = 0; iz < Nz; iz++) {
-                        Eigen::VectorXd Z(b1_rms.rows());
-                        for (Eigen::Index ib = 0; ib < b1_rms.rows(); ib++) {
-                            Z[ib] = in_z[ib][iz];
-                        }
-                        Eigen::VectorXd slope = (Z.transpose() * Z)
-                                                    .partialPivLu()
-                                                    .solve(Z.transpose() * B1 * b1_rms.matrix());
-                        Eigen::VectorXd Zcorrected = slope[0] * b1_rms;
-                        for (Eigen::Index ib = 0; ib < b1_rms.rows(); ib++) {
-                            out_z[ib][iz] = Zcorrected[ib];
-                        }
+                    // The least-squares slope through the B1 levels is a scalar for each offset,
+                    // so this is a ratio of dot-products rather than a solve per offset
+                    Eigen::ArrayXd const slope =
+                        B1 * (Z * b1_rms.matrix()).array() / Z.rowwise().squaredNorm().array();
+                    for (size_t ib = 0; ib < out_its.size(); ib++) {
+                        Eigen::Map<Eigen::ArrayXf>(out_z[ib].GetDataPointer(), Nz) =
+                            (slope * b1_rms[ib]).cast<float>();
                     }
 
                     for (size_t i = 0; i < out_its.size(); i++) {
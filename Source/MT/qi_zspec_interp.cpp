@@ -77,8 +77,14 @@ int zspec_interp_main(args::Subparser &parser) {
     output->SetNumberOfComponentsPerPixel(out_freqs.rows());
     output->Allocate(true);
 
-    std::vector<size_t> indices        = QI::SortedUniqueIndices(in_freqs);
-    auto const          process_region = subregion ?
+    // The offsets are the same in every voxel, so only solve the spline system once. Without an
+    // off-resonance map the output frequencies are also fixed, and each voxel is a single product
+    QI::SplineBasis const basis(in_freqs, order.Get(), QI::SortedUniqueIndices(in_freqs));
+    Eigen::MatrixXd const weights = f0_image ? Eigen::MatrixXd() :
+                                    asym ? Eigen::MatrixXd(basis.weights(-out_freqs) -
+                                                           basis.weights(out_freqs)) :
+                                           basis.weights(out_freqs);
+    auto const process_region = subregion ?
                                     QI::RegionFromString<QI::VolumeF::RegionType>(subregion.Get()) :
                                     input->GetBufferedRegion();
     auto mt = itk::MultiThreaderBase::New();
@@ -101,19 +107,22 @@ int zspec_interp_main(args::Subparser &parser) {
                 if (!mask_image || mask_it.Get()) {
                     const Eigen::Map<const Eigen::ArrayXf> zdata(in_it.Get().GetDataPointer(),
                                                                  in_freqs.rows());
-                    QI::SplineInterpolator                 zspec(
-                        in_freqs, zdata.cast<double>(), order.Get(), indices);
-
-                    float f0 = f0_image ? f0_it.Get() : 0.0;
-                    for (int f = 0; f < out_freqs.rows(); f++) {
-                        if (asym) {
-                            const double p_frq = f0 + out_freqs[f];
-                            const double m_frq = f0 - out_freqs[f];
-                            interped[f]        = zspec(m_frq) - zspec(p_frq);
-                        } else {
-                            const double frq = f0 + out_freqs[f];
-                            interped[f]      = zspec(frq);
+                    if (f0_image) {
+                        Eigen::VectorXd const zspec = basis.coefficients(zdata);
+                        float const           f0    = f0_it.Get();
+                        for (int f = 0; f < out_freqs.rows(); f++) {
+                            if (asym) {
+                                const double p_frq = f0 + out_freqs[f];
+                                const double m_frq = f0 - out_freqs[f];
+                                interped[f]        = basis(zspec, m_frq) - basis(zspec, p_frq);
+                            } else {
+                                const double frq = f0 + out_freqs[f];
+                                interped[f]      = basis(zspec, frq);
+                            }
                         }
+                    } else {
+                        Eigen::Map<Eigen::ArrayXf>(interped.GetDataPointer(), out_freqs.rows()) =
+                            (weights * zdata.cast<double>().matrix()).array().cast<float>();
                     }
                     if (ref_arg) {
                         interped *= (100. / ref_it.Get());
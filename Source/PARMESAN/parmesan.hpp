@@ -2,9 +2,161 @@
 
 #include "Macro.h"
 #include <Eigen/Dense>
+#include <cmath>
 #include <functional>
+#include <random>
+#include <type_traits>
 #include <unsupported/Eigen/MatrixFunctions>
 
+/*
+ *  The value part of a double or a ceres::Jet, for decisions that should not be differentiated
+ */
+template <typename T> double ScalarValue(T const &x) {
+    if constexpr (std::is_arithmetic_v<T>) {
+        return x;
+    } else {
+        return x.a;
+    }
+}
+
+/*
+ *  Matrix exponential that also works with ceres::Jet, so that models can be differentiated
+ *  automatically. Doubles use Eigen's implementation. Other scalars use a [6/6] Pade approximant with
+ *  scaling and squaring (Golub & Van Loan, Algorithm 11.3.1), with the scaling chosen from the values
+ *  so that it is not differentiated.
+ */
+template <typename AugmentedMatrix> AugmentedMatrix Expm(AugmentedMatrix const &A) {
+    using T      = typename AugmentedMatrix::Scalar;
+    const long N = AugmentedMatrix::RowsAtCompileTime;
+    if constexpr (std::is_same_v<T, double>) {
+        return A.exp();
+    } else {
+        Eigen::Matrix<double, N, N> const values =
+            A.unaryExpr([](T const &x) { return ScalarValue(x); });
+        int exponent;
+        std::frexp(values.cwiseAbs().rowwise().sum().maxCoeff(), &exponent);
+        int const             s = std::max(0, exponent + 1); // Scale the norm below 1/2
+        AugmentedMatrix const X = A * T(std::ldexp(1., -s));
+
+        int const       q  = 6;
+        double          c  = 0.5;
+        AugmentedMatrix Xk = X;
+        AugmentedMatrix P  = AugmentedMatrix::Identity() + X * T(c);
+        AugmentedMatrix Q  = AugmentedMatrix::Identity() - X * T(c);
+        for (int k = 2; k <= q; k++) {
+            c  = c * (q - k + 1) / (k * (2 * q - k + 1));
+            Xk = X * Xk;
+            P += Xk * T(c);
+            Q += Xk * T((k % 2) ? -c : c);
+        }
+        AugmentedMatrix E = Q.partialPivLu().solve(P);
+        for (int k = 0; k < s; k++) {
+            E = E * E;
+        }
+        return E;
+    }
+}
+
+/*
+ *  Calculates exp(A t) for a fixed augmented matrix A and any number of durations t. Relaxation and
+ *  exchange matrices do not depend on the sequence and have real eigenvalues, so A is diagonalised
+ *  once and each propagator is a diagonal scaling of its eigenvectors. If A has complex
+ *  eigenvalues or is defective (the eigenvectors are ill-conditioned), or if reference is set, each
+ *  propagator is calculated with Eigen's Pade approximant instead. The decomposition costs about
+ *  three Pade exponentials, so this is only worthwhile when A is needed for several durations. Jets
+ *  cannot be passed through EigenSolver, so they always use Expm.
+ */
+template <typename AugmentedMatrix> class Propagator {
+  public:
+    using T          = typename AugmentedMatrix::Scalar;
+    static const int N = AugmentedMatrix::RowsAtCompileTime;
+    using Vector     = Eigen::Array<T, N, 1>;
+
+    explicit Propagator(AugmentedMatrix const &A, bool const reference = false) : m_A{A} {
+        if constexpr (std::is_same_v<T, double>) {
+            if (reference) {
+                return;
+            }
+            Eigen::EigenSolver<AugmentedMatrix> const eig(A);
+            if (eig.info() != Eigen::Success || (eig.eigenvalues().imag().array() != 0.).any()) {
+                return;
+            }
+            m_V = eig.eigenvectors().real();
+            Eigen::PartialPivLU<AugmentedMatrix> const lu(m_V);
+            if (lu.rcond() < 1e-6) {
+                return;
+            }
+            m_Vinv     = lu.inverse();
+            m_lambda   = eig.eigenvalues().real();
+            m_diagonal = true;
+        }
+    }
+
+    AugmentedMatrix operator()(double const t) const {
+        if (m_diagonal) {
+            return m_V * (m_lambda * t).exp().matrix().asDiagonal() * m_Vinv;
+        } else {
+            return Expm(AugmentedMatrix(m_A * T(t)));
+        }
+    }
+
+    bool diagonal() const { return m_diagonal; }
+
+  private:
+    AugmentedMatrix m_A, m_V, m_Vinv;
+    Vector          m_lambda;
+    bool            m_diagonal = false;
+};
+
+/*
+ *  Integer matrix power by repeated squaring, which avoids the set-up cost of Eigen's general
+ *  MatrixPower and also works with ceres::Jet. If reference is set Eigen's version is used for
+ *  doubles, for checking.
+ */
+template <typename AugmentedMatrix>
+AugmentedMatrix IntPower(AugmentedMatrix const &X, int n, bool const reference = false) {
+    if constexpr (std::is_same_v<typename AugmentedMatrix::Scalar, double>) {
+        if (reference) {
+            return X.pow(n);
+        }
+    }
+    AugmentedMatrix result = AugmentedMatrix::Identity();
+    AugmentedMatrix square = X;
+    while (n > 0) {
+        if (n & 1) {
+            result = result * square;
+        }
+        n >>= 1;
+        if (n > 0) {
+            square = square * square;
+        }
+    }
+    return result;
+}
+
+/*
+ *  Compare the signals from a model against the same model using the reference (Pade and Eigen
+ *  MatrixPower) propagators at n random points within the bounds. Returns the largest difference
+ *  relative to the largest signal.
+ */
+template <typename Model> double CheckPropagators(Model const &model, int const n) {
+    Model reference         = model;
+    reference.use_reference = true;
+    std::mt19937                           gen(0);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    double                                 worst = 0;
+    for (int i = 0; i < n; i++) {
+        typename Model::VaryingArray const v =
+            model.lo +
+            (model.hi - model.lo) * Model::VaryingArray::NullaryExpr([&] { return uniform(gen); });
+        typename Model::FixedArray const f;
+        Eigen::ArrayXd const             s = model.signal(v, f);
+        Eigen::ArrayXd const             r = reference.signal(v, f);
+        worst = std::max(worst, (s - r).abs().maxCoeff() / r.abs().maxCoeff());
+    }
+    return worst;
+}
+
 template <typename AugmentedMatrix>
 auto SolveSteadyState(AugmentedMatrix const &X)
     -> Eigen::Vector<typename AugmentedMatrix::Scalar, AugmentedMatrix::RowsAtCompileTime> {
@@ -19,7 +171,7 @@ auto SolveSteadyState(AugmentedMatrix const &X)
     ReducedVector   b    = -X.template topRightCorner<N - 1, 1>();
     ReducedVector   m_ss = Xr.partialPivLu().solve(b);
     AugmentedVector m_aug;
-    m_aug << m_ss, 1.;
+    m_aug << m_ss, T(1.);
     return m_aug;
 }
 
@@ -37,8 +189,8 @@ auto GeometricAvg(AugmentedMatrix const &X,
 
     AugmentedMatrix const LHS = (AugmentedMatrix::Identity() - X);
     ReducedVector const   RHS = ((AugmentedMatrix::Identity() - Xn) * a).template head<N - 1>() -
-                              (n * LHS.template topRightCorner<N - 1, 1>());
+                              (T(n) * LHS.template topRightCorner<N - 1, 1>());
     ReducedVector const m_gm =
-        LHS.template topLeftCorner<N - 1, N - 1>().partialPivLu().solve(RHS) / n;
+        LHS.template topLeftCorner<N - 1, N - 1>().partialPivLu().solve(RHS) / T(n);
     return m_gm;
 }
@@ -0,0 +1,108 @@
+#include "rf_bloch.h"
+#include "Log.h"
+
+RFPulseCache::RFPulseCache(RFPulse const &pulse, double const scale) {
+    auto const n = pulse.B1x.rows();
+    if (pulse.timestep.rows() != n) {
+        QI::Fail("Pulse has {} samples but {} timesteps", n, pulse.timestep.rows());
+    }
+    angle.resize(n);
+    ux.resize(n);
+    uy.resize(n);
+    dt        = pulse.timestep * 1e-6;
+    duration  = dt.sum();
+    t_active  = 0.;
+    flip      = 0.;
+    int_b1_sq = 0.;
+    max_b1    = 0.;
+    for (Eigen::Index ii = 0; ii < n; ii++) {
+        double const B1x = pulse.B1x[ii] * scale;
+        double const B1y = pulse.B1y[ii] * scale;
+        double const b1  = sqrt(B1x * B1x + B1y * B1y);
+        angle[ii]        = b1 * dt[ii];
+        if (b1 > 0.) {
+            ux[ii] = B1x / b1;
+            uy[ii] = B1y / b1;
+            t_active += dt[ii];
+        } else {
+            ux[ii] = 1.;
+            uy[ii] = 0.;
+        }
+        flip += angle[ii];
+        int_b1_sq += b1 * b1 * dt[ii];
+        max_b1 = std::max(max_b1, b1);
+    }
+}
+
+namespace {
+// Rotation about the effective field for one sample. The sense matches the augmented matrices in
+// the PARMESAN models, i.e. dM/dt = w x M with w = (B1x, -B1y, -dw)
+inline Eigen::Matrix3d
+Rodrigues(RFPulseCache const &c, Eigen::Index const ii, double const B1, double const dw) {
+    double const a  = B1 * c.angle[ii];
+    double const wx = a * c.ux[ii];
+    double const wy = -a * c.uy[ii];
+    double const wz = -dw * c.dt[ii];
+    double const th = sqrt(wx * wx + wy * wy + wz * wz);
+    if (th == 0.) {
+        return Eigen::Matrix3d::Identity();
+    }
+    Eigen::Vector3d const n(wx / th, wy / th, wz / th);
+    Eigen::Matrix3d       K;
+    K << 0, -n[2], n[1], //
+        n[2], 0, -n[0],  //
+        -n[1], n[0], 0;
+    double const cs = cos(th);
+    return cs * Eigen::Matrix3d::Identity() + sin(th) * K + (1. - cs) * n * n.transpose();
+}
+} // namespace
+
+Eigen::Matrix3d RFRotation(RFPulseCache const &c, double const B1, double const dw) {
+    Eigen::Matrix3d rot = Eigen::Matrix3d::Identity();
+    for (Eigen::Index ii = 0; ii < c.size(); ii++) {
+        rot = Rodrigues(c, ii, B1, dw) * rot;
+    }
+    return rot;
+}
+
+Eigen::Matrix4d RFPropagator(
+    RFPulseCache const &c, double const R1, double const R2, double const B1, double const dw) {
+    // Track the affine map m -> A m + b, which is cheaper than multiplying augmented matrices
+    Eigen::Matrix3d A = Eigen::Matrix3d::Identity();
+    Eigen::Vector3d b = Eigen::Vector3d::Zero();
+    Eigen::Vector3d E, r;
+    double          last_dt = -1.;
+    for (Eigen::Index ii = 0; ii < c.size(); ii++) {
+        if (c.dt[ii] != last_dt) {
+            // Most pulses have a fixed timestep, so only pay for the exponentials once
+            last_dt         = c.dt[ii];
+            double const E1 = exp(-R1 * 0.5 * last_dt);
+            double const E2 = exp(-R2 * 0.5 * last_dt);
+            E << E2, E2, E1;
+            r << 0., 0., 1. - E1;
+        }
+        Eigen::Matrix3d const rot  = Rodrigues(c, ii, B1, dw);
+        Eigen::Matrix3d const step = E.asDiagonal() * rot * E.asDiagonal();
+        Eigen::Vector3d const off  = E.asDiagonal() * (rot * r) + r;
+        A                          = step * A;
+        b                          = step * b + off;
+    }
+    Eigen::Matrix4d P        = Eigen::Matrix4d::Zero();
+    P.topLeftCorner<3, 3>()  = A;
+    P.topRightCorner<3, 1>() = b;
+    P(3, 3)                  = 1.;
+    return P;
+}
+
+PrepPulse SummarisePulse(RFPulseCache const &c) {
+    Eigen::Vector3d m(0., 0., 1.);
+    double          T_long  = 0.;
+    double          T_trans = 0.;
+    for (Eigen::Index ii = 0; ii < c.size(); ii++) {
+        m = Rodrigues(c, ii, 1., 0.) * m;
+        T_trans += m.head(2).norm() * c.dt[ii];
+        T_long += std::abs(m[2]) * c.dt[ii];
+    }
+    double const FAeff = atan2(m.head(2).norm(), m[2]);
+    return PrepPulse{FAeff, c.int_b1_sq, T_long, T_trans};
+}
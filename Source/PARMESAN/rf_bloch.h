@@ -0,0 +1,40 @@
+#pragma once
+
+#include "rf_pulse.h"
+#include <Eigen/Dense>
+
+double constexpr GammaUT = 267.52219; // radians per second per uT
+
+/*
+ * The parts of a pulse simulation that only depend on the pulse shape. Built once per pulse, then
+ * each simulation only needs a sin/cos per sample for the rotation and exponentials for relaxation
+ * when the timestep changes.
+ */
+struct RFPulseCache {
+    Eigen::ArrayXd angle;  // Nominal rotation per sample, |B1| * dt
+    Eigen::ArrayXd ux, uy; // Direction of B1 in the transverse plane
+    Eigen::ArrayXd dt;
+    double         duration, t_active, flip, int_b1_sq, max_b1;
+
+    RFPulseCache(RFPulse const &pulse, double const scale = 1.);
+    Eigen::Index size() const { return angle.rows(); }
+};
+
+/*
+ * Rotation for the whole pulse with no relaxation. B1 scales the nominal amplitude, dw is the
+ * off-resonance in radians per second. Each sample uses the closed-form Rodrigues rotation.
+ */
+Eigen::Matrix3d RFRotation(RFPulseCache const &c, double const B1, double const dw);
+
+/*
+ * Augmented 4x4 propagator for the whole pulse (Mx, My, Mz, 1) with relaxation, using a symmetric
+ * split between each Rodrigues rotation and the relaxation factors. Matches the PARMESAN models.
+ */
+Eigen::Matrix4d RFPropagator(
+    RFPulseCache const &c, double const R1, double const R2, double const B1, double const dw);
+
+/*
+ * The effective flip-angle and relaxation times used by the transient models, with the
+ * magnetization followed on-resonance from equilibrium
+ */
+PrepPulse SummarisePulse(RFPulseCache const &c);
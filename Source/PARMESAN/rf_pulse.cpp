@@ -1,5 +1,6 @@
 #include "JSON.h"
 #include "Log.h"
+#include "rf_bloch.h"
 #include "rf_pulse.h"
 
 void from_json(const json &j, RFPulse &p) {
@@ -32,6 +33,12 @@ void to_json(json &j, MTPulse const &p) {
 }
 
 void from_json(const json &j, PrepPulse &p) {
+    if (j.contains("B1x")) {
+        // A pulse shape instead of pre-calculated values, optionally in uT
+        RFPulse const shape = j.get<RFPulse>();
+        p = SummarisePulse(RFPulseCache(shape, j.value("uT", false) ? GammaUT : 1.));
+        return;
+    }
     p.FAeff = j.at("FAeff").get<double>() * M_PI / 180.0;
     j.at("int_b1_sq").get_to(p.int_b1_sq);
     j.at("T_long").get_to(p.T_long);
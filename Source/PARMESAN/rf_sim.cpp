@@ -10,7 +10,6 @@
  */
 
 #include <Eigen/Core>
-#include <unsupported/Eigen/MatrixFunctions>
 
 // #define QI_DEBUG_BUILD 1
 
@@ -18,7 +17,9 @@
 #include "JSON.h"
 #include "Macro.h"
 #include "Util.h"
+#include "itkMultiThreaderBase.h"
 
+#include "rf_bloch.h"
 #include "rf_pulse.h"
 #include "transient_sequence.h"
 
@@ -45,91 +46,57 @@ int rf_sim_main(args::Subparser &parser) {
     parser.Parse();
     QI::CheckPos(in_file);
 
-    double const R1 = 1. / 1.0;
-    double const R2 = 1. / 0.1;
-    double const PD = 1.;
-
-    using AugMat = Eigen::Matrix<double, 4, 4>;
-    using AugVec = Eigen::Vector<double, 4>;
-    AugMat R;
-    R << -R2, 0, 0, 0,      //
-        0, -R2, 0, 0,       //
-        0, 0, -R1, PD * R1, //
-        0, 0, 0, 0;
-
-    AugVec m0{0, 0, PD, 1.};
-
     QI::Log(verbose, "Reading pulses");
     json input = QI::ReadJSON(in_file.Get());
 
-    std::vector<RFPulse>   input_pulses = input.at("pulses").get<std::vector<RFPulse>>();
-    std::vector<PrepPulse> output_pulses;
-
-    double const scale = uT ? 267.52219 : 1.0; // radians per second per uT
-
-    for (auto const pulse : input_pulses) {
-        double int_b1    = 0;
-        double int_b1_sq = 0;
-        double max_b1    = 0;
-        double eff_tv    = 0;
-        double eff_long  = 0;
-
-        double tact_total = 0;
-        AugMat C_rf       = AugMat::Identity();
-        AugMat C_both     = AugMat::Identity();
-        AugVec m_rf       = m0;
-        for (long ii = 0; ii < pulse.B1x.rows(); ii++) {
-
-            double const &B1x = pulse.B1x[ii] * scale;
-            double const &B1y = pulse.B1y[ii] * scale;
-            auto const    dt  = pulse.timestep[ii] * 1e-6;
-
-            double b1_sq = (B1x * B1x + B1y * B1y);
-            double b1    = sqrt(b1_sq);
-            int_b1 += b1 * dt;
-            int_b1_sq += b1_sq * dt;
-            if (b1 > max_b1) {
-                max_b1 = b1;
-            }
-
-            AugMat rf;
-            rf << 0, 0, -B1y, 0, //
-                0, 0, -B1x, 0,   //
-                B1y, B1x, 0, 0,  //
-                0, 0, 0, 0;
-
-            AugMat const A_rf   = (rf * dt).exp();
-            AugMat const both   = R + rf;
-            AugMat const A_both = (both * dt).exp();
-
-            C_rf   = A_rf * C_rf;
-            C_both = A_both * C_both;
-            m_rf   = A_rf * m_rf;
-            if (b1_sq > 0.) {
-                tact_total += dt;
-            }
-            eff_tv += sqrt(m_rf[0] * m_rf[0] + m_rf[1] * m_rf[1]) * dt;
-            eff_long += std::abs(m_rf[2]) * dt;
-        }
-
-        double const eff_flip_onres = atan2(m_rf.head(2).norm(), m_rf[2]);
-        // double const p1             = (int_b1 / tact_total) / max_b1;
-        // double const p2             = (int_b1_sq / tact_total) / (max_b1 * max_b1);
-
-        output_pulses.push_back(PrepPulse{round_sig(eff_flip_onres, 3),
-                                          round_sig(int_b1_sq, 4),
-                                          round_sig(eff_long, 4),
-                                          round_sig(eff_tv, 4)});
-
-        AugMat approx;
-        approx << 0, 0, 0, 0, //
-            0, 0, 0, 0,       //
-            0, 0, exp(-R2 * eff_tv) * cos(eff_flip_onres),
-            PD * (1 - exp(-R1 * eff_long)), //
-            0, 0, 0, 1;
+    std::vector<RFPulse> const input_pulses = input.at("pulses").get<std::vector<RFPulse>>();
+    double const               scale        = uT ? GammaUT : 1.0;
+    std::vector<RFPulseCache>  caches;
+    std::vector<PrepPulse>     output_pulses;
+    for (auto const &pulse : input_pulses) {
+        caches.emplace_back(pulse, scale);
+        auto const p = SummarisePulse(caches.back());
+        output_pulses.push_back(PrepPulse{round_sig(p.FAeff, 3),
+                                          round_sig(p.int_b1_sq, 4),
+                                          round_sig(p.T_long, 4),
+                                          round_sig(p.T_trans, 4)});
     }
     json output;
     output["pulses"] = output_pulses;
+
+    if (input.contains("grid")) {
+        // Longitudinal magnetization after each pulse, starting from equilibrium, for every
+        // combination of off-resonance, B1 and T2. f0 varies fastest.
+        json const &         grid = input["grid"];
+        Eigen::ArrayXd const f0   = QI::ArrayFromJSON(grid, "f0", 1.);
+        Eigen::ArrayXd const B1   = QI::ArrayFromJSON(grid, "B1", 1.);
+        Eigen::ArrayXd const T2   = QI::ArrayFromJSON(grid, "T2", 1.);
+        double const         T1   = grid.value("T1", 1.0);
+        Eigen::Index const   n    = f0.rows() * B1.rows() * T2.rows();
+        QI::Log(verbose, "Simulating {} pulses at {} points", caches.size(), n);
+
+        auto mt = itk::MultiThreaderBase::New();
+        mt->SetNumberOfWorkUnits(threads.Get());
+        json tables = json::array();
+        for (auto const &c : caches) {
+            Eigen::ArrayXd Mz(n);
+            mt->ParallelizeArray(
+                0,
+                n,
+                [&](itk::SizeValueType const index) {
+                    Eigen::Index const    i0 = index % f0.rows();
+                    Eigen::Index const    i1 = (index / f0.rows()) % B1.rows();
+                    Eigen::Index const    i2 = index / (f0.rows() * B1.rows());
+                    Eigen::Matrix4d const P =
+                        RFPropagator(c, 1. / T1, 1. / T2[i2], B1[i1], 2. * M_PI * f0[i0]);
+                    Mz[index] = P(2, 2) + P(2, 3);
+                },
+                nullptr);
+            tables.push_back(json{{"Mz", Mz}});
+        }
+        output["grid"]   = grid;
+        output["tables"] = tables;
+    }
     fmt::print("{}\n", output.dump(2));
     QI::Log(verbose, "Finished.");
     return EXIT_SUCCESS;
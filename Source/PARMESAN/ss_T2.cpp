@@ -55,10 +55,16 @@ auto SS_T1T2_Model::signal(VaryingArray const &v, FixedArray const &) const -> Q
     Eigen::ArrayXd sig(sequence.size());
     for (long is = 0, ie = sequence.size(); is < ie; is++) {
         AugMat const rfp =
-            RF(sequence.prep_FA[is], sequence.prep_Trf, sequence.prep_df[is], sequence.prep_p1);
+            sequence.prep_pulse ?
+                RFPropagator(*sequence.prep_pulse,
+                             R1,
+                             R2,
+                             B1plus * sequence.prep_FA[is] / sequence.prep_pulse->flip,
+                             2. * M_PI * (f0 + sequence.prep_df[is])) :
+                RF(sequence.prep_FA[is], sequence.prep_Trf, sequence.prep_df[is], sequence.prep_p1);
         AugMat const rf1     = RF(sequence.FA[is], sequence.Trf, 0., 1.);
         AugMat const TR_mat  = S * Rrd * rf1;
-        AugMat const seg_mat = TR_mat.pow(sequence.spokes_per_seg);
+        AugMat const seg_mat = IntPower(TR_mat, sequence.spokes_per_seg, use_reference);
 
         // Calculate the steady-state just before the segment readout
         AugMat const X    = ramp * S * rfp * ramp * seg_mat;
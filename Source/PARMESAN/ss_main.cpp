@@ -20,6 +20,7 @@
 #include "ModelFitFilter.h"
 #include "SimulateModel.h"
 #include "Util.h"
+#include "parmesan.hpp"
 
 #include "ss_T2.h"
 #include "ss_model.h"
@@ -31,12 +32,18 @@
 int rufis_ss_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "INPUT", "Input MUPA file");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
+    args::Flag warm(parser, "WARM", "Start each voxel from the last converged voxel", {"warm"});
     args::Flag                   T2(parser, "T2", "Fit T2 model", {"T2"});
     args::Flag                   MT(parser, "MT", "Fit MT model", {"MT"});
     args::ValueFlag<std::string> ls_arg(
         parser, "LINESHAPE", "Path to lineshape file", {"lineshape"});
+    args::ValueFlag<int>         check_propagators(
+        parser, "N", "Compare to Pade exponentials at N points", {"check-propagators"});
     parser.Parse();
-    QI::CheckPos(input_path);
+    if (!check_propagators) {
+        QI::CheckPos(input_path);
+    }
     QI::Log(verbose, "Reading sequence parameters");
     json       doc = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
     SSSequence sequence(doc);
@@ -44,7 +51,13 @@ int rufis_ss_main(args::Subparser &parser) {
     auto process = [&](auto                                       model,
                        const std::string &                        model_name,
                        typename decltype(model)::FixedNames const fixed) {
-        if (simulate) {
+        if (check_propagators) {
+            double const diff = CheckPropagators(model, check_propagators.Get());
+            fmt::print("Largest relative difference: {:g}\n", diff);
+            if (diff > 1e-8) {
+                QI::Fail("Propagators differ from the reference by {:g}", diff);
+            }
+        } else if (simulate) {
             QI::SimulateModel<decltype(model), false>(doc,
                                                       model,
                                                       fixed,
@@ -52,13 +65,26 @@ int rufis_ss_main(args::Subparser &parser) {
                                                       mask.Get(),
                                                       verbose,
                                                       simulate.Get(),
-                                                      subregion.Get());
+                                                      subregion.Get(),
+                                                      int16);
         } else {
             using FitType = QI::ScaledNumericDiffFit<decltype(model), decltype(model)::NS>;
             FitType fit(model);
+            fit.warm_start = warm.Get();
+            fit.solver     = QI::ReadSolverOptions(doc, solver.Get());
 
             auto fit_filter =
                 QI::ModelFitFilter<FitType>::New(&fit, verbose, covar, resids, subregion.Get());
+            fit_filter->SetCheckpoint(checkpoint.Get(),
+                                      slab.Get(),
+                                      {{"input", doc},
+                                       {"T2", T2.Get()},
+                                       {"MT", MT.Get()},
+                                       {"lineshape", ls_arg.Get()}});
+            fit_filter->SetOutputStatus(fit_status);
+            fit_filter->SetOutputProfile(profile);
+            fit_filter->SetPackOutputs(pack);
+            fit_filter->SetInt16Outputs(int16);
             fit_filter->ReadInputs({input_path.Get()}, fixed, mask.Get());
             fit_filter->Update();
             fit_filter->WriteOutputs(prefix.Get() + model_name);
@@ -66,6 +92,9 @@ int rufis_ss_main(args::Subparser &parser) {
     };
 
     if (MT) {
+        if (sequence.prep_pulse) {
+            QI::Fail("The MT model does not support shaped prep pulses");
+        }
         QI::Log(verbose, "Using MT model");
         QI::Log(verbose, "Reading lineshape file: {}", ls_arg.Get());
         json        ls_file = QI::ReadJSON(ls_arg.Get());
@@ -28,10 +28,17 @@ auto SS_T1_Model::signal(VaryingArray const &v, FixedArray const &) const -> QI_
             0, 1;
 
         AugMat TR_mat  = Rrd * rf1;
-        AugMat seg_mat = TR_mat.pow(sequence.spokes_per_seg);
-
+        AugMat seg_mat = IntPower(TR_mat, sequence.spokes_per_seg, use_reference);
+
+        // No T2 or B0 in this model, so a shaped pulse is only a rotation at the nominal offset
+        T const prep_cos =
+            sequence.prep_pulse ?
+                RFRotation(*sequence.prep_pulse,
+                           B1 * sequence.prep_FA[is] / sequence.prep_pulse->flip,
+                           sequence.prep_df[is] * 2. * M_PI)(2, 2) :
+                cos(B1 * sequence.prep_FA[is]);
         AugMat rfp;
-        rfp << cos(B1 * sequence.prep_FA[is]), 0, //
+        rfp << prep_cos, 0, //
             0, 1;
 
         // Calculate the steady-state just before the segment readout
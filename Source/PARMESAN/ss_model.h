@@ -9,6 +9,7 @@ struct SS_T1_Model : QI::Model<double, double, 3, 0> {
     VaryingArray const start{30.0, 1.0, 1};
     VaryingArray const lo{0.1, 0.5, 0.5};
     VaryingArray const hi{60.0, 5.0, 1.5};
+    bool               use_reference = false; // Pade exponentials and MatrixPower, for checking
 
     std::array<std::string, NV> const varying_names{"M0", "T1", "B1"};
 
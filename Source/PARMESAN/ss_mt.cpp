@@ -75,7 +75,7 @@ auto SS_MT_Model::signal(VaryingArray const &v, FixedArray const &) const -> QI_
                               sequence.prep_p2);
         AugMat const rf1     = RF(sequence.FA[is], sequence.Trf, 0., 1., 1.);
         AugMat       TR_mat  = S * Rrd * rf1;
-        AugMat       seg_mat = TR_mat.pow(sequence.spokes_per_seg);
+        AugMat       seg_mat = IntPower(TR_mat, sequence.spokes_per_seg, use_reference);
 
         // Calculate the steady-state just before the segment readout
         AugMat X    = AugMat::Identity();
@@ -11,9 +11,17 @@ void from_json(const json &j, SSSequence &s) {
     QI::GetJSON(j, "Tramp", s.Tramp);
     QI::GetJSON(j, "spokes_per_seg", s.spokes_per_seg);
     s.FA = QI::ArrayFromJSON(j, "FA", M_PI / 180.0);
-    QI::GetJSON(j, "prep_p1", s.prep_p1);
-    QI::GetJSON(j, "prep_p2", s.prep_p2);
-    QI::GetJSON(j, "prep_Trf", s.prep_Trf);
+    if (j.contains("prep_pulse")) {
+        auto const &p = j.at("prep_pulse");
+        s.prep_pulse.emplace(p.get<RFPulse>(), p.value("uT", false) ? GammaUT : 1.);
+        if (s.prep_pulse->flip <= 0.) {
+            QI::Fail("Prep pulse shape has zero amplitude");
+        }
+    } else {
+        QI::GetJSON(j, "prep_p1", s.prep_p1);
+        QI::GetJSON(j, "prep_p2", s.prep_p2);
+        QI::GetJSON(j, "prep_Trf", s.prep_Trf);
+    }
     s.prep_FA = QI::ArrayFromJSON(j, "prep_FA", M_PI / 180.0, s.FA.rows());
     s.prep_df = QI::ArrayFromJSON(j, "prep_df", 1., s.FA.rows());
 }
\ No newline at end of file
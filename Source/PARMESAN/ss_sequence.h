@@ -1,13 +1,16 @@
 #pragma once
 
 #include "JSON.h"
+#include "rf_bloch.h"
+#include <optional>
 
 struct SSSequence {
-    double         TR, Trf, Tramp;
-    Eigen::ArrayXd FA;
-    int            spokes_per_seg;
-    double         prep_p1, prep_p2, prep_Trf;
-    Eigen::ArrayXd prep_FA, prep_df;
-    Eigen::Index   size() const;
+    double                      TR, Trf, Tramp;
+    Eigen::ArrayXd              FA;
+    int                         spokes_per_seg;
+    double                      prep_p1 = 1., prep_p2 = 1., prep_Trf = 0.;
+    Eigen::ArrayXd              prep_FA, prep_df;
+    std::optional<RFPulseCache> prep_pulse; // Shape scaled to each prep_FA, replaces p1/p2/Trf
+    Eigen::Index                size() const;
 };
 void from_json(const json &j, SSSequence &s);
\ No newline at end of file
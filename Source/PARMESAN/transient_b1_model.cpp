@@ -3,15 +3,14 @@
 #include "parmesan.hpp"
 #include "transient_b1_model.h"
 
-using AugMat = Eigen::Matrix<double, 4, 4>;
-using AugVec = Eigen::Vector<double, 4>;
-
-auto MUPAB1Model::signal(VaryingArray const &v, FixedArray const &) const -> QI_ARRAY(double) {
-    using T = double;
+template <typename T>
+auto MUPAB1Model::signal_t(QI_ARRAYN(T, NV) const &v, FixedArray const &) const -> QI_ARRAY(T) {
+    using AugMat = Eigen::Matrix<T, 4, 4>;
+    using AugVec = Eigen::Vector<T, 4>;
 
     T const &M0 = v[0];
-    T const &R1 = 1. / v[1];
-    T const &R2 = 1. / v[2];
+    T const  R1 = 1. / v[1];
+    T const  R2 = 1. / v[2];
     T const &B1 = v[3];
 
     QI_DBVEC(v);
@@ -24,64 +23,73 @@ auto MUPAB1Model::signal(VaryingArray const &v, FixedArray const &) const -> QI_
     QI_DB(sequence.spokes_per_seg)
     QI_DBVEC(sequence.groups_per_seg)
 
-    AugMat R;
-    R << -R2, 0, 0, 0, //
-        0, -R2, 0, 0,  //
-        0, 0, -R1, R1, //
-        0, 0, 0, 0;
+    AugMat R = AugMat::Zero();
+    R(0, 0)  = -R2;
+    R(1, 1)  = -R2;
+    R(2, 2)  = -R1;
+    R(2, 3)  = R1;
+
+    AugMat S = AugMat::Zero();
+    S(2, 2)  = T(1.);
+    S(3, 3)  = T(1.);
 
-    AugMat const Rrd  = (R * sequence.TR).exp();
-    AugMat const S    = Eigen::DiagonalMatrix<double, 4, 4>({0, 0, 1., 1.}).toDenseMatrix();
-    AugMat const ramp = (R * sequence.Tramp).exp();
+    AugMat const Rrd  = Expm(AugMat(R * T(sequence.TR)));
+    AugMat const ramp = Expm(AugMat(R * T(sequence.Tramp)));
 
     // Setup readout segment matrices
-    std::vector<AugMat> TR_mats(sequence.size());
-    std::vector<AugMat> seg_mats(sequence.size());
+    std::array<AugMat, RUFISSequence::MaxSegments> TR_mats;
+    std::array<AugMat, RUFISSequence::MaxSegments> seg_mats;
     for (int is = 0; is < sequence.size(); is++) {
-        AugMat rf;
-        float  B1x = B1 * sequence.FA[is] / sequence.Trf[is];
-        rf << 0, 0, 0, 0,  //
-            0, 0, B1x, 0,  //
-            0, -B1x, 0, 0, //
-            0, 0, 0, 0;
-        AugMat const Ard = ((R + rf) * sequence.Trf[is]).exp();
+        // Segments usually share a readout, and this is the expensive part
+        if (is > 0 && sequence.FA[is] == sequence.FA[is - 1] &&
+            sequence.Trf[is] == sequence.Trf[is - 1] &&
+            sequence.groups_per_seg[is] == sequence.groups_per_seg[is - 1]) {
+            TR_mats[is]  = TR_mats[is - 1];
+            seg_mats[is] = seg_mats[is - 1];
+            continue;
+        }
+        T const B1x = B1 * sequence.FA[is] / sequence.Trf[is];
+        AugMat  rf  = AugMat::Zero();
+        rf(1, 2)    = B1x;
+        rf(2, 1)    = -B1x;
+        AugMat const Ard = Expm(AugMat((R + rf) * T(sequence.Trf[is])));
         TR_mats[is]      = S * Rrd * Ard;
-        seg_mats[is]     = TR_mats[is].pow(sequence.spokes_per_seg / sequence.groups_per_seg[is]);
+        seg_mats[is]     = IntPower(
+            TR_mats[is], sequence.spokes_per_seg / sequence.groups_per_seg[is], use_reference);
     }
 
     // Setup pulse matrices
-    std::vector<AugMat> prep_mats(sequence.size());
+    std::array<AugMat, RUFISSequence::MaxSegments> prep_mats;
     for (int is = 0; is < sequence.size(); is++) {
-        auto const & name = sequence.prep[is];
-        auto const & p    = sequence.prep_pulses[name];
-        double const E2   = exp(-R2 * p.T_trans);
-        double const E1   = exp(-R1 * p.T_long);
-        AugMat       C;
-        C << 0, 0, 0, 0,                            //
-            0, 0, 0, 0,                             //
-            0, 0, E1 * E2 * cos(p.FAeff), (1 - E1), //
-            0, 0, 0, 1;
-        prep_mats[is] = C;
+        auto const &p  = sequence.prep_list[is];
+        T const     E2 = exp(-R2 * p.T_trans);
+        T const     E1 = exp(-R1 * p.T_long);
+        AugMat      C  = AugMat::Zero();
+        C(2, 2)        = E1 * E2 * cos(p.FAeff);
+        C(2, 3)        = 1. - E1;
+        C(3, 3)        = T(1.);
+        prep_mats[is]  = C;
     }
 
     // First calculate the system matrix and get SS
     QI_DBMAT(R);
     AugMat X = AugMat::Identity();
     for (int is = 0; is < sequence.size(); is++) {
+        AugMat const group = ramp * seg_mats[is] * ramp * prep_mats[is];
         for (int ig = 0; ig < sequence.groups_per_seg[is]; ig++) {
-            X = ramp * seg_mats[is] * ramp * prep_mats[is] * X;
+            X = group * X;
         }
     }
     AugVec m_ss = SolveSteadyState(X);
     QI_DBMAT(X);
     QI_DBVEC(m_ss);
     // Now loop through the segments and record the signal for each
-    Eigen::ArrayXd sig(sequence.size());
-    AugVec         m_current = m_ss;
+    QI_ARRAY(T) sig(sequence.size());
+    AugVec      m_current = m_ss;
     for (int is = 0; is < sequence.size(); is++) {
-        double segment_accumulate = 0.;
+        T segment_accumulate(0.);
         for (int ig = 0; ig < sequence.groups_per_seg[is]; ig++) {
-            AugVec const m_prepped = ramp * prep_mats[is] * m_current;
+            AugVec const m_prepped = ramp * (prep_mats[is] * m_current);
             auto const   m_group_avg =
                 GeometricAvg(TR_mats[is],
                              seg_mats[is],
@@ -91,11 +99,17 @@ auto MUPAB1Model::signal(VaryingArray const &v, FixedArray const &) const -> QI_
             QI_DBVEC(m_group_avg);
             QI_DB(sin(B1 * sequence.FA[is]));
             QI_DB(segment_accumulate);
-            m_current = ramp * seg_mats[is] * m_prepped;
+            m_current = ramp * (seg_mats[is] * m_prepped);
         }
         QI_DB(segment_accumulate);
-        sig[is] = M0 * segment_accumulate / sequence.groups_per_seg[is];
+        sig[is] = M0 * segment_accumulate / double(sequence.groups_per_seg[is]);
     }
     QI_DBVEC(sig);
     return sig;
-}
\ No newline at end of file
+}
+
+using Jet = ceres::Jet<double, MUPAB1Model::NV>;
+template auto MUPAB1Model::signal_t<double>(QI_ARRAYN(double, NV) const &, FixedArray const &) const
+    -> QI_ARRAY(double);
+template auto MUPAB1Model::signal_t<Jet>(QI_ARRAYN(Jet, NV) const &, FixedArray const &) const
+    -> QI_ARRAY(Jet);
@@ -20,6 +20,7 @@
 #include "ModelFitFilter.h"
 #include "SimulateModel.h"
 #include "Util.h"
+#include "parmesan.hpp"
 
 #include "transient_b1_model.h"
 #include "transient_model.h"
@@ -31,24 +32,69 @@
 int transient_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "INPUT", "Input MUPA file");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
+    args::Flag warm(parser, "WARM", "Start each voxel from the last converged voxel", {"warm"});
     args::Flag                   mt(parser, "MT", "Use MT model", {"mt"});
     args::ValueFlag<double>      T2_b(parser, "T2_b", "T2 of bound pool", {"T2b"}, 12e-6);
     args::ValueFlag<std::string> ls_arg(
         parser, "LINESHAPE", "Path to lineshape file", {"lineshape"});
+    args::ValueFlag<int>         check_propagators(
+        parser, "N", "Compare to Pade exponentials at N points", {"check-propagators"});
+    args::Flag autodiff(
+        parser, "AUTODIFF", "Use automatic instead of numeric derivatives", {"autodiff"});
+    args::ValueFlag<int> check_autodiff(
+        parser, "N", "Compare automatic and numeric derivatives at N points", {"check-autodiff"});
 
     parser.Parse();
 
-    QI::CheckPos(input_path);
+    if (!check_propagators && !check_autodiff) {
+        QI::CheckPos(input_path);
+    }
 
     QI::Log(verbose, "Reading sequence parameters");
     json doc = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
 
     RUFISSequence sequence(doc["MUPA"]);
 
+    auto run_fit = [&](auto &fit, const std::string &model_name, auto const &fixed) {
+        using FitType  = std::remove_reference_t<decltype(fit)>;
+        fit.warm_start = warm.Get();
+        fit.solver     = QI::ReadSolverOptions(doc, solver.Get());
+        auto fit_filter =
+            QI::ModelFitFilter<FitType>::New(&fit, verbose, covar, resids, subregion.Get());
+        fit_filter->SetCheckpoint(checkpoint.Get(),
+                                  slab.Get(),
+                                  {{"input", doc},
+                                   {"mt", mt.Get()},
+                                   {"T2b", T2_b.Get()},
+                                   {"lineshape", ls_arg.Get()},
+                                   {"autodiff", autodiff.Get()}});
+        fit_filter->SetOutputStatus(fit_status);
+        fit_filter->SetOutputProfile(profile);
+        fit_filter->SetPackOutputs(pack);
+        fit_filter->SetInt16Outputs(int16);
+        fit_filter->ReadInputs({input_path.Get()}, fixed, mask.Get());
+        fit_filter->Update();
+        fit_filter->WriteOutputs(prefix.Get() + model_name);
+    };
+
     auto process = [&](auto                                       model,
                        const std::string &                        model_name,
                        typename decltype(model)::FixedNames const fixed) {
-        if (simulate) {
+        if (check_propagators) {
+            double const diff = CheckPropagators(model, check_propagators.Get());
+            fmt::print("Largest relative difference: {:g}\n", diff);
+            if (diff > 1e-8) {
+                QI::Fail("Propagators differ from the reference by {:g}", diff);
+            }
+        } else if (check_autodiff) {
+            double const diff = QI::CheckNumericJacobian(
+                model, {}, model.lo, model.hi, check_autodiff.Get());
+            fmt::print("Largest relative difference: {:g}\n", diff);
+            if (diff > 1e-4) {
+                QI::Fail("Automatic derivatives differ from numeric by {:g}", diff);
+            }
+        } else if (simulate) {
             QI::SimulateModel<decltype(model), false>(doc,
                                                       model,
                                                       fixed,
@@ -56,15 +102,14 @@ int transient_main(args::Subparser &parser) {
                                                       mask.Get(),
                                                       verbose,
                                                       simulate.Get(),
-                                                      subregion.Get());
+                                                      subregion.Get(),
+                                                      int16);
+        } else if (autodiff) {
+            QI::ScaledNumericDiffFit<decltype(model), decltype(model)::NS, true> fit{model};
+            run_fit(fit, model_name, fixed);
         } else {
-            using FitType = QI::ScaledNumericDiffFit<decltype(model), decltype(model)::NS>;
-            FitType fit{model};
-            auto    fit_filter =
-                QI::ModelFitFilter<FitType>::New(&fit, verbose, covar, resids, subregion.Get());
-            fit_filter->ReadInputs({input_path.Get()}, fixed, mask.Get());
-            fit_filter->Update();
-            fit_filter->WriteOutputs(prefix.Get() + model_name);
+            QI::ScaledNumericDiffFit<decltype(model), decltype(model)::NS> fit{model};
+            run_fit(fit, model_name, fixed);
         }
     };
 
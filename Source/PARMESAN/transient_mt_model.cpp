@@ -3,22 +3,21 @@
 #include "parmesan.hpp"
 #include "transient_mt_model.h"
 
-using AugMat = Eigen::Matrix<double, 5, 5>; // Short for Augmented Matrix
-using AugVec = Eigen::Vector<double, 5>;
+template <typename T>
+auto MUPAMTModel::signal_t(QI_ARRAYN(T, NV) const &v, FixedArray const &) const -> QI_ARRAY(T) {
+    using AugMat = Eigen::Matrix<T, 5, 5>; // Short for Augmented Matrix
+    using AugVec = Eigen::Vector<T, 5>;
 
-auto MUPAMTModel::signal(VaryingArray const &v, FixedArray const &) const -> QI_ARRAY(double) {
-    using T = double;
-
-    T const &M0_f = v[0];
-    T const &M0_b = v[1];
-    T const &R1_f = 1. / v[2];
-    T const &R1_b = R1_f;
-    T const &R2_f = 1. / v[3];
-    T const &k    = 4.3;
-    T const &k_bf = k * M0_f / (M0_f + M0_b);
-    T const &k_fb = k * M0_b / (M0_f + M0_b);
-    T const &B1   = v[4];
-    T const &G0   = 1.4e-5;
+    T const &    M0_f = v[0];
+    T const &    M0_b = v[1];
+    T const      R1_f = 1. / v[2];
+    T const &    R1_b = R1_f;
+    T const      R2_f = 1. / v[3];
+    double const k    = 4.3;
+    T const      k_bf = k * M0_f / (M0_f + M0_b);
+    T const      k_fb = k * M0_b / (M0_f + M0_b);
+    T const &    B1   = v[4];
+    double const G0   = 1.4e-5;
     QI_DBVEC(v)
     QI_DB(M0_f)
     QI_DB(M0_b)
@@ -27,94 +26,108 @@ auto MUPAMTModel::signal(VaryingArray const &v, FixedArray const &) const -> QI_
     QI_DB(k_bf)
     QI_DB(k_fb)
     QI_DB(B1)
-    AugMat R;
-    R << -R2_f, 0, 0, 0, 0,          //
-        0, -R2_f, 0, 0, 0,           //
-        0, 0, -R1_f, 0, M0_f * R1_f, //
-        0, 0, 0, -R1_b, M0_b * R1_b, //
-        0, 0, 0, 0, 0;
+    AugMat R = AugMat::Zero();
+    R(0, 0)  = -R2_f;
+    R(1, 1)  = -R2_f;
+    R(2, 2)  = -R1_f;
+    R(2, 4)  = M0_f * R1_f;
+    R(3, 3)  = -R1_b;
+    R(3, 4)  = M0_b * R1_b;
 
-    AugMat K;
-    K << 0, 0, 0, 0, 0,       //
-        0, 0, 0, 0, 0,        //
-        0, 0, -k_fb, k_bf, 0, //
-        0, 0, k_fb, -k_bf, 0, //
-        0, 0, 0, 0, 0;
+    AugMat K = AugMat::Zero();
+    K(2, 2)  = -k_fb;
+    K(2, 3)  = k_bf;
+    K(3, 2)  = k_fb;
+    K(3, 3)  = -k_bf;
 
-    AugMat const S = Eigen::DiagonalMatrix<double, 5, 5>({0, 0, 1., 1., 1.}).toDenseMatrix();
+    AugMat S = AugMat::Zero();
+    S(2, 2)  = T(1.);
+    S(3, 3)  = T(1.);
+    S(4, 4)  = T(1.);
 
     AugMat const RpK = R + K;
 
     // Setup readout segment matrices
-    AugMat const        ramp = (RpK * sequence.Tramp).exp();
-    std::vector<AugMat> TR_mats(sequence.FA.rows());
-    std::vector<AugMat> seg_mats(sequence.FA.rows());
-    for (int is = 0; is < sequence.FA.rows(); is++) {
-        double const B1x = B1 * sequence.FA[is] / sequence.Trf[is];
-        double const W   = M_PI * G0 * B1x * B1x;
-        AugMat       rf;
-        rf << 0, 0, 0, 0, 0,  //
-            0, 0, B1x, 0, 0,  //
-            0, -B1x, 0, 0, 0, //
-            0, 0, 0, -W, 0,   //
-            0, 0, 0, 0, 0;
-        AugMat const Rrd = (RpK * (sequence.TR - sequence.Trf[is])).exp();
-        AugMat const Ard = ((RpK + rf) * sequence.Trf[is]).exp();
+    Propagator<AugMat> const                       eRpK(RpK, use_reference);
+    AugMat const                                   ramp = eRpK(sequence.Tramp);
+    std::array<AugMat, RUFISSequence::MaxSegments> TR_mats;
+    std::array<AugMat, RUFISSequence::MaxSegments> seg_mats;
+    for (int is = 0; is < sequence.size(); is++) {
+        // Segments usually share a readout, and this is the expensive part
+        if (is > 0 && sequence.FA[is] == sequence.FA[is - 1] &&
+            sequence.Trf[is] == sequence.Trf[is - 1] &&
+            sequence.groups_per_seg[is] == sequence.groups_per_seg[is - 1]) {
+            TR_mats[is]  = TR_mats[is - 1];
+            seg_mats[is] = seg_mats[is - 1];
+            continue;
+        }
+        T const B1x = B1 * sequence.FA[is] / sequence.Trf[is];
+        T const W   = M_PI * G0 * B1x * B1x;
+        AugMat  rf  = AugMat::Zero();
+        rf(1, 2)    = B1x;
+        rf(2, 1)    = -B1x;
+        rf(3, 3)    = -W;
+        AugMat const Rrd = eRpK(sequence.TR - sequence.Trf[is]);
+        AugMat const Ard = Expm(AugMat((RpK + rf) * T(sequence.Trf[is])));
         TR_mats[is]      = S * Rrd * Ard;
-        seg_mats[is]     = TR_mats[is].pow(sequence.spokes_per_seg / sequence.groups_per_seg[is]);
+        seg_mats[is]     = IntPower(
+            TR_mats[is], sequence.spokes_per_seg / sequence.groups_per_seg[is], use_reference);
     }
 
     // Setup pulse matrices
-    std::vector<AugMat> prep_mats(sequence.size());
+    std::array<AugMat, RUFISSequence::MaxSegments> prep_mats;
     for (int is = 0; is < sequence.size(); is++) {
-        auto const & name = sequence.prep[is];
-        auto const & p    = sequence.prep_pulses[name];
-        double const Ew   = exp(-M_PI * 1.4e-5 * B1 * B1 * p.int_b1_sq);
-        AugMat       C;
-        double const E2 = exp(-R2_f * p.T_trans);
-        // double const E1 = exp(-R1_f * p.T_long);
+        auto const &p  = sequence.prep_list[is];
+        T const     Ew = exp(-M_PI * G0 * B1 * B1 * p.int_b1_sq);
+        T const     E2 = exp(-R2_f * p.T_trans);
         QI_DB(Ew)
         QI_DB(E2)
-        C << 0, 0, 0, 0, 0,                //
-            0, 0, 0, 0, 0,                 //
-            0, 0, E2 * cos(p.FAeff), 0, 0, //
-            0, 0, 0, Ew, 0,                //
-            0, 0, 0, 0, 1;
+        AugMat C      = AugMat::Zero();
+        C(2, 2)       = E2 * cos(p.FAeff);
+        C(3, 3)       = Ew;
+        C(4, 4)       = T(1.);
         prep_mats[is] = C;
     }
 
     // First calculate the system matrix
     AugMat X = AugMat::Identity();
     for (int is = 0; is < sequence.size(); is++) {
+        AugMat const group = ramp * seg_mats[is] * ramp * S * prep_mats[is];
         for (int ig = 0; ig < sequence.groups_per_seg[is]; ig++) {
-            X = ramp * seg_mats[is] * ramp * S * prep_mats[is] * X;
+            X = group * X;
         }
     }
     AugVec m_ss = SolveSteadyState(X);
 
     // Now loop through the segments and record the signal for each
-    Eigen::ArrayXd sig(sequence.size());
+    QI_ARRAY(T) sig(sequence.size());
     QI_DBVEC(m_ss);
     AugVec m_current = m_ss;
     for (int is = 0; is < sequence.size(); is++) {
-        double segment_accumulate = 0.;
+        T segment_accumulate(0.);
         for (int ig = 0; ig < sequence.groups_per_seg[is]; ig++) {
-            AugVec const m_prepped = ramp * S * prep_mats[is] * m_current;
+            AugVec const m_prepped = ramp * (S * (prep_mats[is] * m_current));
             auto const   m_group_avg =
                 GeometricAvg(TR_mats[is],
                              seg_mats[is],
                              m_prepped,
                              sequence.spokes_per_seg / sequence.groups_per_seg[is]);
             segment_accumulate += m_group_avg[2] * sin(B1 * sequence.FA[is]);
-            m_current = ramp * seg_mats[is] * m_prepped;
+            m_current = ramp * (seg_mats[is] * m_prepped);
         }
-        sig[is] = segment_accumulate / sequence.groups_per_seg[is];
+        sig[is] = segment_accumulate / double(sequence.groups_per_seg[is]);
     }
     QI_DBVEC(v);
     QI_DBVEC(sig);
     return sig;
 }
 
+using Jet = ceres::Jet<double, MUPAMTModel::NV>;
+template auto MUPAMTModel::signal_t<double>(QI_ARRAYN(double, NV) const &, FixedArray const &) const
+    -> QI_ARRAY(double);
+template auto MUPAMTModel::signal_t<Jet>(QI_ARRAYN(Jet, NV) const &, FixedArray const &) const
+    -> QI_ARRAY(Jet);
+
 void MUPAMTModel::derived(const VaryingArray &varying,
                           const FixedArray & /* Unused */,
                           DerivedArray &derived) const {
@@ -9,13 +9,21 @@ struct MUPAMTModel : QI::Model<double, double, 5, 0, 1, 1> {
     VaryingArray const start{30.0, 3.0, 1.0, 0.1, 1.0};
     VaryingArray const lo{0.1, 0.1, 0.5, 0.005, 0.5};
     VaryingArray const hi{100.0, 60.0, 5.0, 5.0, 1.5};
+    bool               use_reference = false; // Pade exponentials and MatrixPower, for checking
 
     std::array<std::string, NV> const varying_names{"M0_f", "M0_b", "T1_f", "T2_f", "B1"};
     std::array<std::string, ND> const derived_names{"f_b"};
 
     int input_size(const int /* Unused */) const { return sequence.size(); }
 
-    auto signal(VaryingArray const &v, FixedArray const &) const -> QI_ARRAY(double);
+    template <typename Derived>
+    auto signal(Eigen::ArrayBase<Derived> const &v, FixedArray const &f) const
+        -> QI_ARRAY(typename Derived::Scalar) {
+        return signal_t<typename Derived::Scalar>(v, f);
+    }
+    // Instantiated for double and Jet in the .cpp
+    template <typename T>
+    auto signal_t(QI_ARRAYN(T, NV) const &v, FixedArray const &) const -> QI_ARRAY(T);
     void derived(const VaryingArray &varying, const FixedArray &, DerivedArray &derived) const;
 };
 
@@ -15,4 +15,23 @@ void from_json(const json &j, RUFISSequence &s) {
         QI::Fail(
             "Number preps {} does not match number of flip-angles {}", s.prep.size(), s.FA.rows());
     }
+    if (s.Trf.rows() != s.FA.rows() || s.groups_per_seg.rows() != s.FA.rows()) {
+        QI::Fail("Number of Trf {} and groups_per_seg {} must match number of flip-angles {}",
+                 s.Trf.rows(),
+                 s.groups_per_seg.rows(),
+                 s.FA.rows());
+    }
+    if (s.FA.rows() > RUFISSequence::MaxSegments) {
+        QI::Fail("Number of segments {} is more than the maximum {}",
+                 s.FA.rows(),
+                 RUFISSequence::MaxSegments);
+    }
+    s.prep_list.clear();
+    for (auto const &name : s.prep) {
+        auto const p = s.prep_pulses.find(name);
+        if (p == s.prep_pulses.end()) {
+            QI::Fail("Prep pulse {} was not defined", name);
+        }
+        s.prep_list.push_back(p->second);
+    }
 }
\ No newline at end of file
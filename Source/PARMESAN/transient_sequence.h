@@ -5,12 +5,15 @@
 #include <unordered_map>
 
 struct RUFISSequence : QI::SequenceBase {
+    static int const MaxSegments = 32; // So that models can keep per-segment matrices on the stack
+
     double                                     TR, Tramp;
     Eigen::ArrayXd                             FA, Trf;
     Eigen::ArrayXi                             groups_per_seg;
     int                                        spokes_per_seg;
     std::unordered_map<std::string, PrepPulse> prep_pulses;
     std::vector<std::string>                   prep;
+    std::vector<PrepPulse>                     prep_list; // The pulse for each segment
     QI_SEQUENCE_DECLARE(RUFIS);
     Eigen::Index size() const override { return prep.size(); };
 };
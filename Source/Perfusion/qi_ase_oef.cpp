@@ -148,6 +148,8 @@ int ase_oef_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "ASE_FILE", "Input ASE file");
 
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
+    args::Flag warm(parser, "WARM", "Start each voxel from the last converged voxel", {"warm"});
     args::ValueFlag<double> B0(parser, "B0", "Field-strength (Tesla), default 3", {'B', "B0"}, 3.0);
     args::ValueFlag<double> DBV(parser, "DBV", "Fix DBV and only fit R2'", {'d', "DBV"}, 0.0);
 
@@ -165,7 +167,8 @@ int ase_oef_main(args::Subparser &parser) {
                                                      mask.Get(),
                                                      verbose,
                                                      simulate.Get(),
-                                                     subregion.Get());
+                                                     subregion.Get(),
+                                                     int16);
         } else {
             ASEModel model{{}, sequence, B0.Get()};
             QI::SimulateModel<ASEModel, false>(input,
@@ -175,12 +178,24 @@ int ase_oef_main(args::Subparser &parser) {
                                                mask.Get(),
                                                verbose,
                                                simulate.Get(),
-                                               subregion.Get());
+                                               subregion.Get(),
+                                               int16);
         }
     } else {
         auto process = [&](auto fit_func) {
+            fit_func.warm_start = warm.Get();
+            fit_func.solver     = QI::ReadSolverOptions(input, solver.Get());
             auto fit_filter = QI::ModelFitFilter<decltype(fit_func)>::New(
                 &fit_func, verbose, covar, resids, subregion.Get());
+            fit_filter->SetCheckpoint(checkpoint.Get(),
+                                      slab.Get(),
+                                      {{"input", input},
+                                       {"B0", B0.Get()},
+                                       {"DBV", DBV.Get()}});
+            fit_filter->SetOutputStatus(fit_status);
+            fit_filter->SetOutputProfile(profile);
+            fit_filter->SetPackOutputs(pack);
+            fit_filter->SetInt16Outputs(int16);
             fit_filter->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
             fit_filter->Update();
             fit_filter->WriteOutputs(prefix.Get() + "ASE_");
@@ -15,7 +15,7 @@
 #include "MPRAGESequence.h"
 #include "Macro.h"
 #include "SPGRSequence.h"
-#include <Eigen/Core>
+#include <Eigen/Dense>
 
 namespace QI {
 
@@ -29,6 +29,52 @@ inline auto SPGRSignal(const Ta &PD, const Ta &T1, const Tb &B1, const QI::SPGRS
     return PD * ((1. - E1) * sa) / (1. - E1 * ca);
 }
 
+// SPGRSignal and its derivatives with respect to PD and T1, for when B1 is fixed
+inline void SPGRSignalJacobian(const double &           PD,
+                               const double &           T1,
+                               const double &           B1,
+                               const QI::SPGRSequence & s,
+                               Eigen::ArrayXd &         signal,
+                               Eigen::MatrixXd &        jacobian) {
+    const Eigen::ArrayXd sa = sin(B1 * s.FA);
+    const Eigen::ArrayXd ca = cos(B1 * s.FA);
+    const double         E1 = exp(-s.TR / T1);
+    const Eigen::ArrayXd d  = 1. - E1 * ca;
+    signal                  = PD * ((1. - E1) * sa) / d;
+    jacobian.resize(s.size(), 2);
+    jacobian.col(0) = (((1. - E1) * sa) / d).matrix();
+    jacobian.col(1) = (PD * sa * (ca - 1.) * E1 * s.TR / (T1 * T1 * d.square())).matrix();
+}
+
+/*
+ *  SPGRSignalJacobian for W voxels at once, in the structure-of-arrays layout of QI::BatchLM. The
+ *  signal is W x n, and if jacobian is not nullptr it is W x 2n with the PD derivatives first. The
+ *  flip angles depend only on B1, so sincos holds their sines followed by their cosines (W x 2n),
+ *  which can be calculated once per batch.
+ */
+template <int W>
+inline void SPGRSignalBatch(Eigen::Array<double, W, 1> const &             PD,
+                            Eigen::Array<double, W, 1> const &             T1,
+                            Eigen::Array<double, W, Eigen::Dynamic> const &sincos,
+                            const QI::SPGRSequence &                       s,
+                            Eigen::Array<double, W, Eigen::Dynamic> &      signal,
+                            Eigen::Array<double, W, Eigen::Dynamic> *      jacobian) {
+    Eigen::Index const               n  = s.size();
+    Eigen::Array<double, W, 1> const E1 = exp(-s.TR / T1);
+    Eigen::Array<double, W, 1> const dE = PD * E1 * s.TR / T1.square();
+    for (Eigen::Index k = 0; k < n; k++) {
+        auto const                       sa = sincos.col(k);
+        auto const                       ca = sincos.col(n + k);
+        Eigen::Array<double, W, 1> const d  = 1. - E1 * ca;
+        Eigen::Array<double, W, 1> const s1 = ((1. - E1) * sa) / d;
+        signal.col(k)                       = PD * s1;
+        if (jacobian) {
+            jacobian->col(k)     = s1;
+            jacobian->col(n + k) = sa * (ca - 1.) * dE / d.square();
+        }
+    }
+}
+
 // template<typename Ta, typename Tb>
 // inline auto SPGREchoSignal(const Ta &PD, const Ta &T1, const Ta &T2, const Tb &B1,
 //                            const QI::SPGREchoSequence *s) -> QI_ARRAY(Ta)
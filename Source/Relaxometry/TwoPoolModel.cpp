@@ -22,56 +22,151 @@
 using namespace std::literals;
 
 namespace {
+/*
+ *  Relaxation and exchange terms over one TR that do not depend on the flip-angle. Subscript a is
+ *  the myelin water pool and b the intra/extra-cellular pool.
+ */
+struct SSFP2Terms {
+    double E1_a, E1_b, E2_a, E2_b, K1, K2, K3, K4, f_a, f_b;
+
+    SSFP2Terms(const Eigen::ArrayXd &varying, const double TR) {
+        const double &T1_a  = varying[1];
+        const double &T2_a  = varying[2];
+        const double &T1_b  = varying[3];
+        const double &T2_b  = varying[4];
+        const double &tau_a = varying[5];
+        f_a                 = varying[6];
+        E1_a                = exp(-TR / T1_a);
+        E1_b                = exp(-TR / T1_b);
+        E2_a                = exp(-TR / T2_a);
+        E2_b                = exp(-TR / T2_b);
+        double k_ab, k_ba;
+        QI::CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
+        const double E_ab = exp(-TR * k_ab / f_b);
+        K1                = E_ab * f_b + f_a;
+        K2                = E_ab * f_a + f_b;
+        K3                = f_a * (1 - E_ab);
+        K4                = f_b * (1 - E_ab);
+    }
+};
+
+/*
+ *  Solve the full 6x6 steady-state system for one flip-angle with an LU decomposition. Returns the
+ *  transverse magnetization (x then y) of both pools for unit PD.
+ */
+Eigen::Vector4d SSFP2Full(SSFP2Terms const &t,
+                          double const      ca,
+                          double const      sa,
+                          double const      ct,
+                          double const      st) {
+    const auto [E1_a, E1_b, E2_a, E2_b, K1, K2, K3, K4, f_a, f_b] = t;
+    Eigen::Matrix6d LHS;
+    Eigen::Vector6d RHS;
+    RHS << 0, 0, 0, 0, -E1_b * K3 * f_b + f_a * (-E1_a * K1 + 1),
+        -E1_a * K4 * f_a + f_b * (-E1_b * K2 + 1);
+    LHS << -E2_a * K1 * ct + ca, -E2_b * K3 * ct, E2_a * K1 * st, E2_b * K3 * st, sa, 0,
+        -E2_a * K4 * ct, -E2_b * K2 * ct + ca, E2_a * K4 * st, E2_b * K2 * st, 0, sa,
+        -E2_a * K1 * st, -E2_b * K3 * st, -E2_a * K1 * ct + 1, -E2_b * K3 * ct, 0, 0,
+        -E2_a * K4 * st, -E2_b * K2 * st, -E2_a * K4 * ct, -E2_b * K2 * ct + 1, 0, 0, -sa, 0, 0,
+        0, -E1_a * K1 + ca, -E1_b * K3, 0, -sa, 0, 0, -E1_a * K4, -E1_b * K2 + ca;
+    return LHS.partialPivLu().solve(RHS).head(4);
+}
+
+// True if a 2x2 matrix is far enough from singular that its explicit inverse is accurate
+bool WellConditioned(const Eigen::Matrix2d &m) {
+    return std::abs(m.determinant()) > 1e-6 * m.squaredNorm();
+}
+
+/*
+ *  The steady-state is the solution of a 6x6 linear system in the transverse (x, y) and
+ *  longitudinal (z) magnetization of both pools,
+ *
+ *  (ca I - ct P) x + st P y + sa z = 0
+ *  -st P x + (I - ct P) y          = 0
+ *  -sa x + (ca I - Q) z            = r
+ *
+ *  where P and Q are the 2x2 transverse and longitudinal relaxation-exchange matrices, which do not
+ *  depend on the flip-angle. Eliminating y and z leaves a 2x2 system for x, so every solve is
+ *  closed-form and the only work repeated for each flip-angle is a handful of 2x2 products. If one
+ *  of the 2x2 matrices is close to singular, e.g. when cos(alpha) is an eigenvalue of Q, the full
+ *  system is solved instead.
+ */
 Eigen::MatrixXd SSFP2(const Eigen::ArrayXd &varying,
                       const QI_ARRAYN(double, 2) & fixed,
                       QI::SSFPSequence const &ssfp) {
-    const double &PD    = varying[0];
-    const double &T1_a  = varying[1];
-    const double &T2_a  = varying[2];
-    const double &T1_b  = varying[3];
-    const double &T2_b  = varying[4];
-    const double &tau_a = varying[5];
-    const double &f_a   = varying[6];
-    const double &f0    = fixed[0];
-    const double &B1    = fixed[1];
-    const double &TR    = ssfp.TR;
-    const double  E1_a  = exp(-TR / T1_a);
-    const double  E1_b  = exp(-TR / T1_b);
-    const double  E2_a  = exp(-TR / T2_a);
-    const double  E2_b  = exp(-TR / T2_b);
-    double        f_b, k_ab, k_ba;
-    QI::CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
-    const double         E_ab  = exp(-TR * k_ab / f_b);
-    const double         K1    = E_ab * f_b + f_a;
-    const double         K2    = E_ab * f_a + f_b;
-    const double         K3    = f_a * (1 - E_ab);
-    const double         K4    = f_b * (1 - E_ab);
+    const double &       PD = varying[0];
+    const double &       f0 = fixed[0];
+    const double &       B1 = fixed[1];
+    const double &       TR = ssfp.TR;
+    const SSFP2Terms     t(varying, TR);
     const Eigen::ArrayXd alpha = B1 * ssfp.FA;
     const Eigen::ArrayXd theta = ssfp.PhaseInc + 2. * M_PI * f0 * TR;
 
+    const Eigen::Matrix2d I = Eigen::Matrix2d::Identity();
+    Eigen::Matrix2d       P, Q;
+    P << t.E2_a * t.K1, t.E2_b * t.K3, t.E2_a * t.K4, t.E2_b * t.K2;
+    Q << t.E1_a * t.K1, t.E1_b * t.K3, t.E1_a * t.K4, t.E1_b * t.K2;
+    const Eigen::Vector2d r{-t.E1_b * t.K3 * t.f_b + t.f_a * (-t.E1_a * t.K1 + 1),
+                            -t.E1_a * t.K4 * t.f_a + t.f_b * (-t.E1_b * t.K2 + 1)};
+
     Eigen::MatrixXd M(4, ssfp.size());
-    Eigen::Matrix6d LHS;
-    Eigen::Vector6d RHS;
-    RHS << 0, 0, 0, 0, -E1_b * K3 * f_b + f_a * (-E1_a * K1 + 1),
-        -E1_a * K4 * f_a + f_b * (-E1_b * K2 + 1);
+    for (int i = 0; i < ssfp.size(); i++) {
+        const double          ca = cos(alpha[i]);
+        const double          sa = sin(alpha[i]);
+        const double          ct = cos(theta[i]);
+        const double          st = sin(theta[i]);
+        const Eigen::Matrix2d Y  = I - ct * P;
+        const Eigen::Matrix2d Z  = ca * I - Q;
+        if (WellConditioned(Y) && WellConditioned(Z)) {
+            const Eigen::Matrix2d YX  = Y.inverse() * P; // y = st * YX * x
+            const Eigen::Matrix2d Zi  = Z.inverse();     // z = Zi * (r + sa * x)
+            const Eigen::Matrix2d lhs = ca * I - ct * P + st * st * P * YX + sa * sa * Zi;
+            if (WellConditioned(lhs)) {
+                const Eigen::Vector2d x = lhs.inverse() * (-sa * (Zi * r));
+                M.col(i) << PD * x, PD * st * (YX * x);
+                continue;
+            }
+        }
+        M.col(i) = PD * SSFP2Full(t, ca, sa, ct, st);
+    }
+    return M;
+}
 
+/*
+ *  The original solution of the full 6x6 system with an LU decomposition for every flip-angle, kept
+ *  as a reference for the closed-form version above.
+ */
+Eigen::MatrixXd SSFP2Reference(const Eigen::ArrayXd &varying,
+                               const QI_ARRAYN(double, 2) & fixed,
+                               QI::SSFPSequence const &ssfp) {
+    const double &       PD    = varying[0];
+    const double &       f0    = fixed[0];
+    const double &       B1    = fixed[1];
+    const double &       TR    = ssfp.TR;
+    const SSFP2Terms     t(varying, TR);
+    const Eigen::ArrayXd alpha = B1 * ssfp.FA;
+    const Eigen::ArrayXd theta = ssfp.PhaseInc + 2. * M_PI * f0 * TR;
+
+    Eigen::MatrixXd M(4, ssfp.size());
     for (int i = 0; i < ssfp.size(); i++) {
-        const double ca  = cos(alpha[i]);
-        const double sa  = sin(alpha[i]);
-        const double cta = cos(theta[i]);
-        const double ctb = cos(theta[i]);
-        const double sta = sin(theta[i]);
-        const double stb = sin(theta[i]);
-
-        LHS << -E2_a * K1 * cta + ca, -E2_b * K3 * cta, E2_a * K1 * sta, E2_b * K3 * sta, sa, 0,
-            -E2_a * K4 * ctb, -E2_b * K2 * ctb + ca, E2_a * K4 * stb, E2_b * K2 * stb, 0, sa,
-            -E2_a * K1 * sta, -E2_b * K3 * sta, -E2_a * K1 * cta + 1, -E2_b * K3 * cta, 0, 0,
-            -E2_a * K4 * stb, -E2_b * K2 * stb, -E2_a * K4 * ctb, -E2_b * K2 * ctb + 1, 0, 0, -sa,
-            0, 0, 0, -E1_a * K1 + ca, -E1_b * K3, 0, -sa, 0, 0, -E1_a * K4, -E1_b * K2 + ca;
-        M.col(i).noalias() = PD * (LHS.partialPivLu().solve(RHS)).head(4);
+        M.col(i) =
+            PD * SSFP2Full(t, cos(alpha[i]), sin(alpha[i]), cos(theta[i]), sin(theta[i]));
     }
     return M;
 }
+
+/*
+ *  Exponential of a 2x2 matrix with real eigenvalues, which the relaxation-exchange matrices always
+ *  have as the off-diagonal terms share a sign. Uses exp(M) = e^s (cosh(q) I + sinh(q)/q (M - sI))
+ *  where s is the mean of the eigenvalues and q half their difference.
+ */
+Eigen::Matrix2d Expm2(const Eigen::Matrix2d &m) {
+    const double s     = m.trace() / 2.;
+    const double q     = sqrt(std::max(s * s - m.determinant(), 0.));
+    const double sinhc = (q > 1e-6) ? sinh(q) / q : 1. + q * q / 6.;
+    const Eigen::Matrix2d I     = Eigen::Matrix2d::Identity();
+    return exp(s) * (cosh(q) * I + sinhc * (m - s * I));
+}
 } // namespace
 
 namespace QI {
@@ -138,11 +233,16 @@ Eigen::ArrayXd TwoPoolModel::spgr_signal(const Eigen::ArrayXd &varying,
     CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
     M0 << f_a, f_b;
     A << ((1. / T1_a) + k_ab), -k_ba, -k_ab, ((1. / T1_b) + k_ba);
-    eATR                      = (-TR * A).exp();
+    eATR                      = use_reference ? Eigen::Matrix2d((-TR * A).exp()) : Expm2(-TR * A);
     const Eigen::Vector2d RHS = (Eigen::Matrix2d::Identity() - eATR) * M0;
     for (int i = 0; i < spgr.size(); i++) {
-        const double a = spgr.FA[i] * B1;
-        Mobs = (Eigen::Matrix2d::Identity() - eATR * cos(a)).partialPivLu().solve(RHS * sin(a));
+        const double          a   = spgr.FA[i] * B1;
+        const Eigen::Matrix2d lhs = Eigen::Matrix2d::Identity() - eATR * cos(a);
+        if (use_reference) {
+            Mobs = lhs.partialPivLu().solve(RHS * sin(a));
+        } else {
+            Mobs = lhs.inverse() * (RHS * sin(a));
+        }
         signal(i) = PD * Mobs.sum();
     }
     if (scale_to_mean) {
@@ -153,7 +253,8 @@ Eigen::ArrayXd TwoPoolModel::spgr_signal(const Eigen::ArrayXd &varying,
 
 Eigen::ArrayXd TwoPoolModel::ssfp_signal(const Eigen::ArrayXd &varying,
                                          const QI_ARRAYN(double, NF) & fixed) const {
-    Eigen::MatrixXd M       = SSFP2(varying, fixed, ssfp);
+    Eigen::MatrixXd M =
+        use_reference ? SSFP2Reference(varying, fixed, ssfp) : SSFP2(varying, fixed, ssfp);
     QI_ARRAY(double) signal = M.array().square().colwise().sum().sqrt();
     if (scale_to_mean) {
         signal /= signal.mean();
@@ -30,6 +30,7 @@ struct TwoPoolModel : Model<double, double, 7, 2, 2> {
     SPGRSequence spgr;
     SSFPSequence ssfp;
     bool         scale_to_mean = false;
+    bool         use_reference = false; // Use the original LU-based signals, for checking
 
     QI_ARRAYN(double, 7) bounds_lo;
     QI_ARRAYN(double, 7) bounds_hi;
@@ -161,8 +161,9 @@ struct JSRFit {
     using FlagType            = int; // Almost always the number of iterations
 
     using ModelType = JSRModel;
-    ModelType model;
-    int       n_psi;
+    ModelType         model;
+    int               n_psi;
+    QI::SolverOptions solver;
 
     // Have to tell the ModelFitFilter how many volumes we expect in each input
     int input_size(const int i) const {
@@ -194,7 +195,7 @@ struct JSRFit {
         if (scale < std::numeric_limits<double>::epsilon()) {
             best_varying = ModelType::VaryingArray::Zero();
             rmse         = 0.0;
-            return {false, "Maximum data value was zero or less"};
+            return {false, QI::FitStatus::BadData};
         }
         Eigen::ArrayXd const spgr_data = inputs[0] / scale;
         Eigen::ArrayXd const ssfp_data = inputs[1] / scale;
@@ -221,11 +222,14 @@ struct JSRFit {
 
         ceres::Solver::Options options;
         ceres::Solver::Summary summary;
+        QI::FitStatus          status = QI::FitStatus::Success;
+        QI::FitEvaluations     evaluations;
         options.max_num_iterations  = 50;
         options.function_tolerance  = 1e-6;
         options.gradient_tolerance  = 1e-7;
         options.parameter_tolerance = 1e-5;
         options.logging_type        = ceres::SILENT;
+        solver.Apply(options);
 
         // We need to do 2 starts for JSR in case off-resonance is very high
         double       best_cost = std::numeric_limits<double>::max();
@@ -235,13 +239,15 @@ struct JSRFit {
             varying    = model.start;
             varying[3] = psi;
             ceres::Solve(options, &problem, &summary);
+            evaluations.Add(summary);
             if (!summary.IsSolutionUsable()) {
-                return {false, summary.FullReport()};
+                return {false, QI::CeresStatus(summary), evaluations};
             }
             if (summary.final_cost < best_cost) {
                 iterations   = summary.iterations.size();
                 best_varying = varying;
                 best_cost    = summary.final_cost;
+                status       = QI::CeresStatus(summary);
             }
         }
         Eigen::ArrayXd const spgr_residual = (spgr_data - model.spgr_signal(best_varying, fixed));
@@ -261,7 +267,7 @@ struct JSRFit {
         // Wrap and convert to frequency
         best_varying[3] =
             (std::fmod(best_varying[3] + 3 * M_PI, 2 * M_PI) - M_PI) / (2 * M_PI * model.ssfp.TR);
-        return {true, ""};
+        return {true, status, evaluations};
     }
 };
 
@@ -273,6 +279,7 @@ int jsr_main(args::Subparser &parser) {
     args::Positional<std::string> ssfp_path(parser, "SSFP", "Input SSFP file");
 
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
     args::ValueFlag<std::string> b1_path(parser, "B1", "Path to B1 map", {'b', "B1"});
     args::ValueFlag<int>         npsi(
         parser, "N PSI", "Number of starts for psi/off-resonance, default 2", {'p', "npsi"}, 2);
@@ -290,8 +297,14 @@ int jsr_main(args::Subparser &parser) {
 
     JSRModel model{{}, spgr_seq, ssfp_seq};
     JSRFit   jsr_fit{model, npsi.Get()};
-    auto     fit_filter =
+    jsr_fit.solver = QI::ReadSolverOptions(doc, solver.Get());
+    auto fit_filter =
         QI::ModelFitFilter<JSRFit>::New(&jsr_fit, verbose, covar, resids, subregion.Get());
+    fit_filter->SetCheckpoint(checkpoint.Get(), slab.Get(), {{"input", doc}, {"npsi", npsi.Get()}});
+    fit_filter->SetOutputStatus(fit_status);
+    fit_filter->SetOutputProfile(profile);
+    fit_filter->SetPackOutputs(pack);
+    fit_filter->SetInt16Outputs(int16);
     fit_filter->ReadInputs({spgr_path.Get(), ssfp_path.Get()}, {b1_path.Get()}, mask.Get());
     fit_filter->Update();
     fit_filter->WriteOutputs(prefix.Get() + "JSR_");
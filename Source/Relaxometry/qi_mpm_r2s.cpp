@@ -111,7 +111,8 @@ struct MPMFit {
     using RMSErrorType        = double;
     using FlagType            = int;
     using ModelType           = MPMModel;
-    ModelType model;
+    ModelType         model;
+    QI::SolverOptions solver;
 
     int input_size(const int i) const {
         switch (i) {
@@ -138,7 +139,7 @@ struct MPMFit {
         if (scale < std::numeric_limits<double>::epsilon()) {
             v    = ModelType::VaryingArray::Zero();
             rmse = 0.0;
-            return {false, "Maximum data value was zero or less"};
+            return {false, QI::FitStatus::BadData};
         }
         Eigen::ArrayXd const pdw_data = inputs[0] / scale;
         Eigen::ArrayXd const t1w_data = inputs[1] / scale;
@@ -166,9 +167,10 @@ struct MPMFit {
         options.gradient_tolerance  = 1e-6;
         options.parameter_tolerance = 1e-4;
         options.logging_type        = ceres::SILENT;
+        solver.Apply(options);
         ceres::Solve(options, &problem, &summary);
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
         }
         iterations = summary.iterations.size();
 
@@ -188,7 +190,7 @@ struct MPMFit {
         }
         rmse      = sqrt(var / dsize);
         v.tail(3) = v.tail(3) * scale; // Multiply signals/proton densities back up
-        return {true, ""};
+        return {true, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
     }
 };
 
@@ -200,6 +202,7 @@ int mpm_r2s_main(args::Subparser &parser) {
     args::Positional<std::string> t1w_path(parser, "T1w", "Input multi-echo T1-weighted file");
     args::Positional<std::string> mtw_path(parser, "MTw", "Input multi-echo MT-weighted file");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
     parser.Parse();
     QI::CheckPos(pdw_path);
     QI::CheckPos(t1w_path);
@@ -211,8 +214,14 @@ int mpm_r2s_main(args::Subparser &parser) {
 
     MPMModel model{{}, pdw_seq, t1w_seq, mtw_seq};
     MPMFit   mpm_fit{model};
-    auto     fit_filter =
+    mpm_fit.solver = QI::ReadSolverOptions(doc, solver.Get());
+    auto fit_filter =
         QI::ModelFitFilter<MPMFit>::New(&mpm_fit, verbose, covar, resids, subregion.Get());
+    fit_filter->SetCheckpoint(checkpoint.Get(), slab.Get(), {{"input", doc}});
+    fit_filter->SetOutputStatus(fit_status);
+    fit_filter->SetOutputProfile(profile);
+    fit_filter->SetPackOutputs(pack);
+    fit_filter->SetInt16Outputs(int16);
     fit_filter->ReadInputs({pdw_path.Get(), t1w_path.Get(), mtw_path.Get()}, {}, mask.Get());
     fit_filter->Update();
     fit_filter->WriteOutputs(prefix.Get() + "MPM_");
@@ -89,7 +89,7 @@ struct PLANETFit {
         out[0] = PD;
         out[1] = T1;
         out[2] = T2;
-        return {true, ""};
+        return {true, QI::FitStatus::Success};
     }
 };
 
@@ -116,11 +116,17 @@ int planet_main(args::Subparser &parser) {
                                              mask.Get(),
                                              verbose,
                                              simulate.Get(),
-                                             subregion.Get());
+                                             subregion.Get(),
+                                             int16);
     } else {
         PLANETFit fit{model};
         auto      fit_filter =
             QI::ModelFitFilter<PLANETFit>::New(&fit, verbose, false, false, subregion.Get());
+        fit_filter->SetCheckpoint(checkpoint.Get(), slab.Get(), {{"input", input}});
+        fit_filter->SetOutputStatus(fit_status);
+        fit_filter->SetOutputProfile(profile);
+        fit_filter->SetPackOutputs(pack);
+        fit_filter->SetInt16Outputs(int16);
         fit_filter->ReadInputs({G_path.Get(), a_path.Get(), b_path.Get()}, {B1.Get()}, mask.Get());
         fit_filter->SetBlocks(ssfp.size());
         fit_filter->Update();
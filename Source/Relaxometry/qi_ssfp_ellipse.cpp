@@ -105,7 +105,9 @@ struct EllipseFit {
     using RMSErrorType        = double;
     using FlagType            = int;
     using ModelType           = EllipseModel;
-    ModelType model;
+    ModelType         model;
+    bool              warm_start = false; // See QI::WarmStart
+    QI::SolverOptions solver;
 
     int input_size(const int /* Unused */) const { return model.sequence.size(); }
     int n_outputs() const { return model.NV; }
@@ -121,6 +123,7 @@ struct EllipseFit {
         const double               scale  = inputs[0].abs().maxCoeff();
         const Eigen::ArrayXcd      data   = inputs[0] / scale;
         const std::complex<double> c_mean = data.mean();
+        EllipseModel::VaryingArray const seed = p;
 
         using AutoCost = ceres::AutoDiffCostFunction<EllipseCost, ceres::DYNAMIC, EllipseModel::NV>;
         auto *auto_cost           = new AutoCost(new EllipseCost{model, data}, data.rows() * 2);
@@ -147,6 +150,7 @@ struct EllipseFit {
         options.gradient_tolerance  = 1e-6;
         options.parameter_tolerance = 1e-3;
         options.logging_type        = ceres::SILENT;
+        solver.Apply(options);
         double th0, psi0, best_cost = std::numeric_limits<double>::infinity();
         for (const auto &th0_try : {-M_PI, 0., M_PI}) {
             const double psi0_try = arg(c_mean / std::polar(1.0, th0_try / 2));
@@ -159,12 +163,23 @@ struct EllipseFit {
                 psi0      = psi0_try;
             }
         }
-        p << abs(c_mean), 0.5, 0.5, th0, psi0;
+        EllipseModel::VaryingArray const start{abs(c_mean), 0.5, 0.5, th0, psi0};
+        EllipseModel::VaryingArray const lo{not_zero, not_zero, not_zero, -2. * M_PI, -2. * M_PI};
+        EllipseModel::VaryingArray const hi{not_one, max_a, not_one, 2. * M_PI, 2. * M_PI};
+        p                 = seed;
+        bool const seeded = QI::WarmStart(p, start, lo, hi, warm_start, scale, 1);
         ceres::Solve(options, &problem, &summary);
+        iterations = summary.iterations.size();
+        QI::FitEvaluations evaluations = QI::CeresEvaluations(summary);
+        if (seeded && summary.termination_type != ceres::CONVERGENCE) {
+            p = start;
+            ceres::Solve(options, &problem, &summary);
+            iterations += summary.iterations.size();
+            evaluations.Add(summary);
+        }
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, QI::CeresStatus(summary), evaluations};
         }
-        iterations = summary.iterations.size();
 
         Eigen::ArrayXcd const rs  = (data - model.signal(p, fixed));
         double const          var = rs.abs().square().sum();
@@ -179,15 +194,17 @@ struct EllipseFit {
         p[0] *= scale;
         p[3] = std::fmod(p[3] + 3 * M_PI, 2 * M_PI) - M_PI;
         p[4] = std::fmod(p[4] + 3 * M_PI, 2 * M_PI) - M_PI;
-        return {true, ""};
+        return {true, QI::CeresStatus(summary), evaluations};
     }
 };
 
 int ssfp_ellipse_main(args::Subparser &parser) {
     args::Positional<std::string> sequence_path(parser, "sequence_FILE", "Input sequence file");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
     args::ValueFlag<char> algorithm(
         parser, "ALGO", "Choose algorithm (h)yper/(d)irect, default d", {'a', "algo"}, 'd');
+    args::Flag warm(parser, "WARM", "Start each voxel from the last converged voxel", {"warm"});
     parser.Parse();
     QI::CheckPos(sequence_path);
     QI::Log(verbose, "Reading sequence information");
@@ -203,11 +220,22 @@ int ssfp_ellipse_main(args::Subparser &parser) {
                                                mask.Get(),
                                                verbose,
                                                simulate.Get(),
-                                               subregion.Get());
+                                               subregion.Get(),
+                                               int16);
     } else {
         EllipseFit fit{model};
+        fit.warm_start = warm.Get();
+        fit.solver     = QI::ReadSolverOptions(input, solver.Get());
         auto       fit_filter =
             QI::ModelFitFilter<EllipseFit>::New(&fit, verbose, covar, resids, subregion.Get());
+        fit_filter->SetCheckpoint(checkpoint.Get(),
+                                  slab.Get(),
+                                  {{"input", input},
+                                   {"algo", algorithm.Get()}});
+        fit_filter->SetOutputStatus(fit_status);
+        fit_filter->SetOutputProfile(profile);
+        fit_filter->SetPackOutputs(pack);
+        fit_filter->SetInt16Outputs(int16);
         fit_filter->ReadInputs({sequence_path.Get()}, {}, mask.Get());
         fit_filter->SetBlocks(fit_filter->GetInput(0)->GetNumberOfComponentsPerPixel() /
                               sequence.size());
@@ -14,7 +14,9 @@
 #include <array>
 
 #include "Args.h"
+#include "FitDictionary.h"
 #include "FitFunction.h"
+#include "FitLM.h"
 #include "ImageIO.h"
 #include "Model.h"
 #include "ModelFitFilter.h"
@@ -33,6 +35,8 @@ struct DESPOT1 : QI::Model<double, double, 2, 1> {
     std::array<const std::string, 1> const fixed_names{"B1"s};
     FixedArray const                       fixed_defaults{1.0};
 
+    // PD is relative to the largest data point in the NLLS and LM fits
+    VaryingArray const start{10., 1.};
     VaryingArray const bounds_lo{1.e-6, 1.e-6};
     VaryingArray const bounds_hi{100., 10.};
 
@@ -43,6 +47,32 @@ struct DESPOT1 : QI::Model<double, double, 2, 1> {
         -> QI_ARRAY(typename Derived::Scalar) {
         return QI::SPGRSignal(v[0], v[1], f[0], sequence);
     }
+
+    void signal_jacobian(VaryingArray const &v,
+                         FixedArray const &  f,
+                         Eigen::ArrayXd &    s,
+                         Eigen::MatrixXd &   j) const {
+        QI::SPGRSignalJacobian(v[0], v[1], f[0], sequence, s, j);
+    }
+
+    // Batch signal for QI::LMFit. The sines and cosines of the flip angles only depend on B1.
+    template <int W>
+    void prepare_batch(QI::BatchArray<W> const &f, QI::BatchArray<W> &sincos) const {
+        Eigen::Index const n = sequence.size();
+        sincos.resize(W, 2 * n);
+        for (Eigen::Index k = 0; k < n; k++) {
+            sincos.col(k)     = (f.col(0) * sequence.FA[k]).sin();
+            sincos.col(n + k) = (f.col(0) * sequence.FA[k]).cos();
+        }
+    }
+
+    template <int W>
+    void signal_batch(Eigen::Array<double, W, NV> const &v,
+                      QI::BatchArray<W> const &          sincos,
+                      QI::BatchArray<W> &                s,
+                      QI::BatchArray<W> *                j) const {
+        QI::SPGRSignalBatch<W>(v.col(0), v.col(1), sincos, sequence, s, j);
+    }
 };
 
 using DESPOT1Fit = QI::FitFunction<DESPOT1>;
@@ -72,7 +102,7 @@ struct DESPOT1LLS : DESPOT1Fit {
         }
         residual   = sqrt(temp_residuals.square().sum() / temp_residuals.rows());
         iterations = 1;
-        return {true, ""};
+        return {true, QI::FitStatus::Success};
     }
 };
 
@@ -114,7 +144,9 @@ struct DESPOT1WLLS : DESPOT1Fit {
             residuals[0] = temp_residuals;
         }
         residual = sqrt(temp_residuals.square().sum() / temp_residuals.rows());
-        return {true, ""};
+        return {true,
+                (iterations == model.max_iterations) ? QI::FitStatus::IterationLimit :
+                                                       QI::FitStatus::Success};
     }
 };
 
@@ -132,16 +164,12 @@ struct DESPOT1NLLS : DESPOT1Fit {
         if (scale < std::numeric_limits<double>::epsilon()) {
             p << 0.0, 0.0;
             rmse = 0;
-            return {false, "Maximum data value was not positive"};
+            return {false, QI::FitStatus::BadData};
         }
         const Eigen::ArrayXd data = inputs[0] / scale;
-        p << 10., 1.;
+        p                         = model.start;
         ceres::Problem problem;
-        using Cost      = QI::ModelCost<DESPOT1>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, DESPOT1::NV>;
-        auto *cost      = new Cost{model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
+        problem.AddResidualBlock(QI::MakeModelCost(model, fixed, data), NULL, p.data());
         problem.SetParameterLowerBound(p.data(), 0, model.bounds_lo[0]);
         problem.SetParameterUpperBound(p.data(), 0, model.bounds_hi[0]);
         problem.SetParameterLowerBound(p.data(), 1, model.bounds_lo[1]);
@@ -153,10 +181,11 @@ struct DESPOT1NLLS : DESPOT1Fit {
         options.gradient_tolerance  = 1e-6;
         options.parameter_tolerance = 1e-4;
         options.logging_type        = ceres::SILENT;
+        solver.Apply(options);
         ceres::Solve(options, &problem, &summary);
 
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
         }
         iterations = summary.iterations.size();
 
@@ -170,27 +199,48 @@ struct DESPOT1NLLS : DESPOT1Fit {
             QI::GetModelCovariance<DESPOT1>(problem, p, var / (data.rows() - DESPOT1::NV), cov);
         }
         p[0] = p[0] * scale;
-        return {true, ""};
+        return {true, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
     }
 };
 
+using DESPOT1Dictionary = QI::DictionaryFit<DESPOT1>;
+
 //******************************************************************************
 // Main
 //******************************************************************************
 int despot1_main(args::Subparser &parser) {
     args::Positional<std::string> spgr_path(parser, "SPGR FILE", "Path to SPGR data");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
-    args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/w/n)", {'a', "algo"}, 'l');
+    args::ValueFlag<char> algorithm(
+        parser, "ALGO", "Choose algorithm (l/w/n/m/d)", {'a', "algo"}, 'l');
     args::ValueFlag<int>  its(
         parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i', "its"}, 15);
+    args::Flag polish(
+        parser, "POLISH", "Refine dictionary matches with a Gauss-Newton step", {"polish"});
+    args::ValueFlag<std::string> dict_cache(
+        parser, "CACHE", "Save dictionaries to this directory and re-use them", {"dict-cache"});
+    args::ValueFlag<int> dict_rank(parser,
+                                   "RANK",
+                                   "Compress the dictionary to RANK singular vectors (default all)",
+                                   {"dict-rank"},
+                                   0);
+    args::ValueFlag<int> check_jacobian(
+        parser, "N", "Compare analytic and automatic Jacobians at N points", {"check-jacobian"});
     parser.Parse();
-    QI::CheckPos(spgr_path);
     QI::Log(verbose, "Reading sequence information");
     json input        = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
     auto spgrSequence = input.at("SPGR").get<QI::SPGRSequence>();
 
     DESPOT1 model{{}, spgrSequence, its.Get()};
+    if (check_jacobian) {
+        double const diff = QI::CheckJacobian(
+            model, model.fixed_defaults, model.bounds_lo, model.bounds_hi, check_jacobian.Get());
+        fmt::print("Largest relative difference: {:g}\n", diff);
+        return (diff < 1e-8) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    QI::CheckPos(spgr_path);
     if (simulate) {
         QI::SimulateModel<DESPOT1, false>(input,
                                           model,
@@ -199,8 +249,29 @@ int despot1_main(args::Subparser &parser) {
                                           mask.Get(),
                                           verbose,
                                           simulate.Get(),
-                                          subregion.Get());
+                                          subregion.Get(),
+                                          int16);
     } else {
+        auto run = [&](auto *d1) {
+            using FitType = std::remove_pointer_t<decltype(d1)>;
+            d1->solver    = QI::ReadSolverOptions(input, solver.Get());
+            auto fit =
+                QI::ModelFitFilter<FitType>::New(d1, verbose, covar, resids, subregion.Get());
+            fit->SetCheckpoint(checkpoint.Get(),
+                               slab.Get(),
+                               {{"input", input},
+                                {"algo", algorithm.Get()},
+                                {"its", its.Get()},
+                                {"polish", polish.Get()},
+                                {"dict_rank", dict_rank.Get()}});
+            fit->SetOutputStatus(fit_status);
+            fit->SetOutputProfile(profile);
+            fit->SetPackOutputs(pack);
+            fit->SetInt16Outputs(int16);
+            fit->ReadInputs({QI::CheckPos(spgr_path)}, {B1.Get()}, mask.Get());
+            fit->Update();
+            fit->WriteOutputs(prefix.Get() + "D1_");
+        };
         DESPOT1Fit *d1 = nullptr;
         switch (algorithm.Get()) {
         case 'l':
@@ -215,13 +286,31 @@ int despot1_main(args::Subparser &parser) {
             d1 = new DESPOT1NLLS(model);
             QI::Log(verbose, "NLLS algorithm selected.");
             break;
+        case 'm':
+            // The filter needs the LMFit type itself to pass it several voxels at a time
+            QI::Log(verbose, "Batched LM algorithm selected ({} voxels per batch).", QI::SIMDWidth);
+            run(new QI::LMFit<DESPOT1, 1>(model));
+            break;
+        case 'd': {
+            auto dict          = new DESPOT1Dictionary(model);
+            // About 300 points per decade, as the bounds span seven decades of T1
+            dict->varying_grid = {dict->BoundsGrid(1, 2000, true)};
+            if (B1) {
+                dict->fixed_grid = {DESPOT1Dictionary::Grid(0.5, 1.5, 101, false)};
+            }
+            dict->polish = polish.Get();
+            dict->rank   = dict_rank.Get();
+            dict->cache  = dict_cache.Get();
+            dict->Build(verbose);
+            d1 = dict;
+            QI::Log(verbose, "Dictionary algorithm selected.");
+        } break;
         default:
             QI::Fail("Unknown algorithm type: {}", algorithm.Get());
         }
-        auto fit = QI::ModelFitFilter<DESPOT1Fit>::New(d1, verbose, covar, resids, subregion.Get());
-        fit->ReadInputs({QI::CheckPos(spgr_path)}, {B1.Get()}, mask.Get());
-        fit->Update();
-        fit->WriteOutputs(prefix.Get() + "D1_");
+        if (d1) {
+            run(d1);
+        }
         QI::Log(verbose, "Finished.");
     }
     return EXIT_SUCCESS;
@@ -103,7 +103,8 @@ struct HIFIFit {
     using RMSErrorType        = double;
     using FlagType            = int;
     using ModelType           = HIFIModel;
-    HIFIModel model;
+    HIFIModel         model;
+    QI::SolverOptions solver;
 
     int input_size(const int i) const {
         switch (i) {
@@ -128,7 +129,7 @@ struct HIFIFit {
         if (scale < std::numeric_limits<double>::epsilon()) {
             v << 0.0, 0.0, 0.0;
             rmse = 0.0;
-            return {false, "Maximum data value was zero or less"};
+            return {false, QI::FitStatus::BadData};
         }
         const Eigen::ArrayXd spgr_data   = inputs[0] / scale;
         const Eigen::ArrayXd mprage_data = inputs[1] / scale;
@@ -154,9 +155,10 @@ struct HIFIFit {
         options.gradient_tolerance  = 1e-6;
         options.parameter_tolerance = 1e-4;
         options.logging_type        = ceres::SILENT;
+        solver.Apply(options);
         ceres::Solve(options, &problem, &summary);
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
         }
         iterations = summary.iterations.size();
 
@@ -174,7 +176,7 @@ struct HIFIFit {
         rmse = sqrt(var / dsize);
 
         v[0] = v[0] * scale;
-        return {true, ""};
+        return {true, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
     }
 };
 
@@ -185,6 +187,7 @@ int despot1hifi_main(args::Subparser &parser) {
     args::Positional<std::string> spgr_path(parser, "SPGR_FILE", "Input SPGR file");
     args::Positional<std::string> mprage_path(parser, "MPRAGE_FILE", "Input MP-RAGE file");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
     args::ValueFlag<float> clamp(parser,
                                  "CLAMP",
                                  "Clamp output T1 values to this value",
@@ -206,11 +209,21 @@ int despot1hifi_main(args::Subparser &parser) {
                                            mask.Get(),
                                            verbose,
                                            simulate.Get(),
-                                           subregion.Get());
+                                           subregion.Get(),
+                                           int16);
     } else {
         HIFIFit hifi_fit{model};
-        auto    fit_filter =
+        hifi_fit.solver = QI::ReadSolverOptions(input, solver.Get());
+        auto fit_filter =
             QI::ModelFitFilter<HIFIFit>::New(&hifi_fit, verbose, covar, resids, subregion.Get());
+        fit_filter->SetCheckpoint(checkpoint.Get(),
+                                  slab.Get(),
+                                  {{"input", input},
+                                   {"clamp", clamp.Get()}});
+        fit_filter->SetOutputStatus(fit_status);
+        fit_filter->SetOutputProfile(profile);
+        fit_filter->SetPackOutputs(pack);
+        fit_filter->SetInt16Outputs(int16);
         fit_filter->ReadInputs(
             {QI::CheckPos(spgr_path), QI::CheckPos(mprage_path)}, {}, mask.Get());
         fit_filter->Update();
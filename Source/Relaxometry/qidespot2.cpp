@@ -55,6 +55,30 @@ struct DESPOT2 : QI::Model<double, double, 2, 2> {
         const QI_ARRAY(T) numer = PD * sqrt(E2) * (1.0 - E1) * sin(alpha);
         return numer / denom;
     }
+
+    void signal_jacobian(VaryingArray const &v,
+                         FixedArray const &  f,
+                         Eigen::ArrayXd &    s,
+                         Eigen::MatrixXd &   j) const {
+        const double &       PD    = v[0];
+        const double &       T2    = v[1];
+        const double &       T1    = f[0];
+        const double &       B1    = f[1];
+        const double         E1    = exp(-sequence.TR / T1);
+        const double         E2    = exp(-sequence.TR / T2);
+        const Eigen::ArrayXd alpha = sequence.FA * B1;
+        const Eigen::ArrayXd denom = elliptical ?
+                                         (1.0 - E1 * E2 * E2 - (E1 - E2 * E2) * cos(alpha)) :
+                                         (1.0 - E1 * E2 - (E1 - E2) * cos(alpha));
+
+        s = PD * sqrt(E2) * (1.0 - E1) * sin(alpha) / denom;
+
+        // Derivative of denom with respect to E2
+        const Eigen::ArrayXd d_denom = (elliptical ? 2.0 * E2 : 1.0) * (cos(alpha) - E1);
+        j.resize(sequence.size(), 2);
+        j.col(0) = (sqrt(E2) * (1.0 - E1) * sin(alpha) / denom).matrix();
+        j.col(1) = (s * (0.5 - E2 * d_denom / denom) * sequence.TR / (T2 * T2)).matrix();
+    }
 };
 
 using DESPOT2Fit = QI::FitFunction<DESPOT2>;
@@ -98,7 +122,7 @@ struct DESPOT2LLS : DESPOT2Fit {
         }
         residual   = sqrt(r.square().sum() / r.rows());
         iterations = 1;
-        return {true, ""};
+        return {true, QI::FitStatus::Success};
     }
 };
 
@@ -164,7 +188,7 @@ struct DESPOT2WLLS : DESPOT2Fit {
             residuals[0] = r;
         }
         residual = sqrt(r.square().sum() / r.rows());
-        return {true, ""};
+        return {true, QI::FitStatus::Success};
     }
 };
 
@@ -182,16 +206,12 @@ struct DESPOT2NLLS : DESPOT2Fit {
         if (scale < std::numeric_limits<double>::epsilon()) {
             p << 0.0, 0.0;
             rmse = 0;
-            return {false, "Maximum data value was not positive"};
+            return {false, QI::FitStatus::BadData};
         }
         const Eigen::ArrayXd data = inputs[0] / scale;
         p << 10., 0.1;
         ceres::Problem problem;
-        using Cost      = QI::ModelCost<DESPOT2>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, DESPOT2::NV>;
-        auto *cost      = new Cost{model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
+        problem.AddResidualBlock(QI::MakeModelCost(model, fixed, data), NULL, p.data());
         problem.SetParameterLowerBound(p.data(), 0, model.bounds_lo[0] / scale);
         problem.SetParameterUpperBound(p.data(), 0, model.bounds_hi[0] / scale);
         problem.SetParameterLowerBound(p.data(), 1, model.bounds_lo[1]);
@@ -204,10 +224,11 @@ struct DESPOT2NLLS : DESPOT2Fit {
         options.gradient_tolerance  = 1e-6;
         options.parameter_tolerance = 1e-4;
         options.logging_type        = ceres::SILENT;
+        solver.Apply(options);
         ceres::Solve(options, &problem, &summary);
         p[0] = p[0] * scale;
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
         }
         iterations = summary.iterations.size();
 
@@ -221,7 +242,7 @@ struct DESPOT2NLLS : DESPOT2Fit {
             QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
         }
         p[0] *= scale; // Multiply signals/proton density back up
-        return {true, ""};
+        return {true, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
     }
 };
 
@@ -231,6 +252,7 @@ struct DESPOT2NLLS : DESPOT2Fit {
 int despot2_main(args::Subparser &parser) {
     args::Positional<std::string> ssfp_path(parser, "SSFP FILE", "Path to SSFP data");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
     args::ValueFlag<std::string> t1_path(parser, "T1 MAP", "Path to T1 map **REQUIRED**", {"T1"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/w/n)", {'a', "algo"}, 'l');
@@ -238,12 +260,21 @@ int despot2_main(args::Subparser &parser) {
         parser, "GS", "Data is band-free geometric solution / ellipse data", {'g', "gs"});
     args::ValueFlag<int> its(
         parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i', "its"}, 15);
+    args::ValueFlag<int> check_jacobian(
+        parser, "N", "Compare analytic and automatic Jacobians at N points", {"check-jacobian"});
     parser.Parse();
 
     QI::Log(verbose, "Reading sequence information");
     json    input = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
     auto    ssfp  = input.at("SSFP").get<QI::SSFPSequence>();
     DESPOT2 model{{}, ssfp, its.Get()};
+    if (check_jacobian) {
+        model.elliptical = gs_arg;
+        double const diff = QI::CheckJacobian(
+            model, model.fixed_defaults, model.bounds_lo, model.bounds_hi, check_jacobian.Get());
+        fmt::print("Largest relative difference: {:g}\n", diff);
+        return (diff < 1e-8) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     if (simulate) {
         if (gs_arg)
             model.elliptical = true;
@@ -254,7 +285,8 @@ int despot2_main(args::Subparser &parser) {
                                           mask.Get(),
                                           verbose,
                                           simulate.Get(),
-                                          subregion.Get());
+                                          subregion.Get(),
+                                          int16);
     } else {
         DESPOT2Fit *d2 = nullptr;
         switch (algorithm.Get()) {
@@ -275,7 +307,18 @@ int despot2_main(args::Subparser &parser) {
             QI::Log(verbose, "GS Mode selected");
             d2->model.elliptical = true;
         }
+        d2->solver = QI::ReadSolverOptions(input, solver.Get());
         auto fit = QI::ModelFitFilter<DESPOT2Fit>::New(d2, verbose, covar, resids, subregion.Get());
+        fit->SetCheckpoint(checkpoint.Get(),
+                           slab.Get(),
+                           {{"input", input},
+                            {"algo", algorithm.Get()},
+                            {"gs", gs_arg.Get()},
+                            {"its", its.Get()}});
+        fit->SetOutputStatus(fit_status);
+        fit->SetOutputProfile(profile);
+        fit->SetPackOutputs(pack);
+        fit->SetInt16Outputs(int16);
         fit->ReadInputs({QI::CheckPos(ssfp_path)}, {QI::CheckValue(t1_path), B1.Get()}, mask.Get());
         fit->Update();
         fit->WriteOutputs(prefix.Get() + "D2_");
@@ -12,7 +12,9 @@
 
 #include "ceres/ceres.h"
 #include <Eigen/Core>
+#include <algorithm>
 #include <array>
+#include <vector>
 
 #include "Args.h"
 #include "FitFunction.h"
@@ -62,14 +64,168 @@ struct FMModel : QI::Model<double, double, 3, 2> {
             (sin_psi - E2 * (cos_th * sin_psi + sin_th * cos_psi)) * G / (1.0 - b * cos_th);
         return sqrt(re_m.square() + im_m.square());
     }
+
+    void signal_jacobian(VaryingArray const &v,
+                         FixedArray const &  f,
+                         Eigen::ArrayXd &    s,
+                         Eigen::MatrixXd &   j) const {
+        const double &       PD    = v[0];
+        const double &       T2    = v[1];
+        const double &       f0    = v[2];
+        const double &       T1    = f[0];
+        const double &       B1    = f[1];
+        const double         E1    = exp(-sequence.TR / T1);
+        const double         E2    = exp(-sequence.TR / T2);
+        const double         psi   = 2. * M_PI * f0 * sequence.TR;
+        const Eigen::ArrayXd alpha = sequence.FA * B1;
+        const Eigen::ArrayXd d     = (1. - E1 * E2 * E2 - (E1 - E2 * E2) * cos(alpha));
+        const Eigen::ArrayXd G     = -PD * (1. - E1) * sin(alpha) / d;
+        const Eigen::ArrayXd b     = E2 * (1. - E1) * (1. + cos(alpha)) / d;
+
+        const Eigen::ArrayXd theta   = sequence.PhaseInc + psi;
+        const Eigen::ArrayXd cos_th  = cos(theta);
+        const Eigen::ArrayXd sin_th  = sin(theta);
+        const double         cos_psi = cos(psi);
+        const double         sin_psi = sin(psi);
+        // re_m = P * G / den and im_m = Q * G / den
+        const Eigen::ArrayXd c2   = cos_th * cos_psi - sin_th * sin_psi;
+        const Eigen::ArrayXd s2   = cos_th * sin_psi + sin_th * cos_psi;
+        const Eigen::ArrayXd P    = cos_psi - E2 * c2;
+        const Eigen::ArrayXd Q    = sin_psi - E2 * s2;
+        const Eigen::ArrayXd den  = 1.0 - b * cos_th;
+        const Eigen::ArrayXd re_m = P * G / den;
+        const Eigen::ArrayXd im_m = Q * G / den;
+        s                         = sqrt(re_m.square() + im_m.square());
+
+        // Derivatives of K = G / den by PD, E2 and psi
+        const Eigen::ArrayXd d_E2  = 2. * E2 * (cos(alpha) - E1);
+        const Eigen::ArrayXd G_E2  = -G * d_E2 / d;
+        const Eigen::ArrayXd b_E2  = (1. - E1) * (1. + cos(alpha)) / d - b * d_E2 / d;
+        const Eigen::ArrayXd K     = G / den;
+        const Eigen::ArrayXd K_PD  = -(1. - E1) * sin(alpha) / d / den;
+        const Eigen::ArrayXd K_E2  = (G_E2 + K * cos_th * b_E2) / den;
+        const Eigen::ArrayXd K_psi = -K * b * sin_th / den;
+        // psi appears in both psi and theta
+        const Eigen::ArrayXd P_psi = -sin_psi + 2. * E2 * s2;
+        const Eigen::ArrayXd Q_psi = cos_psi - 2. * E2 * c2;
+        j.resize(sequence.size(), 3);
+        j.col(0) = ((re_m * P + im_m * Q) * K_PD / s).matrix();
+        j.col(1) = ((re_m * (P * K_E2 - c2 * K) + im_m * (Q * K_E2 - s2 * K)) / s * E2 *
+                    sequence.TR / (T2 * T2))
+                       .matrix();
+        j.col(2) = ((re_m * (P_psi * K + P * K_psi) + im_m * (Q_psi * K + Q * K_psi)) / s * 2. *
+                    M_PI * sequence.TR)
+                       .matrix();
+    }
 };
 
 using FMFit = QI::FitFunction<FMModel>;
 
+/*
+ * Coarse (T2, f0) grid used to choose the starting points for the NLLS. The signal is linear in
+ * PD, so at each grid point PD is solved for directly and only T2 and f0 are searched. Local
+ * minima of the grid cost are returned best first, keeping at most max_basins of them and
+ * dropping any whose cost is more than prune times the best.
+ */
+struct FMSeedGrid {
+    struct Seed {
+        double         cost;
+        Eigen::Array3d p;
+    };
+
+    double          TR         = 0;
+    bool            asymmetric = false;
+    int             nT2        = 0;
+    int             max_basins = 2;
+    double          prune      = 2.0;
+    Eigen::ArrayXd  FA, f0, cos_psi, sin_psi;
+    Eigen::ArrayXXd cos_th, c2, s2; // Readouts x f0, cos(theta) and cos/sin(theta + psi)
+
+    FMSeedGrid() = default;
+    FMSeedGrid(QI::SSFPSequence const &s, bool const asym, int const nT2_, int const nf0) :
+        TR{s.TR}, asymmetric{asym}, nT2{nT2_}, FA{s.FA} {
+        // The symmetric range includes both ends, the asymmetric range is one full period
+        f0 = asym ? Eigen::ArrayXd((Eigen::ArrayXd::LinSpaced(nf0, 0, nf0 - 1) / nf0 - 0.5) / TR)
+                  : Eigen::ArrayXd::LinSpaced(nf0, 0., 0.5 / TR);
+        Eigen::ArrayXd const psi = 2. * M_PI * TR * f0;
+        cos_psi                  = cos(psi);
+        sin_psi                  = sin(psi);
+        Eigen::ArrayXXd const theta =
+            s.PhaseInc.replicate(1, nf0) + psi.transpose().replicate(s.size(), 1);
+        cos_th = cos(theta);
+        c2     = cos(theta.rowwise() + psi.transpose());
+        s2     = sin(theta.rowwise() + psi.transpose());
+    }
+
+    std::vector<Seed> seeds(Eigen::ArrayXd const &data, double const T1, double const B1) const {
+        long const           nf0 = f0.rows();
+        Eigen::ArrayXXd      cost(nT2, nf0), PD(nT2, nf0);
+        Eigen::ArrayXd       T2(nT2);
+        double const         T2lo = std::min(1.5 * TR, T1);
+        double const         E1   = exp(-TR / T1);
+        Eigen::ArrayXd const ca   = cos(FA * B1);
+        Eigen::ArrayXd const sa   = sin(FA * B1);
+        double const         dd   = data.square().sum();
+        for (int k = 0; k < nT2; k++) {
+            T2[k]                  = T2lo * pow(T1 / T2lo, k / (nT2 - 1.));
+            double const         E2 = exp(-TR / T2[k]);
+            Eigen::ArrayXd const d  = 1. - E1 * E2 * E2 - (E1 - E2 * E2) * ca;
+            Eigen::ArrayXd const G  = (1. - E1) * sa / d;
+            Eigen::ArrayXd const b  = E2 * (1. - E1) * (1. + ca) / d;
+            // |re_m + i * im_m| written out so Eigen evaluates it in a single pass
+            Eigen::ArrayXXd const S =
+                (((-E2 * c2).rowwise() + cos_psi.transpose()).square() +
+                 ((-E2 * s2).rowwise() + sin_psi.transpose()).square())
+                    .sqrt()
+                    .colwise() *
+                G.abs() / (1. - cos_th.colwise() * b).abs();
+            Eigen::ArrayXd const dS = (S.colwise() * data).colwise().sum().transpose();
+            Eigen::ArrayXd const SS = S.square().colwise().sum().transpose();
+            cost.row(k)             = (dd - dS.square() / SS).transpose();
+            PD.row(k)               = (dS / SS).transpose();
+        }
+
+        // A point is a basin if no neighbour is lower. Ties go to the earlier point.
+        std::vector<Seed> found;
+        auto const        lower = [&](int k, int j, int nk, int nj) {
+            if (nk < 0 || nk >= nT2) {
+                return false;
+            }
+            if (nj < 0 || nj >= nf0) {
+                if (!asymmetric) {
+                    return false;
+                }
+                nj = (nj + nf0) % nf0;
+            }
+            return (cost(nk, nj) < cost(k, j)) ||
+                   (cost(nk, nj) == cost(k, j) && (nk * nf0 + nj) < (k * nf0 + j));
+        };
+        for (int k = 0; k < nT2; k++) {
+            for (int j = 0; j < nf0; j++) {
+                if (std::isfinite(cost(k, j)) && !lower(k, j, k - 1, j) &&
+                    !lower(k, j, k + 1, j) && !lower(k, j, k, j - 1) && !lower(k, j, k, j + 1)) {
+                    found.push_back({cost(k, j), {std::max(PD(k, j), 1.), T2[k], f0[j]}});
+                }
+            }
+        }
+        std::sort(found.begin(), found.end(), [](Seed const &a, Seed const &b) {
+            return a.cost < b.cost;
+        });
+        long keep = 0;
+        while (keep < static_cast<long>(found.size()) && keep < max_basins &&
+               (keep == 0 || found[keep].cost <= prune * found[0].cost)) {
+            keep++;
+        }
+        found.resize(keep);
+        return found;
+    }
+};
+
 struct FMNLLS : FMFit {
     using FMFit::FMFit;
     long              max_iterations;
     bool              asymmetric = false;
+    FMSeedGrid        grid; // Empty to use the fixed f0 starts
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           FMModel::FixedArray const &        fixed,
                           FMModel::VaryingArray &            bestP,
@@ -77,28 +233,19 @@ struct FMNLLS : FMFit {
                           RMSErrorType &                     rmse,
                           std::vector<Eigen::ArrayXd> &      residuals,
                           FlagType &                         iterations) const override {
-        const double &T1 = fixed[0];
+        const double &     T1     = fixed[0];
+        QI::FitStatus      status = QI::FitStatus::Success;
+        QI::FitEvaluations evaluations;
         if (std::isfinite(T1) && (T1 > model.sequence.TR)) {
             // Improve scaling by dividing the PD down to something sensible.
             // This gets scaled back up at the end.
             const double         scale = inputs[0].maxCoeff();
             const Eigen::ArrayXd data  = inputs[0] / scale;
 
-            std::vector<double> f0_starts = {0, 0.4 / model.sequence.TR};
-            if (this->asymmetric) {
-                f0_starts.push_back(0.2 / model.sequence.TR);
-                f0_starts.push_back(-0.2 / model.sequence.TR);
-                f0_starts.push_back(-0.4 / model.sequence.TR);
-            }
-
             double         best = std::numeric_limits<double>::infinity();
-            Eigen::Array3d p;
+            Eigen::Array3d p    = bestP; // Holds the seed in warm-start mode
             ceres::Problem problem;
-            using Cost      = QI::ModelCost<FMModel>;
-            using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, FMModel::NV>;
-            auto *cost      = new Cost{model, fixed, data};
-            auto *auto_cost = new AutoCost(cost, model.sequence.size());
-            problem.AddResidualBlock(auto_cost, NULL, p.data());
+            problem.AddResidualBlock(QI::MakeModelCost(model, fixed, data), NULL, p.data());
             problem.SetParameterLowerBound(p.data(), 0, 1.);
             problem.SetParameterLowerBound(p.data(), 1, model.sequence.TR);
             problem.SetParameterUpperBound(p.data(), 1, T1);
@@ -115,26 +262,65 @@ struct FMNLLS : FMFit {
             options.gradient_tolerance  = 1e-7;
             options.parameter_tolerance = 1e-5;
             options.logging_type        = ceres::SILENT;
-            for (const double &f0 : f0_starts) {
-                p = {5., std::max(0.1 * T1, 1.5 * model.sequence.TR), f0};
-                // Yarnykh gives T2 = 0.045 * T1 in brain, but best to overestimate for CSF
+            this->solver.Apply(options);
+            // A converged neighbour is almost always in the right f0 basin, so only fall back to
+            // the multi-start search if the seeded solve does not converge
+            double const         inf    = std::numeric_limits<double>::infinity();
+            double const         f0_max = 0.5 / model.sequence.TR;
+            Eigen::Array3d const lo{1., model.sequence.TR, this->asymmetric ? -f0_max : 0.};
+            Eigen::Array3d const hi{inf, T1, f0_max};
+            Eigen::Array3d const start{5., std::max(0.1 * T1, 1.5 * model.sequence.TR), 0.};
+            iterations = 0;
+            if (QI::WarmStart(p, start, lo, hi, this->warm_start, scale, 1)) {
                 ceres::Solve(options, &problem, &summary);
-                if (!summary.IsSolutionUsable()) {
-                    return {false, summary.FullReport()};
-                }
-                double r = summary.final_cost;
-                if (r < best) {
-                    best       = r;
-                    bestP      = p;
-                    iterations = summary.iterations.size();
+                iterations = summary.iterations.size();
+                evaluations.Add(summary);
+                if (summary.termination_type == ceres::CONVERGENCE) {
+                    best   = summary.final_cost;
+                    bestP  = p;
+                    status = QI::CeresStatus(summary);
                 }
             }
-            if (!summary.IsSolutionUsable()) {
-                return {false, summary.FullReport()};
+            if (!std::isfinite(best)) {
+                std::vector<Eigen::Array3d> starts;
+                if (grid.nT2 > 0) {
+                    for (auto const &seed : grid.seeds(data, T1, fixed[1])) {
+                        starts.push_back(seed.p);
+                    }
+                } else {
+                    std::vector<double> f0_starts = {0, 0.4 / model.sequence.TR};
+                    if (this->asymmetric) {
+                        f0_starts.push_back(0.2 / model.sequence.TR);
+                        f0_starts.push_back(-0.2 / model.sequence.TR);
+                        f0_starts.push_back(-0.4 / model.sequence.TR);
+                    }
+                    for (const double &f0 : f0_starts) {
+                        // Yarnykh gives T2 = 0.045 * T1 in brain, but best to overestimate for CSF
+                        starts.push_back(start);
+                        starts.back()[2] = f0;
+                    }
+                }
+                if (starts.empty()) {
+                    starts.push_back(start);
+                }
+                for (auto const &s : starts) {
+                    p = s;
+                    ceres::Solve(options, &problem, &summary);
+                    evaluations.Add(summary);
+                    if (!summary.IsSolutionUsable()) {
+                        return {false, QI::CeresStatus(summary), evaluations};
+                    }
+                    iterations += summary.iterations.size();
+                    double r = summary.final_cost;
+                    if (r < best) {
+                        best   = r;
+                        bestP  = p;
+                        status = QI::CeresStatus(summary);
+                    }
+                }
             }
-            iterations = summary.iterations.size();
 
-            Eigen::ArrayXd const rs  = (data - model.signal(p, fixed));
+            Eigen::ArrayXd const rs  = (data - model.signal(bestP, fixed));
             double const         var = rs.square().sum();
             rmse                     = sqrt(var / data.rows()) * scale;
             if (residuals.size() > 0) {
@@ -150,9 +336,9 @@ struct FMNLLS : FMFit {
             bestP << 0.0, 0.0, 0.0;
             rmse       = 0;
             iterations = 0;
-            return {false, "T1 was either infinite or shorter than TR"};
+            return {false, QI::FitStatus::BadFixed};
         }
-        return {true, ""};
+        return {true, status, evaluations};
     }
 };
 
@@ -162,17 +348,42 @@ struct FMNLLS : FMFit {
 int despot2fm_main(args::Subparser &parser) {
     args::Positional<std::string> ssfp_path(parser, "SSFP_FILE", "Input SSFP file");
     QI_COMMON_ARGS;
+    QI_SOLVER_ARGS;
     args::ValueFlag<std::string> t1_path(parser, "T1_MAP", "Input T1 map ** REQUIRED **", {"T1"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<int>         its(
         parser, "ITERS", "Max iterations for NLLS (default 75)", {'i', "its"}, 75);
     args::Flag asym(parser, "ASYM", "Fit +/- off-resonance frequency", {'A', "asym"});
+    args::ValueFlag<int> basins(parser,
+                                "BASINS",
+                                "Refine at most N basins of the seed grid, 0 for fixed starts "
+                                "(default 2)",
+                                {"basins"},
+                                2);
+    args::ValueFlag<double> prune(
+        parser,
+        "PRUNE",
+        "Skip basins whose grid cost is over PRUNE times the best (default 2)",
+        {"prune"},
+        2.0);
+    args::Flag warm(parser, "WARM", "Start each voxel from the last converged voxel", {"warm"});
+    args::ValueFlag<int> check_jacobian(
+        parser, "N", "Compare analytic and automatic Jacobians at N points", {"check-jacobian"});
     parser.Parse();
 
     QI::Log(verbose, "Reading sequence information");
     json    input = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
     auto    ssfp  = input.at("SSFP").get<QI::SSFPSequence>();
     FMModel model{{}, ssfp};
+    if (check_jacobian) {
+        double const                f0_max = 0.5 / ssfp.TR;
+        FMModel::VaryingArray const lo{1., ssfp.TR, -f0_max};
+        FMModel::VaryingArray const hi{100., model.fixed_defaults[0], f0_max};
+        double const                diff =
+            QI::CheckJacobian(model, model.fixed_defaults, lo, hi, check_jacobian.Get());
+        fmt::print("Largest relative difference: {:g}\n", diff);
+        return (diff < 1e-8) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     if (simulate) {
         QI::SimulateModel<FMModel, false>(input,
                                           model,
@@ -181,13 +392,41 @@ int despot2fm_main(args::Subparser &parser) {
                                           mask.Get(),
                                           verbose,
                                           simulate.Get(),
-                                          subregion.Get());
+                                          subregion.Get(),
+                                          int16);
     } else {
         FMNLLS fm{model};
         fm.max_iterations = its.Get();
         fm.asymmetric     = asym.Get();
+        fm.warm_start     = warm.Get();
+        fm.solver         = QI::ReadSolverOptions(input, solver.Get());
+        if (basins.Get() > 0) {
+            fm.grid            = FMSeedGrid(ssfp, fm.asymmetric, 12, fm.asymmetric ? 48 : 25);
+            fm.grid.max_basins = basins.Get();
+            fm.grid.prune      = prune.Get();
+            QI::Log(verbose,
+                    "Seeding from a {}x{} T2/f0 grid, refining up to {} basins within {}x of the "
+                    "best grid cost",
+                    fm.grid.nT2,
+                    fm.grid.f0.rows(),
+                    fm.grid.max_basins,
+                    fm.grid.prune);
+        } else {
+            QI::Log(verbose, "Refining every fixed f0 start");
+        }
         auto fit_filter =
             QI::ModelFitFilter<FMNLLS>::New(&fm, verbose, covar, resids, subregion.Get());
+        fit_filter->SetCheckpoint(checkpoint.Get(),
+                                  slab.Get(),
+                                  {{"input", input},
+                                   {"its", its.Get()},
+                                   {"asym", asym.Get()},
+                                   {"basins", basins.Get()},
+                                   {"prune", prune.Get()}});
+        fit_filter->SetOutputStatus(fit_status);
+        fit_filter->SetOutputProfile(profile);
+        fit_filter->SetPackOutputs(pack);
+        fit_filter->SetInt16Outputs(int16);
         fit_filter->ReadInputs(
             {QI::CheckPos(ssfp_path)}, {QI::CheckValue(t1_path), B1.Get()}, mask.Get());
         fit_filter->Update();
@@ -12,7 +12,11 @@
 
 #include "ceres/ceres.h"
 #include <Eigen/Core>
+#include <algorithm>
 #include <array>
+#include <memory>
+#include <random>
+#include <type_traits>
 
 #include "Args.h"
 #include "FitFunction.h"
@@ -27,17 +31,14 @@
 #include "TwoPoolModel.h"
 #include "Util.h"
 
+// The data, weights and fixed parameters are filled in for each voxel
 template <typename Model> struct MCDSRCFunctor {
-    const Eigen::ArrayXd data, weights;
-    const QI_ARRAYN(double, Model::NF) fixed;
+    Eigen::ArrayXd data, weights;
+    QI_ARRAYN(double, Model::NF) fixed;
     const Model &model;
 
-    MCDSRCFunctor(const Model &m,
-                  const QI_ARRAYN(double, Model::NF) & f,
-                  const Eigen::ArrayXd &d,
-                  const Eigen::ArrayXd &w) :
-        data(d),
-        weights(w), fixed(f), model(m) {}
+    MCDSRCFunctor(const Model &m) :
+        data(m.spgr.size() + m.ssfp.size()), weights(m.spgr.size() + m.ssfp.size()), model(m) {}
 
     int inputs() const { return Model::NV; }
     int values() const { return model.spgr.size() + model.ssfp.size(); }
@@ -57,7 +58,7 @@ template <typename Model> struct MCDSRCFunctor {
 
 template <typename Model> struct SRCFit {
     static const bool Blocked = false;
-    static const bool Indexed = false;
+    static const bool Indexed = true;
     using InputType           = double;
     using OutputType          = double;
     using RMSErrorType        = double;
@@ -76,9 +77,89 @@ template <typename Model> struct SRCFit {
     }
     int n_outputs() const { return Model::NV; }
 
-    int    max_iterations = 5;
-    size_t src_samples = 5000, src_retain = 50;
-    bool   src_gauss = true;
+    QI::RCOptions options{
+        .samples = 5000, .retain = 50, .max_contractions = 4, .expand = 0.02, .gaussian = true};
+    // The seed is combined with the voxel index, so results do not depend on the thread count.
+    // With prefit, the bounds are narrowed to within prefit_margin of single-component T1/T2.
+    std::uint64_t seed          = 0;
+    bool          prefit        = false;
+    double        prefit_margin = 0.1;
+
+    /*
+     *  Narrow the bounds for a voxel with the apparent single-component T1 and T2 from linear
+     *  DESPOT1 and DESPOT2 fits. These lie between the values of the shortest and longest-lived
+     *  pools, so bound the myelin water T1 and T2 from above and those of the longest-lived pool
+     *  from below. DESPOT2 assumes the SSFP data is on-resonance, so T2 is only used for voxels
+     *  close to resonance and the 180 degree phase-increment data.
+     */
+    void PreFit(const std::vector<Eigen::ArrayXd> &inputs,
+                typename Model::FixedArray const & fixed,
+                typename Model::VaryingArray &     lo,
+                typename Model::VaryingArray &     hi) const {
+        constexpr int long_pool = std::is_same_v<Model, QI::ThreePoolModel> ? 5 : 3;
+        double const  f0        = fixed[0];
+        double const  B1        = fixed[1];
+        auto const    slope     = [](Eigen::ArrayXd const &data, Eigen::ArrayXd const &angles) {
+            Eigen::ArrayXd const y  = data / angles.sin();
+            Eigen::ArrayXd const x  = data / angles.tan();
+            Eigen::ArrayXd const dx = x - x.mean();
+            return (dx * (y - y.mean())).sum() / dx.square().sum();
+        };
+        auto const narrow = [&](int const short_index, int const long_index, double const value) {
+            if (std::isfinite(value) && value > 0.) {
+                hi[short_index] =
+                    std::clamp(value * (1. + prefit_margin), lo[short_index], hi[short_index]);
+                lo[long_index] =
+                    std::clamp(value * (1. - prefit_margin), lo[long_index], hi[long_index]);
+            }
+        };
+
+        double const T1 = -model.spgr.TR / std::log(slope(inputs[0], model.spgr.FA * B1));
+        narrow(1, long_pool, T1);
+        if (!std::isfinite(T1) || T1 <= 0. || std::abs(f0 * model.ssfp.TR) > 0.1) {
+            return;
+        }
+        Eigen::ArrayXd data(model.ssfp.size()), angles(model.ssfp.size());
+        int            n = 0;
+        for (int i = 0; i < model.ssfp.size(); i++) {
+            if (std::abs(std::abs(model.ssfp.PhaseInc[i]) - M_PI) < 1e-3) {
+                data[n]   = inputs[1][i];
+                angles[n] = model.ssfp.FA[i] * B1;
+                n++;
+            }
+        }
+        if (n < 2) {
+            return;
+        }
+        data.conservativeResize(n);
+        angles.conservativeResize(n);
+        double const E1 = exp(-model.ssfp.TR / T1);
+        double const m  = slope(data, angles);
+        double const E2 = (E1 - m) / (1. - m * E1);
+        narrow(2, long_pool + 1, -model.ssfp.TR / std::log(E2));
+    }
+
+    using Functor = MCDSRCFunctor<Model>;
+
+    /*
+     *  The region contraction and its cost functor, made once for each thread by ModelFitFilter
+     *  and kept in its workspace, so the sample buffers are only allocated once. The contraction
+     *  refers to the functor, so the pair lives on the heap and never moves. The voxel index is
+     *  passed to optimise() as the random number key.
+     */
+    struct Engine {
+        Functor                        func;
+        QI::RegionContraction<Functor> rc;
+
+        Engine(SRCFit const &f) :
+            func{f.model}, rc{func,
+                              f.model.bounds_lo,
+                              f.model.bounds_hi,
+                              Eigen::ArrayXd::Constant(Model::NV, 0.05),
+                              f.options} {}
+    };
+
+    std::unique_ptr<Engine> make_scratch() const { return std::make_unique<Engine>(*this); }
 
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           typename Model::FixedArray const & fixed,
@@ -86,36 +167,46 @@ template <typename Model> struct SRCFit {
                           typename Model::CovarArray * /*Unused */,
                           RMSErrorType &               residual,
                           std::vector<Eigen::ArrayXd> &residuals,
-                          FlagType &                   iterations) const {
-        Eigen::ArrayXd data(model.ssfp.size() + model.spgr.size());
-        int            dataIndex = 0;
+                          FlagType &                   iterations,
+                          const itk::Index<3> &        index,
+                          std::unique_ptr<Engine> const &    engine) const {
+        auto &func      = engine->func;
+        auto &rc        = engine->rc;
+        int   dataIndex = 0;
         for (size_t i = 0; i < inputs.size(); i++) {
             if (model.scale_to_mean) {
-                data.segment(dataIndex, inputs[i].rows()) = inputs[i] / inputs[i].mean();
+                func.data.segment(dataIndex, inputs[i].rows()) = inputs[i] / inputs[i].mean();
             } else {
-                data.segment(dataIndex, inputs[i].rows()) = inputs[i];
+                func.data.segment(dataIndex, inputs[i].rows()) = inputs[i];
             }
             dataIndex += inputs[i].rows();
         }
-        QI_ARRAYN(double, Model::NV) thresh = QI_ARRAYN(double, Model::NV)::Constant(0.05);
-        const double & f0                   = fixed[0];
-        Eigen::ArrayXd weights(model.spgr.size() + model.ssfp.size());
-        weights.head(model.spgr.size()) = 1;
-        weights.tail(model.ssfp.size()) = model.ssfp.weights(f0);
-        using Functor                   = MCDSRCFunctor<Model>;
-        Functor                        func(model, fixed, data, weights);
-        QI::RegionContraction<Functor> rc(func,
-                                          model.bounds_lo,
-                                          model.bounds_hi,
-                                          thresh,
-                                          src_samples,
-                                          src_retain,
-                                          max_iterations,
-                                          0.02,
-                                          src_gauss,
-                                          false);
-        if (!rc.optimise(v)) {
-            return {false, "Region contraction failed"};
+        const double &f0                     = fixed[0];
+        func.fixed                           = fixed;
+        func.weights.head(model.spgr.size()) = 1;
+        func.weights.tail(model.ssfp.size()) = model.ssfp.weights(f0);
+        typename Model::VaryingArray lo = model.bounds_lo, hi = model.bounds_hi;
+        int                          samples = options.samples;
+        if (prefit) {
+            PreFit(inputs, fixed, lo, hi);
+            // Keep the same density of samples in the smaller region
+            typename Model::VaryingArray const full = model.bounds_hi - model.bounds_lo;
+            double const fraction = (full > 0.).select((hi - lo) / full, 1.).prod();
+            samples               = std::clamp(static_cast<int>(options.samples * fraction),
+                                               std::min(10 * options.retain, options.samples),
+                                               options.samples);
+        }
+        rc.setBounds(lo, hi);
+        rc.setSamples(samples);
+        auto const key = QI::CounterRNG::Key(seed, {index[0], index[1], index[2]});
+        bool const ok  = rc.optimise(v, key);
+        iterations     = rc.contractions();
+        QI::FitEvaluations const evaluations{rc.contractions() * samples, 0};
+        if (!ok) {
+            return {false,
+                    (rc.status() == QI::RCStatus::ErrorResidual) ? QI::FitStatus::NonFinite :
+                                                                    QI::FitStatus::NoSolution,
+                    evaluations};
         }
         auto r   = func.residuals(v);
         residual = sqrt(r.square().sum() / r.rows());
@@ -123,11 +214,45 @@ template <typename Model> struct SRCFit {
             residuals[0] = r.head(model.spgr.size());
             residuals[1] = r.tail(model.ssfp.size());
         }
-        iterations = rc.contractions();
-        return {true, ""};
+        return {true,
+                (rc.status() == QI::RCStatus::IterationLimit) ? QI::FitStatus::IterationLimit :
+                                                                 QI::FitStatus::Success,
+                evaluations};
     }
 };
 
+/*
+ *  Compare the closed-form two-pool signals against the original LU-based versions at n random
+ *  valid points within the bounds, with random off-resonance and B1. Returns the largest difference
+ *  relative to the largest signal.
+ */
+template <typename Model> double CheckKernels(Model const &model, int const n) {
+    Model reference = model;
+    if constexpr (std::is_same_v<Model, QI::ThreePoolModel>) {
+        reference.two_pool.use_reference = true;
+    } else {
+        reference.use_reference = true;
+    }
+    std::mt19937                           gen(0);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    double                                 worst = 0;
+    for (int i = 0, tries = 0; i < n && tries < 100 * n; tries++) {
+        typename Model::VaryingArray const v =
+            model.bounds_lo + (model.bounds_hi - model.bounds_lo) *
+                                  Model::VaryingArray::NullaryExpr([&] { return uniform(gen); });
+        if (!model.valid(v)) {
+            continue;
+        }
+        typename Model::FixedArray const f{(uniform(gen) - 0.5) / model.ssfp.TR,
+                                           0.5 + uniform(gen)};
+        Eigen::ArrayXd const s = model.signal(v, f);
+        Eigen::ArrayXd const r = reference.signal(v, f);
+        worst                  = std::max(worst, (s - r).abs().maxCoeff() / r.abs().maxCoeff());
+        i++;
+    }
+    return worst;
+}
+
 //******************************************************************************
 // Main
 //******************************************************************************
@@ -143,10 +268,17 @@ int mcdespot_main(args::Subparser &parser) {
     args::Flag use_src(
         parser, "SRC", "Use flat prior (stochastic region contraction), not gaussian", {"SRC"});
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations, default 4", {'i', "its"}, 4);
+    args::ValueFlag<int> samples(
+        parser, "N", "Samples per iteration, default 5000", {"samples"}, 5000);
+    args::ValueFlag<int> retain(
+        parser, "N", "Samples retained per iteration, default 50", {"retain"}, 50);
+    args::ValueFlag<std::uint64_t> seed(parser, "SEED", "Random seed, default 0", {"seed"}, 0);
+    args::Flag                     prefit(
+        parser, "PREFIT", "Narrow bounds with single-component DESPOT1/2 fits", {"prefit"});
     args::Flag           bounds(parser, "BOUNDS", "Specify bounds in input", {"bounds"});
+    args::ValueFlag<int> check_kernels(
+        parser, "N", "Compare closed-form and LU-based signals at N points", {"check-kernels"});
     parser.Parse();
-    QI::CheckPos(spgr_path);
-    QI::CheckPos(ssfp_path);
 
     QI::Log(verbose, "Reading sequences");
     auto input = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
@@ -154,6 +286,17 @@ int mcdespot_main(args::Subparser &parser) {
     auto ssfp  = input.at("SSFP").get<QI::SSFPSequence>();
 
     auto process = [&](auto model, const std::string &model_name) {
+        if (bounds) {
+            model.bounds_lo = QI::ArrayFromJSON<double>(input, "lower_bounds");
+            model.bounds_hi = QI::ArrayFromJSON<double>(input, "upper_bounds");
+        }
+        if (check_kernels) {
+            double const diff = CheckKernels(model, check_kernels.Get());
+            fmt::print("Largest relative difference: {:g}\n", diff);
+            return (diff < 1e-8) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        QI::CheckPos(spgr_path);
+        QI::CheckPos(ssfp_path);
         if (simulate) {
             QI::SimulateModel<decltype(model), true>(input,
                                                      model,
@@ -162,38 +305,59 @@ int mcdespot_main(args::Subparser &parser) {
                                                      mask.Get(),
                                                      verbose,
                                                      simulate.Get(),
-                                                     subregion.Get());
+                                                     subregion.Get(),
+                                                     int16);
         } else {
             using FitType = SRCFit<decltype(model)>;
             FitType src{model};
-            src.src_gauss = !use_src;
-            if (bounds) {
-                src.model.bounds_lo = QI::ArrayFromJSON<double>(input, "lower_bounds");
-                src.model.bounds_hi = QI::ArrayFromJSON<double>(input, "upper_bounds");
+            src.options.gaussian         = !use_src;
+            src.options.max_contractions = its.Get();
+            src.options.samples          = samples.Get();
+            src.options.retain           = retain.Get();
+            src.seed                     = seed.Get();
+            src.prefit                   = prefit;
+            if (src.options.retain < 1 || src.options.retain > src.options.samples) {
+                QI::Fail("Retained samples must be between 1 and the number of samples");
             }
             QI::Log(verbose, "Low bounds: {}", src.model.bounds_lo.transpose());
             QI::Log(verbose, "High bounds: {}", src.model.bounds_hi.transpose());
 
             auto fit_filter =
                 QI::ModelFitFilter<FitType>::New(&src, verbose, covar, resids, subregion.Get());
+            fit_filter->SetCheckpoint(checkpoint.Get(),
+                                      slab.Get(),
+                                      {{"input", input},
+                                       {"model", modelarg.Get()},
+                                       {"scale", scale.Get()},
+                                       {"SRC", use_src.Get()},
+                                       {"its", its.Get()},
+                                       {"samples", samples.Get()},
+                                       {"retain", retain.Get()},
+                                       {"seed", seed.Get()},
+                                       {"prefit", prefit.Get()},
+                                       {"bounds", bounds.Get()}});
+            fit_filter->SetOutputStatus(fit_status);
+            fit_filter->SetOutputProfile(profile);
+            fit_filter->SetPackOutputs(pack);
+            fit_filter->SetInt16Outputs(int16);
             fit_filter->ReadInputs(
                 {spgr_path.Get(), ssfp_path.Get()}, {f0.Get(), B1.Get()}, mask.Get());
             fit_filter->Update();
             fit_filter->WriteOutputs(prefix.Get() + model_name);
             QI::Log(verbose, "Finished.");
         }
+        return EXIT_SUCCESS;
     };
     switch (modelarg.Get()) {
     case 2: {
         QI::TwoPoolModel two_pool{spgr, ssfp, scale.Get()};
-        process(two_pool, "2C_");
-    } break;
+        return process(two_pool, "2C_");
+    }
     case 3: {
         QI::ThreePoolModel three_pool{spgr, ssfp, scale.Get()};
-        process(three_pool, "3C_");
-    } break;
+        return process(three_pool, "3C_");
+    }
     default:
         QI::Fail("Unknown model specifier: {}", modelarg.Get());
     }
-    return EXIT_SUCCESS;
 }
@@ -10,14 +10,17 @@
  *
  */
 
+#include <algorithm>
+#include <cmath>
 #include <complex>
+#include <limits>
+#include <random>
 #include <string>
 
-#include "itkAddImageFilter.h"
-#include "itkBinaryGeneratorImageFilter.h"
 #include "itkExtractImageFilter.h"
-#include "itkMaskImageFilter.h"
-#include "itkUnaryGeneratorImageFilter.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkMultiThreaderBase.h"
 
 // #define QI_DEBUG_BUILD 1
 #include "Args.h"
@@ -25,7 +28,6 @@
 #include "ImageTypes.h"
 #include "MPRAGESequence.h"
 #include "Masking.h"
-#include "Spline.h"
 #include "Util.h"
 
 inline float
@@ -60,6 +62,176 @@ One_MP2RAGE(const double &M0, const double &T1, const double &B1, const QI::MP2R
     return Me;
 }
 
+double MP2Signal(double const T1, double const B1, QI::MP2RAGESequence const &s) {
+    auto const sig = One_MP2RAGE(1., T1, B1, s);
+    return MP2Contrast(sig[0], sig[1]);
+}
+
+/*
+ * The MP2 contrast falls as T1 increases, apart from a small rise at very short T1 with high
+ * flip-angles, and can turn over again at long T1. Either side of the monotonic range the
+ * inversion is ambiguous, so this finds that range for a given B1, then inverts with bisection.
+ */
+struct MP2Inverse {
+    static constexpr double T1_min = 0.25;
+    static constexpr double T1_max = 4.0;
+
+    static std::pair<double, double> Range(double const B1, QI::MP2RAGESequence const &s) {
+        int const      n = 100;
+        Eigen::ArrayXd mp2(n);
+        for (int i = 0; i < n; i++) {
+            mp2[i] = MP2Signal(T1_min + i * (T1_max - T1_min) / (n - 1), B1, s);
+        }
+        Eigen::Index start;
+        mp2.maxCoeff(&start);
+        Eigen::Index end = start;
+        while (end < n - 1 && mp2[end + 1] <= mp2[end]) {
+            end++;
+        }
+        return {T1_min + start * (T1_max - T1_min) / (n - 1),
+                T1_min + end * (T1_max - T1_min) / (n - 1)};
+    }
+
+    static double Solve(double const                     mp2,
+                        double const                     B1,
+                        std::pair<double, double> const &range,
+                        QI::MP2RAGESequence const &      s) {
+        double lo = range.first;
+        double hi = range.second;
+        if (mp2 >= MP2Signal(lo, B1, s)) {
+            return lo;
+        }
+        if (mp2 <= MP2Signal(hi, B1, s)) {
+            return hi;
+        }
+        while ((hi - lo) > 1e-7) {
+            double const mid = 0.5 * (lo + hi);
+            if (MP2Signal(mid, B1, s) > mp2) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        return 0.5 * (lo + hi);
+    }
+};
+
+/*
+ * The MP2 contrast on a regular grid of T1 and B1. The forward signal is smooth, so bicubic
+ * interpolation is accurate everywhere. To invert, the grid is interpolated to the voxel's B1, then
+ * the cubic segment that brackets the contrast is solved for T1.
+ */
+class MP2Table {
+  public:
+    explicit MP2Table(QI::MP2RAGESequence const &s) :
+        values(B1_count * T1_count), starts(B1_count), ends(B1_count) {
+        for (int ib = 0; ib < B1_count; ib++) {
+            double const B1 = B1_min + ib * B1_step;
+            double      *v  = &values[ib * T1_count];
+            for (int it = 0; it < T1_count; it++) {
+                v[it] = MP2Signal(T1_min + it * T1_step, B1, s);
+            }
+            starts[ib] = std::max_element(v, v + T1_count) - v;
+            ends[ib]   = starts[ib];
+            while (ends[ib] < T1_count - 1 && v[ends[ib] + 1] <= v[ends[ib]]) {
+                ends[ib]++;
+            }
+        }
+    }
+
+    double operator()(double const mp2, double const B1) const {
+        if (!std::isfinite(mp2) || !std::isfinite(B1)) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        // Catmull-Rom weights along B1, rows are clamped at the edges like ceres::Grid2D
+        double const r   = std::clamp((B1 - B1_min) / B1_step, 0., B1_count - 1.);
+        int const    row = std::min(static_cast<int>(r), B1_count - 2);
+        double const t   = r - row;
+        double const w[4]{0.5 * t * ((2. - t) * t - 1.),
+                          0.5 * (t * t * (3. * t - 5.) + 2.),
+                          0.5 * t * ((4. - 3. * t) * t + 1.),
+                          0.5 * t * t * (t - 1.)};
+        int rows[4];
+        int start = 0;
+        int end   = T1_count - 1;
+        for (int i = 0; i < 4; i++) {
+            rows[i] = std::clamp(row - 1 + i, 0, B1_count - 1);
+            start   = std::max(start, starts[rows[i]]);
+            end     = std::min(end, ends[rows[i]]);
+        }
+        auto const column = [&](int it) {
+            it           = std::clamp(it, 0, T1_count - 1);
+            double value = 0.;
+            for (int i = 0; i < 4; i++) {
+                value += w[i] * values[rows[i] * T1_count + it];
+            }
+            return value;
+        };
+        // The rows can turn over at different places, so refine the range for this B1
+        while (start > 0 && column(start - 1) >= column(start)) {
+            start--;
+        }
+        while (end < T1_count - 1 && column(end + 1) <= column(end)) {
+            end++;
+        }
+
+        // Contrast falls with T1, find the bracketing nodes
+        if (mp2 >= column(start) || end <= start) {
+            return T1_min + start * T1_step;
+        }
+        if (mp2 <= column(end)) {
+            return T1_min + end * T1_step;
+        }
+        int lo = start;
+        int hi = end;
+        while (hi - lo > 1) {
+            int const mid = (lo + hi) / 2;
+            if (column(mid) > mp2) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+
+        // Solve the Catmull-Rom segment, Newton steps safe-guarded by bisection
+        double const p0 = column(lo - 1), p1 = column(lo), p2 = column(lo + 1), p3 = column(lo + 2);
+        double const a  = 0.5 * (-p0 + 3. * p1 - 3. * p2 + p3);
+        double const b  = 0.5 * (2. * p0 - 5. * p1 + 4. * p2 - p3);
+        double const c  = 0.5 * (-p0 + p2);
+        double       x0 = 0., x1 = 1., x = (p1 - mp2) / (p1 - p2);
+        for (int i = 0; i < 20; i++) {
+            double const f  = p1 + x * (c + x * (b + x * a)) - mp2;
+            double const df = c + x * (2. * b + 3. * a * x);
+            if (f > 0.) {
+                x0 = x;
+            } else {
+                x1 = x;
+            }
+            double next = x - f / df;
+            if (!(next > x0 && next < x1)) {
+                next = 0.5 * (x0 + x1);
+            }
+            if (std::abs(next - x) < 1e-10) {
+                x = next;
+                break;
+            }
+            x = next;
+        }
+        return T1_min + (lo + x) * T1_step;
+    }
+
+  private:
+    static constexpr int    B1_count = 25;
+    static constexpr double B1_min   = 0.4;
+    static constexpr double B1_step  = 0.05;
+    static constexpr int    T1_count = 151;
+    static constexpr double T1_min   = MP2Inverse::T1_min;
+    static constexpr double T1_step  = (MP2Inverse::T1_max - MP2Inverse::T1_min) / (T1_count - 1);
+
+    std::vector<double> values;      // T1 varies fastest
+    std::vector<int>    starts, ends; // Monotonic range of T1 indices for each B1
+};
+
 int mp2rage_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "INPUT FILE", "Path to complex MP-RAGE data");
     args::ValueFlag<int>          threads(parser,
@@ -78,8 +250,37 @@ int mp2rage_main(args::Subparser &parser) {
         "(https://journals.plos.org/plosone/article?id=10.1371/journal.pone.0099676)",
         {'b', "beta"},
         0.0);
+    args::ValueFlag<std::string> b1_path(
+        parser, "B1", "Path to B1 map, corrects T1 for transmit inhomogeneity", {'B', "B1"});
+    args::ValueFlag<int> check(
+        parser, "N", "Compare the lookup table to root-finding at N points", {"check"});
     parser.Parse();
 
+    QI::Log(verbose, "Reading sequence information");
+    json input    = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
+    auto sequence = input.at("MP2RAGE").get<QI::MP2RAGESequence>();
+    QI::Log(verbose, "Building look-up table");
+    MP2Table const table(sequence);
+
+    if (check) {
+        // T1 values outside the monotonic range cannot be recovered by either method, so stay
+        // inside it
+        std::mt19937_64                        rng(0);
+        std::uniform_real_distribution<double> T1_dist(0.4, 3.5);
+        std::uniform_real_distribution<double> B1_dist(0.6, 1.4);
+        double                                 max_diff = 0.;
+        for (int i = 0; i < check.Get(); i++) {
+            double const B1    = B1_dist(rng);
+            auto const   range = MP2Inverse::Range(B1, sequence);
+            double const T1    = std::clamp(T1_dist(rng), 1.05 * range.first, 0.95 * range.second);
+            double const mp2   = MP2Signal(T1, B1, sequence);
+            double const ref   = MP2Inverse::Solve(mp2, B1, range, sequence);
+            max_diff           = std::max(max_diff, std::abs(table(mp2, B1) - ref) / ref);
+        }
+        fmt::print("Largest relative difference: {:g}\n", max_diff);
+        return max_diff < 1e-3 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     auto inFile = QI::ReadImage<QI::SeriesXF>(QI::CheckPos(input_path), verbose);
 
     auto ti_1                     = itk::ExtractImageFilter<QI::SeriesXF, QI::VolumeXF>::New();
@@ -93,54 +294,45 @@ int mp2rage_main(args::Subparser &parser) {
     ti_2->SetExtractionRegion(region);
     ti_2->SetDirectionCollapseToSubmatrix();
     ti_2->SetInput(inFile);
+    ti_1->Update();
+    ti_2->Update();
+    QI::VolumeXF::Pointer const vol_1    = ti_1->GetOutput();
+    QI::VolumeXF::Pointer const vol_2    = ti_2->GetOutput();
+    QI::VolumeF::Pointer const  B1_image =
+        b1_path ? QI::ReadImage(b1_path.Get(), verbose) : nullptr;
+
+    auto uni = QI::NewImageLike(vol_1);
+    auto T1  = QI::NewImageLike(vol_1);
 
-    QI::Log(verbose, "Generating MP2 contrasts");
-    using BinaryFilter = itk::BinaryGeneratorImageFilter<QI::VolumeXF, QI::VolumeXF, QI::VolumeF>;
-    auto MP2Filter     = BinaryFilter::New();
-    MP2Filter->SetInput1(ti_1->GetOutput());
-    MP2Filter->SetInput2(ti_2->GetOutput());
+    // The robust contrast is written out, but the lookup needs the unregularised contrast. Both
+    // come from the same pass over the data.
+    QI::Log(verbose, "Calculating MP2 contrasts and T1");
     const float &beta = beta_arg.Get();
-    MP2Filter->SetFunctor([&](const std::complex<float> &p1, const std::complex<float> &p2) {
-        return MP2Contrast(p1, p2, beta);
-    });
-    MP2Filter->Update();
+    auto         mt   = itk::MultiThreaderBase::New();
+    mt->SetNumberOfWorkUnits(threads.Get());
+    mt->ParallelizeImageRegion<3>(
+        vol_1->GetBufferedRegion(),
+        [&](const QI::VolumeF::RegionType &region) {
+            itk::ImageRegionConstIterator<QI::VolumeXF> ti1_it(vol_1, region);
+            itk::ImageRegionConstIterator<QI::VolumeXF> ti2_it(vol_2, region);
+            itk::ImageRegionConstIterator<QI::VolumeF>  B1_it;
+            if (B1_image)
+                B1_it = itk::ImageRegionConstIterator<QI::VolumeF>(B1_image, region);
+            itk::ImageRegionIterator<QI::VolumeF> uni_it(uni, region);
+            itk::ImageRegionIterator<QI::VolumeF> T1_it(T1, region);
+            for (; !ti1_it.IsAtEnd(); ++ti1_it, ++ti2_it, ++uni_it, ++T1_it) {
+                uni_it.Set(MP2Contrast(ti1_it.Get(), ti2_it.Get(), beta));
+                float const mp2 = beta ? MP2Contrast(ti1_it.Get(), ti2_it.Get()) : uni_it.Get();
+                float const B1  = B1_image ? B1_it.Get() : 1.0f;
+                T1_it.Set(table(mp2, B1));
+                if (B1_image)
+                    ++B1_it;
+            }
+        },
+        nullptr);
     const std::string out_prefix = outarg.Get() + "MP2";
-    QI::WriteImage(MP2Filter->GetOutput(), out_prefix + "_UNI" + QI::OutExt(), verbose);
-
-    QI::Log(verbose, "Reading sequence information");
-    json input    = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
-    auto sequence = input.at("MP2RAGE").get<QI::MP2RAGESequence>();
-    QI::Log(verbose, "Building look-up spline");
-    int            num_entries = 100;
-    Eigen::ArrayXd T1_values   = Eigen::ArrayXd::LinSpaced(num_entries, 0.25, 4.0);
-    Eigen::ArrayXd MP2_values(num_entries);
-    for (int i = 0; i < num_entries; i++) {
-        const auto  sig = One_MP2RAGE(1., T1_values[i], 1., sequence);
-        const float mp2 = MP2Contrast(sig[0], sig[1]);
-        if ((i > 0) && (mp2 > MP2_values[i - 1])) {
-            num_entries = i;
-            break;
-        } else {
-            MP2_values[i] = mp2;
-        }
-    }
-    QI::Log(verbose, "Lookup table length = {}", num_entries);
-    QI::SplineInterpolator mp2_to_t1(MP2_values.head(num_entries), T1_values.head(num_entries));
-    if (beta) {
-        QI::Log(verbose, "Recalculating unregularised MP2 image");
-        MP2Filter->SetFunctor([&](const std::complex<float> &p1, const std::complex<float> &p2) {
-            return MP2Contrast(p1, p2, 0.0);
-        });
-        MP2Filter->Update();
-    }
-    using UnaryFilter   = itk::UnaryGeneratorImageFilter<QI::VolumeF, QI::VolumeF>;
-    auto T1LookupFilter = UnaryFilter::New();
-    T1LookupFilter->SetInput(MP2Filter->GetOutput());
-    auto lookup = [&](const float &p) { return mp2_to_t1(p); };
-    T1LookupFilter->SetFunctor(lookup);
-    QI::Log(verbose, "Calculating T1");
-    T1LookupFilter->Update();
-    QI::WriteImage(T1LookupFilter->GetOutput(), out_prefix + "_T1" + QI::OutExt(), verbose);
+    QI::WriteImage(uni, out_prefix + "_UNI" + QI::OutExt(), verbose);
+    QI::WriteImage(T1, out_prefix + "_T1" + QI::OutExt(), verbose);
 
     QI::Log(verbose, "Finished.");
     return EXIT_SUCCESS;
@@ -17,6 +17,7 @@
 
 #include "Args.h"
 #include "FitFunction.h"
+#include "FitLM.h"
 #include "ImageIO.h"
 #include "Model.h"
 #include "ModelFitFilter.h"
@@ -44,6 +45,36 @@ struct MultiEcho : QI::Model<double, double, 2, 0> {
         const T &T2 = p[1];
         return PD * exp(-sequence.TE / T2);
     }
+
+    void signal_jacobian(VaryingArray const &p,
+                         FixedArray const & /* Unused */,
+                         Eigen::ArrayXd & s,
+                         Eigen::MatrixXd &j) const {
+        const double &       PD = p[0];
+        const double &       T2 = p[1];
+        const Eigen::ArrayXd E2 = exp(-sequence.TE / T2);
+        s                       = PD * E2;
+        j.resize(sequence.size(), 2);
+        j.col(0) = E2.matrix();
+        j.col(1) = (s * sequence.TE / (T2 * T2)).matrix();
+    }
+
+    // Batch signal for QI::LMFit
+    template <int W>
+    void signal_batch(Eigen::Array<double, W, NV> const &p,
+                      QI::BatchArray<W> const & /* Unused */,
+                      QI::BatchArray<W> &s,
+                      QI::BatchArray<W> *j) const {
+        Eigen::Index const n = sequence.size();
+        for (Eigen::Index k = 0; k < n; k++) {
+            QI::BatchLanes<W> const E2 = exp(-sequence.TE[k] / p.col(1));
+            s.col(k)                   = p.col(0) * E2;
+            if (j) {
+                j->col(k)     = E2;
+                j->col(n + k) = s.col(k) * sequence.TE[k] / p.col(1).square();
+            }
+        }
+    }
 };
 
 using MultiEchoFit = QI::BlockFitFunction<MultiEcho>;
@@ -71,7 +102,7 @@ struct MultiEchoLogLin : MultiEchoFit {
         }
         residual   = sqrt(temp_residuals.square().sum() / temp_residuals.rows());
         iterations = 1;
-        return {true, ""};
+        return {true, QI::FitStatus::Success};
     }
 };
 
@@ -105,7 +136,7 @@ struct MultiEchoARLO : MultiEchoFit {
         }
         residual   = sqrt(temp_residuals.square().sum() / temp_residuals.rows());
         iterations = 1;
-        return {true, ""};
+        return {true, QI::FitStatus::Success};
     }
 };
 
@@ -123,16 +154,12 @@ struct MultiEchoNLLS : MultiEchoFit {
         if (scale < std::numeric_limits<double>::epsilon()) {
             p << 0.0, 0.0;
             rmse = 0;
-            return {false, "Maximum data value was not positive"};
+            return {false, QI::FitStatus::BadData};
         }
         const Eigen::ArrayXd data = inputs[0] / scale;
         p                         = model.start;
         ceres::Problem problem;
-        using Cost      = QI::ModelCost<MultiEcho>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, MultiEcho::NV>;
-        auto *cost      = new Cost{model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
+        problem.AddResidualBlock(QI::MakeModelCost(model, fixed, data), NULL, p.data());
         problem.SetParameterLowerBound(p.data(), 0, 1.0e-6);
         problem.SetParameterUpperBound(p.data(), 0, model.bounds_hi[0] / scale);
         problem.SetParameterLowerBound(p.data(), 1, 1.0e-3);
@@ -144,9 +171,10 @@ struct MultiEchoNLLS : MultiEchoFit {
         options.gradient_tolerance  = 1e-6;
         options.parameter_tolerance = 1e-4;
         options.logging_type        = ceres::SILENT;
+        solver.Apply(options);
         ceres::Solve(options, &problem, &summary);
         if (!summary.IsSolutionUsable()) {
-            return {false, summary.FullReport()};
+            return {false, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
         }
         iterations = summary.iterations.size();
 
@@ -160,7 +188,7 @@ struct MultiEchoNLLS : MultiEchoFit {
             QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
         }
         p[0] = p[0] * scale;
-        return {true, ""};
+        return {true, QI::CeresStatus(summary), QI::CeresEvaluations(summary)};
     }
 };
 
@@ -170,14 +198,24 @@ struct MultiEchoNLLS : MultiEchoFit {
 int multiecho_main(args::Subparser &parser) {
     args::Positional<std::string> input_path(parser, "INPUT FILE", "Input multi-echo data");
     QI_COMMON_ARGS;
-    args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/a/n)", {'a', "algo"}, 'l');
+    QI_SOLVER_ARGS;
+    args::ValueFlag<char> algorithm(
+        parser, "ALGO", "Choose algorithm (l/a/n/m)", {'a', "algo"}, 'l');
+    args::ValueFlag<int> check_jacobian(
+        parser, "N", "Compare analytic and automatic Jacobians at N points", {"check-jacobian"});
     parser.Parse();
-    QI::CheckPos(input_path);
     QI::Log(verbose, "Reading sequence parameters");
     json input    = json_file ? QI::ReadJSON(json_file.Get()) : QI::ReadJSON(std::cin);
     auto sequence = input.at("MultiEcho").get<QI::MultiEchoSequence>();
 
     MultiEcho model{{}, sequence};
+    if (check_jacobian) {
+        double const diff = QI::CheckJacobian(
+            model, MultiEcho::FixedArray{}, model.bounds_lo, model.bounds_hi, check_jacobian.Get());
+        fmt::print("Largest relative difference: {:g}\n", diff);
+        return (diff < 1e-8) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    QI::CheckPos(input_path);
     if (simulate) {
         QI::SimulateModel<MultiEcho, false>(input,
                                             model,
@@ -186,8 +224,33 @@ int multiecho_main(args::Subparser &parser) {
                                             mask.Get(),
                                             verbose,
                                             simulate.Get(),
-                                            subregion.Get());
+                                            subregion.Get(),
+                                            int16);
     } else {
+        auto run = [&](auto *me) {
+            using FitType = std::remove_pointer_t<decltype(me)>;
+            me->solver    = QI::ReadSolverOptions(input, solver.Get());
+            auto fit =
+                QI::ModelFitFilter<FitType>::New(me, verbose, covar, resids, subregion.Get());
+            fit->SetCheckpoint(checkpoint.Get(),
+                               slab.Get(),
+                               {{"input", input},
+                                {"algo", algorithm.Get()}});
+            fit->SetOutputStatus(fit_status);
+            fit->SetOutputProfile(profile);
+            fit->SetPackOutputs(pack);
+            fit->SetInt16Outputs(int16);
+            fit->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
+            const int nvols = fit->GetInput(0)->GetNumberOfComponentsPerPixel();
+            if (nvols % sequence.size() == 0) {
+                const int nblocks = nvols / sequence.size();
+                fit->SetBlocks(nblocks);
+            } else {
+                QI::Fail("Input size is not a multiple of the sequence size");
+            }
+            fit->Update();
+            fit->WriteOutputs(prefix.Get() + "ME_");
+        };
         MultiEchoFit *me = nullptr;
         switch (algorithm.Get()) {
         case 'l':
@@ -202,21 +265,17 @@ int multiecho_main(args::Subparser &parser) {
             me = new MultiEchoNLLS(model);
             QI::Log(verbose, "Non-linear algorithm (Levenberg Marquardt) selected.");
             break;
+        case 'm':
+            // The filter needs the LMFit type itself to pass it several blocks at a time
+            QI::Log(verbose, "Batched LM algorithm selected ({} blocks per batch).", QI::SIMDWidth);
+            run(new QI::LMFit<MultiEcho, 1, true>(model));
+            break;
         default:
             QI::Fail("Unknown algorithm type {}", algorithm.Get());
         }
-        auto fit =
-            QI::ModelFitFilter<MultiEchoFit>::New(me, verbose, covar, resids, subregion.Get());
-        fit->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
-        const int nvols = fit->GetInput(0)->GetNumberOfComponentsPerPixel();
-        if (nvols % sequence.size() == 0) {
-            const int nblocks = nvols / sequence.size();
-            fit->SetBlocks(nblocks);
-        } else {
-            QI::Fail("Input size is not a multiple of the sequence size");
+        if (me) {
+            run(me);
         }
-        fit->Update();
-        fit->WriteOutputs(prefix.Get() + "ME_");
         QI::Log(verbose, "Finished.");
     }
     return EXIT_SUCCESS;
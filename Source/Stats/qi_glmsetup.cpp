@@ -50,6 +50,8 @@ int glm_setup_main(args::Subparser &parser) {
         parser, "CONTRASTS", "Generate and save contrasts", {'c', "contrasts"});
     args::ValueFlag<std::string> ftests_path(
         parser, "FTESTS", "Generate and save F-tests", {'f', "ftests"});
+    args::Flag int16(
+        parser, "INT16", "Write the merged file as scaled 16-bit integers", {"int16"});
     parser.Parse();
 
     std::ifstream group_file(QI::CheckValue(group_path));
@@ -241,6 +243,6 @@ int glm_setup_main(args::Subparser &parser) {
     output->SetSpacing(spacing);
     output->SetOrigin(origin);
     output->SetDirection(direction);
-    QI::WriteImage<QI::SeriesF>(output, QI::CheckValue(output_path), verbose);
+    QI::WriteImage<QI::SeriesF>(output, QI::CheckValue(output_path), verbose, int16);
     return EXIT_SUCCESS;
 }
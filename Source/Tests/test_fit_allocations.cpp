@@ -0,0 +1,161 @@
+/*
+ *  test_fit_allocations.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+/*
+ *  Checks that the ModelFitFilter voxel loop does not allocate. The filter is run on two images of
+ *  different sizes with a fit function that does not allocate itself, and the number of heap
+ *  allocations made during each Update() is compared. Allocations per run (outputs, workspaces,
+ *  the voxel list) are the same for both, so any difference is per voxel. Eigen allocates with
+ *  malloc rather than operator new, so malloc itself is counted. That relies on glibc's
+ *  __libc_malloc, so on other platforms the test is skipped.
+ */
+
+#include <atomic>
+#include <cstdlib>
+
+#include "FitFunction.h"
+#include "ImageTypes.h"
+#include "Log.h"
+#include "Model.h"
+#include "ModelFitFilter.h"
+
+#ifdef __GLIBC__
+namespace {
+std::atomic<bool>   counting{false};
+std::atomic<size_t> allocations{0};
+} // namespace
+
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void  __libc_free(void *);
+
+void *malloc(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+    __libc_free(p);
+}
+}
+#endif
+
+using namespace std::literals;
+
+// The mean of the data, with its standard deviation as the residual
+struct MeanModel : QI::Model<double, double, 1, 0> {
+    int                              n;
+    std::array<const std::string, 1> varying_names{{"mean"s}};
+    VaryingArray const               start{0.};
+    VaryingArray const               bounds_lo{-1e6};
+    VaryingArray const               bounds_hi{1e6};
+
+    int input_size(const int /* Unused */) const { return n; }
+
+    template <typename Derived>
+    auto signal(Eigen::ArrayBase<Derived> const &p, FixedArray const & /* Unused */) const
+        -> QI_ARRAY(typename Derived::Scalar) {
+        return QI_ARRAY(typename Derived::Scalar)::Constant(n, p[0]);
+    }
+};
+
+struct MeanFit : QI::FitFunction<MeanModel> {
+    using FitFunction::FitFunction;
+    QI::FitReturnType fit(std::vector<Eigen::ArrayXd> const &inputs,
+                          MeanModel::FixedArray const & /* Unused */,
+                          MeanModel::VaryingArray &    p,
+                          MeanModel::CovarArray *      cov,
+                          RMSErrorType &               rmse,
+                          std::vector<Eigen::ArrayXd> &residuals,
+                          FlagType &                   iterations) const override {
+        auto const &data = inputs[0];
+        p[0]             = data.mean();
+        rmse             = std::sqrt((data - p[0]).square().mean());
+        if (residuals.size() > 0) {
+            residuals[0] = data - p[0]; // Already the right size, so no allocation
+        }
+        if (cov) {
+            (*cov)[0] = rmse / std::sqrt(data.rows());
+        }
+        iterations = 1;
+        return {true, QI::FitStatus::Success};
+    }
+};
+
+size_t CountAllocations(MeanFit const &fit, int const nx, bool const extras) {
+    QI::VectorVolumeF::SizeType size;
+    size[0]    = nx;
+    size[1]    = 8;
+    size[2]    = 4;
+    auto input = QI::VectorVolumeF::New();
+    input->SetRegions(size);
+    input->SetNumberOfComponentsPerPixel(fit.model.n);
+    input->Allocate();
+    float *data = input->GetBufferPointer();
+    for (size_t i = 0; i < input->GetPixelContainer()->Size(); i++) {
+        data[i] = i % 7;
+    }
+
+    auto filter = QI::ModelFitFilter<MeanFit>::New(&fit, false, extras, extras, "");
+    filter->SetInput(0, input);
+    filter->SetOutputStatus(extras);
+    filter->SetNumberOfWorkUnits(1);
+    allocations = 0;
+    counting    = true;
+    filter->Update();
+    counting = false;
+    return allocations;
+}
+
+int main() {
+#ifdef __GLIBC__
+    MeanModel model{{}, 5};
+    MeanFit   fit{model};
+    bool      passed = true;
+    for (bool const extras : {false, true}) {
+        CountAllocations(fit, 2, extras); // Start the ITK thread pool etc.
+        size_t const small = CountAllocations(fit, 8, extras);
+        size_t const large = CountAllocations(fit, 64, extras);
+        double const per_voxel =
+            (static_cast<double>(large) - static_cast<double>(small)) / ((64 - 8) * 8 * 4);
+        fmt::print("Covariance and residuals {}: {} and {} allocations, {} extra per voxel\n",
+                   extras ? "on" : "off",
+                   small,
+                   large,
+                   per_voxel);
+        if (per_voxel > 0.01) {
+            passed = false;
+        }
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+    fmt::print("Allocations can only be counted with glibc, skipping\n");
+    return 77;
+#endif
+}
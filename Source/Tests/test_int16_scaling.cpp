@@ -0,0 +1,84 @@
+/*
+ *  test_int16_scaling.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+/*
+ *  Checks the int16 scaling used for residual and covariance outputs. A ramp from 0 to 1 is
+ *  scaled on its own, and again with a few huge outliers, NaNs and infinities mixed in. The
+ *  outliers and non-finite values must be counted, and must not spoil the precision of the ramp.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+#include "Log.h"
+#include "VectorIO.h"
+
+struct Result {
+    float  error;        // Largest round-trip error over the ramp
+    float  outlier, nan; // What an outlier and a NaN read back as
+    size_t clipped, nonfinite;
+};
+
+Result RoundTrip(std::vector<float> const &data, size_t const ramp) {
+    QI::Int16Scaling const scale(data.data(), data.size());
+
+    auto const decode = [&](float const v) { return scale.inter + scale(v) * scale.slope; };
+    Result     r{0.f, 0.f, 0.f, scale.clipped, scale.nonfinite};
+    for (size_t i = 0; i < ramp; i++) {
+        r.error = std::max(r.error, std::abs(decode(data[i]) - data[i]));
+    }
+    r.outlier = decode(1e6f);
+    r.nan     = decode(std::numeric_limits<float>::quiet_NaN());
+    return r;
+}
+
+int main() {
+    size_t const       ramp = 100000;
+    std::vector<float> data(ramp);
+    for (size_t i = 0; i < ramp; i++) {
+        data[i] = static_cast<float>(i) / (ramp - 1);
+    }
+    bool passed = true;
+
+    Result const clean = RoundTrip(data, ramp);
+    fmt::print("Ramp: error {:g}, {} clipped, {} non-finite\n",
+               clean.error,
+               clean.clipped,
+               clean.nonfinite);
+    // The codes span the whole ramp, so the error is at most half of 1/65534
+    if (clean.error > 1e-5f || clean.clipped != 0 || clean.nonfinite != 0) {
+        passed = false;
+    }
+
+    for (size_t i = 0; i < 10; i++) {
+        data.push_back(1e6f);
+    }
+    for (size_t i = 0; i < 5; i++) {
+        data.push_back(std::numeric_limits<float>::quiet_NaN());
+    }
+    data.push_back(std::numeric_limits<float>::infinity());
+    data.push_back(-std::numeric_limits<float>::infinity());
+    Result const dirty = RoundTrip(data, ramp);
+    fmt::print("Ramp with outliers: error {:g}, {} clipped to {:g}, {} non-finite stored as {:g}\n",
+               dirty.error,
+               dirty.clipped,
+               dirty.outlier,
+               dirty.nonfinite,
+               dirty.nan);
+    // Without clipping the outliers would make the slope about 15
+    if (dirty.error > 2e-5f || dirty.clipped != 10 || dirty.nonfinite != 7 ||
+        dirty.outlier > 1.2f || std::abs(dirty.nan) > 2e-5f) {
+        passed = false;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
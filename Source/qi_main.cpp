@@ -1,5 +1,6 @@
 #include "Args.h"
 #include "Commands.h"
+#include "Log.h"
 #include "Util.h"
 #include <iostream>
 
@@ -14,6 +15,7 @@ int main(int argc, char **argv) {
     ADD(newimage, "Create a new image");
     ADD(diff, "Calcualte the difference between two images");
     ADD(hdr, "Print header information from an image");
+    ADD(io_bench, "Time reading an image and report memory use");
 #ifdef BUILD_B1
     ADD(afi, "Actual Flip-Angle Imaging");
     ADD(dream, "DREAM B1-Mapping");
@@ -42,6 +44,7 @@ int main(int argc, char **argv) {
     ADD(despot1hifi, "DESPOT1-HIFI simultaneous T1/B1 mapping");
     ADD(despot2, "DESPOT2");
     ADD(despot2fm, "DESPOT2-FM simultaneous T2/B0 mapping");
+    ADD(mcdespot, "Multi-component DESPOT (mcDESPOT)");
     ADD(mp2rage, "MP2-RAGE estimation of T1");
     ADD(multiecho, "Multi-echo T2/T2*");
     ADD(planet, "PLANET method of T1/T2 mapping");
@@ -91,6 +94,9 @@ int main(int argc, char **argv) {
         }
         std::cerr << parser << '\n' << e.what() << '\n';
         exit(EXIT_FAILURE);
+    } catch (std::exception const &e) {
+        // Errors thrown by ITK, and by image writes that may run on background threads
+        QI::Fail("{}", e.what());
     }
 
     exit(EXIT_SUCCESS);